@@ -0,0 +1,642 @@
+#include "pcap_file.h"
+#include "../src/ring.h"
+#include "../src/compress.h"
+#include "../src/io.h"
+#include "../src/constants.h"
+#include "../src/log.h"
+#include "../src/flow_group.h"
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <math.h>
+#include <limits.h>
+
+/* Offline tuner: replays a capture through the real compressor and ring code against a
+   simulated socket + link on a virtual clock, sweeps compression-level, flush-policy and
+   connection-ring sizing, and recommends l3tc flags from the ratio/cpu/latency frontier.
+
+   The virtual clock advances by wall-time actually spent compressing, so results reflect
+   this machine's CPU. Modelled: single io-loop, tun reads in batches of upto 64 packets,
+   socket send-buffer, link bandwidth/propagation delay, loss (as one extra rtt for the
+   lost packet, with in-order delivery). Not modelled: tun-side ring (unbounded here),
+   jitter, TCP congestion control and low-latency-mode socket options. */
+
+#define TUN_BATCH 64 /* FLUSH_BATCH_MAX_PKTS in io.c */
+#define MAX_LEVELS 32
+#define MAX_KNOBS 1024
+#define NS 1000000000.0
+
+struct link_s {
+    char name[32];
+    double bw_kbit;
+    double rtt_ms;
+    double loss_pct;
+};
+
+typedef struct link_s link_t;
+
+static const link_t named_links[] = { /* same as wan_bench.sh */
+    {"dsl", 8000, 40, 0.1},
+    {"lte", 20000, 70, 0.5},
+    {"satellite", 10000, 600, 0.5},
+    {"metro", 100000, 10, 0.01},
+};
+
+struct knob_s {
+    int level;
+    int flush_policy;
+    ssize_t ring_sz;
+    int adaptive;
+    ssize_t max_ring_sz;
+};
+
+typedef struct knob_s knob_t;
+
+struct result_s {
+    knob_t k;
+    uint64_t in_bytes, accepted_bytes, out_bytes, pkts, dropped;
+    uint64_t comp_ns, decomp_ns, span_ns;
+    double ratio, cpu_pct, p50_ms, p99_ms, drop_pct;
+    int feasible, frontier;
+};
+
+typedef struct result_s result_t;
+
+static struct {
+    const char *pcap;
+    link_t link;
+    ssize_t sndbuf;
+    double speedup;
+    int loops;
+    int levels[MAX_LEVELS];
+    int n_levels;
+    double cpu_budget_pct, p99_budget_ms, max_drop_pct;
+    int json, all, verbose;
+} cfg = {NULL, {"dsl", 8000, 40, 0.1}, 0, 1.0, 1, {0}, 0, 100.0, 0, 0.1, 0, 0, 0};
+
+static pcap_pkts_t pkts;
+
+static uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/* one packet awaiting delivery, flush_at is the offset in compressed stream after which it is decodable */
+struct pend_s {
+    uint64_t arrived;
+    uint64_t flush_at;
+};
+
+/* bytes handed to socket in one go, serialized back to back from start */
+struct seg_s {
+    uint64_t begin;
+    uint64_t start;
+};
+
+struct sim_s {
+    double ns_per_byte;
+    uint64_t half_rtt, rtt;
+    uint32_t loss_threshold;
+    unsigned int seed;
+
+    uint64_t now;
+    uint64_t link_free_at;
+    uint64_t pushed;
+
+    struct seg_s *segs;
+    size_t n_segs, segs_cap, seg_cursor;
+
+    struct pend_s *q;
+    size_t q_head, q_tail, unflushed_from;
+    uint64_t hol_until;
+    uint64_t *lat;
+    size_t n_lat;
+
+    compress_t tx, rx;
+    ring_buff_t ring;
+    int flush_stalled;
+    uint8_t *rx_out;
+    uint64_t decompressed, decomp_ns;
+};
+
+typedef struct sim_s sim_t;
+
+static ssize_t sock_room(sim_t *s) {
+    ssize_t queued = (s->link_free_at > s->now) ? (ssize_t) ((s->link_free_at - s->now) / s->ns_per_byte) : 0;
+    return cfg.sndbuf - queued;
+}
+
+static void receive(sim_t *s, uint8_t *buff, ssize_t len) {
+    uint64_t t0 = mono_ns();
+    while (len > 0) {
+        ssize_t chunk = (len > s->rx.inflate_src_buff_sz) ? s->rx.inflate_src_buff_sz : len;
+        memcpy(s->rx.inflate_src_buff, buff, chunk);
+        s->rx.inflatable_bytes = chunk;
+        do {
+            s->decompressed += do_decompress(&s->rx, s->rx_out, DECOMPRESSION_SRC_BUFF_CAPACITY);
+        } while (s->rx.inflatable_bytes > 0);
+        buff += chunk;
+        len -= chunk;
+    }
+    s->decomp_ns += mono_ns() - t0;
+}
+
+static void deliver_flushed(sim_t *s) {
+    while (s->q_head < s->unflushed_from && s->q[s->q_head].flush_at <= s->pushed) {
+        struct pend_s *p = &s->q[s->q_head++];
+        while (s->seg_cursor + 1 < s->n_segs && s->segs[s->seg_cursor + 1].begin < p->flush_at) s->seg_cursor++;
+        struct seg_s *seg = &s->segs[s->seg_cursor];
+        uint64_t t = seg->start + (uint64_t) ((p->flush_at - seg->begin) * s->ns_per_byte) + s->half_rtt;
+        if ((uint32_t) rand_r(&s->seed) < s->loss_threshold) t += s->rtt;
+        if (t < s->hol_until) t = s->hol_until;
+        s->hol_until = t;
+        s->lat[s->n_lat++] = t - p->arrived;
+    }
+}
+
+static ssize_t sock_send(sim_t *s, uint8_t *buff, ssize_t len) {
+    ssize_t room = sock_room(s);
+    if (room <= 0) return 0;
+    if (len > room) len = room;
+    if (s->n_segs == s->segs_cap) {
+        s->segs_cap = s->segs_cap ? s->segs_cap * 2 : 4096;
+        assert((s->segs = realloc(s->segs, s->segs_cap * sizeof(struct seg_s))) != NULL);
+    }
+    uint64_t start = (s->link_free_at > s->now) ? s->link_free_at : s->now;
+    s->segs[s->n_segs++] = (struct seg_s) {s->pushed, start};
+    s->link_free_at = start + (uint64_t) (len * s->ns_per_byte);
+    s->pushed += len;
+    receive(s, buff, len);
+    deliver_flushed(s);
+    return len;
+}
+
+/* stand-in for send_bl_batch */
+static int sock_drain_hdlr(int fd, void *buff, ssize_t len, ssize_t *start, void *ctx, ssize_t ignore_) {
+    ssize_t sent = sock_send((sim_t *) ctx, buff, len);
+    if (sent == 0) return CONN_IO_OK_EXHAUSTED;
+    *start += sent;
+    return CONN_IO_OK;
+}
+
+struct pkt_in_s {
+    sim_t *s;
+    uint8_t *buff;
+    ssize_t len, consumed;
+    int started;
+};
+
+/* stand-in for write_passthru_to_conn, gets the same ctx as read_pkt */
+static ssize_t sock_push(void *b1, ssize_t len1, void *b2, ssize_t len2, void *ctx) {
+    sim_t *s = ((struct pkt_in_s *) ctx)->s;
+    ssize_t written = sock_send(s, b1, len1);
+    if ((written == len1) && len2 > 0) written += sock_send(s, b2, len2);
+    return written;
+}
+
+/* mirrors read_from_tun_buff in io.c */
+static int read_pkt(int fd, void *to_buff, ssize_t capacity, ssize_t *end, void *ctx, ssize_t additional_capacity) {
+    struct pkt_in_s *pkt = (struct pkt_in_s *) ctx;
+    compress_t *comp = &pkt->s->tx;
+    if (! pkt->started) {
+        if (worst_case_compressed_out_sz(comp, pkt->len) > (capacity + additional_capacity)) {
+            return CONN_IO_OK_NOT_ENOUGH_SPACE;
+        }
+        setup_compress_input(comp, pkt->buff, pkt->len);
+        pkt->started = 1;
+    }
+    ssize_t consumed = 0;
+    int complete = 0;
+    ssize_t written = do_compress(comp, to_buff, capacity, &consumed, &complete);
+    *end += written;
+    pkt->consumed += consumed;
+    if ((! complete) && additional_capacity == 0) return CONN_KILL;
+    if (pkt->len == 0 && written == capacity) return CONN_IO_OK;
+    return (pkt->consumed == pkt->len) ? CONN_IO_OK_EXHAUSTED : CONN_IO_OK;
+}
+
+static uint64_t ring_produced(sim_t *s) { /* compressed bytes produced so far = pushed + still in ring */
+    ring_buff_t *r = &s->ring;
+    ssize_t used = r->wraped ? (r->sz - r->start + r->end) : (r->end - r->start);
+    return s->pushed + used;
+}
+
+static int write_pkt(sim_t *s, uint8_t *buff, ssize_t len, int defer) {
+    struct pkt_in_s in = {s, buff, len, 0, 0};
+    s->tx.defer_flush = defer && (len > 0);
+    int ret = fill_ring(-1, &s->ring, read_pkt, sock_push, &in);
+    assertf(ret == CONN_IO_OK_EXHAUSTED || ret == CONN_IO_OK_NOT_ENOUGH_SPACE, "autotune", L("unexpected ring result: %d"), ret);
+    return ret == CONN_IO_OK_EXHAUSTED;
+}
+
+static void flush(sim_t *s) {
+    if (! write_pkt(s, NULL, 0, 0)) {
+        s->flush_stalled = 1;
+        return;
+    }
+    s->flush_stalled = 0;
+    uint64_t at = ring_produced(s);
+    for (size_t i = s->unflushed_from; i < s->q_tail; i++) s->q[i].flush_at = at;
+    s->unflushed_from = s->q_tail;
+    deliver_flushed(s);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static const char *flush_name(int flush_policy) {
+    return (flush_policy == IO_FLUSH_FLOW) ? "flow" : (flush_policy == IO_FLUSH_BATCH) ? "batch" : "pkt";
+}
+
+/* reorders a tun batch (indices into the replayed sequence) the way io.c does for IO_FLUSH_FLOW */
+static void group_by_flow(size_t *batch, int n) {
+    uint64_t keys[TUN_BATCH];
+    uint8_t order[TUN_BATCH];
+    size_t orig[TUN_BATCH];
+    for (int b = 0; b < n; b++) {
+        size_t j = batch[b] % pkts.n;
+        keys[b] = flow_group_key(pcap_pkt(&pkts, j), pkts.len[j]);
+        orig[b] = batch[b];
+    }
+    flow_group_order(keys, n, order);
+    for (int b = 0; b < n; b++) batch[b] = orig[order[b]];
+}
+
+static uint64_t arrival(size_t i, uint64_t span) {
+    return (uint64_t) (((i / pkts.n) * span + pkts.ts_ns[i % pkts.n]) / cfg.speedup);
+}
+
+static void simulate(knob_t *k, result_t *r) {
+    sim_t s;
+    memset(&s, 0, sizeof(s));
+    memset(r, 0, sizeof(*r));
+    r->k = *k;
+
+    size_t total = pkts.n * cfg.loops;
+    uint64_t span = pkts.n > 1 ? pkts.ts_ns[pkts.n - 1] + pkts.ts_ns[pkts.n - 1] / (pkts.n - 1) : 0; /* loop period, one mean gap after last */
+    s.ns_per_byte = 8.0e6 / cfg.link.bw_kbit;
+    s.half_rtt = cfg.link.rtt_ms * 1e6 / 2;
+    s.rtt = cfg.link.rtt_ms * 1e6;
+    s.loss_threshold = (uint32_t) (cfg.link.loss_pct / 100.0 * RAND_MAX);
+    s.seed = 1;
+    assert((s.q = calloc(total, sizeof(struct pend_s))) != NULL);
+    assert((s.lat = calloc(total, sizeof(uint64_t))) != NULL);
+    assert((s.rx_out = malloc(DECOMPRESSION_SRC_BUFF_CAPACITY)) != NULL);
+    assert(init_compression_ctx(&s.tx, k->level) == 0);
+    assert(init_compression_ctx(&s.rx, k->level) == 0);
+    assert(init_backlog_ring(&s.ring, k->ring_sz, k->adaptive, k->max_ring_sz) == 0);
+
+    int defer = (k->flush_policy != IO_FLUSH_PKT);
+    size_t batch[TUN_BATCH];
+    size_t i = 0;
+    while (1) {
+        drain_ring(-1, &s.ring, sock_drain_hdlr, &s);
+        if (s.flush_stalled) flush(&s);
+
+        if (i < total && arrival(i, span) <= s.now) {
+            uint64_t t0 = mono_ns();
+            int n = 0;
+            while (n < TUN_BATCH && i < total && arrival(i, span) <= s.now) batch[n++] = i++;
+            if (k->flush_policy == IO_FLUSH_FLOW) group_by_flow(batch, n);
+            for (int b = 0; b < n; b++) {
+                size_t j = batch[b] % pkts.n;
+                r->in_bytes += pkts.len[j];
+                if (! write_pkt(&s, pcap_pkt(&pkts, j), pkts.len[j], defer)) {
+                    r->dropped++;
+                    continue;
+                }
+                r->accepted_bytes += pkts.len[j];
+                s.q[s.q_tail++] = (struct pend_s) {arrival(batch[b], span), UINT64_MAX};
+                if (! defer) {
+                    s.unflushed_from = s.q_tail;
+                    s.q[s.q_tail - 1].flush_at = ring_produced(&s);
+                } else if (s.tx.unflushed_bytes > s.ring.sz / 4) {
+                    flush(&s);
+                }
+            }
+            if (defer) flush(&s);
+            deliver_flushed(&s);
+            uint64_t spent = mono_ns() - t0;
+            r->comp_ns += spent;
+            s.now += spent;
+            continue;
+        }
+
+        uint64_t next = (i < total) ? arrival(i, span) : UINT64_MAX;
+        if (! ring_empty(&s.ring) || s.flush_stalled) {
+            ssize_t want = cfg.sndbuf / 2;
+            uint64_t room_at = s.link_free_at - (uint64_t) ((cfg.sndbuf - want) * s.ns_per_byte);
+            if (room_at <= s.now) room_at = s.now + 1;
+            if (room_at < next) next = room_at;
+        }
+        if (next == UINT64_MAX) break;
+        if (next > s.now) s.now = next;
+    }
+    assert(s.q_head == s.q_tail);
+    assertf(s.decompressed == r->accepted_bytes, "autotune", L("round-trip mismatch: %llu in, %llu out"),
+            (unsigned long long) r->accepted_bytes, (unsigned long long) s.decompressed);
+
+    r->pkts = total;
+    r->out_bytes = s.pushed;
+    r->decomp_ns = s.decomp_ns;
+    r->span_ns = (s.hol_until > arrival(total - 1, span)) ? s.hol_until : arrival(total - 1, span);
+    r->ratio = s.pushed ? (double) s.decompressed / s.pushed : 0;
+    r->cpu_pct = r->span_ns ? 100.0 * (r->comp_ns + r->decomp_ns) / r->span_ns : 0;
+    r->drop_pct = 100.0 * r->dropped / total;
+    if (s.n_lat > 0) {
+        qsort(s.lat, s.n_lat, sizeof(uint64_t), cmp_u64);
+        r->p50_ms = s.lat[s.n_lat / 2] / 1e6;
+        r->p99_ms = s.lat[(s.n_lat * 99) / 100 < s.n_lat ? (s.n_lat * 99) / 100 : s.n_lat - 1] / 1e6;
+    }
+    r->feasible = (r->drop_pct <= cfg.max_drop_pct) && (s.n_lat > 0);
+
+    destroy_ring_buff(&s.ring);
+    destroy_compression_ctx(&s.tx);
+    destroy_compression_ctx(&s.rx);
+    free(s.rx_out);
+    free(s.segs);
+    free(s.q);
+    free(s.lat);
+}
+
+/* cpu and latency are measured, so values are compared in relative buckets of these widths
+   (bucketing rather than pairwise tolerance keeps dominance transitive) */
+#define RATIO_TOLERANCE 0.005
+#define CPU_TOLERANCE 0.10
+#define P99_TOLERANCE 0.02
+
+static long bucket(double v, double tol) {
+    return (v > 0) ? (long) floor(log(v) / log1p(tol)) : LONG_MIN;
+}
+
+static int cmp_long(long a, long b) {
+    return (a > b) - (a < b);
+}
+
+static int flush_rank(int flush_policy) {
+    return (flush_policy == IO_FLUSH_BATCH) ? 2 : (flush_policy == IO_FLUSH_FLOW) ? 1 : 0;
+}
+
+static ssize_t ring_footprint(knob_t *k) {
+    return k->adaptive ? k->max_ring_sz : k->ring_sz;
+}
+
+static int dominates(result_t *a, result_t *b) {
+    int c[] = {cmp_long(bucket(b->ratio, RATIO_TOLERANCE), bucket(a->ratio, RATIO_TOLERANCE)), /* lower is better for a */
+               cmp_long(bucket(a->cpu_pct, CPU_TOLERANCE), bucket(b->cpu_pct, CPU_TOLERANCE)),
+               cmp_long(bucket(a->p99_ms, P99_TOLERANCE), bucket(b->p99_ms, P99_TOLERANCE))};
+    int better = 0;
+    for (size_t i = 0; i < sizeof(c) / sizeof(c[0]); i++) {
+        if (c[i] > 0) return 0;
+        better |= (c[i] < 0);
+    }
+    if (better) return 1;
+    /* equivalent within noise: smaller ring footprint wins, then batch (fewer syscalls, and no reordering), then flow, then position for a total order */
+    if (ring_footprint(&a->k) != ring_footprint(&b->k)) return ring_footprint(&a->k) < ring_footprint(&b->k);
+    if (a->k.adaptive != b->k.adaptive) return a->k.adaptive < b->k.adaptive;
+    if (a->k.flush_policy != b->k.flush_policy) return flush_rank(a->k.flush_policy) > flush_rank(b->k.flush_policy);
+    return a < b;
+}
+
+static void mark_frontier(result_t *r, int n) {
+    for (int i = 0; i < n; i++) {
+        r[i].frontier = r[i].feasible;
+        for (int j = 0; j < n && r[i].frontier; j++) {
+            if (j != i && r[j].feasible && dominates(&r[j], &r[i])) r[i].frontier = 0;
+        }
+    }
+}
+
+static int within_budget(result_t *r) {
+    return r->feasible && r->cpu_pct <= cfg.cpu_budget_pct && (cfg.p99_budget_ms <= 0 || r->p99_ms <= cfg.p99_budget_ms);
+}
+
+#define PICK_RATIO 0
+#define PICK_LATENCY 1
+#define PICK_CPU 2
+
+static result_t *pick(result_t *r, int n, int what) {
+    result_t *best = NULL;
+    for (int i = 0; i < n; i++) {
+        if (! r[i].frontier || (what == PICK_RATIO && ! within_budget(&r[i]))) continue;
+        if (best == NULL) {
+            best = &r[i];
+        } else if (what == PICK_RATIO) {
+            if (r[i].ratio > best->ratio) best = &r[i];
+        } else if (what == PICK_LATENCY) {
+            if (r[i].p99_ms < best->p99_ms || (r[i].p99_ms == best->p99_ms && r[i].ratio > best->ratio)) best = &r[i];
+        } else {
+            if (r[i].cpu_pct < best->cpu_pct) best = &r[i];
+        }
+    }
+    return best;
+}
+
+static void flags_of(knob_t *k, char *buff, size_t len) {
+    int n = snprintf(buff, len, "-c %d -F %s -e %zd", k->level, flush_name(k->flush_policy), k->ring_sz);
+    if (k->adaptive) snprintf(buff + n, len - n, " -a -M %zd", k->max_ring_sz);
+}
+
+static void ring_str(ssize_t sz, char *buff, size_t len) {
+    if (sz >= 1024 * 1024) snprintf(buff, len, "%zdM", sz / (1024 * 1024));
+    else snprintf(buff, len, "%zdK", sz / 1024);
+}
+
+static void print_text(result_t *r, int n) {
+    char e[24], m[24], flags[128];
+    printf("link: %s, %.0f kbit/s, rtt %.0f ms, loss %.2f%%, socket send-buffer %zd bytes\n",
+           cfg.link.name, cfg.link.bw_kbit, cfg.link.rtt_ms, cfg.link.loss_pct, cfg.sndbuf);
+    printf("trace: %s, %zu pkts, %zu bytes, %.3f s (replayed %d times, speedup %.2f), compression: %s\n\n",
+           cfg.pcap, pkts.n, pkts.bytes, pkts.n ? pkts.ts_ns[pkts.n - 1] / NS : 0, cfg.loops, cfg.speedup, COMPRESSION_IMPL);
+    printf("%s configurations (* = on ratio/cpu/p99 frontier, ! = drops above %.2f%%):\n", cfg.all ? "all" : "frontier", cfg.max_drop_pct);
+    printf("  %5s %5s %6s %8s %7s %7s %9s %9s %7s\n", "level", "flush", "ring", "adaptive", "ratio", "cpu%", "p50(ms)", "p99(ms)", "drop%");
+    for (int i = 0; i < n; i++) {
+        if (! cfg.all && ! r[i].frontier) continue;
+        ring_str(r[i].k.ring_sz, e, sizeof(e));
+        if (r[i].k.adaptive) ring_str(r[i].k.max_ring_sz, m, sizeof(m));
+        else snprintf(m, sizeof(m), "-");
+        printf("%c %5d %5s %6s %8s %7.3f %7.2f %9.2f %9.2f %7.2f\n", r[i].frontier ? '*' : (r[i].feasible ? ' ' : '!'),
+               r[i].k.level, flush_name(r[i].k.flush_policy), e, m,
+               r[i].ratio, r[i].cpu_pct, r[i].p50_ms, r[i].p99_ms, r[i].drop_pct);
+    }
+
+    const char *names[] = {"best ratio within budget", "lowest p99 latency", "lowest cpu"};
+    char p99_budget[32] = "none";
+    if (cfg.p99_budget_ms > 0) snprintf(p99_budget, sizeof(p99_budget), "%.1f ms", cfg.p99_budget_ms);
+    printf("\nrecommendations (cpu budget %.1f%%, p99 budget %s):\n", cfg.cpu_budget_pct, p99_budget);
+    for (int w = PICK_RATIO; w <= PICK_CPU; w++) {
+        result_t *p = pick(r, n, w);
+        if (p == NULL) {
+            printf("  %-26s none satisfies the constraints\n", names[w]);
+            continue;
+        }
+        flags_of(&p->k, flags, sizeof(flags));
+        printf("  %-26s l3tc %-36s (ratio %.3f, cpu %.2f%%, p99 %.2f ms)\n", names[w], flags, p->ratio, p->cpu_pct, p->p99_ms);
+    }
+    printf("\n-t (tun ring) is not simulated, keep the default (%d) unless tun-side drops are seen.\n", TUN_RING_SZ);
+}
+
+static void print_json(result_t *r, int n) {
+    char flags[128];
+    printf("{\n  \"suite\": \"autotune\",\n  \"compression\": \"%s\",\n", COMPRESSION_IMPL);
+    printf("  \"link\": {\"name\": \"%s\", \"bw_kbit\": %.0f, \"rtt_ms\": %.1f, \"loss_pct\": %.3f, \"sndbuf\": %zd},\n",
+           cfg.link.name, cfg.link.bw_kbit, cfg.link.rtt_ms, cfg.link.loss_pct, cfg.sndbuf);
+    printf("  \"trace\": {\"pcap\": \"%s\", \"pkts\": %zu, \"bytes\": %zu, \"loops\": %d, \"speedup\": %.3f},\n",
+           cfg.pcap, pkts.n, pkts.bytes, cfg.loops, cfg.speedup);
+    printf("  \"results\": [\n");
+    for (int i = 0; i < n; i++) {
+        printf("    {\"level\": %d, \"flush\": \"%s\", \"ring_sz\": %zd, \"adaptive\": %d, \"max_ring_sz\": %zd, "
+               "\"ratio\": %.4f, \"cpu_pct\": %.3f, \"comp_ns\": %llu, \"decomp_ns\": %llu, \"p50_ms\": %.3f, \"p99_ms\": %.3f, "
+               "\"drop_pct\": %.3f, \"feasible\": %d, \"frontier\": %d}%s\n",
+               r[i].k.level, flush_name(r[i].k.flush_policy), r[i].k.ring_sz, r[i].k.adaptive, r[i].k.max_ring_sz,
+               r[i].ratio, r[i].cpu_pct, (unsigned long long) r[i].comp_ns, (unsigned long long) r[i].decomp_ns, r[i].p50_ms, r[i].p99_ms,
+               r[i].drop_pct, r[i].feasible, r[i].frontier, (i + 1 < n) ? "," : "");
+    }
+    printf("  ],\n  \"recommendations\": {");
+    const char *names[] = {"ratio", "latency", "cpu"};
+    for (int w = PICK_RATIO; w <= PICK_CPU; w++) {
+        result_t *p = pick(r, n, w);
+        if (p != NULL) flags_of(&p->k, flags, sizeof(flags));
+        printf("%s\"%s\": %s%s%s", w ? ", " : "", names[w], p ? "\"" : "", p ? flags : "null", p ? "\"" : "");
+    }
+    printf("}\n}\n");
+}
+
+static int parse_link(const char *s) {
+    for (size_t i = 0; i < sizeof(named_links) / sizeof(named_links[0]); i++) {
+        if (strcmp(s, named_links[i].name) == 0) {
+            cfg.link = named_links[i];
+            return 0;
+        }
+    }
+    cfg.link.loss_pct = 0;
+    if (sscanf(s, "%lf:%lf:%lf", &cfg.link.bw_kbit, &cfg.link.rtt_ms, &cfg.link.loss_pct) < 2 || cfg.link.bw_kbit <= 0) return -1;
+    snprintf(cfg.link.name, sizeof(cfg.link.name), "custom");
+    return 0;
+}
+
+static int parse_levels(char *s) {
+    cfg.n_levels = 0;
+    for (char *tok = strtok(s, ","); tok != NULL && cfg.n_levels < MAX_LEVELS; tok = strtok(NULL, ",")) {
+        int l = atoi(tok);
+        if (l < MIN_COMPRESSION_LEVEL || l > MAX_COMPRESSION_LEVEL) return -1;
+        cfg.levels[cfg.n_levels++] = l;
+    }
+    return cfg.n_levels ? 0 : -1;
+}
+
+static void default_levels() {
+#ifdef USE_ZSTD
+    static const int lvls[] = {1, 2, 3, 4, 6, 9, 12, 15, 19}; /* higher ones are too slow for a data-path */
+    for (size_t i = 0; i < sizeof(lvls) / sizeof(lvls[0]); i++) cfg.levels[cfg.n_levels++] = lvls[i];
+#else
+    for (int l = MIN_COMPRESSION_LEVEL; l <= MAX_COMPRESSION_LEVEL; l++) cfg.levels[cfg.n_levels++] = l;
+#endif
+}
+
+static int build_knobs(knob_t *k) {
+    static const ssize_t fixed[] = {64 * 1024, 128 * 1024, 256 * 1024, 512 * 1024, 1024 * 1024, 4 * 1024 * 1024};
+    static const ssize_t adaptive_max[] = {1024 * 1024, MAX_RING_SZ};
+    ssize_t min_sz = compress_ring_min_sz();
+    ssize_t start_sz = (min_sz > fixed[0]) ? min_sz : fixed[0];
+    int n = 0;
+    for (int l = 0; l < cfg.n_levels; l++) {
+        for (int f = IO_FLUSH_PKT; f <= IO_FLUSH_FLOW; f++) {
+            for (size_t i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++) {
+                if (fixed[i] < min_sz) continue;
+                k[n++] = (knob_t) {cfg.levels[l], f, fixed[i], 0, fixed[i]};
+            }
+            for (size_t i = 0; i < sizeof(adaptive_max) / sizeof(adaptive_max[0]); i++) {
+                k[n++] = (knob_t) {cfg.levels[l], f, start_sz, 1, adaptive_max[i]};
+            }
+        }
+    }
+    return n;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -f pcap [-l link] [-b sndbuf-bytes] [-s speedup] [-n loops] [-L levels] [-C cpu-budget-pct] [-P p99-budget-ms] [-D max-drop-pct] [-j] [-A] [-v]\n", prog);
+    fprintf(stderr, "  link: dsl, lte, satellite, metro or <bw-kbit>:<rtt-ms>[:<loss-pct>] (default: dsl)\n");
+    fprintf(stderr, "  levels: comma separated compression levels to sweep (%s, %d..%d)\n", COMPRESSION_IMPL, MIN_COMPRESSION_LEVEL, MAX_COMPRESSION_LEVEL);
+}
+
+int main(int argc, char *argv[]) {
+    int ch;
+    while ((ch = getopt(argc, argv, "hf:l:b:s:n:L:C:P:D:jAv")) != -1) {
+        switch (ch) {
+        case 'f': cfg.pcap = optarg; break;
+        case 'l':
+            if (parse_link(optarg) != 0) {
+                fprintf(stderr, "bad link profile `%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'b': cfg.sndbuf = atol(optarg); break;
+        case 's': cfg.speedup = atof(optarg); break;
+        case 'n': cfg.loops = atoi(optarg); break;
+        case 'L':
+            if (parse_levels(optarg) != 0) {
+                fprintf(stderr, "bad compression level list\n");
+                exit(1);
+            }
+            break;
+        case 'C': cfg.cpu_budget_pct = atof(optarg); break;
+        case 'P': cfg.p99_budget_ms = atof(optarg); break;
+        case 'D': cfg.max_drop_pct = atof(optarg); break;
+        case 'j': cfg.json = 1; break;
+        case 'A': cfg.all = 1; break;
+        case 'v': cfg.verbose++; break;
+        default:
+            usage(argv[0]);
+            exit(ch == 'h' ? 0 : 1);
+        }
+    }
+    if (cfg.pcap == NULL || cfg.loops < 1 || cfg.speedup <= 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+    log_init(cfg.verbose, "autotune");
+    if (cfg.n_levels == 0) default_levels();
+    if (cfg.sndbuf <= 0) { /* roughly what tcp autotuning settles at: 2 x BDP */
+        double bdp = cfg.link.bw_kbit * 1000 / 8 * cfg.link.rtt_ms / 1000;
+        cfg.sndbuf = (2 * bdp > 64 * 1024) ? (ssize_t) (2 * bdp) : 64 * 1024;
+    }
+
+    if (pcap_load_l3_pkts(cfg.pcap, 0, &pkts) != 0 || pkts.n == 0) {
+        fprintf(stderr, "couldn't load packets from %s\n", cfg.pcap);
+        exit(1);
+    }
+
+    knob_t *knobs = calloc(MAX_KNOBS, sizeof(knob_t));
+    assert(knobs != NULL);
+    int n = build_knobs(knobs);
+    result_t *results = calloc(n, sizeof(result_t));
+    assert(results != NULL);
+    for (int i = 0; i < n; i++) {
+        simulate(&knobs[i], &results[i]);
+        if (cfg.verbose) fprintf(stderr, "[%d/%d] level %d flush %d ring %zd adaptive %d => ratio %.3f, p99 %.2f ms\n",
+                                 i + 1, n, knobs[i].level, knobs[i].flush_policy, knobs[i].ring_sz, knobs[i].adaptive, results[i].ratio, results[i].p99_ms);
+    }
+    mark_frontier(results, n);
+
+    if (cfg.json) print_json(results, n);
+    else print_text(results, n);
+
+    free(results);
+    free(knobs);
+    pcap_pkts_free(&pkts);
+    return 0;
+}
@@ -0,0 +1,444 @@
+#include "../src/ring.h"
+#include "../src/common.h"
+#include "../src/ba_htab.h"
+#include "../src/str_htab.h"
+#include "../src/log.h"
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sched.h>
+#include <sys/utsname.h>
+
+/* micro-benchmarks for data-path primitives, emits one JSON document on stdout */
+
+#define DEFAULT_REPS 9
+#define BENCH_RING_SZ 128*1024 /* same as CONN_RING_SZ */
+#define ADDR_KEY_LEN 16 /* MAX_NW_ADDR_LEN in io.c */
+#define STR_KEY_LEN 32
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/* returns nanoseconds spent doing iters operations (setup excluded by the callee) */
+typedef uint64_t (bench_fn_t)(void *ctx, long iters);
+
+struct bench_s {
+    char name[64];
+    char params[128]; /* json object body */
+    bench_fn_t *run;
+    void *ctx;
+    long iters;
+    ssize_t bytes_per_op; /* 0 => throughput not reported */
+};
+
+typedef struct bench_s bench_t;
+
+static volatile uint64_t sink; /* keeps the optimizer from discarding results */
+
+static int reps = DEFAULT_REPS;
+static double scale = 1.0;
+static const char *filter = NULL;
+static int emitted = 0;
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void run_bench(bench_t *b) {
+    if (filter != NULL && strstr(b->name, filter) == NULL) return;
+
+    long iters = (long) (b->iters * scale);
+    if (iters < 1) iters = 1;
+
+    double ns_per_op[reps];
+    b->run(b->ctx, iters > 1 ? iters / 10 + 1 : 1); /* warm caches and allocator */
+    for (int i = 0; i < reps; i++) {
+        ns_per_op[i] = (double) b->run(b->ctx, iters) / iters;
+    }
+    qsort(ns_per_op, reps, sizeof(double), cmp_double);
+    double median = ns_per_op[reps / 2];
+
+    printf("%s\n    {\"name\": \"%s\", \"params\": {%s}, \"iters\": %ld, \"reps\": %d, "
+           "\"ns_per_op\": {\"min\": %.2f, \"median\": %.2f, \"max\": %.2f}",
+           emitted ? "," : "", b->name, b->params, iters, reps, ns_per_op[0], median, ns_per_op[reps - 1]);
+    if (b->bytes_per_op > 0) {
+        printf(", \"mb_per_s\": %.2f", (b->bytes_per_op / median) * 1000.0);
+    }
+    printf("}");
+    fflush(stdout);
+    emitted++;
+}
+
+/* ring fill / drain */
+
+struct ring_bench_s {
+    ring_buff_t ring;
+    ssize_t chunk;
+    int backlog_pct;
+    int straddle_wrap;
+    uint8_t *src, *dest;
+};
+
+typedef struct ring_bench_s ring_bench_t;
+
+struct chunk_io_s {
+    uint8_t *data;
+    ssize_t remaining;
+};
+
+typedef struct chunk_io_s chunk_io_t;
+
+static int bench_fill_hdlr(int fd, void *buff, ssize_t len, ssize_t *end, void *hdlr_ctx, ssize_t additional_len) {
+    chunk_io_t *c = (chunk_io_t *) hdlr_ctx;
+    ssize_t n = c->remaining < len ? c->remaining : len;
+    memcpy(buff, c->data, n);
+    c->data += n;
+    c->remaining -= n;
+    *end += n;
+    return (c->remaining == 0) ? CONN_IO_OK_EXHAUSTED : CONN_IO_OK;
+}
+
+static int bench_drain_hdlr(int fd, void *buff, ssize_t len, ssize_t *start, void *hdlr_ctx, ssize_t additional_len) {
+    chunk_io_t *c = (chunk_io_t *) hdlr_ctx;
+    ssize_t n = c->remaining < len ? c->remaining : len;
+    memcpy(c->data, buff, n);
+    c->data += n;
+    c->remaining -= n;
+    *start += n;
+    return (c->remaining == 0) ? CONN_IO_OK_EXHAUSTED : CONN_IO_OK;
+}
+
+static void ring_bench_reset(ring_bench_t *rb) {
+    ring_buff_t *r = &rb->ring;
+    r->wraped = 0;
+    r->start = r->end = rb->straddle_wrap ? (r->sz - rb->chunk / 2) : 0;
+    ssize_t backlog = (r->sz * rb->backlog_pct) / 100;
+    chunk_io_t c = {rb->src, backlog};
+    while (c.remaining > 0) {
+        ssize_t n = c.remaining > rb->chunk ? rb->chunk : c.remaining;
+        chunk_io_t part = {c.data, n};
+        fill_ring(-1, r, bench_fill_hdlr, NULL, &part);
+        c.remaining -= n;
+    }
+}
+
+static uint64_t bench_ring_fill_drain(void *ctx, long iters) {
+    ring_bench_t *rb = (ring_bench_t *) ctx;
+    ring_bench_reset(rb);
+    uint64_t start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        if (rb->straddle_wrap) {
+            rb->ring.start = rb->ring.end = rb->ring.sz - rb->chunk / 2;
+            rb->ring.wraped = 0;
+        }
+        chunk_io_t in = {rb->src, rb->chunk};
+        fill_ring(-1, &rb->ring, bench_fill_hdlr, NULL, &in);
+        chunk_io_t out = {rb->dest, rb->chunk};
+        drain_ring(-1, &rb->ring, bench_drain_hdlr, &out);
+    }
+    uint64_t elapsed = now_ns() - start;
+    sink += rb->dest[0];
+    return elapsed;
+}
+
+static void bench_rings(uint8_t *src, uint8_t *dest) {
+    ssize_t chunks[] = {64, 1500, 9000};
+    int backlogs[] = {0, 50, 90};
+    ring_bench_t rb;
+    memset(&rb, 0, sizeof(rb));
+    assert(init_backlog_ring(&rb.ring, BENCH_RING_SZ, 0, BENCH_RING_SZ) == 0);
+    rb.src = src;
+    rb.dest = dest;
+    bench_t b = {.run = bench_ring_fill_drain, .ctx = &rb};
+    for (unsigned i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+        for (unsigned j = 0; j < sizeof(backlogs) / sizeof(backlogs[0]); j++) {
+            rb.chunk = chunks[i];
+            rb.backlog_pct = backlogs[j];
+            rb.straddle_wrap = 0;
+            snprintf(b.name, sizeof(b.name), "ring_fill_drain/%zd/backlog_%d", rb.chunk, rb.backlog_pct);
+            snprintf(b.params, sizeof(b.params), "\"ring_sz\": %d, \"chunk\": %zd, \"backlog_pct\": %d, \"wrap\": \"walking\"", BENCH_RING_SZ, rb.chunk, rb.backlog_pct);
+            b.iters = 2000000 / (1 + rb.chunk / 256);
+            b.bytes_per_op = rb.chunk;
+            run_bench(&b);
+        }
+        rb.chunk = chunks[i];
+        rb.backlog_pct = 0;
+        rb.straddle_wrap = 1;
+        snprintf(b.name, sizeof(b.name), "ring_fill_drain/%zd/straddle_wrap", rb.chunk);
+        snprintf(b.params, sizeof(b.params), "\"ring_sz\": %d, \"chunk\": %zd, \"backlog_pct\": 0, \"wrap\": \"every_op\"", BENCH_RING_SZ, rb.chunk);
+        b.iters = 2000000 / (1 + rb.chunk / 256);
+        b.bytes_per_op = rb.chunk;
+        run_bench(&b);
+    }
+    destroy_ring_buff(&rb.ring);
+}
+
+/* ring expansion */
+
+struct expand_bench_s {
+    ssize_t sz;
+    int wrapped;
+};
+
+typedef struct expand_bench_s expand_bench_t;
+
+static uint64_t bench_ring_expand(void *ctx, long iters) {
+    expand_bench_t *eb = (expand_bench_t *) ctx;
+    uint64_t elapsed = 0;
+    for (long i = 0; i < iters; i++) {
+        ring_buff_t r;
+        assert(init_backlog_ring(&r, eb->sz, 1, eb->sz * 2) == 0);
+        memset(r.buff, i, r.sz); /* fault pages in, expansion copies a full ring */
+        if (eb->wrapped) {
+            r.start = r.end = r.sz / 2;
+            r.wraped = 1;
+        } else {
+            r.start = 0;
+            r.end = r.sz;
+        }
+        uint64_t start = now_ns();
+        assert(expand_ring_buffer(&r) == 0);
+        elapsed += now_ns() - start;
+        sink += ((uint8_t *) r.buff)[r.end - 1];
+        destroy_ring_buff(&r);
+    }
+    return elapsed;
+}
+
+static void bench_ring_expansion() {
+    ssize_t szs[] = {128*1024, 1024*1024, 8*1024*1024};
+    expand_bench_t eb;
+    bench_t b = {.run = bench_ring_expand, .ctx = &eb};
+    for (unsigned i = 0; i < sizeof(szs) / sizeof(szs[0]); i++) {
+        for (eb.wrapped = 0; eb.wrapped <= 1; eb.wrapped++) {
+            eb.sz = szs[i];
+            snprintf(b.name, sizeof(b.name), "ring_expand/%zd/%s", eb.sz, eb.wrapped ? "wrapped" : "linear");
+            snprintf(b.params, sizeof(b.params), "\"from_sz\": %zd, \"to_sz\": %zd, \"wrapped\": %d", eb.sz, eb.sz * 2, eb.wrapped);
+            b.iters = (64 * 1024 * 1024) / eb.sz;
+            b.bytes_per_op = eb.sz;
+            run_bench(&b);
+        }
+    }
+}
+
+/* packet-length parsing across split buffers */
+
+struct parse_bench_s {
+    uint8_t pkt[64];
+    ssize_t split;
+};
+
+typedef struct parse_bench_s parse_bench_t;
+
+static uint64_t bench_parse_ipv4(void *ctx, long iters) {
+    parse_bench_t *pb = (parse_bench_t *) ctx;
+    uint8_t *b1 = pb->split > 0 ? pb->pkt : NULL;
+    uint8_t *b2 = pb->pkt + pb->split;
+    ssize_t len1 = pb->split, len2 = sizeof(pb->pkt) - pb->split;
+    uint64_t acc = 0;
+    uint64_t start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        acc += parse_ipv4_pkt_sz(b1, len1, b2, len2);
+    }
+    uint64_t elapsed = now_ns() - start;
+    sink += acc;
+    return elapsed;
+}
+
+static void bench_pkt_len_parsing() {
+    parse_bench_t pb;
+    memset(pb.pkt, 0, sizeof(pb.pkt));
+    pb.pkt[0] = 0x45;
+    pb.pkt[2] = 0x05;
+    pb.pkt[3] = 0xdc;
+    bench_t b = {.run = bench_parse_ipv4, .ctx = &pb, .iters = 20000000};
+    ssize_t splits[] = {0, 1, 2, 3, 4, 20};
+    for (unsigned i = 0; i < sizeof(splits) / sizeof(splits[0]); i++) {
+        pb.split = splits[i];
+        snprintf(b.name, sizeof(b.name), "parse_ipv4_pkt_sz/split_%zd", pb.split);
+        snprintf(b.params, sizeof(b.params), "\"len1\": %zd, \"len2\": %zd", pb.split, sizeof(pb.pkt) - pb.split);
+        run_bench(&b);
+    }
+}
+
+/* hash lookups */
+
+struct addr_entry_s {
+    uint8_t addr[ADDR_KEY_LEN];
+    int id;
+};
+
+typedef struct addr_entry_s addr_entry_t;
+
+struct htab_bench_s {
+    int n;
+    int hit;
+    uint8_t (*keys)[ADDR_KEY_LEN]; /* lookup order */
+    char (*str_keys)[STR_KEY_LEN];
+    batab_t batab;
+    shtab_t shtab;
+};
+
+typedef struct htab_bench_s htab_bench_t;
+
+#define LOOKUP_KEYS 4096
+
+static void fill_addr(uint8_t *addr, int i, int hit) {
+    memset(addr, 0, ADDR_KEY_LEN);
+    addr[0] = 10;
+    addr[1] = hit ? 0 : 255;
+    addr[2] = (i >> 8) & 0xFF;
+    addr[3] = i & 0xFF;
+    addr[4] = (i >> 16) & 0xFF; /* keep keys distinct beyond 64k entries */
+}
+
+static uint64_t bench_batab_get(void *ctx, long iters) {
+    htab_bench_t *hb = (htab_bench_t *) ctx;
+    uint64_t found = 0;
+    uint64_t start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        found += (batab_get(&hb->batab, hb->keys[i % LOOKUP_KEYS]) != NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+    assert(found == (hb->hit ? (uint64_t) iters : 0));
+    sink += found;
+    return elapsed;
+}
+
+static uint64_t bench_shtab_get(void *ctx, long iters) {
+    htab_bench_t *hb = (htab_bench_t *) ctx;
+    uint64_t found = 0;
+    uint64_t start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        found += (shtab_get(&hb->shtab, hb->str_keys[i % LOOKUP_KEYS]) != NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+    assert(found == (hb->hit ? (uint64_t) iters : 0));
+    sink += found;
+    return elapsed;
+}
+
+static void bench_htabs() {
+    int sizes[] = {10, 1000, 100000};
+    htab_bench_t hb;
+    assert((hb.keys = malloc(LOOKUP_KEYS * ADDR_KEY_LEN)) != NULL);
+    assert((hb.str_keys = malloc(LOOKUP_KEYS * STR_KEY_LEN)) != NULL);
+    bench_t b = {.ctx = &hb, .iters = 2000000};
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        hb.n = sizes[i];
+        addr_entry_t *entries = calloc(hb.n, sizeof(addr_entry_t));
+        assert(entries != NULL);
+        assert(batab_init(&hb.batab, offsetof(addr_entry_t, addr), ADDR_KEY_LEN, NULL, "bench-addr") == 0);
+        assert(shtab_init(&hb.shtab, NULL, "bench-str") == 0);
+        char key[STR_KEY_LEN];
+        for (int j = 0; j < hb.n; j++) {
+            fill_addr(entries[j].addr, j, 1);
+            entries[j].id = j;
+            assert(batab_put(&hb.batab, &entries[j], NULL) == 0);
+            snprintf(key, sizeof(key), "peer-%d.example.net", j);
+            assert(shtab_put(&hb.shtab, key, &entries[j], NULL) == 0);
+        }
+        for (hb.hit = 1; hb.hit >= 0; hb.hit--) {
+            srand(hb.n);
+            for (int j = 0; j < LOOKUP_KEYS; j++) {
+                int k = rand() % hb.n;
+                fill_addr(hb.keys[j], k, hb.hit);
+                snprintf(hb.str_keys[j], STR_KEY_LEN, "%s-%d.example.net", hb.hit ? "peer" : "miss", k);
+            }
+            const char *kind = hb.hit ? "hit" : "miss";
+
+            b.run = bench_batab_get;
+            snprintf(b.name, sizeof(b.name), "batab_get/%d/%s", hb.n, kind);
+            snprintf(b.params, sizeof(b.params), "\"entries\": %d, \"key_len\": %d, \"lookup\": \"%s\"", hb.n, ADDR_KEY_LEN, kind);
+            run_bench(&b);
+
+            b.run = bench_shtab_get;
+            snprintf(b.name, sizeof(b.name), "shtab_get/%d/%s", hb.n, kind);
+            snprintf(b.params, sizeof(b.params), "\"entries\": %d, \"lookup\": \"%s\"", hb.n, kind);
+            run_bench(&b);
+        }
+        shtab_destory(&hb.shtab);
+        batab_destory(&hb.batab);
+        free(entries);
+    }
+    free(hb.keys);
+    free(hb.str_keys);
+}
+
+static void discard_log(int severity, const char *msg, void *arg) {}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-r repetitions] [-s iteration-scale] [-f name-filter] [-c cpu]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int ch, cpu = -1;
+    while ((ch = getopt(argc, argv, "hr:s:f:c:")) != -1) {
+        switch (ch) {
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 's':
+            scale = atof(optarg);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'c':
+            cpu = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            exit(ch == 'h' ? 0 : 1);
+        }
+    }
+    if (reps < 1) reps = 1;
+
+    log_init(1, "micro_bench");
+    log_register(discard_log, NULL); /* ring expansion logs at warn, keep it out of measurements */
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            fprintf(stderr, "couldn't pin to cpu %d, running unpinned\n", cpu);
+            cpu = -1;
+        }
+    }
+
+    struct utsname u;
+    uname(&u);
+    printf("{\n  \"suite\": \"micro\",\n  \"version\": \"%s\",\n  \"timestamp\": %ld,\n  \"host\": \"%s\",\n  \"machine\": \"%s\",\n  \"cpu\": %d,\n  \"results\": [",
+           PACKAGE_VERSION, (long) time(NULL), u.nodename, u.machine, cpu);
+
+    uint8_t *src = malloc(BENCH_RING_SZ), *dest = malloc(BENCH_RING_SZ);
+    assert(src != NULL && dest != NULL);
+    for (int i = 0; i < BENCH_RING_SZ; i++) src[i] = i * 31;
+
+    bench_rings(src, dest);
+    bench_ring_expansion();
+    bench_pkt_len_parsing();
+    bench_htabs();
+
+    printf("\n  ]\n}\n");
+
+    free(src);
+    free(dest);
+    return 0;
+}
@@ -0,0 +1,147 @@
+#include "pcap_file.h"
+#include "../src/common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86DD
+#define ETHERTYPE_VLAN 0x8100
+
+struct pcap_global_hdr_s {
+    uint32_t magic;
+    uint16_t major, minor;
+    int32_t thiszone;
+    uint32_t sigfigs, snaplen, linktype;
+};
+
+struct pcap_rec_hdr_s {
+    uint32_t ts_sec, ts_frac, caplen, origlen;
+};
+
+static inline uint32_t swap32(uint32_t v, int swapped) {
+    return swapped ? __builtin_bswap32(v) : v;
+}
+
+/* returns offset of the L3 header within the record, -1 if it isn't IP */
+static ssize_t l3_offset(uint32_t linktype, const uint8_t *rec, uint32_t caplen) {
+    uint16_t ethertype;
+    ssize_t off;
+    switch (linktype) {
+    case LINKTYPE_RAW:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+        return 0;
+    case LINKTYPE_ETHERNET:
+        if (caplen < 14) return -1;
+        off = 12;
+        ethertype = ntohs(*(uint16_t *) (rec + off));
+        while (ethertype == ETHERTYPE_VLAN && caplen >= (uint32_t) off + 6) {
+            off += 4;
+            ethertype = ntohs(*(uint16_t *) (rec + off));
+        }
+        off += 2;
+        break;
+    case LINKTYPE_LINUX_SLL:
+        if (caplen < 16) return -1;
+        ethertype = ntohs(*(uint16_t *) (rec + 14));
+        off = 16;
+        break;
+    default:
+        return -1;
+    }
+    return (ethertype == ETHERTYPE_IPV4 || ethertype == ETHERTYPE_IPV6) ? off : -1;
+}
+
+static uint32_t l3_len(const uint8_t *pkt, uint32_t avail) {
+    return parse_l3_pkt_sz((void *) pkt, avail, NULL, 0);
+}
+
+int pcap_load_l3_pkts(const char *path, int flags, pcap_pkts_t *pkts) {
+    struct pcap_global_hdr_s gh;
+    struct pcap_rec_hdr_s rh;
+    size_t cap = 0, data_cap = 0;
+    uint8_t *rec = NULL;
+    uint32_t rec_cap = 0;
+
+    memset(pkts, 0, sizeof(*pkts));
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return -1;
+    if (fread(&gh, sizeof(gh), 1, f) != 1) goto fail;
+    int swapped = (gh.magic == __builtin_bswap32(PCAP_MAGIC_US) || gh.magic == __builtin_bswap32(PCAP_MAGIC_NS));
+    if (! swapped && gh.magic != PCAP_MAGIC_US && gh.magic != PCAP_MAGIC_NS) goto fail;
+    uint32_t linktype = swap32(gh.linktype, swapped) & 0xFFFF;
+    int nsec = (swap32(gh.magic, swapped) == PCAP_MAGIC_NS);
+    uint64_t first_ts = 0;
+
+    while (fread(&rh, sizeof(rh), 1, f) == 1) {
+        uint32_t caplen = swap32(rh.caplen, swapped);
+        if (caplen > rec_cap) {
+            uint8_t *r = realloc(rec, caplen);
+            if (r == NULL) goto fail;
+            rec = r;
+            rec_cap = caplen;
+        }
+        if (fread(rec, 1, caplen, f) != caplen) break;
+
+        ssize_t off = l3_offset(linktype, rec, caplen);
+        uint32_t len = (off >= 0) ? l3_len(rec + off, caplen - off) : 0;
+        if (len == 0 || len > caplen - off || ((flags & PCAP_IPV4_ONLY) && (rec[off] & 0xF0) != 0x40)) {
+            pkts->skipped++;
+            continue;
+        }
+
+        if (pkts->n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            size_t *o = realloc(pkts->off, cap * sizeof(size_t));
+            if (o != NULL) pkts->off = o;
+            uint16_t *l = realloc(pkts->len, cap * sizeof(uint16_t));
+            if (l != NULL) pkts->len = l;
+            uint64_t *t = realloc(pkts->ts_ns, cap * sizeof(uint64_t));
+            if (t != NULL) pkts->ts_ns = t;
+            if (o == NULL || l == NULL || t == NULL) goto fail;
+        }
+        if (pkts->bytes + len > data_cap) {
+            data_cap = (data_cap ? data_cap * 2 : 1024 * 1024) + len;
+            uint8_t *d = realloc(pkts->data, data_cap);
+            if (d == NULL) goto fail;
+            pkts->data = d;
+        }
+        memcpy(pkts->data + pkts->bytes, rec + off, len);
+        pkts->off[pkts->n] = pkts->bytes;
+        pkts->len[pkts->n] = len;
+        uint64_t ts = ((uint64_t) swap32(rh.ts_sec, swapped)) * 1000000000ULL + ((uint64_t) swap32(rh.ts_frac, swapped)) * (nsec ? 1 : 1000);
+        if (pkts->n == 0) first_ts = ts;
+        pkts->ts_ns[pkts->n] = (ts > first_ts) ? ts - first_ts : 0; /* clamp out-of-order records */
+        pkts->bytes += len;
+        pkts->n++;
+    }
+    free(rec);
+    fclose(f);
+    return 0;
+
+ fail:
+    free(rec);
+    fclose(f);
+    pcap_pkts_free(pkts);
+    return -1;
+}
+
+void pcap_pkts_free(pcap_pkts_t *pkts) {
+    free(pkts->data);
+    free(pkts->off);
+    free(pkts->len);
+    free(pkts->ts_ns);
+    memset(pkts, 0, sizeof(*pkts));
+}
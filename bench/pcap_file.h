@@ -0,0 +1,30 @@
+#ifndef _PCAP_FILE_H
+#define _PCAP_FILE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* L3 packets (IPv4/IPv6) extracted from a classic pcap capture, stored back to back */
+struct pcap_pkts_s {
+    uint8_t *data;
+    size_t *off;
+    uint16_t *len;
+    uint64_t *ts_ns; /* capture time, relative to the first kept packet */
+    size_t n;
+    size_t bytes;
+    size_t skipped; /* non-IP, truncated or filtered-out records */
+};
+
+typedef struct pcap_pkts_s pcap_pkts_t;
+
+#define PCAP_IPV4_ONLY 0x1
+
+int pcap_load_l3_pkts(const char *path, int flags, pcap_pkts_t *pkts);
+
+void pcap_pkts_free(pcap_pkts_t *pkts);
+
+static inline uint8_t *pcap_pkt(pcap_pkts_t *pkts, size_t i) {
+    return pkts->data + pkts->off[i];
+}
+
+#endif
@@ -0,0 +1,724 @@
+#include "../src/io.h"
+#include "../src/compress.h"
+#include "../src/constants.h"
+#include "../src/log.h"
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <sys/utsname.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * Peer-scale soak: one l3tc io-loop (forked child, tun replaced by a datagram
+ * socketpair, no ipset) against N simulated peers on 127.1.0.0/16 that speak
+ * the compressed stream protocol. Peers below self dial in, peers above self
+ * are dialed by l3tc (passive-peers, re-connected by fix_broken_connections).
+ * Emits one JSON document on stdout.
+ */
+
+#define BASE_ADDR 0x7F010000 /* 127.1.0.0 */
+#define MAX_PEERS 60000
+#define MAX_EVTS 512
+#define TICK_MS 1
+#define MAX_GEN_BURST_MS 100 /* traffic that couldn't be generated within this window is skipped (reported as lag) */
+#define INBOUND_REDIAL_BACKOFF_NS 100000000ULL
+
+#define EVT_LSTN 1
+#define EVT_CONN 2
+#define EVT_TUN 3
+
+struct sim_peer_s {
+    uint32_t addr; /* host order */
+    int inbound; /* dials l3tc (addr < self) */
+    int traffic; /* carries generated traffic */
+    int listed; /* present in peer-file */
+    int lstn_fd, fd, connecting;
+    uint16_t gen; /* connection generation, carried in IP-id of probes */
+    compress_t *comp;
+    uint8_t *out;
+    ssize_t out_cap, out_len, out_off;
+    uint64_t down_at, recover_from, redial_at;
+};
+
+typedef struct sim_peer_s sim_peer_t;
+
+struct samples_s {
+    double *v;
+    size_t n, cap;
+};
+
+typedef struct samples_s samples_t;
+
+struct soak_cfg_s {
+    int peers;
+    double inbound_frac;
+    double traffic_frac;
+    int duration, warmup;
+    double pps;
+    int pkt_sz;
+    double churn;
+    int hup_itvl;
+    int reconnect_itvl;
+    int level;
+    int port;
+    int verbose;
+};
+
+static struct soak_cfg_s cfg = {
+    .peers = 1000, .inbound_frac = 0.5, .traffic_frac = 1.0,
+    .duration = 30, .warmup = 20,
+    .pps = 5, .pkt_sz = 512, .churn = 10, .hup_itvl = 0,
+    .reconnect_itvl = 1, .level = DEFAULT_COMPRESSION_LEVEL, .port = 15000, .verbose = 0
+};
+
+static sim_peer_t *peers;
+static int n_inbound;
+static uint32_t self_addr;
+static int ep_fd, tun_end;
+static uint8_t *scratch;
+static uint64_t now;
+
+static struct {
+    uint64_t to_peer_sent, to_peer_rcvd_bytes, tun_blocked;
+    uint64_t from_peer_sent, from_peer_rcvd, from_peer_rcvd_bytes, sim_backpressured;
+    uint64_t churned, closed_by_l3tc, gen_lag;
+} ctr;
+
+static samples_t redial_ms, recovery_passive_ms, recovery_inbound_ms;
+
+static uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sample_add(samples_t *s, double v) {
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->v = realloc(s->v, s->cap * sizeof(double));
+        assert(s->v != NULL);
+    }
+    s->v[s->n++] = v;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void print_dist(const char *name, samples_t *s, int last) {
+    printf("    \"%s\": {\"samples\": %zu", name, s->n);
+    if (s->n > 0) {
+        qsort(s->v, s->n, sizeof(double), cmp_double);
+        printf(", \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f",
+               s->v[s->n / 2], s->v[(s->n * 90) / 100], s->v[(s->n * 99) / 100], s->v[s->n - 1]);
+    }
+    printf("}%s\n", last ? "" : ",");
+}
+
+static uint32_t peer_addr(int i) {
+    return (i < n_inbound) ? (BASE_ADDR + 1 + i) : (BASE_ADDR + 2 + i);
+}
+
+static sim_peer_t *peer_of(uint32_t addr) {
+    int64_t a = (int64_t) addr - BASE_ADDR - 1;
+    if (a < 0 || a == n_inbound) return NULL;
+    if (a > n_inbound) a--;
+    return (a < cfg.peers) ? &peers[a] : NULL;
+}
+
+static long read_rss_kb(pid_t pid) {
+    char path[64], line[256];
+    long rss = -1;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "VmRSS: %ld kB", &rss) == 1) break;
+    }
+    fclose(f);
+    return rss;
+}
+
+static long read_cpu_ticks(pid_t pid) {
+    char path[64], buff[1024];
+    unsigned long utime, stime;
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    size_t len = fread(buff, 1, sizeof(buff) - 1, f);
+    fclose(f);
+    buff[len] = '\0';
+    char *p = strrchr(buff, ')'); /* comm may contain spaces */
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) return -1;
+    return utime + stime;
+}
+
+static int write_peer_file(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) return -1;
+    for (int i = 0; i < cfg.peers; i++) {
+        if (! peers[i].listed) continue;
+        struct in_addr a = {htonl(peers[i].addr)};
+        fprintf(f, "%s:%d\n", inet_ntoa(a), cfg.port + 1);
+    }
+    fclose(f);
+    return 0;
+}
+
+static void set_nonblock_nodelay(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    assert(flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (int[]){1}, sizeof(int));
+}
+
+static void epoll_set(int op, int fd, uint32_t events, int kind, int idx) {
+    struct epoll_event e = {.events = events, .data.u64 = (((uint64_t) idx) << 8) | kind};
+    assert(epoll_ctl(ep_fd, op, fd, &e) == 0);
+}
+
+/* l3tc side */
+
+static void discard_log(int severity, const char *msg, void *arg) {}
+
+static int run_l3tc(int tun_fd, const char *peer_file, int go_fd, int stats_fd) {
+    char self[INET_ADDRSTRLEN], go;
+    struct in_addr a = {htonl(self_addr)};
+    inet_ntop(AF_INET, &a, self, sizeof(self));
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    log_init(cfg.verbose, "peer_soak/l3tc");
+    if (! cfg.verbose) log_register(discard_log, NULL);
+    signal(SIGTERM, trigger_io_loop_stop);
+    signal(SIGHUP, trigger_peer_reset);
+
+    if (read(go_fd, &go, 1) != 1) return 1;
+    long rss_idle = read_rss_kb(getpid());
+    if (write(stats_fd, &rss_idle, sizeof(rss_idle)) != sizeof(rss_idle)) return 1;
+
+    io_cfg_t io_cfg = {
+        .peer_file_path = peer_file,
+        .self_addr_v4 = self,
+        .listener_port = cfg.port,
+        .try_reconnect_itvl = cfg.reconnect_itvl,
+        .compression_level = cfg.level,
+        .flush_policy = IO_FLUSH_PKT,
+        .ring_sz = {TUN_RING_SZ, CONN_RING_SZ, MAX_RING_SZ, 0},
+    };
+    if (io_cfg.ring_sz.conn < compress_ring_min_sz()) io_cfg.ring_sz.conn = compress_ring_min_sz();
+    int ret = io(tun_fd, 0, &io_cfg);
+
+    io_loop_stats_t stats;
+    io_loop_stats(&stats);
+    if (write(stats_fd, &stats, sizeof(stats)) != sizeof(stats)) return 1;
+    return ret == 0 ? 0 : 1;
+}
+
+/* simulated peers */
+
+static ssize_t build_pkt(uint8_t *pkt, uint32_t src, uint32_t dst, uint16_t id, uint32_t seq) {
+    static const char body[] = "GET /api/v1/catalog/items?page=%u&sort=price HTTP/1.1\r\nHost: edge.example.net\r\n"
+        "User-Agent: soak/1.0\r\nAccept: application/json\r\nCookie: session=%08x\r\n\r\n";
+    ssize_t len = cfg.pkt_sz;
+    memset(pkt, 0, 28);
+    pkt[0] = 0x45;
+    *(uint16_t *) (pkt + 2) = htons(len);
+    *(uint16_t *) (pkt + 4) = htons(id);
+    pkt[8] = 64;
+    pkt[9] = IPPROTO_UDP;
+    *(uint32_t *) (pkt + 12) = htonl(src);
+    *(uint32_t *) (pkt + 16) = htonl(dst);
+    *(uint16_t *) (pkt + 24) = htons(len - 20);
+    for (ssize_t off = 28; off < len; ) {
+        int w = snprintf((char *) pkt + off, len - off, body, seq, seq * 2654435761U);
+        if (w <= 0) break;
+        off += w;
+    }
+    return len;
+}
+
+static void peer_disconnected(sim_peer_t *p, int by_l3tc) {
+    if (p->fd < 0) return;
+    close(p->fd);
+    p->fd = -1;
+    p->connecting = 0;
+    if (p->comp != NULL) {
+        destroy_compression_ctx(p->comp);
+        free(p->comp);
+        p->comp = NULL;
+    }
+    p->out_len = p->out_off = 0;
+    if (by_l3tc) ctr.closed_by_l3tc++;
+    if (p->inbound) p->redial_at = now + (by_l3tc ? INBOUND_REDIAL_BACKOFF_NS : 0);
+}
+
+static int ensure_comp(sim_peer_t *p) {
+    if (p->comp != NULL) return 0;
+    if ((p->comp = calloc(1, sizeof(compress_t))) == NULL) return -1;
+    if (init_compression_ctx(p->comp, cfg.level) != 0) {
+        free(p->comp);
+        p->comp = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void flush_out(sim_peer_t *p) {
+    while (p->out_off < p->out_len) {
+        ssize_t sent = send(p->fd, p->out + p->out_off, p->out_len - p->out_off, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                epoll_set(EPOLL_CTL_MOD, p->fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, EVT_CONN, p - peers);
+                return;
+            }
+            peer_disconnected(p, 1);
+            return;
+        }
+        p->out_off += sent;
+    }
+    p->out_len = p->out_off = 0;
+}
+
+static void send_from_peer(sim_peer_t *p, uint16_t id, uint32_t seq) {
+    uint8_t pkt[0xFFFF];
+    if (p->out_len > 0) {
+        ctr.sim_backpressured++;
+        return;
+    }
+    if (ensure_comp(p) != 0) return;
+    ssize_t len = build_pkt(pkt, p->addr, self_addr, id, seq);
+    ssize_t cap = worst_case_compressed_out_sz(p->comp, len);
+    if (cap > p->out_cap) {
+        free(p->out);
+        assert((p->out = malloc(cap)) != NULL);
+        p->out_cap = cap;
+    }
+    ssize_t consumed = 0;
+    int complete = 0;
+    setup_compress_input(p->comp, pkt, len);
+    p->out_len = do_compress(p->comp, p->out, cap, &consumed, &complete);
+    assert(complete);
+    ctr.from_peer_sent++;
+    flush_out(p);
+}
+
+static void peer_connected(sim_peer_t *p, int fd) {
+    if (p->fd >= 0 && p->fd != fd) peer_disconnected(p, 0);
+    p->fd = fd;
+    p->connecting = 0;
+    p->gen++;
+    epoll_set(p->inbound ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, EPOLLIN | EPOLLRDHUP, EVT_CONN, p - peers);
+    if (p->down_at != 0) {
+        if (! p->inbound) sample_add(&redial_ms, (now - p->down_at) / 1e6);
+        p->down_at = 0;
+    }
+    if (p->recover_from != 0) send_from_peer(p, p->gen, 0); /* probe, recovery completes when it shows up on tun */
+}
+
+static void dial(sim_peer_t *p) {
+    struct sockaddr_in local = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(p->addr)};
+    struct sockaddr_in remote = {.sin_family = AF_INET, .sin_port = htons(cfg.port), .sin_addr.s_addr = htonl(self_addr)};
+    p->redial_at = 0;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        p->redial_at = now + INBOUND_REDIAL_BACKOFF_NS;
+        return;
+    }
+    set_nonblock_nodelay(fd);
+    if (bind(fd, (struct sockaddr *) &local, sizeof(local)) != 0 ||
+        (connect(fd, (struct sockaddr *) &remote, sizeof(remote)) != 0 && errno != EINPROGRESS)) {
+        close(fd);
+        p->redial_at = now + INBOUND_REDIAL_BACKOFF_NS;
+        return;
+    }
+    p->fd = fd;
+    p->connecting = 1;
+    epoll_set(EPOLL_CTL_ADD, fd, EPOLLOUT, EVT_CONN, p - peers);
+}
+
+static int setup_sim_listener(sim_peer_t *p) {
+    struct sockaddr_in local = {.sin_family = AF_INET, .sin_port = htons(cfg.port + 1), .sin_addr.s_addr = htonl(p->addr)};
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (int[]){1}, sizeof(int));
+    set_nonblock_nodelay(fd);
+    if (bind(fd, (struct sockaddr *) &local, sizeof(local)) != 0 || listen(fd, 16) != 0) {
+        close(fd);
+        return -1;
+    }
+    p->lstn_fd = fd;
+    epoll_set(EPOLL_CTL_ADD, fd, EPOLLIN, EVT_LSTN, p - peers);
+    return 0;
+}
+
+static void peer_rx(sim_peer_t *p) {
+    while (p->fd >= 0) {
+        if (ensure_comp(p) != 0) return;
+        ssize_t rcvd = recv(p->fd, p->comp->inflate_src_buff, p->comp->inflate_src_buff_sz, 0);
+        if (rcvd == 0 || (rcvd < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            peer_disconnected(p, 1);
+            return;
+        }
+        if (rcvd < 0) return;
+        p->comp->inflatable_bytes = rcvd;
+        do {
+            ctr.to_peer_rcvd_bytes += do_decompress(p->comp, scratch, 0xFFFF);
+        } while (p->comp->inflatable_bytes > 0);
+    }
+}
+
+static void peer_evt(sim_peer_t *p, uint32_t events) {
+    if (p->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+            peer_disconnected(p, 1);
+            return;
+        }
+        peer_connected(p, p->fd);
+        return;
+    }
+    if (events & EPOLLOUT) {
+        flush_out(p);
+        if (p->fd >= 0 && p->out_len == 0) epoll_set(EPOLL_CTL_MOD, p->fd, EPOLLIN | EPOLLRDHUP, EVT_CONN, p - peers);
+    }
+    if (p->fd >= 0 && (events & EPOLLIN)) peer_rx(p);
+    if (p->fd >= 0 && (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) peer_disconnected(p, 1);
+}
+
+static void peer_accept(sim_peer_t *p) {
+    int fd;
+    while ((fd = accept(p->lstn_fd, NULL, NULL)) >= 0) {
+        set_nonblock_nodelay(fd);
+        peer_connected(p, fd);
+    }
+}
+
+static void tun_rx() {
+    uint8_t pkt[0xFFFF];
+    ssize_t len;
+    while ((len = read(tun_end, pkt, sizeof(pkt))) > 0) {
+        if (len < 20) continue;
+        ctr.from_peer_rcvd++;
+        ctr.from_peer_rcvd_bytes += len;
+        sim_peer_t *p = peer_of(ntohl(*(uint32_t *) (pkt + 12)));
+        if (p != NULL && p->recover_from != 0 && ntohs(*(uint16_t *) (pkt + 4)) == p->gen) {
+            sample_add(p->inbound ? &recovery_inbound_ms : &recovery_passive_ms, (now - p->recover_from) / 1e6);
+            p->recover_from = 0;
+        }
+    }
+}
+
+static void send_to_peer(sim_peer_t *p, uint32_t seq) {
+    uint8_t pkt[0xFFFF];
+    ssize_t len = build_pkt(pkt, self_addr, p->addr, 0, seq);
+    if (write(tun_end, pkt, len) != len) {
+        ctr.tun_blocked++;
+        return;
+    }
+    ctr.to_peer_sent++;
+}
+
+static int connected(sim_peer_t *p) {
+    return p->fd >= 0 && ! p->connecting;
+}
+
+static int count_connected() {
+    int c = 0;
+    for (int i = 0; i < cfg.peers; i++) c += connected(&peers[i]) && peers[i].listed;
+    return c;
+}
+
+static void generate_traffic(uint64_t since, double *generated) {
+    static int rr = 0;
+    static uint32_t seq = 0;
+    double due = ((now - since) / 1e9) * cfg.pps * cfg.peers * cfg.traffic_frac - *generated;
+    double max_burst = cfg.pps * cfg.peers * cfg.traffic_frac * MAX_GEN_BURST_MS / 1000.0;
+    if (due > max_burst) {
+        ctr.gen_lag += (uint64_t) (due - max_burst);
+        *generated += due - max_burst;
+        due = max_burst;
+    }
+    for (; due >= 1; due--, (*generated)++) {
+        sim_peer_t *p = NULL;
+        for (int tries = 0; tries < cfg.peers; tries++) {
+            sim_peer_t *c = &peers[rr];
+            rr = (rr + 1) % cfg.peers;
+            if (c->traffic && connected(c)) {
+                p = c;
+                break;
+            }
+        }
+        if (p == NULL) return;
+        seq++;
+        if (seq & 1) send_to_peer(p, seq);
+        else send_from_peer(p, 0, seq);
+    }
+}
+
+static void churn_one() {
+    for (int tries = 0; tries < 16; tries++) {
+        sim_peer_t *p = &peers[random() % cfg.peers];
+        if (! connected(p) || ! p->listed || p->down_at != 0 || p->recover_from != 0) continue;
+        ctr.churned++;
+        peer_disconnected(p, 0);
+        p->down_at = p->recover_from = now;
+        return;
+    }
+}
+
+/* drops a rotating slice of passive peers from the peer-file (re-adding the previous one) and HUPs l3tc */
+static void mutate_peers_and_hup(pid_t child, const char *peer_file, int round) {
+    int passive = cfg.peers - n_inbound;
+    int slice = passive / 20 > 0 ? passive / 20 : 1;
+    for (int i = n_inbound; i < cfg.peers; i++) {
+        int s = (i - n_inbound) / slice;
+        peers[i].listed = (s != (round % 20));
+        if (! peers[i].listed) peers[i].down_at = peers[i].recover_from = 0;
+    }
+    write_peer_file(peer_file);
+    kill(child, SIGHUP);
+}
+
+static void print_loop_stats(io_loop_stats_t *s) {
+    double pct[] = {50, 90, 99, 99.9};
+    const char *names[] = {"p50", "p90", "p99", "p999"};
+    printf("    \"iterations\": %llu,\n    \"events\": %llu,\n    \"mean_us\": %.2f,\n    \"max_us\": %.2f,\n",
+           (unsigned long long) s->iterations, (unsigned long long) s->events,
+           s->iterations ? (s->busy_ns / 1e3) / s->iterations : 0.0, s->max_busy_ns / 1e3);
+    for (int i = 0; i < 4; i++) {
+        uint64_t want = (uint64_t) (s->iterations * pct[i] / 100.0), seen = 0;
+        int b = 0;
+        for (; b < IO_LOOP_LAT_BUCKETS - 1; b++) {
+            seen += s->lat_hist[b];
+            if (seen > want) break;
+        }
+        printf("    \"%s_us_upper_bound\": %llu,\n", names[i], 1ULL << b);
+    }
+    printf("    \"histogram_us\": {");
+    for (int b = 0, first = 1; b < IO_LOOP_LAT_BUCKETS; b++) {
+        if (s->lat_hist[b] == 0) continue;
+        printf("%s\"%s%llu\": %llu", first ? "" : ", ", b == IO_LOOP_LAT_BUCKETS - 1 ? ">=" : "<", 1ULL << (b == IO_LOOP_LAT_BUCKETS - 1 ? b - 1 : b), (unsigned long long) s->lat_hist[b]);
+        first = 0;
+    }
+    printf("}\n");
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n peers] [-i inbound-fraction] [-f traffic-fraction] [-d duration-s] [-w max-warmup-s]\n"
+            "          [-p pps-per-peer] [-s pkt-sz] [-c churn-per-s] [-H hup-interval-s] [-r reconnect-interval-s]\n"
+            "          [-l compression-level] [-P port] [-v]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int ch;
+    while ((ch = getopt(argc, argv, "hn:i:f:d:w:p:s:c:H:r:l:P:v")) != -1) {
+        switch (ch) {
+        case 'n': cfg.peers = atoi(optarg); break;
+        case 'i': cfg.inbound_frac = atof(optarg); break;
+        case 'f': cfg.traffic_frac = atof(optarg); break;
+        case 'd': cfg.duration = atoi(optarg); break;
+        case 'w': cfg.warmup = atoi(optarg); break;
+        case 'p': cfg.pps = atof(optarg); break;
+        case 's': cfg.pkt_sz = atoi(optarg); break;
+        case 'c': cfg.churn = atof(optarg); break;
+        case 'H': cfg.hup_itvl = atoi(optarg); break;
+        case 'r': cfg.reconnect_itvl = atoi(optarg); break;
+        case 'l': cfg.level = atoi(optarg); break;
+        case 'P': cfg.port = atoi(optarg); break;
+        case 'v': cfg.verbose++; break;
+        default:
+            usage(argv[0]);
+            exit(ch == 'h' ? 0 : 1);
+        }
+    }
+    if (cfg.peers < 1 || cfg.peers > MAX_PEERS || cfg.pkt_sz < 64 || cfg.pkt_sz > 9000 || cfg.reconnect_itvl < 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    struct rlimit nofile;
+    getrlimit(RLIMIT_NOFILE, &nofile);
+    rlim_t need = 2 * cfg.peers + 64;
+    if (nofile.rlim_cur < need) {
+        nofile.rlim_cur = (nofile.rlim_max < need) ? nofile.rlim_max : need;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
+    if (nofile.rlim_cur < need) {
+        fprintf(stderr, "need %lu fds for %d peers, hard-limit is %lu\n", (unsigned long) need, cfg.peers, (unsigned long) nofile.rlim_max);
+        exit(1);
+    }
+
+    n_inbound = (int) (cfg.peers * cfg.inbound_frac);
+    self_addr = BASE_ADDR + 1 + n_inbound;
+    assert((peers = calloc(cfg.peers, sizeof(sim_peer_t))) != NULL);
+    assert((scratch = malloc(0xFFFF)) != NULL);
+    int traffic_every = cfg.traffic_frac > 0 ? (int) (1 / cfg.traffic_frac) : 0;
+    for (int i = 0; i < cfg.peers; i++) {
+        peers[i].addr = peer_addr(i);
+        peers[i].inbound = i < n_inbound;
+        peers[i].traffic = traffic_every > 0 && (i % traffic_every) == 0;
+        peers[i].listed = 1;
+        peers[i].fd = peers[i].lstn_fd = -1;
+    }
+
+    char peer_file[] = "/tmp/l3tc_soak_peers.XXXXXX";
+    int pf_fd = mkstemp(peer_file);
+    assert(pf_fd >= 0);
+    close(pf_fd);
+    write_peer_file(peer_file);
+
+    int tun_pair[2], go_pipe[2], stats_pipe[2];
+    assert(socketpair(AF_UNIX, SOCK_DGRAM, 0, tun_pair) == 0);
+    int buff_sz = 4 * 1024 * 1024;
+    for (int i = 0; i < 2; i++) {
+        setsockopt(tun_pair[i], SOL_SOCKET, SO_SNDBUF, &buff_sz, sizeof(buff_sz));
+        setsockopt(tun_pair[i], SOL_SOCKET, SO_RCVBUF, &buff_sz, sizeof(buff_sz));
+    }
+    assert(pipe(go_pipe) == 0 && pipe(stats_pipe) == 0);
+
+    pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        close(tun_pair[0]);
+        close(go_pipe[1]);
+        close(stats_pipe[0]);
+        exit(run_l3tc(tun_pair[1], peer_file, go_pipe[0], stats_pipe[1]));
+    }
+    close(tun_pair[1]);
+    close(go_pipe[0]);
+    close(stats_pipe[1]);
+    tun_end = tun_pair[0];
+    assert(fcntl(tun_end, F_SETFL, O_NONBLOCK) == 0);
+
+    log_init(cfg.verbose, "peer_soak");
+    if (! cfg.verbose) log_register(discard_log, NULL);
+
+    assert((ep_fd = epoll_create(10)) >= 0);
+    epoll_set(EPOLL_CTL_ADD, tun_end, EPOLLIN, EVT_TUN, 0);
+    now = mono_ns();
+    for (int i = n_inbound; i < cfg.peers; i++) {
+        if (setup_sim_listener(&peers[i]) != 0) {
+            fprintf(stderr, "couldn't listen on peer %d's address (127.1.0.0/16 must be routable on lo)\n", i);
+            kill(child, SIGKILL);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < n_inbound; i++) peers[i].redial_at = now + 200000000ULL; /* give l3tc time to start listening */
+
+    long rss_idle = -1, rss_connected = -1, rss_end = -1;
+    assert(write(go_pipe[1], "g", 1) == 1);
+    assert(read(stats_pipe[0], &rss_idle, sizeof(rss_idle)) == sizeof(rss_idle));
+
+    uint64_t started = mono_ns(), measure_from = 0, measure_to = 0, last_hup = 0, last_status = 0;
+    double generated = 0, churn_due = 0;
+    long cpu_from = 0, cpu_to = 0;
+    int connected_at_start = 0, connected_at_end = 0, hup_round = 0;
+    struct epoll_event evts[MAX_EVTS];
+
+    while (1) {
+        int n = epoll_wait(ep_fd, evts, MAX_EVTS, TICK_MS);
+        now = mono_ns();
+        for (int i = 0; i < n; i++) {
+            int kind = evts[i].data.u64 & 0xFF;
+            sim_peer_t *p = &peers[evts[i].data.u64 >> 8];
+            if (kind == EVT_TUN) tun_rx();
+            else if (kind == EVT_LSTN) peer_accept(p);
+            else peer_evt(p, evts[i].events);
+        }
+        for (int i = 0; i < n_inbound; i++) {
+            if (peers[i].fd < 0 && peers[i].redial_at != 0 && peers[i].redial_at <= now) dial(&peers[i]);
+        }
+
+        if (measure_from == 0) {
+            if (now - last_status > 1000000000ULL) {
+                connected_at_start = count_connected();
+                last_status = now;
+                if (connected_at_start == cfg.peers || now - started > cfg.warmup * 1000000000ULL) {
+                    rss_connected = read_rss_kb(child);
+                    cpu_from = read_cpu_ticks(child);
+                    measure_from = last_hup = now;
+                    fprintf(stderr, "warmup done: %d of %d peers connected after %.1fs, soaking for %ds\n",
+                            connected_at_start, cfg.peers, (now - started) / 1e9, cfg.duration);
+                }
+            }
+            continue;
+        }
+
+        generate_traffic(measure_from, &generated);
+        for (churn_due += cfg.churn * TICK_MS / 1000.0; churn_due >= 1; churn_due--) churn_one();
+        if (cfg.hup_itvl > 0 && now - last_hup > cfg.hup_itvl * 1000000000ULL) {
+            mutate_peers_and_hup(child, peer_file, hup_round++);
+            last_hup = now;
+        }
+        if (now - measure_from > cfg.duration * 1000000000ULL) break;
+    }
+
+    measure_to = now;
+    cpu_to = read_cpu_ticks(child);
+    rss_end = read_rss_kb(child);
+    connected_at_end = count_connected();
+
+    kill(child, SIGTERM);
+    io_loop_stats_t loop;
+    memset(&loop, 0, sizeof(loop));
+    int status = 0;
+    if (read(stats_pipe[0], &loop, sizeof(loop)) != sizeof(loop)) fprintf(stderr, "couldn't collect loop-stats from l3tc\n");
+    waitpid(child, &status, 0);
+    unlink(peer_file);
+
+    double secs = (measure_to - measure_from) / 1e9;
+    double cpu_pct = 100.0 * (cpu_to - cpu_from) / sysconf(_SC_CLK_TCK) / secs;
+    int per_peer_base = connected_at_end > 0 ? connected_at_end : 1;
+    struct utsname u;
+    uname(&u);
+
+    printf("{\n  \"suite\": \"peer_soak\",\n  \"version\": \"%s\",\n  \"compression\": \"%s\",\n  \"timestamp\": %ld,\n  \"host\": \"%s\",\n  \"l3tc_exit_status\": %d,\n",
+           PACKAGE_VERSION, COMPRESSION_IMPL, (long) time(NULL), u.nodename, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    printf("  \"config\": {\"peers\": %d, \"inbound_peers\": %d, \"traffic_fraction\": %.3f, \"duration_s\": %.1f, \"pps_per_peer\": %.2f, "
+           "\"pkt_sz\": %d, \"churn_per_s\": %.2f, \"hup_interval_s\": %d, \"reconnect_interval_s\": %d, \"compression_level\": %d},\n",
+           cfg.peers, n_inbound, cfg.traffic_frac, secs, cfg.pps, cfg.pkt_sz, cfg.churn, cfg.hup_itvl, cfg.reconnect_itvl, cfg.level);
+    printf("  \"peers\": {\"connected_at_start\": %d, \"connected_at_end\": %d, \"churned\": %llu, \"closed_by_l3tc\": %llu, \"hups\": %d},\n",
+           connected_at_start, connected_at_end, (unsigned long long) ctr.churned, (unsigned long long) ctr.closed_by_l3tc, hup_round);
+    printf("  \"memory\": {\"rss_idle_kb\": %ld, \"rss_connected_kb\": %ld, \"rss_end_kb\": %ld, \"rss_per_peer_connected_kb\": %.1f, \"rss_per_peer_end_kb\": %.1f},\n",
+           rss_idle, rss_connected, rss_end,
+           (double) (rss_connected - rss_idle) / (connected_at_start > 0 ? connected_at_start : 1), (double) (rss_end - rss_idle) / per_peer_base);
+    printf("  \"cpu\": {\"total_pct\": %.2f, \"per_peer_pct\": %.5f, \"per_peer_us_per_s\": %.2f},\n",
+           cpu_pct, cpu_pct / per_peer_base, cpu_pct * 1e4 / per_peer_base);
+    printf("  \"loop\": {\n");
+    print_loop_stats(&loop);
+    printf("  },\n  \"reconnect\": {\n");
+    print_dist("redial_ms", &redial_ms, 0);
+    print_dist("recovery_passive_ms", &recovery_passive_ms, 0);
+    print_dist("recovery_inbound_ms", &recovery_inbound_ms, 1);
+    printf("  },\n");
+    printf("  \"traffic\": {\"to_peers_sent\": %llu, \"to_peers_rcvd_bytes\": %llu, \"from_peers_sent\": %llu, \"from_peers_rcvd\": %llu, "
+           "\"from_peers_rcvd_bytes\": %llu, \"tun_blocked\": %llu, \"sim_backpressured\": %llu, \"generation_lag\": %llu}\n}\n",
+           (unsigned long long) ctr.to_peer_sent, (unsigned long long) ctr.to_peer_rcvd_bytes,
+           (unsigned long long) ctr.from_peer_sent, (unsigned long long) ctr.from_peer_rcvd, (unsigned long long) ctr.from_peer_rcvd_bytes,
+           (unsigned long long) ctr.tun_blocked, (unsigned long long) ctr.sim_backpressured, (unsigned long long) ctr.gen_lag);
+
+    return 0;
+}
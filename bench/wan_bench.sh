@@ -0,0 +1,67 @@
+#!/bin/bash
+# Goodput of l3tc vs. a plain TCP stream (no-l3tc baseline) over emulated WAN
+# links, plus l3tc over shared memory (no link at all, the codec ceiling).
+# Emits one JSON document on stdout.
+#
+# usage: wan_bench.sh [-f pcap] [-d duration-s] [-l compression-level] [-p profiles]
+#   profiles: comma separated name:bandwidth-kbit:rtt-ms:jitter-ms:loss-pct
+
+set -e
+
+here=$(dirname "$0")
+bin=${WAN_BENCH_BIN:-$here} # where wan_emu and wan_goodput were built
+pcap=$here/../test/http.pcap.original
+duration=10
+level=
+profiles="dsl:8000:40:4:0.1,lte:20000:70:15:0.5,satellite:10000:600:30:0.5,metro:100000:10:1:0.01"
+emu_port=16000
+port=16100
+
+while getopts "f:d:l:p:" opt; do
+    case $opt in
+        f) pcap=$OPTARG ;;
+        d) duration=$OPTARG ;;
+        l) level="-l $OPTARG" ;;
+        p) profiles=$OPTARG ;;
+        *) exit 1 ;;
+    esac
+done
+
+emu_pid=
+trap '[ -n "$emu_pid" ] && kill $emu_pid 2>/dev/null' EXIT
+
+function run() { # <mode> <bw> <rtt> <jitter> <loss>
+    local emu_out=$(mktemp)
+    $bin/wan_emu -l 127.2.0.2:$emu_port -t 127.2.0.2:$port -s 127.2.0.1 -b $2 -r $3 -j $4 -p $5 > $emu_out &
+    emu_pid=$!
+    sleep 0.2
+    local result=$($bin/wan_goodput -m $1 -f $pcap -e $emu_port -p $port -d $duration $level)
+    kill $emu_pid
+    wait $emu_pid || true
+    emu_pid=
+    echo "{\"run\": ${result:-null}, \"link\": $(cat $emu_out)}"
+    rm -f $emu_out
+    # fresh ports for every run, so TIME_WAIT from the previous one can't interfere
+    emu_port=$((emu_port + 1))
+    port=$((port + 2))
+}
+
+echo "{"
+echo "  \"suite\": \"wan_goodput\","
+echo "  \"pcap\": \"$(basename $pcap)\","
+echo "  \"profiles\": ["
+first=1
+for p in ${profiles//,/ }; do
+    IFS=: read name bw rtt jitter loss <<< "$p"
+    raw=$(run raw $bw $rtt $jitter $loss)
+    l3tc=$(run l3tc $bw $rtt $jitter $loss)
+    [ $first -eq 1 ] || echo "    ,"
+    first=0
+    echo "    {\"name\": \"$name\", \"bandwidth_kbit\": $bw, \"rtt_ms\": $rtt, \"jitter_ms\": $jitter, \"loss_pct\": $loss,"
+    echo "     \"raw\": $raw,"
+    echo "     \"l3tc\": $l3tc}"
+done
+echo "  ],"
+shm=$($bin/wan_goodput -m shm -f $pcap -p $port -d $duration $level)
+echo "  \"shm\": ${shm:-null}"
+echo "}"
@@ -0,0 +1,396 @@
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * Userspace TCP relay emulating a constrained link between two endpoints
+ * (eg. two l3tc peers on loopback). Every accepted connection is relayed to
+ * the target, data in each direction is cut into MSS sized segments that
+ * are serialized at the configured bandwidth and delivered (in order) after
+ * RTT/2 +/- jitter. A lost segment is delivered one extra RTT late (fast
+ * retransmit), holding back everything behind it, which is what the
+ * application above a lossy TCP path observes.
+ *
+ * The amount of data buffered per direction is capped (default 2 x BDP), so
+ * senders see back-pressure instead of an infinitely deep link.
+ */
+
+#define MSS 1448
+#define READ_CHUNK 64*1024
+#define MIN_QUEUE_LIMIT 64*1024
+#define MAX_EVTS 64
+
+struct segment_s {
+    struct segment_s *next;
+    uint64_t deliver_at;
+    ssize_t len, sent;
+    uint8_t data[];
+};
+
+typedef struct segment_s segment_t;
+
+struct direction_s {
+    segment_t *head, *tail;
+    ssize_t queued;
+    uint64_t link_free_at, last_deliver_at;
+    int eof; /* reader saw EOF, propagate once drained */
+    int blocked; /* writer hit EAGAIN, wait for EPOLLOUT */
+    uint64_t bytes, lost;
+};
+
+typedef struct direction_s direction_t;
+
+struct relay_s;
+
+struct endpoint_s {
+    struct relay_s *relay;
+    int side;
+    int fd;
+    uint32_t interest;
+};
+
+typedef struct endpoint_s endpoint_t;
+
+struct relay_s {
+    struct relay_s *next;
+    endpoint_t ep[2]; /* 0: accepted (client) side, 1: target side */
+    direction_t dir[2]; /* dir[i] carries data read from ep[i] */
+    int connecting;
+    int dead;
+};
+
+typedef struct relay_s relay_t;
+
+static struct {
+    struct sockaddr_in listen, target, source;
+    int bind_source;
+    double bw_bps; /* 0 => unlimited */
+    uint64_t half_rtt_ns, jitter_ns;
+    double loss;
+    ssize_t queue_limit;
+    int verbose;
+} link_cfg;
+
+static int ep_fd;
+static relay_t *relays;
+static volatile sig_atomic_t stop = 0;
+static uint64_t total_bytes[2], total_lost;
+static int total_conns;
+
+static uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void on_signal(int sig) {
+    stop = 1;
+}
+
+static int parse_addr(const char *s, struct sockaddr_in *a) {
+    char host[64];
+    const char *colon = strrchr(s, ':');
+    if (colon == NULL || (size_t) (colon - s) >= sizeof(host)) return -1;
+    memcpy(host, s, colon - s);
+    host[colon - s] = '\0';
+    memset(a, 0, sizeof(*a));
+    a->sin_family = AF_INET;
+    a->sin_port = htons(atoi(colon + 1));
+    return inet_pton(AF_INET, host, &a->sin_addr) == 1 ? 0 : -1;
+}
+
+static void set_interest(endpoint_t *e, uint32_t interest) {
+    if (e->fd < 0 || e->interest == interest) return;
+    struct epoll_event evt = {.events = interest, .data.ptr = e};
+    assert(epoll_ctl(ep_fd, EPOLL_CTL_MOD, e->fd, &evt) == 0);
+    e->interest = interest;
+}
+
+static void add_endpoint(relay_t *r, int side, int fd, uint32_t interest) {
+    endpoint_t *e = &r->ep[side];
+    e->relay = r;
+    e->side = side;
+    e->fd = fd;
+    e->interest = interest;
+    struct epoll_event evt = {.events = interest, .data.ptr = e};
+    assert(epoll_ctl(ep_fd, EPOLL_CTL_ADD, fd, &evt) == 0);
+}
+
+static void kill_relay(relay_t *r) {
+    for (int i = 0; i < 2; i++) {
+        if (r->ep[i].fd >= 0) close(r->ep[i].fd);
+        r->ep[i].fd = -1;
+        while (r->dir[i].head != NULL) {
+            segment_t *s = r->dir[i].head;
+            r->dir[i].head = s->next;
+            free(s);
+        }
+    }
+    r->dead = 1;
+}
+
+static double uniform() {
+    return random() / (RAND_MAX + 1.0);
+}
+
+/* schedules len bytes read from side as link segments */
+static int enqueue(direction_t *d, uint8_t *buff, ssize_t len, uint64_t now) {
+    for (ssize_t off = 0; off < len; off += MSS) {
+        ssize_t seg_len = (len - off) > MSS ? MSS : (len - off);
+        segment_t *s = malloc(sizeof(segment_t) + seg_len);
+        if (s == NULL) return -1;
+        memcpy(s->data, buff + off, seg_len);
+        s->len = seg_len;
+        s->sent = 0;
+        s->next = NULL;
+
+        uint64_t serialization = link_cfg.bw_bps > 0 ? (uint64_t) (seg_len * 8 * 1e9 / link_cfg.bw_bps) : 0;
+        uint64_t depart = d->link_free_at > now ? d->link_free_at : now;
+        d->link_free_at = depart + serialization;
+        int64_t jitter = link_cfg.jitter_ns ? (int64_t) ((uniform() * 2 - 1) * link_cfg.jitter_ns) : 0;
+        uint64_t deliver = d->link_free_at + link_cfg.half_rtt_ns + jitter;
+        if (link_cfg.loss > 0 && uniform() < link_cfg.loss) {
+            deliver += 2 * link_cfg.half_rtt_ns + serialization; /* retransmitted a round-trip later */
+            d->link_free_at += serialization;
+            d->lost++;
+        }
+        if (deliver < d->last_deliver_at) deliver = d->last_deliver_at; /* in-order, like TCP */
+        d->last_deliver_at = s->deliver_at = deliver;
+
+        if (d->tail == NULL) d->head = s;
+        else d->tail->next = s;
+        d->tail = s;
+        d->queued += seg_len;
+        d->bytes += seg_len;
+    }
+    return 0;
+}
+
+static void update_interest(relay_t *r) {
+    for (int i = 0; i < 2; i++) {
+        uint32_t interest = 0;
+        if (! r->dir[i].eof && r->dir[i].queued < link_cfg.queue_limit) interest |= EPOLLIN;
+        if (r->dir[1 - i].blocked) interest |= EPOLLOUT;
+        set_interest(&r->ep[i], interest);
+    }
+}
+
+static void do_read(relay_t *r, int side, uint64_t now) {
+    static uint8_t buff[READ_CHUNK];
+    direction_t *d = &r->dir[side];
+    while (! d->eof && d->queued < link_cfg.queue_limit) {
+        ssize_t want = link_cfg.queue_limit - d->queued;
+        ssize_t n = recv(r->ep[side].fd, buff, want < READ_CHUNK ? want : READ_CHUNK, 0);
+        if (n == 0) {
+            d->eof = 1;
+        } else if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) kill_relay(r);
+            return;
+        } else if (enqueue(d, buff, n, now) != 0) {
+            kill_relay(r);
+            return;
+        }
+    }
+}
+
+/* writes due segments of dir[side] to the other end */
+static void do_deliver(relay_t *r, int side, uint64_t now) {
+    direction_t *d = &r->dir[side];
+    int fd = r->ep[1 - side].fd;
+    while (d->head != NULL && d->head->deliver_at <= now) {
+        segment_t *s = d->head;
+        ssize_t n = send(fd, s->data + s->sent, s->len - s->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) d->blocked = 1;
+            else kill_relay(r);
+            return;
+        }
+        s->sent += n;
+        if (s->sent < s->len) return;
+        d->head = s->next;
+        if (d->head == NULL) d->tail = NULL;
+        d->queued -= s->len;
+        free(s);
+    }
+    if (d->head == NULL && d->eof == 1) {
+        shutdown(fd, SHUT_WR);
+        d->eof = 2;
+    }
+}
+
+static void do_accept(int lfd) {
+    int fd;
+    while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+        relay_t *r = calloc(1, sizeof(relay_t));
+        int out = socket(AF_INET, SOCK_STREAM, 0);
+        if (r == NULL || out < 0) {
+            close(fd);
+            if (out >= 0) close(out);
+            free(r);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(out, F_SETFL, fcntl(out, F_GETFL) | O_NONBLOCK);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (int[]){1}, sizeof(int));
+        setsockopt(out, IPPROTO_TCP, TCP_NODELAY, (int[]){1}, sizeof(int));
+        if ((link_cfg.bind_source && bind(out, (struct sockaddr *) &link_cfg.source, sizeof(link_cfg.source)) != 0) ||
+            (connect(out, (struct sockaddr *) &link_cfg.target, sizeof(link_cfg.target)) != 0 && errno != EINPROGRESS)) {
+            if (link_cfg.verbose) perror("wan_emu: connect to target");
+            close(fd);
+            close(out);
+            free(r);
+            continue;
+        }
+        r->connecting = 1;
+        add_endpoint(r, 0, fd, 0); /* don't read from client till target is connected */
+        add_endpoint(r, 1, out, EPOLLOUT);
+        r->next = relays;
+        relays = r;
+        total_conns++;
+        if (link_cfg.verbose) fprintf(stderr, "wan_emu: relaying connection %d\n", total_conns);
+    }
+}
+
+static void handle(endpoint_t *e, uint32_t events, uint64_t now) {
+    relay_t *r = e->relay;
+    if (r->dead) return;
+    if (r->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(e->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            if (link_cfg.verbose) fprintf(stderr, "wan_emu: connect to target failed: %s\n", strerror(err));
+            kill_relay(r);
+            return;
+        }
+        r->connecting = 0;
+        update_interest(r);
+        return;
+    }
+    if (events & EPOLLOUT) {
+        r->dir[1 - e->side].blocked = 0;
+        do_deliver(r, 1 - e->side, now);
+    }
+    if (! r->dead && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) do_read(r, e->side, now);
+}
+
+static void reap() {
+    for (relay_t **p = &relays; *p != NULL; ) {
+        relay_t *r = *p;
+        if (! r->dead && r->dir[0].eof == 2 && r->dir[1].eof == 2) kill_relay(r);
+        if (r->dead) {
+            for (int i = 0; i < 2; i++) total_bytes[i] += r->dir[i].bytes;
+            total_lost += r->dir[0].lost + r->dir[1].lost;
+            *p = r->next;
+            free(r);
+        } else {
+            p = &r->next;
+        }
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -l listen-addr:port -t target-addr:port [-s source-addr] [-b bandwidth-kbit/s]\n"
+            "          [-r rtt-ms] [-j jitter-ms] [-p loss-pct] [-q queue-limit-kb] [-v]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int ch, have_listen = 0, have_target = 0;
+    double rtt_ms = 0, jitter_ms = 0, queue_kb = 0;
+    while ((ch = getopt(argc, argv, "hl:t:s:b:r:j:p:q:v")) != -1) {
+        switch (ch) {
+        case 'l': have_listen = (parse_addr(optarg, &link_cfg.listen) == 0); break;
+        case 't': have_target = (parse_addr(optarg, &link_cfg.target) == 0); break;
+        case 's':
+            link_cfg.source.sin_family = AF_INET;
+            link_cfg.bind_source = (inet_pton(AF_INET, optarg, &link_cfg.source.sin_addr) == 1);
+            break;
+        case 'b': link_cfg.bw_bps = atof(optarg) * 1000; break;
+        case 'r': rtt_ms = atof(optarg); break;
+        case 'j': jitter_ms = atof(optarg); break;
+        case 'p': link_cfg.loss = atof(optarg) / 100; break;
+        case 'q': queue_kb = atof(optarg); break;
+        case 'v': link_cfg.verbose++; break;
+        default:
+            usage(argv[0]);
+            exit(ch == 'h' ? 0 : 1);
+        }
+    }
+    if (! have_listen || ! have_target) {
+        usage(argv[0]);
+        exit(1);
+    }
+    link_cfg.half_rtt_ns = rtt_ms * 1e6 / 2;
+    link_cfg.jitter_ns = jitter_ms * 1e6;
+    if (link_cfg.jitter_ns > link_cfg.half_rtt_ns) link_cfg.jitter_ns = link_cfg.half_rtt_ns;
+    link_cfg.queue_limit = queue_kb * 1024;
+    if (link_cfg.queue_limit <= 0) {
+        link_cfg.queue_limit = link_cfg.bw_bps > 0 ? (ssize_t) (2 * link_cfg.bw_bps / 8 * rtt_ms / 1000) : 4 * 1024 * 1024;
+        if (link_cfg.queue_limit < MIN_QUEUE_LIMIT) link_cfg.queue_limit = MIN_QUEUE_LIMIT;
+    }
+    srandom(mono_ns());
+    signal(SIGTERM, on_signal);
+    signal(SIGINT, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(lfd >= 0);
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, (int[]){1}, sizeof(int));
+    fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK);
+    if (bind(lfd, (struct sockaddr *) &link_cfg.listen, sizeof(link_cfg.listen)) != 0 || listen(lfd, 64) != 0) {
+        perror("wan_emu: listen");
+        exit(1);
+    }
+    assert((ep_fd = epoll_create(10)) >= 0);
+    struct epoll_event levt = {.events = EPOLLIN, .data.ptr = NULL};
+    assert(epoll_ctl(ep_fd, EPOLL_CTL_ADD, lfd, &levt) == 0);
+
+    struct epoll_event evts[MAX_EVTS];
+    while (! stop) {
+        uint64_t now = mono_ns(), next = UINT64_MAX;
+        for (relay_t *r = relays; r != NULL; r = r->next) {
+            for (int i = 0; i < 2; i++) {
+                if (! r->dir[i].blocked && r->dir[i].head != NULL && r->dir[i].head->deliver_at < next) next = r->dir[i].head->deliver_at;
+            }
+        }
+        int timeout = (next == UINT64_MAX) ? 100 : (next <= now ? 0 : (int) ((next - now + 999999) / 1000000));
+        int n = epoll_wait(ep_fd, evts, MAX_EVTS, timeout);
+        now = mono_ns();
+        for (int i = 0; i < n; i++) {
+            if (evts[i].data.ptr == NULL) do_accept(lfd);
+            else handle(evts[i].data.ptr, evts[i].events, now);
+        }
+        for (relay_t *r = relays; r != NULL; r = r->next) {
+            if (r->dead || r->connecting) continue;
+            for (int i = 0; i < 2 && ! r->dead; i++) {
+                if (! r->dir[i].blocked) do_deliver(r, i, now);
+            }
+            if (! r->dead) update_interest(r);
+        }
+        reap();
+    }
+
+    for (relay_t *r = relays; r != NULL; r = r->next) kill_relay(r);
+    reap();
+    printf("{\"connections\": %d, \"bytes_fwd\": %llu, \"bytes_rev\": %llu, \"segments_lost\": %llu}\n",
+           total_conns, (unsigned long long) total_bytes[0], (unsigned long long) total_bytes[1], (unsigned long long) total_lost);
+    return 0;
+}
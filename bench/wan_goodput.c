@@ -0,0 +1,316 @@
+#include "../src/io.h"
+#include "../src/compress.h"
+#include "../src/constants.h"
+#include "../src/log.h"
+#include "pcap_file.h"
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * Goodput driver for WAN-emulation runs (see wan_emu.c and wan_bench.sh).
+ * Replays IPv4 packets from a pcap (re-addressed A -> B) for a fixed duration
+ * and reports uncompressed L3 bytes delivered per second at B.
+ *
+ *   l3tc: two io-loops (A: 127.2.0.1, B: 127.2.0.2, tuns replaced by
+ *         socketpairs). A dials B through the emulator, which must listen on
+ *         127.2.0.2:<emu-port>, relay to 127.2.0.2:<port> and bind its
+ *         outbound side to 127.2.0.1.
+ *   raw:  the same packets over a plain TCP connection through the emulator
+ *         (the no-l3tc baseline).
+ *   shm:  the two io-loops over a shared-memory channel (no emulator), what
+ *         l3tc costs with no network in the way (the codec ceiling).
+ *
+ * Load is open-loop: packets are offered as fast as the path (tun socketpair
+ * or TCP socket) accepts them, so l3tc may drop when its rings are full,
+ * exactly like it would when routing real traffic into a slow link.
+ */
+
+#define ADDR_A 0x7F020001 /* 127.2.0.1 */
+#define ADDR_B 0x7F020002 /* 127.2.0.2 */
+#define PROBE_TIMEOUT_NS 15000000000ULL
+#define MAX_EVTS 16
+
+#define MODE_RAW 0
+#define MODE_L3TC 1
+#define MODE_SHM 2
+
+static struct {
+    int l3tc; /* MODE_* */
+    const char *pcap;
+    int port, emu_port;
+    int duration;
+    int level;
+    int low_lat;
+    int flush_policy;
+    int flow_ctxs;
+    int verbose;
+} cfg = {MODE_L3TC, NULL, 16100, 16000, 10, DEFAULT_COMPRESSION_LEVEL, 0, IO_FLUSH_PKT, 0, 0};
+
+static pcap_pkts_t pkts;
+
+static uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void discard_log(int severity, const char *msg, void *arg) {}
+
+static void readdress(pcap_pkts_t *p) {
+    for (size_t i = 0; i < p->n; i++) {
+        uint8_t *pkt = pcap_pkt(p, i);
+        *(uint32_t *) (pkt + 12) = htonl(ADDR_A);
+        *(uint32_t *) (pkt + 16) = htonl(ADDR_B);
+    }
+}
+
+static pid_t spawn_l3tc(int tun_fd, uint32_t self, int port, const char *peer_file, const char *shm_path) {
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid > 0) return pid;
+
+    char self_buff[INET_ADDRSTRLEN];
+    struct in_addr a = {htonl(self)};
+    inet_ntop(AF_INET, &a, self_buff, sizeof(self_buff));
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    log_init(cfg.verbose, "wan_goodput/l3tc");
+    if (! cfg.verbose) log_register(discard_log, NULL);
+    signal(SIGTERM, trigger_io_loop_stop);
+    io_cfg_t io_cfg = {
+        .peer_file_path = peer_file,
+        .self_addr_v4 = self_buff,
+        .listener_port = port,
+        .shm_path = shm_path,
+        .try_reconnect_itvl = 1,
+        .compression_level = cfg.level,
+        .flush_policy = cfg.flush_policy,
+        .flow_ctxs = cfg.flow_ctxs,
+        .low_latency_aggressiveness = cfg.low_lat,
+        .ring_sz = {TUN_RING_SZ, CONN_RING_SZ, MAX_RING_SZ, 0},
+    };
+    if (io_cfg.ring_sz.conn < compress_ring_min_sz()) io_cfg.ring_sz.conn = compress_ring_min_sz();
+    exit(io(tun_fd, 0, &io_cfg) == 0 ? 0 : 1);
+}
+
+static int tcp_sock(uint32_t bind_addr, int port) {
+    struct sockaddr_in a = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(bind_addr)};
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (int[]){1}, sizeof(int));
+    if (bind(fd, (struct sockaddr *) &a, sizeof(a)) != 0) {
+        perror("wan_goodput: bind");
+        exit(1);
+    }
+    return fd;
+}
+
+static void set_nonblock(int fd) {
+    assert(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0);
+}
+
+struct path_s {
+    int tx_fd, rx_fd;
+    int dgram; /* tx/rx are packet oriented (tun) */
+    ssize_t tx_off; /* stream: bytes of current pkt already sent */
+    size_t next_pkt;
+    uint64_t offered, rcvd;
+};
+
+typedef struct path_s path_t;
+
+#define OFFER_BATCH 64
+
+/* offers packets until the path pushes back (or a batch is done, l3tc reads tun as fast as it can drop) */
+static void offer(path_t *p) {
+    for (int i = 0; i < OFFER_BATCH; i++) {
+        uint8_t *pkt = pcap_pkt(&pkts, p->next_pkt);
+        ssize_t len = pkts.len[p->next_pkt];
+        ssize_t n = p->dgram ? write(p->tx_fd, pkt, len) : send(p->tx_fd, pkt + p->tx_off, len - p->tx_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) return;
+            perror("wan_goodput: offer");
+            exit(1);
+        }
+        if (! p->dgram) {
+            p->tx_off += n;
+            if (p->tx_off < len) continue;
+            p->tx_off = 0;
+        }
+        p->offered += len;
+        p->next_pkt = (p->next_pkt + 1) % pkts.n;
+    }
+}
+
+static void drain(path_t *p) {
+    static uint8_t buff[0x10000];
+    ssize_t n;
+    while ((n = read(p->rx_fd, buff, sizeof(buff))) > 0) p->rcvd += n;
+    if (n == 0) {
+        fprintf(stderr, "wan_goodput: receive side closed\n");
+        exit(1);
+    }
+}
+
+static int wait_until_path_works(path_t *p, int ep) {
+    struct epoll_event evts[MAX_EVTS];
+    uint64_t deadline = mono_ns() + PROBE_TIMEOUT_NS, last_probe = 0;
+    while (p->rcvd == 0) {
+        uint64_t now = mono_ns();
+        if (now > deadline) return -1;
+        if (now - last_probe > 100000000ULL) {
+            uint8_t *pkt = pcap_pkt(&pkts, 0);
+            if (write(p->tx_fd, pkt, pkts.len[0]) < 0 && errno != EAGAIN) return -1;
+            last_probe = now;
+        }
+        int n = epoll_wait(ep, evts, MAX_EVTS, 10);
+        for (int i = 0; i < n; i++) {
+            if (evts[i].data.fd == p->rx_fd) drain(p);
+        }
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -f pcap [-m l3tc|raw|shm] [-e emu-port] [-p port] [-d duration-s] [-l compression-level] [-a low-latency-aggressiveness] [-F pkt|batch|flow] [-x flow-contexts] [-v]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int ch;
+    while ((ch = getopt(argc, argv, "hf:m:e:p:d:l:a:F:x:v")) != -1) {
+        switch (ch) {
+        case 'f': cfg.pcap = optarg; break;
+        case 'm': cfg.l3tc = (strcmp(optarg, "raw") == 0) ? MODE_RAW : (strcmp(optarg, "shm") == 0) ? MODE_SHM : MODE_L3TC; break;
+        case 'e': cfg.emu_port = atoi(optarg); break;
+        case 'p': cfg.port = atoi(optarg); break;
+        case 'd': cfg.duration = atoi(optarg); break;
+        case 'l': cfg.level = atoi(optarg); break;
+        case 'a': cfg.low_lat = atoi(optarg); break;
+        case 'F': cfg.flush_policy = (strcmp(optarg, "flow") == 0) ? IO_FLUSH_FLOW : (strcmp(optarg, "batch") == 0) ? IO_FLUSH_BATCH : IO_FLUSH_PKT; break;
+        case 'x': cfg.flow_ctxs = atoi(optarg); break;
+        case 'v': cfg.verbose++; break;
+        default:
+            usage(argv[0]);
+            exit(ch == 'h' ? 0 : 1);
+        }
+    }
+    if (cfg.pcap == NULL) {
+        usage(argv[0]);
+        exit(1);
+    }
+    if (pcap_load_l3_pkts(cfg.pcap, PCAP_IPV4_ONLY, &pkts) != 0 || pkts.n == 0) {
+        fprintf(stderr, "wan_goodput: no IPv4 packets in %s\n", cfg.pcap);
+        exit(1);
+    }
+    readdress(&pkts);
+    signal(SIGPIPE, SIG_IGN);
+    log_init(cfg.verbose, "wan_goodput");
+    if (! cfg.verbose) log_register(discard_log, NULL);
+
+    path_t path;
+    memset(&path, 0, sizeof(path));
+    pid_t a_pid = -1, b_pid = -1;
+    char peer_file_a[] = "/tmp/l3tc_wan_peers_a.XXXXXX", peer_file_b[] = "/tmp/l3tc_wan_peers_b.XXXXXX";
+    char shm_path[64];
+    snprintf(shm_path, sizeof(shm_path), "/tmp/l3tc_wan_shm.%d", (int) getpid());
+
+    if (cfg.l3tc) {
+        int tun_a[2], tun_b[2], buff_sz = 4 * 1024 * 1024;
+        assert(socketpair(AF_UNIX, SOCK_DGRAM, 0, tun_a) == 0 && socketpair(AF_UNIX, SOCK_DGRAM, 0, tun_b) == 0);
+        for (int i = 0; i < 2; i++) {
+            setsockopt(tun_a[i], SOL_SOCKET, SO_SNDBUF, &buff_sz, sizeof(buff_sz));
+            setsockopt(tun_b[i], SOL_SOCKET, SO_RCVBUF, &buff_sz, sizeof(buff_sz));
+        }
+        int fa = mkstemp(peer_file_a), fb = mkstemp(peer_file_b);
+        assert(fa >= 0 && fb >= 0);
+        if (cfg.l3tc == MODE_SHM) dprintf(fa, "127.2.0.2:%d shm=%s\n", cfg.port, shm_path);
+        else dprintf(fa, "127.2.0.2:%d\n", cfg.emu_port); /* B is passive for A (higher address), reached via the emulator */
+        close(fa);
+        close(fb);
+        b_pid = spawn_l3tc(tun_b[1], ADDR_B, cfg.port, peer_file_b, (cfg.l3tc == MODE_SHM) ? shm_path : NULL);
+        usleep(200000); /* let B listen before A dials */
+        a_pid = spawn_l3tc(tun_a[1], ADDR_A, cfg.port + 1, peer_file_a, NULL);
+        close(tun_a[1]);
+        close(tun_b[1]);
+        path.tx_fd = tun_a[0];
+        path.rx_fd = tun_b[0];
+        path.dgram = 1;
+    } else {
+        int lfd = tcp_sock(ADDR_B, cfg.port);
+        assert(listen(lfd, 1) == 0);
+        int cfd = tcp_sock(ADDR_A, 0);
+        struct sockaddr_in emu = {.sin_family = AF_INET, .sin_port = htons(cfg.emu_port), .sin_addr.s_addr = htonl(ADDR_B)};
+        if (connect(cfd, (struct sockaddr *) &emu, sizeof(emu)) != 0) {
+            perror("wan_goodput: connect to emulator");
+            exit(1);
+        }
+        int rfd = accept(lfd, NULL, NULL);
+        assert(rfd >= 0);
+        close(lfd);
+        path.tx_fd = cfd;
+        path.rx_fd = rfd;
+    }
+    set_nonblock(path.tx_fd);
+    set_nonblock(path.rx_fd);
+
+    int ep = epoll_create(2);
+    assert(ep >= 0);
+    struct epoll_event rx_evt = {.events = EPOLLIN, .data.fd = path.rx_fd}, tx_evt = {.events = EPOLLOUT, .data.fd = path.tx_fd};
+    assert(epoll_ctl(ep, EPOLL_CTL_ADD, path.rx_fd, &rx_evt) == 0);
+
+    int ret = 0;
+    if (cfg.l3tc && wait_until_path_works(&path, ep) != 0) {
+        fprintf(stderr, "wan_goodput: l3tc path didn't come up (is the emulator relaying %d -> %d?)\n", cfg.emu_port, cfg.port);
+        ret = 1;
+    } else {
+        assert(epoll_ctl(ep, EPOLL_CTL_ADD, path.tx_fd, &tx_evt) == 0);
+        struct epoll_event evts[MAX_EVTS];
+        path.offered = path.rcvd = 0;
+        uint64_t start = mono_ns(), end = start + cfg.duration * 1000000000ULL;
+        while (mono_ns() < end) {
+            int n = epoll_wait(ep, evts, MAX_EVTS, 10);
+            for (int i = 0; i < n; i++) {
+                if (evts[i].data.fd == path.rx_fd) drain(&path);
+                else offer(&path);
+            }
+        }
+        double secs = (mono_ns() - start) / 1e9;
+        printf("{\"mode\": \"%s\", \"compression\": \"%s\", \"compression_level\": %d, \"flush_policy\": \"%s\", \"flow_contexts\": %d, \"pcap_pkts\": %zu, \"pcap_bytes\": %zu, \"duration_s\": %.2f, "
+               "\"offered_bytes\": %llu, \"delivered_bytes\": %llu, \"goodput_mbps\": %.3f}\n",
+               (cfg.l3tc == MODE_SHM) ? "shm" : cfg.l3tc ? "l3tc" : "raw", COMPRESSION_IMPL, cfg.level, (cfg.flush_policy == IO_FLUSH_FLOW) ? "flow" : (cfg.flush_policy == IO_FLUSH_BATCH) ? "batch" : "pkt", cfg.flow_ctxs, pkts.n, pkts.bytes, secs,
+               (unsigned long long) path.offered, (unsigned long long) path.rcvd, path.rcvd * 8 / secs / 1e6);
+    }
+
+    if (cfg.l3tc) {
+        kill(a_pid, SIGTERM);
+        kill(b_pid, SIGTERM);
+        waitpid(a_pid, NULL, 0);
+        waitpid(b_pid, NULL, 0);
+        unlink(peer_file_a);
+        unlink(peer_file_b);
+        unlink(shm_path);
+    }
+    pcap_pkts_free(&pkts);
+    return ret;
+}
@@ -0,0 +1,100 @@
+#!/bin/bash
+
+# up-cmd for NFQUEUE mode (l3tc -Q), pkts to peers are queued to l3tc instead of being routed over tun.
+# l3tc passes IPSET_NAME, NFQUEUE_FIRST, NFQUEUE_LAST and REINJECT_MARK.
+
+set -x
+set -e
+
+tc_tcp_ports=${TCP_PORTS:-80,443,8080}
+tc_icmp=${ICMP:-y}
+tc_ipset_name=${IPSET_NAME:-l3tc}
+tc_ipv6=${IPV6:-y}
+tc_forward=${FORWARD:-n}
+tc_cpu_fanout=${CPU_FANOUT:-n}
+
+if [ "$NFQUEUE_FIRST" == "$NFQUEUE_LAST" ]; then
+    tc_queue="--queue-num $NFQUEUE_FIRST"
+else
+    tc_queue="--queue-balance $NFQUEUE_FIRST:$NFQUEUE_LAST"
+    if [ "x$tc_cpu_fanout" == "xy" ]; then
+        tc_queue="$tc_queue --queue-cpu-fanout"
+    fi
+fi
+# reinjected pkts (from peers) carry REINJECT_MARK and must not be queued again,
+# --queue-bypass lets traffic through uncompressed while l3tc isn't bound to the queues
+tc_target="-m mark ! --mark $REINJECT_MARK -j NFQUEUE $tc_queue --queue-bypass"
+
+function setup_ipset() {
+    local name=$1
+    local family=$2
+    set +e
+    ipset list | grep -F Name: -A1 | grep '^[0-9a-zA-Z]' | xargs -n4 | grep -qF "Name: $name Type: hash:net"
+    local ipset_exists=$?
+    ipset list -n | grep -qxF "$name"
+    local ipset_name_taken=$?
+    set -e
+    if [ $ipset_exists -eq 0 ]; then
+        ipset flush $name
+    else
+        if [ $ipset_name_taken -eq 0 ]; then
+            ipset destroy $name
+        fi
+        ipset create $name hash:net family $family
+    fi
+}
+
+# destination,port pairs l3tc found not to compress (-b), its entries time out by themselves
+function setup_bypass_ipset() {
+    local name=$1
+    local family=$2
+    set +e
+    ipset list -n | grep -qxF "$name"
+    local ipset_exists=$?
+    set -e
+    if [ $ipset_exists -eq 0 ]; then
+        ipset flush $name
+    else
+        ipset create $name hash:ip,port family $family timeout 0
+    fi
+}
+
+# iptables-binary chain rule
+function ensure_rule() {
+    local ipt=$1
+    shift
+    set +e
+    $ipt -t mangle -C "$@" 2>/dev/null
+    local has_rule=$?
+    set -e
+    if [ $has_rule -ne 0 ]; then
+        $ipt -t mangle -A "$@"
+    fi
+}
+
+# iptables-binary icmp-protocol ipset-name bypass-ipset-name
+function setup_queueing() {
+    local ipt=$1
+    local icmp_proto=$2
+    local name=$3
+    local bypass_name=$4
+    local chains="OUTPUT"
+    if [ "x$tc_forward" == "xy" ]; then
+        chains="$chains FORWARD"
+    fi
+    for chain in $chains; do
+        ensure_rule $ipt $chain -p tcp -m set --match-set $name dst -m set ! --match-set $bypass_name dst,dst -m multiport --ports $tc_tcp_ports $tc_target
+        if [ "x$tc_icmp" == "xy" ]; then
+            ensure_rule $ipt $chain -p $icmp_proto -m set --match-set $name dst $tc_target
+        fi
+    done
+}
+
+setup_ipset $tc_ipset_name inet
+setup_bypass_ipset ${tc_ipset_name}-bypass inet
+setup_queueing iptables icmp $tc_ipset_name ${tc_ipset_name}-bypass
+if [ "x$tc_ipv6" == "xy" ]; then
+    setup_ipset ${tc_ipset_name}6 inet6
+    setup_bypass_ipset ${tc_ipset_name}-bypass6 inet6
+    setup_queueing ip6tables ipv6-icmp ${tc_ipset_name}6 ${tc_ipset_name}-bypass6
+fi
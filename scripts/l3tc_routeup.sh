@@ -8,37 +8,81 @@ tc_icmp=${ICMP:-y}
 tc_nf_mark_value=${MARK_VALUE:-1}
 tc_routing_tbl=${ROUTING_TABLE:-1}
 tc_ipset_name=${IPSET_NAME:-l3tc}
+tc_ipv6=${IPV6:-y}
 
-set +e
-ipset list | grep -F Name: -A1 | grep '^[0-9a-zA-Z]' | xargs -n4 | grep -qF "Name: $tc_ipset_name Type: hash:ip"
-ipset_exists=$?
-set -e
-if [ $ipset_exists -eq 0 ]; then
-    ipset flush $tc_ipset_name
-else
-    ipset create $tc_ipset_name hash:ip
-fi
-tcp_pkt_mark="OUTPUT -t mangle -p tcp -m set --match-set ${tc_ipset_name} dst -m multiport --ports ${tc_tcp_ports} -j MARK --set-mark ${tc_nf_mark_value}"
-icmp_pkt_mark="OUTPUT -t mangle -p icmp -m set --match-set ${tc_ipset_name} dst -j MARK --set-mark ${tc_nf_mark_value}"
-set +e
-echo $tcp_pkt_mark | xargs iptables -C
-has_tcp_mark=$?
-echo $icmp_pkt_mark | xargs iptables -C
-has_icmp_mark=$?
-set -e
+# single-family sets, IPv6 peers and subnets go to ${tc_ipset_name}6
+function setup_ipset() {
+    local name=$1
+    local family=$2
+    set +e
+    ipset list | grep -F Name: -A1 | grep '^[0-9a-zA-Z]' | xargs -n4 | grep -qF "Name: $name Type: hash:net"
+    local ipset_exists=$?
+    ipset list -n | grep -qxF "$name"
+    local ipset_name_taken=$?
+    set -e
+    if [ $ipset_exists -eq 0 ]; then
+        ipset flush $name
+    else
+        if [ $ipset_name_taken -eq 0 ]; then
+            # older hash:ip set, can't hold subnets behind peers
+            ipset destroy $name
+        fi
+        ipset create $name hash:net family $family
+    fi
+}
 
-if [ $has_tcp_mark -ne 0 ]; then
-    echo $tcp_pkt_mark | xargs iptables -A
-fi
+# destination,port pairs l3tc found not to compress (-b), its entries time out by themselves
+function setup_bypass_ipset() {
+    local name=$1
+    local family=$2
+    set +e
+    ipset list -n | grep -qxF "$name"
+    local ipset_exists=$?
+    set -e
+    if [ $ipset_exists -eq 0 ]; then
+        ipset flush $name
+    else
+        ipset create $name hash:ip,port family $family timeout 0
+    fi
+}
 
-if [ $has_icmp_mark -ne 0 ]; then
-    if [ "x$tc_icmp" == "xy" ]; then
-        echo $icmp_pkt_mark | xargs iptables -A
+# iptables-binary icmp-protocol ipset-name bypass-ipset-name
+function setup_marks() {
+    local ipt=$1
+    local icmp_proto=$2
+    local name=$3
+    local bypass_name=$4
+    local tcp_pkt_mark="OUTPUT -t mangle -p tcp -m set --match-set ${name} dst -m set ! --match-set ${bypass_name} dst,dst -m multiport --ports ${tc_tcp_ports} -j MARK --set-mark ${tc_nf_mark_value}"
+    local icmp_pkt_mark="OUTPUT -t mangle -p ${icmp_proto} -m set --match-set ${name} dst -j MARK --set-mark ${tc_nf_mark_value}"
+    set +e
+    echo $tcp_pkt_mark | xargs $ipt -C
+    local has_tcp_mark=$?
+    echo $icmp_pkt_mark | xargs $ipt -C
+    local has_icmp_mark=$?
+    set -e
+
+    if [ $has_tcp_mark -ne 0 ]; then
+        echo $tcp_pkt_mark | xargs $ipt -A
     fi
-else
-    if [ "x$tc_icmp" != "xy" ]; then
-        echo $icmp_pkt_mark | xargs iptables -D
+
+    if [ $has_icmp_mark -ne 0 ]; then
+        if [ "x$tc_icmp" == "xy" ]; then
+            echo $icmp_pkt_mark | xargs $ipt -A
+        fi
+    else
+        if [ "x$tc_icmp" != "xy" ]; then
+            echo $icmp_pkt_mark | xargs $ipt -D
+        fi
     fi
+}
+
+setup_ipset $tc_ipset_name inet
+setup_bypass_ipset ${tc_ipset_name}-bypass inet
+setup_marks iptables icmp $tc_ipset_name ${tc_ipset_name}-bypass
+if [ "x$tc_ipv6" == "xy" ]; then
+    setup_ipset ${tc_ipset_name}6 inet6
+    setup_bypass_ipset ${tc_ipset_name}-bypass6 inet6
+    setup_marks ip6tables ipv6-icmp ${tc_ipset_name}6 ${tc_ipset_name}-bypass6
 fi
 
 ip link set $TUN_IFACE up
@@ -46,3 +90,8 @@ ip link set $TUN_IFACE up
 ip route add 0.0.0.0/0 dev $TUN_IFACE table $tc_routing_tbl
 
 ip rule add from all fwmark $tc_nf_mark_value table $tc_routing_tbl
+
+if [ "x$tc_ipv6" == "xy" ]; then
+    ip -6 route add ::/0 dev $TUN_IFACE table $tc_routing_tbl
+    ip -6 rule add from all fwmark $tc_nf_mark_value table $tc_routing_tbl
+fi
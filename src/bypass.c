@@ -0,0 +1,119 @@
+#include "bypass.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+int bypass_init(bypass_tab_t *t, int threshold) {
+    memset(t, 0, sizeof(*t));
+    if ((t->slots = calloc(BYPASS_SLOTS, sizeof(bypass_dest_t))) == NULL) {
+        log_crit("bypass", L("couldn't allocate destination tracker"));
+        return -1;
+    }
+    t->threshold = threshold;
+    return 0;
+}
+
+void bypass_destroy(bypass_tab_t *t) {
+    free(t->slots);
+    t->slots = NULL;
+}
+
+int bypass_key(const uint8_t *pkt, size_t len, uint8_t *key) {
+    size_t hl;
+    uint8_t proto;
+    memset(key, 0, BYPASS_KEY_SZ);
+    if (len >= 20 && (pkt[0] & 0xF0) == 0x40) {
+        hl = (pkt[0] & 0x0F) * 4;
+        proto = pkt[9];
+        if ((((pkt[6] << 8) | pkt[7]) & 0x1FFF) != 0) return -1; /* only the first fragment has ports */
+        key[0] = 4;
+        memcpy(key + 4, pkt + 16, 4);
+    } else if (len >= 40 && (pkt[0] & 0xF0) == 0x60) {
+        hl = 40;
+        proto = pkt[6]; /* extension headers aren't walked */
+        key[0] = 6;
+        memcpy(key + 4, pkt + 24, 16);
+    } else {
+        return -1;
+    }
+    if ((proto != IPPROTO_TCP && proto != IPPROTO_UDP) || hl < 20 || len < hl + 4) return -1;
+    key[1] = proto;
+    memcpy(key + 2, pkt + hl + 2, 2);
+    return 0;
+}
+
+static unsigned slot_of(const uint8_t *key) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < BYPASS_KEY_SZ; i++) h = (h ^ key[i]) * 16777619u;
+    return h % BYPASS_SLOTS;
+}
+
+static void judge(bypass_tab_t *t, unsigned slot, time_t now) {
+    bypass_dest_t *d = &t->slots[slot];
+    int pct = (int) (d->out * 100 / d->in);
+    d->in = d->out = 0;
+    d->last_pct = pct;
+    t->stats.windows++;
+    if (pct <= t->threshold - BYPASS_HYSTERESIS) {
+        d->poor = 0;
+        d->hold = BYPASS_HOLD_MIN;
+        return;
+    }
+    if (pct < t->threshold) return;
+    t->stats.poor_windows++;
+    if (++d->poor < BYPASS_WINDOWS || t->n_pending == BYPASS_PENDING_MAX) return;
+    t->pending[t->n_pending++] = slot;
+    d->poor = 0;
+    d->held = d->hold;
+    d->until = now + d->held;
+    d->hold = (d->hold * 2 < BYPASS_HOLD_MAX) ? d->hold * 2 : BYPASS_HOLD_MAX;
+    t->stats.bypassed++;
+}
+
+void bypass_account(bypass_tab_t *t, const uint8_t *key, size_t in, size_t out, time_t now) {
+    unsigned slot = slot_of(key);
+    bypass_dest_t *d = &t->slots[slot];
+    if (memcmp(d->key, key, BYPASS_KEY_SZ) != 0) {
+        if (d->until > now) {
+            t->stats.untracked_pkts++;
+            return;
+        }
+        memset(d, 0, sizeof(*d));
+        memcpy(d->key, key, BYPASS_KEY_SZ);
+        d->hold = BYPASS_HOLD_MIN;
+    } else if (d->until != 0) {
+        if (d->until > now) return; /* already in flight as the entry went in */
+        d->until = 0; /* entry timed out, on probation */
+        d->poor = BYPASS_WINDOWS - 1;
+        d->in = d->out = 0;
+        t->stats.reprobed++;
+    }
+    d->in += in;
+    d->out += out;
+    if (d->in >= BYPASS_WINDOW_BYTES) judge(t, slot, now);
+}
+
+bypass_dest_t *bypass_next(bypass_tab_t *t, uint32_t *hold) {
+    if (t->n_pending == 0) return NULL;
+    bypass_dest_t *d = &t->slots[t->pending[--t->n_pending]];
+    *hold = d->held;
+    return d;
+}
+
+void bypass_undo(bypass_tab_t *t, bypass_dest_t *d) {
+    d->until = 0;
+    d->hold = d->held;
+    t->stats.failed++;
+}
+
+int bypass_entry_str(const uint8_t *key, char *buff, size_t sz, int *af) {
+    char addr[INET6_ADDRSTRLEN];
+    *af = (key[0] == 6) ? AF_INET6 : AF_INET;
+    if (inet_ntop(*af, key + 4, addr, sizeof(addr)) == NULL) return -1;
+    int len = snprintf(buff, sz, "%s,%s:%u", addr, (key[1] == IPPROTO_TCP) ? "tcp" : "udp", (key[2] << 8) | key[3]);
+    return (len > 0 && (size_t) len < sz) ? 0 : -1;
+}
@@ -0,0 +1,81 @@
+#ifndef _BYPASS_H
+#define _BYPASS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* steering feedback (opt-in). What a destination (address, protocol and port of TCP / UDP pkts from
+   tun) sends is judged a window (BYPASS_WINDOW_BYTES in) at a time by the bytes it took in the conn.
+   A destination whose windows come out at or above threshold percent of what went in BYPASS_WINDOWS
+   times in a row is put in the bypass set (a netfilter set the routing rules skip, entries with a
+   timeout) for hold secs, its traffic goes natively meanwhile. With hysteresis:
+
+   - a window has to come out BYPASS_HYSTERESIS points below threshold to clear the streak, windows
+     in between leave it as it is,
+   - once the entry times out the destination comes back on probation, one poor window puts it back
+     for twice as long (up to BYPASS_HOLD_MAX), a good one makes it start over.
+
+   Destinations are tracked in a direct-mapped table, a destination colliding with another takes its
+   slot over unless that one is bypassed. Bypassing is queued up for the caller (it means running
+   ipset), a destination whose bypass couldn't be queued is judged again next window. */
+
+#define BYPASS_SLOTS 4096
+#define BYPASS_KEY_SZ 20 /* version, protocol, port, address */
+#define BYPASS_WINDOW_BYTES (256 * 1024)
+#define BYPASS_WINDOWS 4
+#define BYPASS_HYSTERESIS 10
+#define BYPASS_HOLD_MIN 60
+#define BYPASS_HOLD_MAX 3600
+#define BYPASS_PENDING_MAX 64
+
+struct bypass_dest_s {
+    uint8_t key[BYPASS_KEY_SZ]; /* key[0] == 0 => free */
+    uint64_t in, out; /* window so far */
+    int poor; /* consecutive poor windows */
+    uint32_t hold; /* secs the next bypass lasts */
+    uint32_t held; /* secs the current (or last) one lasts */
+    time_t until; /* bypassed till then, 0 => not since it came back */
+    int last_pct; /* of the last window */
+};
+
+typedef struct bypass_dest_s bypass_dest_t;
+
+struct bypass_stats_s {
+    uint64_t windows, poor_windows;
+    uint64_t bypassed, reprobed, failed;
+    uint64_t untracked_pkts; /* slot held by a bypassed destination */
+};
+
+typedef struct bypass_stats_s bypass_stats_t;
+
+struct bypass_tab_s {
+    bypass_dest_t *slots; /* NULL => off */
+    int threshold; /* percent */
+    unsigned pending[BYPASS_PENDING_MAX]; /* slots to add to the bypass set */
+    int n_pending;
+    bypass_stats_t stats;
+};
+
+typedef struct bypass_tab_s bypass_tab_t;
+
+int bypass_init(bypass_tab_t *t, int threshold);
+
+void bypass_destroy(bypass_tab_t *t);
+
+/* key of pkt's destination, -1 if it isn't a TCP / UDP pkt with ports (fragments, extension headers) */
+int bypass_key(const uint8_t *pkt, size_t len, uint8_t *key);
+
+/* pkt to key's destination took out bytes in the conn */
+void bypass_account(bypass_tab_t *t, const uint8_t *key, size_t in, size_t out, time_t now);
+
+/* next destination to put in the bypass set for *hold secs, NULL once there are none */
+bypass_dest_t *bypass_next(bypass_tab_t *t, uint32_t *hold);
+
+/* d couldn't be put in the set, it's judged again from scratch */
+void bypass_undo(bypass_tab_t *t, bypass_dest_t *d);
+
+/* netfilter set entry (addr,proto:port) of a key, af is set to its family */
+int bypass_entry_str(const uint8_t *key, char *buff, size_t sz, int *af);
+
+#endif
@@ -0,0 +1,171 @@
+#include "calibrate.h"
+#include "compress.h"
+#include "log.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#define C_LOG "calibrate"
+
+#define CORPUS_SZ 256*1024
+#define CORPUS_MTU 1400
+#define CORPUS_HDR_SZ 40 /* ipv4 + tcp */
+
+static const char *text_fragments[] = {
+    "GET /api/v2/items?page=", "HTTP/1.1 200 OK\r\n", "Content-Type: application/json; charset=utf-8\r\n",
+    "Host: static.example.com\r\n", "Accept-Encoding: identity\r\n", "Connection: keep-alive\r\n",
+    "Cache-Control: max-age=3600\r\n", "{\"id\": ", ", \"name\": \"", "\", \"tags\": [\"alpha\", \"beta\"], ",
+    "\"created_at\": \"2016-02-05T10:", "\", \"status\": \"active\"}", "<div class=\"row\"><span>", "</span></div>\n",
+    "INSERT INTO events (ts, host, level, msg) VALUES (", "2016-02-05 10:12:01,104 INFO  [worker-", "] request served in ",
+};
+
+static uint32_t prng(uint32_t *state) { /* xorshift, corpus must be the same on every host */
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void fill_hdr(uint8_t *p, uint16_t len, uint32_t seq) {
+    memset(p, 0, CORPUS_HDR_SZ);
+    p[0] = 0x45;
+    *(uint16_t *) (p + 2) = htons(len);
+    *(uint16_t *) (p + 4) = htons(seq & 0xFFFF);
+    p[8] = 64;
+    p[9] = 6;
+    *(uint32_t *) (p + 12) = htonl(0x0A000001);
+    *(uint32_t *) (p + 16) = htonl(0x0A000002 + (seq % 7));
+    *(uint16_t *) (p + 20) = htons(443);
+    *(uint16_t *) (p + 22) = htons(40000 + (seq % 7));
+    *(uint32_t *) (p + 24) = htonl(seq * 1400);
+    p[32] = 0x50;
+    p[33] = 0x18;
+}
+
+/* mix of mostly-text packets, bare acks and incompressible payloads, returns packet count */
+static size_t build_corpus(uint8_t *corpus, uint16_t *lens, size_t max_pkts) {
+    uint32_t state = 0x13572468;
+    size_t off = 0, n = 0;
+    while (n < max_pkts) {
+        uint32_t kind = prng(&state) % 10;
+        uint16_t len = (kind < 2) ? CORPUS_HDR_SZ : (CORPUS_HDR_SZ + 200 + prng(&state) % (CORPUS_MTU - CORPUS_HDR_SZ - 200));
+        if (off + len > CORPUS_SZ) break;
+        uint8_t *p = corpus + off;
+        fill_hdr(p, len, n);
+        for (size_t i = CORPUS_HDR_SZ; i < len;) {
+            if (kind >= 8) {
+                p[i++] = prng(&state) & 0xFF;
+            } else {
+                const char *frag = text_fragments[prng(&state) % (sizeof(text_fragments) / sizeof(text_fragments[0]))];
+                size_t flen = strlen(frag);
+                if (flen > len - i) flen = len - i;
+                memcpy(p + i, frag, flen);
+                i += flen;
+                if (i < len) p[i++] = '0' + prng(&state) % 10;
+            }
+        }
+        lens[n++] = len;
+        off += len;
+    }
+    return n;
+}
+
+static uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static int measure_level(int level, uint8_t *corpus, uint16_t *lens, size_t n, int budget_ms, calibration_t *result) {
+    compress_t comp;
+    memset(&comp, 0, sizeof(comp));
+    if (init_compression_ctx(&comp, level) != 0) {
+        log_warn(C_LOG, L("couldn't initialize compression context for level %d"), level);
+        return -1;
+    }
+    ssize_t out_sz = worst_case_compressed_out_sz(&comp, CORPUS_MTU);
+    uint8_t *out = malloc(out_sz);
+    if (out == NULL) {
+        destroy_compression_ctx(&comp);
+        return -1;
+    }
+
+    uint64_t in_bytes = 0, out_bytes = 0;
+    uint64_t budget_ns = ((uint64_t) budget_ms) * 1000000, elapsed = 0;
+    uint64_t start = mono_ns();
+    size_t off = 0, i = 0;
+    while (elapsed < budget_ns || in_bytes < CORPUS_SZ / 4) {
+        setup_compress_input(&comp, corpus + off, lens[i]);
+        ssize_t consumed = 0;
+        int complete = 0;
+        do {
+            ssize_t c = 0;
+            out_bytes += do_compress(&comp, out, out_sz, &c, &complete);
+            consumed += c;
+        } while (consumed < lens[i] || ! complete);
+        in_bytes += lens[i];
+        off += lens[i];
+        if (++i == n) i = off = 0;
+        if ((i & 0xF) == 0) elapsed = mono_ns() - start;
+    }
+    elapsed = mono_ns() - start;
+
+    result->level = level;
+    result->mb_per_s = (in_bytes / 1e6) / (elapsed / 1e9);
+    result->ratio = out_bytes ? ((double) in_bytes) / out_bytes : 0;
+
+    free(out);
+    destroy_compression_ctx(&comp);
+    return 0;
+}
+
+int calibrate_compression_level(double target_mbps, int budget_ms, calibration_t *results, int max_results, int *num_results) {
+    size_t max_pkts = CORPUS_SZ / CORPUS_HDR_SZ;
+    uint8_t *corpus = malloc(CORPUS_SZ);
+    uint16_t *lens = malloc(max_pkts * sizeof(uint16_t));
+    int chosen = MIN_COMPRESSION_LEVEL;
+    int found = 0, filled = 0;
+    if (corpus == NULL || lens == NULL) {
+        log_warnx(C_LOG, L("couldn't allocate calibration corpus, using level %d"), chosen);
+        goto done;
+    }
+    size_t n = build_corpus(corpus, lens, max_pkts);
+
+    double target_mb_per_s = target_mbps / 8;
+    calibration_t picked, next_slower;
+    int have_next = 0;
+    for (int level = MIN_COMPRESSION_LEVEL; level <= MAX_COMPRESSION_LEVEL; level++) {
+        calibration_t r;
+        if (measure_level(level, corpus, lens, n, budget_ms, &r) != 0) continue;
+        log_info(C_LOG, L("level %d: %.1f MB/s (%.0f Mbit/s) per core, ratio %.2f"), r.level, r.mb_per_s, r.mb_per_s * 8, r.ratio);
+        if (results != NULL && filled < max_results) results[filled++] = r;
+        if (r.mb_per_s >= target_mb_per_s) {
+            chosen = level;
+            picked = r;
+            found = 1;
+            have_next = 0;
+        } else if (found && ! have_next) {
+            next_slower = r;
+            have_next = 1;
+        }
+    }
+    if (! found) {
+        log_info(C_LOG, L("calibration: no %s level sustains %.0f Mbit/s per core on this host, using fastest level %d"), COMPRESSION_IMPL, target_mbps, chosen);
+    } else if (have_next) {
+        log_info(C_LOG, L("calibration: picked %s level %d, %.0f Mbit/s per core (ratio %.2f) meets the %.0f Mbit/s target, level %d only does %.0f Mbit/s"),
+                 COMPRESSION_IMPL, chosen, picked.mb_per_s * 8, picked.ratio, target_mbps, next_slower.level, next_slower.mb_per_s * 8);
+    } else {
+        log_info(C_LOG, L("calibration: picked %s level %d, %.0f Mbit/s per core (ratio %.2f) meets the %.0f Mbit/s target"),
+                 COMPRESSION_IMPL, chosen, picked.mb_per_s * 8, picked.ratio, target_mbps);
+    }
+
+ done:
+    free(corpus);
+    free(lens);
+    if (num_results != NULL) *num_results = filled;
+    return chosen;
+}
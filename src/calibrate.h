@@ -0,0 +1,24 @@
+#ifndef _CALIBRATE_H
+#define _CALIBRATE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CALIBRATION_BUDGET_MS 40 /* per compression level */
+
+struct calibration_s {
+    int level;
+    double mb_per_s; /* uncompressed input, single core */
+    double ratio;
+};
+
+typedef struct calibration_s calibration_t;
+
+/* runs a built-in corpus of packet-like data (per-packet sync-flushed, like the data-path)
+   through every compression level and returns the highest level that compresses atleast
+   target_mbps (Mbit/s of uncompressed traffic) on one core of this host, or
+   MIN_COMPRESSION_LEVEL if none does. results (if not NULL) receives upto max_results
+   per-level measurements, *num_results is set to the number filled. */
+int calibrate_compression_level(double target_mbps, int budget_ms, calibration_t *results, int max_results, int *num_results);
+
+#endif
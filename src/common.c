@@ -25,3 +25,95 @@ uint16_t parse_ipv4_pkt_sz(void *b1, ssize_t len1, void *b2, ssize_t len2) {
     return ntohs(pkt_len);
 }
 
+
+#define IPv6_HDR_LEN 40
+#define IPv6_NEXT_HDR_HOP_BY_HOP 0
+#define IPv6_OPT_PAD1 0
+#define IPv6_OPT_JUMBO 0xC2
+
+static inline int byte_at(void *b1, ssize_t len1, void *b2, ssize_t len2, ssize_t off, uint8_t *out) {
+    if (off < len1) {
+        *out = *((uint8_t *) b1 + off);
+    } else if (off - len1 < len2) {
+        *out = *((uint8_t *) b2 + off - len1);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static inline int be_uint_at(void *b1, ssize_t len1, void *b2, ssize_t len2, ssize_t off, int width, uint32_t *out) {
+    uint8_t b;
+    *out = 0;
+    for (int i = 0; i < width; i++) {
+        if (byte_at(b1, len1, b2, len2, off + i, &b) != 0) return -1;
+        *out = (*out << 8) | b;
+    }
+    return 0;
+}
+
+size_t parse_ipv6_pkt_sz(void *b1, ssize_t len1, void *b2, ssize_t len2) {
+    uint32_t payload_len, next_hdr, hbh_len, opt_typ, opt_len;
+
+    if (b1 == NULL) len1 = 0;
+    if (b2 == NULL) len2 = 0;
+    assert(len1 >= 0);
+    assert(len2 >= 0);
+
+    if (be_uint_at(b1, len1, b2, len2, 4, 2, &payload_len) != 0) return 0;
+    if (payload_len > 0) return IPv6_HDR_LEN + payload_len;
+
+    if (be_uint_at(b1, len1, b2, len2, 6, 1, &next_hdr) != 0) return 0;
+    if (next_hdr != IPv6_NEXT_HDR_HOP_BY_HOP) return IPv6_HDR_LEN; /* eg. no-next-header */
+
+    if (be_uint_at(b1, len1, b2, len2, IPv6_HDR_LEN + 1, 1, &hbh_len) != 0) return 0;
+    ssize_t off = IPv6_HDR_LEN + 2, end = IPv6_HDR_LEN + (hbh_len + 1) * 8;
+    while (off < end) {
+        if (be_uint_at(b1, len1, b2, len2, off, 1, &opt_typ) != 0) return 0;
+        if (opt_typ == IPv6_OPT_PAD1) {
+            off++;
+            continue;
+        }
+        if (be_uint_at(b1, len1, b2, len2, off + 1, 1, &opt_len) != 0) return 0;
+        if (opt_typ == IPv6_OPT_JUMBO && opt_len == 4) {
+            uint32_t jumbo_len;
+            if (be_uint_at(b1, len1, b2, len2, off + 2, 4, &jumbo_len) != 0) return 0;
+            return (jumbo_len > MAX_L3_PKT_SZ - IPv6_HDR_LEN) ? L3_PKT_MALFORMED : IPv6_HDR_LEN + (size_t) jumbo_len;
+        }
+        off += 2 + opt_len;
+    }
+    return IPv6_HDR_LEN; /* zero payload-length without jumbo option is malformed, kernel will drop it */
+}
+
+size_t parse_l3_pkt_sz(void *b1, ssize_t len1, void *b2, ssize_t len2) {
+    uint8_t ver;
+    if (b1 == NULL) len1 = 0;
+    if (b2 == NULL) len2 = 0;
+    if (byte_at(b1, len1, b2, len2, 0, &ver) != 0) return 0;
+    switch (ver & 0xF0) {
+    case 0x40:
+        return parse_ipv4_pkt_sz(len1 > 0 ? b1 : NULL, len1, b2, len2);
+    case 0x60:
+        return parse_ipv6_pkt_sz(b1, len1, b2, len2);
+    default:
+        return 0;
+    }
+}
+
+uint32_t csum_add(uint32_t sum, const uint8_t *p, size_t len) {
+    size_t i;
+    for (i = 0; i + 1 < len; i += 2) sum += rd16(p + i);
+    if (len & 1) sum += ((uint32_t) p[len - 1]) << 8;
+    return sum;
+}
+
+uint16_t csum_fold(uint32_t sum) {
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum & 0xFFFF;
+}
+
+uint16_t csum_replace(uint16_t csum, uint16_t old, uint16_t new) {
+    uint32_t sum = (uint16_t) ~csum + (uint16_t) ~old + new;
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
+}
@@ -6,7 +6,45 @@
 #include <stddef.h>
 
 #define MAX_ADDR_LEN 260 /*256 + some for newline*/
+#define MAX_L3_PKT_SZ (0xFFFF + 40) /* IPv6 payload-length excludes the fixed header, jumbograms need tun MTU > 64k which linux doesn't do */
+#define L3_PKT_MALFORMED ((size_t) -1) /* claims to be longer than MAX_L3_PKT_SZ */
+
+/* network byte order, p needn't be aligned */
+static inline uint16_t rd16(const uint8_t *p) {
+    return (((uint16_t) p[0]) << 8) | p[1];
+}
+
+static inline void wr16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+static inline uint32_t rd32(const uint8_t *p) {
+    return (((uint32_t) rd16(p)) << 16) | rd16(p + 2);
+}
+
+static inline void wr32(uint8_t *p, uint32_t v) {
+    wr16(p, v >> 16);
+    wr16(p + 2, v & 0xFFFF);
+}
+
+/* internet checksum (RFC 1071): 16 bit words of p added to sum (an odd last byte is padded), csum_fold
+   turns the total into the checksum */
+uint32_t csum_add(uint32_t sum, const uint8_t *p, size_t len);
+
+uint16_t csum_fold(uint32_t sum);
+
+/* csum once a 16 bit word it covers goes from old to new (RFC 1624, eqn. 3) */
+uint16_t csum_replace(uint16_t csum, uint16_t old, uint16_t new);
 
 uint16_t parse_ipv4_pkt_sz(void *b1, ssize_t len1, void *b2, ssize_t len2);
 
+/* fixed header + payload (which covers extension headers), jumbograms are sized from the
+   hop-by-hop jumbo-payload option; 0 when more bytes are needed to tell, L3_PKT_MALFORMED for a
+   jumbogram none of our buffers can hold */
+size_t parse_ipv6_pkt_sz(void *b1, ssize_t len1, void *b2, ssize_t len2);
+
+/* dispatches on IP version, 0 for an unknown version or when more bytes are needed, see parse_ipv6_pkt_sz */
+size_t parse_l3_pkt_sz(void *b1, ssize_t len1, void *b2, ssize_t len2);
+
 #endif
@@ -21,6 +21,8 @@
 #define MIN_COMPRESSION_LEVEL Z_BEST_SPEED
 #define NO_COMPRESSION_LEVEL Z_NO_COMPRESSION
 #define COMPRESSION_IMPL "zlib"
+#define COMPRESSION_LIVE_LEVEL_CHANGE 1 /* set_compression_level keeps the history */
+#define COMPRESSION_HANDOFF 1 /* both directions can be handed over at a block boundary */
 #endif
 #ifdef USE_ZSTD
 #define DEFAULT_COMPRESSION_LEVEL 4
@@ -28,6 +30,8 @@
 #define MIN_COMPRESSION_LEVEL 1
 #define NO_COMPRESSION_LEVEL -1
 #define COMPRESSION_IMPL "zstd"
+#define COMPRESSION_LIVE_LEVEL_CHANGE 0 /* set_compression_level ends the frame, the window starts over */
+#define COMPRESSION_HANDOFF 0 /* the decompressor's window can't be exported, it only gets to a frame end when the peer ends one */
 #endif
 
 struct compress_s {
@@ -35,6 +39,9 @@ struct compress_s {
     z_stream deflate;
     z_stream inflate;
     uint8_t inflate_src_buff[DECOMPRESSION_SRC_BUFF_CAPACITY];
+    int deflate_raw, inflate_raw; /* picked up mid-stream from another process (init_compression_ctx_from), no zlib header */
+    uint8_t inflate_last_in; /* last input byte inflate took, a handed over stream resumes from its unused bits */
+    int inflate_resume_bits; /* unused bits primed at pick-up, till inflate takes more input */
 #endif
     
 #ifdef USE_ZSTD
@@ -44,13 +51,20 @@ struct compress_s {
     ZSTD_DStream* dstream;
 
     uint8_t *inflate_src_buff;
-    uint32_t inflate_src_buff_offset;
+    ZSTD_inBuffer dinput; /* inflate_src_buff, or what setup_decompress_input pointed at */
 #endif
     
     int deflate_fully_flushed;
+    int defer_flush; /* when set, do_compress keeps input buffered in the codec, the next call with it cleared flushes everything */
+    uint32_t unflushed_bytes; /* input consumed since last flush */
+    int compression_level;
+    int level_change_pending; /* compression_level is applied once the stream is flushed */
     uint32_t inflate_src_buff_sz;
 
     uint32_t inflatable_bytes;
+
+    int handoff; /* see set_compression_handoff */
+    int rx_at_handoff_point; /* zstd: decompressor is between frames */
 };
 
 typedef struct compress_s compress_t;
@@ -63,10 +77,39 @@ ssize_t do_decompress(compress_t *comp, void *to, ssize_t capacity);
 
 ssize_t do_compress(compress_t *comp, void *to, ssize_t capacity, ssize_t *consumed, int *complete);
 
+/* accounts for input held back by a deferred flush too */
 ssize_t worst_case_compressed_out_sz(compress_t *comp, ssize_t len);
 
 void setup_compress_input(compress_t *comp, void *buff, ssize_t len);
 
+/* decompress straight from buff instead of inflate_src_buff (only once inflatable_bytes is 0), buff must
+   stay put till do_decompress has used it up */
+void setup_decompress_input(compress_t *comp, const void *buff, ssize_t len);
+
+/* switches the compressor to level at the next point its stream is flushed (zlib: right away if it
+   already is), history is kept with zlib, zstd closes the frame and starts over with the new level */
+void set_compression_level(compress_t *comp, int level);
+
+/* start the compressed (resp. decompressed) stream over, history and held back input are dropped */
+void reset_compress_stream(compress_t *comp);
+
+void reset_decompress_stream(compress_t *comp);
+
 ssize_t compress_ring_min_sz();
 
+/* hot upgrade (see handoff.h), streams of a conn are picked up by another process without the peer
+   noticing. Once on, decompression stops at the next point the stream can be resumed from (zlib: end of a
+   deflate block, zstd: end of a frame) and zstd ends the compressed frame at the next flush */
+void set_compression_handoff(compress_t *comp, int on);
+
+/* both streams can be exported: compressor flushed, decompressor stopped at a resumable point */
+int compression_at_handoff_point(compress_t *comp);
+
+/* stream state (level, history, received input not decompressed yet) in *state (malloc'd), -1 if not at a
+   handoff point */
+ssize_t export_compression_state(compress_t *comp, uint8_t **state);
+
+/* init_compression_ctx, but carrying on the streams export_compression_state captured */
+int init_compression_ctx_from(compress_t *comp, const uint8_t *state, ssize_t len);
+
 #endif
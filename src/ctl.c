@@ -0,0 +1,193 @@
+#include "ctl.h"
+#include "log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CTL_LOG "ctl"
+#define CTL_LISTEN_BACKLOG 8
+
+int ctl_listen(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_crit(CTL_LOG, L("control socket path too long: %s"), path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        log_crit(CTL_LOG, L("couldn't create control socket"));
+        return -1;
+    }
+    if (unlink(path) != 0 && errno != ENOENT) {
+        log_warn(CTL_LOG, L("couldn't remove stale control socket %s"), path);
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        log_crit(CTL_LOG, L("couldn't bind control socket to %s"), path);
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, CTL_LISTEN_BACKLOG) != 0) {
+        log_crit(CTL_LOG, L("couldn't listen on control socket %s"), path);
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+static void ctl_vprintf(ctl_out_t *out, const char *fmt, va_list ap) {
+    for (;;) {
+        size_t room = out->cap - out->len;
+        va_list aq;
+        va_copy(aq, ap);
+        int n = vsnprintf(out->buff + out->len, room, fmt, aq);
+        va_end(aq);
+        if (n < 0) return;
+        if ((size_t) n < room) {
+            out->len += n;
+            return;
+        }
+        size_t cap = (out->cap == 0) ? 4096 : out->cap * 2;
+        while (cap - out->len <= (size_t) n) cap *= 2;
+        char *b = realloc(out->buff, cap);
+        if (b == NULL) {
+            log_warn(CTL_LOG, L("couldn't grow reply buffer to %zu bytes, reply truncated"), cap);
+            return;
+        }
+        out->buff = b;
+        out->cap = cap;
+    }
+}
+
+void ctl_printf(ctl_out_t *out, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    ctl_vprintf(out, fmt, ap);
+    va_end(ap);
+}
+
+int ctl_error(ctl_out_t *out, const char *fmt, ...) {
+    va_list ap;
+    ctl_printf(out, "error: ");
+    va_start(ap, fmt);
+    ctl_vprintf(out, fmt, ap);
+    va_end(ap);
+    ctl_printf(out, "\n");
+    return -1;
+}
+
+static void ctl_help(const ctl_cmd_t *cmds, ctl_out_t *out) {
+    for (const ctl_cmd_t *c = cmds; c->name != NULL; c++) {
+        ctl_printf(out, "%s\n", c->usage);
+    }
+    ctl_printf(out, "help\n");
+}
+
+void ctl_run_line(char *line, const ctl_cmd_t *cmds, void *ctx, ctl_out_t *out) {
+    char *argv[CTL_MAX_ARGS + 1];
+    int argc = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(line, " \t\r", &save); tok != NULL; tok = strtok_r(NULL, " \t\r", &save)) {
+        if (argc == CTL_MAX_ARGS) {
+            ctl_error(out, "more than %d words in request", CTL_MAX_ARGS);
+            return;
+        }
+        argv[argc++] = tok;
+    }
+    if (argc == 0) return;
+    argv[argc] = NULL;
+
+    if (strcmp(argv[0], "help") == 0) {
+        ctl_help(cmds, out);
+        ctl_printf(out, "ok\n");
+        return;
+    }
+    const ctl_cmd_t *c;
+    for (c = cmds; c->name != NULL && strcmp(c->name, argv[0]) != 0; c++);
+    if (c->name == NULL) {
+        ctl_error(out, "unknown command '%s' (try help)", argv[0]);
+        return;
+    }
+    if ((argc - 1) < c->min_args || (argc - 1) > c->max_args) {
+        ctl_error(out, "usage: %s", c->usage);
+        return;
+    }
+    if (c->fn(ctx, argc, argv, out) == 0) ctl_printf(out, "ok\n");
+}
+
+static void run_lines(ctl_client_t *c, const ctl_cmd_t *cmds, void *ctx) {
+    size_t start = 0;
+    char *nl;
+    while ((nl = memchr(c->in + start, '\n', c->in_len - start)) != NULL) {
+        *nl = '\0';
+        if (c->discarding) {
+            c->discarding = 0;
+        } else {
+            ctl_run_line(c->in + start, cmds, ctx, &c->out);
+        }
+        start = nl - c->in + 1;
+    }
+    memmove(c->in, c->in + start, c->in_len - start);
+    c->in_len -= start;
+    if (c->in_len == sizeof(c->in)) {
+        if (! c->discarding) ctl_error(&c->out, "request longer than %d bytes", CTL_MAX_LINE - 1);
+        c->discarding = 1;
+        c->in_len = 0;
+    }
+}
+
+int ctl_serve(int fd, ctl_client_t *c, const ctl_cmd_t *cmds, void *ctx) {
+    for (;;) {
+        ssize_t n = recv(fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (n == 0) {
+            c->eof = 1;
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            log_warn(CTL_LOG, L("recv on control client %d failed"), fd);
+            return -1;
+        }
+        c->in_len += n;
+        run_lines(c, cmds, ctx);
+    }
+    return ctl_flush(fd, c);
+}
+
+int ctl_flush(int fd, ctl_client_t *c) {
+    while (c->out.off < c->out.len) {
+        ssize_t n = send(fd, c->out.buff + c->out.off, c->out.len - c->out.off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        c->out.off += n;
+    }
+    if (c->out.off == c->out.len) {
+        c->out.off = c->out.len = 0;
+        return c->eof ? -1 : 0; /* replies to everything it sent before closing its end are out */
+    }
+    if (c->out.len - c->out.off > CTL_MAX_PENDING_OUT) {
+        log_warn(CTL_LOG, L("control client %d isn't reading replies, dropping it"), fd);
+        return -1;
+    }
+    return 0;
+}
+
+void ctl_client_destroy(ctl_client_t *c) {
+    free(c->out.buff);
+    memset(&c->out, 0, sizeof(c->out));
+}
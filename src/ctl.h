@@ -0,0 +1,68 @@
+#ifndef _CTL_H
+#define _CTL_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <sys/types.h>
+
+/* runtime control over a UNIX-domain stream socket, served from the io-loop. A request is one line,
+   a command followed by whitespace separated args. The reply is whatever the command prints followed
+   by a line with "ok" or "error: <reason>", so a client can pipeline requests. */
+
+#define CTL_MAX_LINE 1024
+#define CTL_MAX_ARGS 16
+#define CTL_MAX_PENDING_OUT (4 * 1024 * 1024) /* a client not reading its replies is dropped beyond this */
+
+struct ctl_out_s {
+    char *buff;
+    size_t len, off, cap;
+};
+
+typedef struct ctl_out_s ctl_out_t;
+
+/* argv[0] is the command. Returns 0 on success, -1 after describing the failure with ctl_error */
+typedef int (ctl_cmd_fn_t)(void *ctx, int argc, char **argv, ctl_out_t *out);
+
+struct ctl_cmd_s {
+    const char *name;
+    int min_args, max_args; /* excluding the command */
+    ctl_cmd_fn_t *fn;
+    const char *usage;
+};
+
+typedef struct ctl_cmd_s ctl_cmd_t;
+
+struct ctl_client_s {
+    char in[CTL_MAX_LINE];
+    size_t in_len;
+    int discarding; /* rest of an overlong line */
+    int eof; /* client closed its end, dropped once replies are out */
+    ctl_out_t out;
+};
+
+typedef struct ctl_client_s ctl_client_t;
+
+/* bound and listening, a stale socket file at path is replaced. Returns fd, -1 on failure */
+int ctl_listen(const char *path);
+
+/* runs cmds (terminated by an entry with NULL name) on every complete line received on fd, then sends
+   the replies. Returns -1 when the client is gone (or misbehaves) and should be dropped */
+int ctl_serve(int fd, ctl_client_t *c, const ctl_cmd_t *cmds, void *ctx);
+
+/* sends reply bytes held back because the socket was full. -1 => drop the client (error, or it has
+   closed its end and got all replies) */
+int ctl_flush(int fd, ctl_client_t *c);
+
+/* runs a single request line (modified in place), the reply goes to out */
+void ctl_run_line(char *line, const ctl_cmd_t *cmds, void *ctx, ctl_out_t *out);
+
+void ctl_client_destroy(ctl_client_t *c);
+
+void ctl_printf(ctl_out_t *out, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+/* always returns -1, for "return ctl_error(...)" */
+int ctl_error(ctl_out_t *out, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+#endif
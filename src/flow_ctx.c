@@ -0,0 +1,283 @@
+#include "flow_ctx.h"
+#include "flow_group.h"
+#include "log.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FC_LOG "flow_ctx"
+
+int flow_ctx_init(flow_ctx_tab_t *fc, compress_t *shared, int max, int compression_level) {
+    assert(max >= 0 && max <= FLOW_CTX_MAX);
+    memset(fc, 0, sizeof(*fc));
+    fc->max = max;
+    fc->compression_level = compression_level;
+    fc->shared = shared;
+    fc->ctx[0].comp = shared;
+    fc->tx_open = -1;
+    fc->rx_buff_sz = FLOW_CTX_MAX_PAYLOAD + FLOW_CTX_HDR_SZ;
+    if ((fc->rx_buff = malloc(fc->rx_buff_sz)) == NULL) {
+        log_crit(FC_LOG, L("couldn't allocate rx buffer"));
+        return -1;
+    }
+    return 0;
+}
+
+void flow_ctx_destroy(flow_ctx_tab_t *fc) {
+    for (int i = 1; i <= fc->max; i++) {
+        if (fc->ctx[i].comp == NULL) continue;
+        destroy_compression_ctx(fc->ctx[i].comp);
+        free(fc->ctx[i].comp);
+    }
+    free(fc->rx_buff);
+}
+
+static compress_t *ctx_comp(flow_ctx_tab_t *fc, int id) {
+    flow_ctx_t *c = &fc->ctx[id];
+    if (c->comp != NULL) return c->comp;
+    if ((c->comp = calloc(1, sizeof(compress_t))) == NULL) { /* zlib wants its alloc hooks zeroed */
+        log_crit(FC_LOG, L("couldn't allocate compression ctx %d"), id);
+        return NULL;
+    }
+    if (init_compression_ctx(c->comp, fc->compression_level) != 0) {
+        free(c->comp);
+        c->comp = NULL;
+        return NULL;
+    }
+    return c->comp;
+}
+
+/* a ctx for a newly promoted flow, a free one or the least recently used (but never the open one, it
+   holds unflushed input). 0 => none available */
+static int claim_ctx(flow_ctx_tab_t *fc) {
+    int victim = 0;
+    for (int i = 1; i <= fc->max; i++) {
+        if (! fc->ctx[i].tx_live) return i;
+        if (i == fc->tx_open) continue;
+        if (victim == 0 || fc->ctx[i].last_used < fc->ctx[victim].last_used) victim = i;
+    }
+    if (victim != 0) {
+        flow_ctx_t *c = &fc->ctx[victim];
+        flow_heat_t *h = &fc->heat[c->heat_slot];
+        assert(h->id == victim);
+        h->id = 0;
+        h->bytes = 0; /* has to earn it again, or flows just past the LRU keep evicting each other */
+        c->tx_live = 0;
+        fc->tx_live--;
+        fc->stats.evicted++;
+        DBG(FC_LOG, L("evicted flow %" PRIx64 " from ctx %d"), c->key, victim);
+    }
+    return victim;
+}
+
+int flow_ctx_pick(flow_ctx_tab_t *fc, const uint8_t *pkt, size_t len) {
+    fc->tick++;
+    if (fc->max == 0) return 0;
+    uint64_t key = flow_group_key(pkt, len);
+    int slot = key % FLOW_CTX_HEAT_SLOTS;
+    flow_heat_t *h = &fc->heat[slot];
+    if (h->key != key) {
+        if (h->id != 0) return 0; /* slot's flow has a ctx, colliding flows stay shared till it is evicted */
+        h->bytes -= len;
+        if (h->bytes > 0) return 0;
+        h->key = key;
+        h->bytes = 0;
+    }
+    if (h->id != 0) {
+        fc->ctx[h->id].last_used = fc->tick;
+        return h->id;
+    }
+    h->bytes += len;
+    if (h->bytes < FLOW_CTX_PROMOTE_BYTES) return 0;
+
+    int id = claim_ctx(fc);
+    if (id == 0) return 0;
+    if (ctx_comp(fc, id) == NULL) return 0;
+    flow_ctx_t *c = &fc->ctx[id];
+    reset_compress_stream(c->comp);
+    c->key = key;
+    c->heat_slot = slot;
+    c->last_used = fc->tick;
+    c->tx_live = 1;
+    c->tx_reset_pending = 1; /* receiver's decompressor for id may have another flow's history */
+    h->id = id;
+    fc->tx_live++;
+    fc->stats.promoted++;
+    DBG(FC_LOG, L("promoted flow %" PRIx64 " to ctx %d"), key, id);
+    return id;
+}
+
+static inline ssize_t frames_bound(ssize_t payload) {
+    return payload + FLOW_CTX_HDR_SZ * (payload / FLOW_CTX_MAX_PAYLOAD + 2);
+}
+
+ssize_t flow_ctx_encode_bound(flow_ctx_tab_t *fc, int id, ssize_t len) {
+    compress_t *comp = ctx_comp(fc, id);
+    if (comp == NULL) return -1;
+    ssize_t bound = frames_bound(worst_case_compressed_out_sz(comp, len));
+    if (fc->tx_open >= 0 && fc->tx_open != id) {
+        bound += frames_bound(worst_case_compressed_out_sz(fc->ctx[fc->tx_open].comp, 0));
+    }
+    return bound;
+}
+
+ssize_t flow_ctx_relay_bound(flow_ctx_tab_t *fc, compress_t *comp, ssize_t len) {
+    ssize_t payload = worst_case_compressed_out_sz(comp, len);
+    ssize_t bound = payload + FLOW_CTX_RELAY_HDR_SZ * (payload / FLOW_CTX_RELAY_MAX_PAYLOAD + 2);
+    if (fc->tx_open >= 0) bound += frames_bound(worst_case_compressed_out_sz(fc->ctx[fc->tx_open].comp, 0));
+    return bound;
+}
+
+compress_t *flow_ctx_open_comp(flow_ctx_tab_t *fc) {
+    return (fc->tx_open >= 0) ? fc->ctx[fc->tx_open].comp : NULL;
+}
+
+/* runs ctx id's compressor over input already set up (if any) */
+static ssize_t emit_frames(flow_ctx_tab_t *fc, int id, int defer, uint8_t *out, ssize_t capacity) {
+    flow_ctx_t *c = &fc->ctx[id];
+    ssize_t off = 0;
+    ssize_t consumed;
+    int complete;
+    c->comp->defer_flush = defer;
+    for (;;) {
+        ssize_t chunk = capacity - off - FLOW_CTX_HDR_SZ;
+        if (chunk > FLOW_CTX_MAX_PAYLOAD) chunk = FLOW_CTX_MAX_PAYLOAD;
+        assert(chunk > 0);
+        ssize_t w = do_compress(c->comp, out + off + FLOW_CTX_HDR_SZ, chunk, &consumed, &complete);
+        if (w > 0) {
+            uint8_t *hdr = out + off;
+            hdr[0] = id;
+            hdr[1] = c->tx_reset_pending ? FLOW_CTX_RESET : 0;
+            hdr[2] = w >> 8;
+            hdr[3] = w & 0xFF;
+            c->tx_reset_pending = 0;
+            off += FLOW_CTX_HDR_SZ + w;
+        }
+        if (complete && w < chunk) break;
+    }
+    flow_ctx_ratio_t *r = (id == 0) ? &fc->stats.shared : &fc->stats.dedicated;
+    r->out += off;
+    return off;
+}
+
+ssize_t flow_ctx_encode(flow_ctx_tab_t *fc, int id, const void *pkt, ssize_t len, int defer, void *out, ssize_t capacity) {
+    ssize_t written = 0;
+    if (fc->tx_open >= 0 && (pkt == NULL || fc->tx_open != id)) { /* receiver must get all of it before another ctx's output */
+        written = emit_frames(fc, fc->tx_open, 0, out, capacity);
+        fc->tx_open = -1;
+    }
+    if (pkt == NULL) return written;
+
+    compress_t *comp = ctx_comp(fc, id);
+    if (comp == NULL) return -1;
+    setup_compress_input(comp, (void *) pkt, len);
+    written += emit_frames(fc, id, defer, out + written, capacity - written);
+    fc->tx_open = defer ? id : -1;
+    flow_ctx_ratio_t *r = (id == 0) ? &fc->stats.shared : &fc->stats.dedicated;
+    r->in += len;
+    return written;
+}
+
+ssize_t flow_ctx_encode_relay(flow_ctx_tab_t *fc, compress_t *comp, const uint8_t *dest, int reset, const void *pkt, ssize_t len, void *out_, ssize_t capacity) {
+    uint8_t *out = (uint8_t *) out_, *last = NULL;
+    ssize_t off = 0, consumed;
+    int complete;
+    if (fc->tx_open >= 0) {
+        off = emit_frames(fc, fc->tx_open, 0, out, capacity);
+        fc->tx_open = -1;
+    }
+    setup_compress_input(comp, (void *) pkt, len);
+    comp->defer_flush = 0;
+    for (;;) {
+        ssize_t chunk = capacity - off - FLOW_CTX_RELAY_HDR_SZ;
+        if (chunk > FLOW_CTX_RELAY_MAX_PAYLOAD) chunk = FLOW_CTX_RELAY_MAX_PAYLOAD;
+        assert(chunk > 0);
+        ssize_t w = do_compress(comp, out + off + FLOW_CTX_RELAY_HDR_SZ, chunk, &consumed, &complete);
+        if (w > 0) {
+            last = out + off;
+            flow_ctx_relay_hdr(last, FLOW_CTX_RELAY_TO | FLOW_CTX_MORE | (reset ? FLOW_CTX_RESET : 0), dest, w);
+            reset = 0;
+            off += FLOW_CTX_RELAY_HDR_SZ + w;
+        }
+        if (complete && w < chunk) break;
+    }
+    if (last != NULL) last[1] &= ~FLOW_CTX_MORE;
+    return off;
+}
+
+/* header of the next frame is in, returns -1 if it is bad */
+static int start_frame(flow_ctx_tab_t *fc) {
+    uint8_t *hdr = fc->rx_hdr;
+    int flags = hdr[1];
+    fc->rx_comp = NULL;
+    fc->rx_fwd = 0;
+    fc->rx_left = (hdr[2] << 8) | hdr[3];
+    if (flags & (FLOW_CTX_RELAY_TO | FLOW_CTX_RELAY_FROM)) {
+        const uint8_t *addr = hdr + FLOW_CTX_HDR_SZ;
+        if (fc->relay == NULL || hdr[0] != 0 || fc->rx_left < FLOW_CTX_RELAY_ADDR_SZ) {
+            log_crit(FC_LOG, L("unexpected relay frame (flags: %#x)"), flags);
+            return -1;
+        }
+        fc->rx_left -= FLOW_CTX_RELAY_ADDR_SZ;
+        if (flags & FLOW_CTX_RELAY_TO) {
+            fc->rx_fwd = 1;
+            if (fc->rx_left == 0 && fc->relay->forward(fc->relay->ctx, hdr, NULL, 0) != 0) return -1;
+        } else if (flags & FLOW_CTX_RELAY_LOST) {
+            fc->relay->lost(fc->relay->ctx, addr);
+        } else if ((fc->rx_comp = fc->relay->rx_comp(fc->relay->ctx, addr)) != NULL) {
+            if (flags & FLOW_CTX_RESET) reset_decompress_stream(fc->rx_comp);
+        }
+        return 0;
+    }
+    int id = hdr[0];
+    if (id > fc->max) {
+        log_crit(FC_LOG, L("frame for ctx %d, only %d configured (peers must agree on flow contexts)"), id, fc->max);
+        return -1;
+    }
+    if ((fc->rx_comp = ctx_comp(fc, id)) == NULL) return -1;
+    if (flags & FLOW_CTX_RESET) reset_decompress_stream(fc->rx_comp);
+    return 0;
+}
+
+static inline int rx_hdr_sz(flow_ctx_tab_t *fc) {
+    if (fc->rx_hdr_len < 2 || ! (fc->rx_hdr[1] & (FLOW_CTX_RELAY_TO | FLOW_CTX_RELAY_FROM))) return FLOW_CTX_HDR_SZ;
+    return FLOW_CTX_RELAY_HDR_SZ;
+}
+
+ssize_t flow_ctx_decode(flow_ctx_tab_t *fc, void *out, ssize_t capacity) {
+    ssize_t written = 0;
+    for (;;) {
+        compress_t *comp = fc->rx_comp;
+        if (comp != NULL && (comp->inflatable_bytes > 0 || fc->rx_owed)) {
+            ssize_t room = capacity - written;
+            if (room == 0) return written;
+            ssize_t w = do_decompress(comp, out + written, room);
+            written += w;
+            fc->rx_owed = (w == room); /* can't tell if it is done, it gets called again before the next frame is looked at */
+            if (fc->rx_owed) return written;
+        }
+        if (fc->rx_left > 0 && fc->rx_off < fc->rx_len) {
+            ssize_t n = fc->rx_len - fc->rx_off;
+            if (n > fc->rx_left) n = fc->rx_left;
+            if (comp != NULL) {
+                setup_decompress_input(comp, fc->rx_buff + fc->rx_off, n); /* in place, rx_buff isn't refilled till it is used up */
+            } else if (fc->rx_fwd && fc->relay->forward(fc->relay->ctx, fc->rx_hdr, fc->rx_buff + fc->rx_off, n) != 0) {
+                return -1;
+            }
+            fc->rx_off += n;
+            fc->rx_left -= n;
+            continue;
+        }
+        if (fc->rx_off == fc->rx_len) return written;
+        assert(fc->rx_left == 0);
+
+        while (fc->rx_hdr_len < rx_hdr_sz(fc) && fc->rx_off < fc->rx_len) {
+            fc->rx_hdr[fc->rx_hdr_len++] = fc->rx_buff[fc->rx_off++];
+        }
+        if (fc->rx_hdr_len < rx_hdr_sz(fc)) return written;
+        fc->rx_hdr_len = 0;
+        if (start_frame(fc) != 0) return -1;
+    }
+}
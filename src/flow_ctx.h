@@ -0,0 +1,171 @@
+#ifndef _FLOW_CTX_H
+#define _FLOW_CTX_H
+
+#include "compress.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* per-flow compression contexts of a connection (opt-in, both peers must have it on). Heavy flows get
+   a compressor of their own so unrelated flows don't evict each other's history, everything else
+   shares the connection's compressor (context 0).
+
+   With flow contexts on, the stream is a sequence of frames instead of one compressed stream:
+
+       | ctx-id (1) | flags (1) | payload-len (2, big-endian) | payload |
+
+   payload is the next piece of ctx-id's compressed stream. A context is sync-flushed before another
+   context's frame goes out, so decompressed output of frames can be appended to one pkt stream.
+   FLOW_CTX_RESET on a frame asks the receiver to reset ctx-id's decompressor first (the sender gave
+   the id to a different flow).
+
+   Relay frames carry a stream between two peers that goes through a third one (the hub), ctx-id is 0
+   and a peer address follows the header (counted in payload-len):
+
+       | 0 (1) | flags (1) | payload-len (2) | peer-addr (16) | payload |
+
+   FLOW_CTX_RELAY_TO frames go to the hub, peer-addr is where the stream is headed. The hub passes them
+   on untouched (but for the header) as FLOW_CTX_RELAY_FROM frames, peer-addr being where they came
+   from. payload is the next piece of the stream between the two, compressed by the sending end with a
+   compressor of its own for the other end and sync-flushed after every pkt. The frames of one pkt
+   (all but the last carry FLOW_CTX_MORE) are passed on back to back. A FLOW_CTX_RELAY_LOST frame
+   (no payload) from the hub says frames to peer-addr were dropped, the stream has to start over (with
+   FLOW_CTX_RESET on its next frame). */
+
+#define FLOW_CTX_MAX 255
+#define FLOW_CTX_HDR_SZ 4
+#define FLOW_CTX_MAX_PAYLOAD 0xFFFF
+#define FLOW_CTX_RESET 0x1
+#define FLOW_CTX_RELAY_TO 0x2
+#define FLOW_CTX_RELAY_FROM 0x4
+#define FLOW_CTX_MORE 0x8
+#define FLOW_CTX_RELAY_LOST 0x10
+#define FLOW_CTX_RELAY_ADDR_SZ 16
+#define FLOW_CTX_RELAY_HDR_SZ (FLOW_CTX_HDR_SZ + FLOW_CTX_RELAY_ADDR_SZ)
+#define FLOW_CTX_RELAY_MAX_PAYLOAD (FLOW_CTX_MAX_PAYLOAD - FLOW_CTX_RELAY_ADDR_SZ)
+
+#define FLOW_CTX_HEAT_SLOTS 1024 /* flows tracked for promotion, direct-mapped by flow-key */
+#define FLOW_CTX_PROMOTE_BYTES (64 * 1024) /* a flow this far ahead of flows colliding with it gets its own ctx */
+
+struct flow_heat_s {
+    uint64_t key;
+    int64_t bytes;
+    uint8_t id; /* ctx owned by the flow (0 => none) */
+};
+
+typedef struct flow_heat_s flow_heat_t;
+
+struct flow_ctx_s {
+    compress_t *comp; /* allocated on first use by either side */
+    uint64_t key; /* flow using the ctx for tx */
+    uint64_t last_used;
+    uint16_t heat_slot;
+    int tx_live;
+    int tx_reset_pending; /* next frame must carry FLOW_CTX_RESET */
+};
+
+typedef struct flow_ctx_s flow_ctx_t;
+
+/* uncompressed pkt bytes in => frame bytes out (headers included) */
+struct flow_ctx_ratio_s {
+    uint64_t in, out;
+};
+
+typedef struct flow_ctx_ratio_s flow_ctx_ratio_t;
+
+struct flow_ctx_stats_s {
+    flow_ctx_ratio_t shared, dedicated;
+    uint32_t promoted, evicted;
+};
+
+typedef struct flow_ctx_stats_s flow_ctx_stats_t;
+
+/* what the owner of a table does with relay frames it receives */
+struct flow_ctx_relay_s {
+    void *ctx;
+    /* decompressor for the stream from src, NULL => the frame is skipped */
+    compress_t *(*rx_comp)(void *ctx, const uint8_t *src);
+    /* next piece of a FLOW_CTX_RELAY_TO frame (hdr is its header, addr included), a frame without
+       payload is passed with len 0. -1 => the conn is bad */
+    int (*forward)(void *ctx, const uint8_t *hdr, const uint8_t *piece, ssize_t len);
+    /* hub dropped frames of the stream to dest */
+    void (*lost)(void *ctx, const uint8_t *dest);
+};
+
+typedef struct flow_ctx_relay_s flow_ctx_relay_t;
+
+struct flow_ctx_tab_s {
+    int max, compression_level;
+    compress_t *shared;
+    flow_ctx_t ctx[FLOW_CTX_MAX + 1]; /* [0] is the shared one */
+    int tx_open; /* ctx with data not yet sync-flushed (-1 => none) */
+    int tx_live;
+    uint64_t tick;
+    flow_heat_t heat[FLOW_CTX_HEAT_SLOTS];
+    flow_ctx_stats_t stats; /* reset by whoever reports them */
+
+    uint8_t *rx_buff; /* raw frames from the peer */
+    ssize_t rx_buff_sz, rx_len, rx_off;
+    uint8_t rx_hdr[FLOW_CTX_RELAY_HDR_SZ];
+    int rx_hdr_len;
+    compress_t *rx_comp; /* decompressor of the current frame, NULL => its payload is skipped (or forwarded) */
+    int rx_fwd; /* current frame goes to relay->forward */
+    ssize_t rx_left; /* payload of the current frame still in rx_buff / yet to arrive */
+    int rx_owed; /* rx_comp's last decompress filled the output, it may hold more */
+    const flow_ctx_relay_t *relay; /* NULL => relay frames are refused */
+};
+
+typedef struct flow_ctx_tab_s flow_ctx_tab_t;
+
+/* shared is the connection's own compressor (used as ctx 0), max is the number of dedicated ctxs */
+int flow_ctx_init(flow_ctx_tab_t *fc, compress_t *shared, int max, int compression_level);
+
+void flow_ctx_destroy(flow_ctx_tab_t *fc);
+
+/* ctx the pkt should be compressed with, promotes the pkt's flow (evicting the least recently used
+   flow when all ctxs are taken) once it is heavy enough */
+int flow_ctx_pick(flow_ctx_tab_t *fc, const uint8_t *pkt, size_t len);
+
+/* most encode may write for len bytes of input to ctx id (includes flushing another open ctx) */
+ssize_t flow_ctx_encode_bound(flow_ctx_tab_t *fc, int id, ssize_t len);
+
+/* compresses pkt with ctx id (pkt NULL => sync-flush whatever ctx is open), writes frames to out
+   (capacity must be at least flow_ctx_encode_bound). With defer set the ctx is left open (unflushed).
+   Returns bytes written, -1 if the ctx couldn't be allocated */
+ssize_t flow_ctx_encode(flow_ctx_tab_t *fc, int id, const void *pkt, ssize_t len, int defer, void *out, ssize_t capacity);
+
+/* most encode_relay may write for len bytes of pkt (includes flushing an open ctx) */
+ssize_t flow_ctx_relay_bound(flow_ctx_tab_t *fc, compress_t *comp, ssize_t len);
+
+/* compresses pkt with comp (the stream to dest) into FLOW_CTX_RELAY_TO frames, an open ctx is flushed
+   first. With reset set the first frame carries FLOW_CTX_RESET. Returns bytes written */
+ssize_t flow_ctx_encode_relay(flow_ctx_tab_t *fc, compress_t *comp, const uint8_t *dest, int reset, const void *pkt, ssize_t len, void *out, ssize_t capacity);
+
+static inline void flow_ctx_relay_hdr(uint8_t *hdr, int flags, const uint8_t *addr, ssize_t len) {
+    len += FLOW_CTX_RELAY_ADDR_SZ;
+    hdr[0] = 0;
+    hdr[1] = flags;
+    hdr[2] = len >> 8;
+    hdr[3] = len & 0xFF;
+    memcpy(hdr + FLOW_CTX_HDR_SZ, addr, FLOW_CTX_RELAY_ADDR_SZ);
+}
+
+/* payload (after the address) of a relay frame */
+static inline ssize_t flow_ctx_relay_len(const uint8_t *hdr) {
+    return ((hdr[2] << 8) | hdr[3]) - FLOW_CTX_RELAY_ADDR_SZ;
+}
+
+/* compressor with unflushed input (NULL when nothing is held back) */
+compress_t *flow_ctx_open_comp(flow_ctx_tab_t *fc);
+
+/* decompresses frames sitting in rx_buff (rx_off .. rx_len) into out. Returns bytes written, stops
+   once out is full or rx_buff is used up. -1 => bad frame (ctx-id beyond our max, allocation failure) */
+ssize_t flow_ctx_decode(flow_ctx_tab_t *fc, void *out, ssize_t capacity);
+
+/* rx_buff can be refilled (the decompressor reads frame payload from it in place) */
+static inline int flow_ctx_rx_empty(flow_ctx_tab_t *fc) {
+    return fc->rx_off == fc->rx_len && (fc->rx_comp == NULL || fc->rx_comp->inflatable_bytes == 0);
+}
+
+#endif
@@ -0,0 +1,53 @@
+#include "flow_group.h"
+
+#include <string.h>
+#include <netinet/in.h>
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static inline uint64_t fnv1a(uint64_t h, const uint8_t *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static inline int has_ports(uint8_t proto) {
+    return proto == IPPROTO_TCP || proto == IPPROTO_UDP || proto == IPPROTO_SCTP || proto == IPPROTO_DCCP;
+}
+
+uint64_t flow_group_key(const uint8_t *pkt, size_t len) {
+    uint64_t h = FNV_OFFSET;
+    if (len >= 20 && (pkt[0] & 0xF0) == 0x40) {
+        size_t hl = (pkt[0] & 0x0F) * 4;
+        uint8_t proto = pkt[9];
+        h = fnv1a(h, &proto, 1);
+        h = fnv1a(h, pkt + 12, 8);
+        int first_frag = ((((uint16_t) pkt[6] << 8) | pkt[7]) & 0x1FFF) == 0;
+        if (first_frag && has_ports(proto) && hl >= 20 && len >= hl + 4) h = fnv1a(h, pkt + hl, 4);
+    } else if (len >= 40 && (pkt[0] & 0xF0) == 0x60) {
+        uint8_t proto = pkt[6];
+        h = fnv1a(h, &proto, 1);
+        h = fnv1a(h, pkt + 8, 32);
+        if (has_ports(proto) && len >= 44) h = fnv1a(h, pkt + 40, 4);
+    } else {
+        h = fnv1a(h, pkt, len > 20 ? 20 : len); /* not IP, whatever is there */
+    }
+    return h;
+}
+
+void flow_group_order(const uint64_t *keys, int n, uint8_t *order) {
+    uint8_t grp[FLOW_GROUP_MAX_PKTS];
+    uint16_t pos[FLOW_GROUP_MAX_PKTS + 1];
+    memset(pos, 0, sizeof(pos));
+    for (int i = 0; i < n; i++) { /* batches are small, quadratic scan beats hashing here */
+        int j = 0;
+        while (keys[j] != keys[i]) j++;
+        grp[i] = j; /* index of the group's first pkt */
+        pos[j + 1]++;
+    }
+    for (int g = 0; g < n; g++) pos[g + 1] += pos[g];
+    for (int i = 0; i < n; i++) order[pos[grp[i]]++] = i;
+}
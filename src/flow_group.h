@@ -0,0 +1,21 @@
+#ifndef _FLOW_GROUP_H
+#define _FLOW_GROUP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* reordering of a batch of pkts so pkts of one flow are compressed back to back (similar headers and
+   payloads end up close together in the compressor's window). Order within a flow is kept, so the
+   receiving end doesn't need to restore anything, IP doesn't promise ordering across flows anyway. */
+
+#define FLOW_GROUP_MAX_PKTS 256
+
+/* hash of addresses, protocol and (for TCP / UDP / SCTP / DCCP) ports. IPv4 non-first fragments and
+   IPv6 pkts with extension headers are keyed on addresses + protocol (next-header) alone */
+uint64_t flow_group_key(const uint8_t *pkt, size_t len);
+
+/* fills order[0..n) with indices of pkts such that pkts with equal keys are adjacent and keep their
+   relative order, groups are ordered by their first pkt. n must not exceed FLOW_GROUP_MAX_PKTS */
+void flow_group_order(const uint64_t *keys, int n, uint8_t *order);
+
+#endif
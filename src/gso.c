@@ -0,0 +1,122 @@
+#include "gso.h"
+#include "common.h"
+
+#include <string.h>
+#include <netinet/in.h>
+
+#define TCP_FIN 0x01
+#define TCP_PSH 0x08
+#define TCP_CWR 0x80
+
+/* ip_hl: bytes before the L4 header, l4_len: L4 header + payload (as per the IP header, trailing bytes are ignored) */
+static int parse_l3(const uint8_t *pkt, size_t len, size_t *ip_hl, uint8_t *proto, size_t *l4_len) {
+    if (len < 20) return -1;
+    if ((pkt[0] & 0xF0) == 0x40) {
+        size_t hl = (pkt[0] & 0x0F) * 4, tot = rd16(pkt + 2);
+        if (hl < 20 || tot < hl || tot > len) return -1;
+        if (rd16(pkt + 6) & 0x3FFF) return -1; /* fragment (MF or offset set), L4 header isn't whole */
+        *ip_hl = hl;
+        *proto = pkt[9];
+        *l4_len = tot - hl;
+        return 0;
+    }
+    if ((pkt[0] & 0xF0) == 0x60) {
+        if (len < 40) return -1;
+        size_t plen = rd16(pkt + 4);
+        if (plen == 0 || 40 + plen > len) return -1; /* jumbogram or truncated */
+        *ip_hl = 40;
+        *proto = pkt[6];
+        *l4_len = plen;
+        return 0;
+    }
+    return -1;
+}
+
+static uint32_t pseudo_hdr_sum(const uint8_t *pkt, uint8_t proto, size_t l4_len) {
+    uint32_t sum = proto;
+    if ((pkt[0] & 0xF0) == 0x40) {
+        sum = csum_add(sum, pkt + 12, 8);
+        sum += l4_len;
+    } else {
+        sum = csum_add(sum, pkt + 8, 32);
+        sum += (l4_len >> 16) + (l4_len & 0xFFFF);
+    }
+    return sum;
+}
+
+static void fill_ipv4_hdr_csum(uint8_t *pkt, size_t ip_hl) {
+    wr16(pkt + 10, 0);
+    wr16(pkt + 10, csum_fold(csum_add(0, pkt, ip_hl)));
+}
+
+int gso_fill_l4_csum(uint8_t *pkt, size_t len) {
+    size_t ip_hl, l4_len, csum_off;
+    uint8_t proto;
+    if (parse_l3(pkt, len, &ip_hl, &proto, &l4_len) != 0) return -1;
+    if (proto == IPPROTO_TCP) {
+        if (l4_len < 20) return -1;
+        csum_off = 16;
+    } else if (proto == IPPROTO_UDP) {
+        if (l4_len < 8) return -1;
+        csum_off = 6;
+    } else {
+        return -1;
+    }
+    uint8_t *l4 = pkt + ip_hl;
+    wr16(l4 + csum_off, 0);
+    uint16_t csum = csum_fold(csum_add(pseudo_hdr_sum(pkt, proto, l4_len), l4, l4_len));
+    if (csum == 0 && proto == IPPROTO_UDP) csum = 0xFFFF; /* 0 means no checksum for UDP */
+    wr16(l4 + csum_off, csum);
+    return 0;
+}
+
+int gso_segment_tcp(const uint8_t *pkt, size_t len, size_t mtu, uint8_t *seg_buff, gso_seg_hdlr_t *hdlr, void *hdlr_ctx) {
+    size_t ip_hl, l4_len;
+    uint8_t proto;
+    if (parse_l3(pkt, len, &ip_hl, &proto, &l4_len) != 0 || proto != IPPROTO_TCP || l4_len < 20) return -1;
+    size_t tcp_hl = (pkt[ip_hl + 12] >> 4) * 4;
+    if (tcp_hl < 20 || tcp_hl > l4_len) return -1;
+    size_t hdr_len = ip_hl + tcp_hl;
+    if (hdr_len >= mtu) return -1;
+    size_t mss = mtu - hdr_len, payload_len = l4_len - tcp_hl;
+    int v4 = (pkt[0] & 0xF0) == 0x40;
+    uint32_t seq = rd32(pkt + ip_hl + 4);
+    uint16_t ip_id = v4 ? rd16(pkt + 4) : 0;
+    uint8_t flags = pkt[ip_hl + 13];
+    int failed = 0;
+    size_t off = 0;
+    int i = 0;
+    do {
+        size_t n = (payload_len - off > mss) ? mss : (payload_len - off);
+        int last = (off + n == payload_len);
+        size_t seg_len = hdr_len + n;
+        memcpy(seg_buff, pkt, hdr_len);
+        memcpy(seg_buff + hdr_len, pkt + hdr_len + off, n);
+        if (v4) {
+            wr16(seg_buff + 2, seg_len);
+            wr16(seg_buff + 4, ip_id + i);
+            fill_ipv4_hdr_csum(seg_buff, ip_hl);
+        } else {
+            wr16(seg_buff + 4, seg_len - 40);
+        }
+        uint8_t *tcp = seg_buff + ip_hl;
+        wr32(tcp + 4, seq + off);
+        tcp[13] = flags;
+        if (! last) tcp[13] &= ~(TCP_FIN | TCP_PSH);
+        if (i > 0) tcp[13] &= ~TCP_CWR;
+        gso_fill_l4_csum(seg_buff, seg_len);
+        if (hdlr(seg_buff, seg_len, hdlr_ctx) != 0) failed++;
+        off += n;
+        i++;
+    } while (off < payload_len);
+    return failed;
+}
+
+int gso_deliver(uint8_t *pkt, size_t len, size_t mtu, int csum_partial, uint8_t *seg_buff, gso_seg_hdlr_t *hdlr, void *hdlr_ctx) {
+    if (mtu > 0 && len > mtu) {
+        int failed = gso_segment_tcp(pkt, len, mtu, seg_buff, hdlr, hdlr_ctx); /* fills checksums of segments anyway */
+        return (failed == 0) ? 0 : -1;
+    }
+    if (csum_partial && gso_fill_l4_csum(pkt, len) != 0) return -1;
+    return hdlr(pkt, len, hdlr_ctx);
+}
@@ -0,0 +1,32 @@
+#ifndef _GSO_H
+#define _GSO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* helpers for pkts handed over by the kernel before it finished them: with GSO a TCP pkt may be a
+   super-pkt (upto 64k, segmented only at the NIC) and with checksum-offload its L4 checksum may be
+   a partial (pseudo-header only) sum. Pkts that are to be compressed and shipped to a peer need both
+   done in software. */
+
+/* computes and writes the TCP/UDP checksum of an IPv4 or IPv6 pkt (IPv6 extension headers are
+   not walked), returns -1 if the pkt is not TCP/UDP or is malformed */
+int gso_fill_l4_csum(uint8_t *pkt, size_t len);
+
+/* called for every segment, seg is only valid for the duration of the call, non-zero return
+   counts as a failed segment */
+typedef int (gso_seg_hdlr_t)(void *seg, size_t len, void *hdlr_ctx);
+
+/* splits a TCP super-pkt into pkts of atmost mtu bytes (with IP/TCP headers replicated, seq, IPv4 id,
+   lengths and checksums fixed, FIN/PSH kept on the last and CWR on the first segment only).
+   seg_buff must hold atleast mtu bytes.
+   Returns the number of segments hdlr failed on (0 => all went through), or -1 if pkt can't be
+   segmented (not TCP, IPv4 fragment, IPv6 extension headers, headers don't fit mtu) */
+int gso_segment_tcp(const uint8_t *pkt, size_t len, size_t mtu, uint8_t *seg_buff, gso_seg_hdlr_t *hdlr, void *hdlr_ctx);
+
+/* hands pkt to hdlr as pkts of atmost mtu bytes (super-pkts segmented, mtu 0 => never), completing the
+   L4 checksum first if csum_partial. Returns 0 if hdlr took all of it, -1 if it couldn't be segmented
+   or hdlr failed on (some of) it */
+int gso_deliver(uint8_t *pkt, size_t len, size_t mtu, int csum_partial, uint8_t *seg_buff, gso_seg_hdlr_t *hdlr, void *hdlr_ctx);
+
+#endif
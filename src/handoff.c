@@ -0,0 +1,201 @@
+#include "handoff.h"
+#include "log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define HANDOFF_LOG "handoff"
+
+struct handoff_hdr_s {
+    uint32_t typ;
+    uint32_t len; /* whole blob */
+};
+
+typedef struct handoff_hdr_s handoff_hdr_t;
+
+static int handoff_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        log_crit(HANDOFF_LOG, L("upgrade socket path too long: %s"), path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (handoff_addr(path, &addr) != 0) return -1;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) {
+        log_crit(HANDOFF_LOG, L("couldn't create upgrade socket"));
+        return -1;
+    }
+    if (unlink(path) != 0 && errno != ENOENT) {
+        log_warn(HANDOFF_LOG, L("couldn't remove stale upgrade socket %s"), path);
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        log_crit(HANDOFF_LOG, L("couldn't bind upgrade socket to %s"), path);
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, 1) != 0) {
+        log_crit(HANDOFF_LOG, L("couldn't listen on upgrade socket %s"), path);
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (handoff_addr(path, &addr) != 0) return -1;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) {
+        log_crit(HANDOFF_LOG, L("couldn't create upgrade socket"));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        log_crit(HANDOFF_LOG, L("couldn't connect to the running process at %s"), path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_msg(int sock, struct iovec *iov, int iovcnt, int fd) {
+    union {
+        struct cmsghdr align;
+        char buff[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    if (fd >= 0) {
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl.buff;
+        msg.msg_controllen = sizeof(ctl.buff);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    }
+    ssize_t sent;
+    while ((sent = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    if (sent < 0) {
+        log_warn(HANDOFF_LOG, L("couldn't send handoff message"));
+        return -1;
+    }
+    return 0;
+}
+
+int handoff_send(int sock, int typ, int fd, const void *data, size_t len) {
+    assert(len <= HANDOFF_MAX_RECORD);
+    handoff_hdr_t hdr = {typ, len};
+    size_t chunk = (len < HANDOFF_CHUNK) ? len : HANDOFF_CHUNK;
+    struct iovec iov[2] = {{.iov_base = &hdr, .iov_len = sizeof(hdr)}, {.iov_base = (void *) data, .iov_len = chunk}};
+    if (send_msg(sock, iov, 2, fd) != 0) return -1;
+    for (size_t off = chunk; off < len; off += chunk) {
+        chunk = (len - off < HANDOFF_CHUNK) ? (len - off) : HANDOFF_CHUNK;
+        iov[0].iov_base = (uint8_t *) data + off;
+        iov[0].iov_len = chunk;
+        if (send_msg(sock, iov, 1, -1) != 0) return -1;
+    }
+    return 0;
+}
+
+/* one message, fd (if the caller wants it) is -1 unless one came with it */
+static ssize_t recv_msg(int sock, struct iovec *iov, int iovcnt, int *fd) {
+    union {
+        struct cmsghdr align;
+        char buff[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    msg.msg_control = ctl.buff;
+    msg.msg_controllen = sizeof(ctl.buff);
+    ssize_t rcvd;
+    while ((rcvd = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    if (rcvd <= 0) {
+        if (rcvd < 0) log_warn(HANDOFF_LOG, L("couldn't receive handoff message"));
+        return -1;
+    }
+    int got_fd = -1;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof(int))) {
+            memcpy(&got_fd, CMSG_DATA(c), sizeof(int));
+        }
+    }
+    if (fd != NULL) {
+        *fd = got_fd;
+    } else if (got_fd >= 0) {
+        log_warnx(HANDOFF_LOG, L("unexpected fd in handoff message, closing it"));
+        close(got_fd);
+    }
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        log_warnx(HANDOFF_LOG, L("handoff message truncated"));
+        if (fd != NULL && *fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+        return -1;
+    }
+    return rcvd;
+}
+
+ssize_t handoff_recv(int sock, int *typ, int *fd, void **data) {
+    handoff_hdr_t hdr;
+    uint8_t *buff = malloc(HANDOFF_CHUNK);
+    *data = NULL;
+    *fd = -1;
+    if (buff == NULL) {
+        log_crit(HANDOFF_LOG, L("couldn't allocate handoff buffer"));
+        return -1;
+    }
+    struct iovec iov[2] = {{.iov_base = &hdr, .iov_len = sizeof(hdr)}, {.iov_base = buff, .iov_len = HANDOFF_CHUNK}};
+    ssize_t rcvd = recv_msg(sock, iov, 2, fd);
+    if (rcvd < (ssize_t) sizeof(hdr) || hdr.len > HANDOFF_MAX_RECORD || (size_t) (rcvd - sizeof(hdr)) > hdr.len) {
+        if (rcvd >= 0) log_warnx(HANDOFF_LOG, L("malformed handoff record"));
+        goto fail;
+    }
+    if (hdr.len > HANDOFF_CHUNK) {
+        uint8_t *b = realloc(buff, hdr.len);
+        if (b == NULL) {
+            log_crit(HANDOFF_LOG, L("couldn't allocate %u bytes for handoff record"), hdr.len);
+            goto fail;
+        }
+        buff = b;
+    }
+    size_t off = rcvd - sizeof(hdr);
+    while (off < hdr.len) {
+        iov[0].iov_base = buff + off;
+        iov[0].iov_len = hdr.len - off;
+        if ((rcvd = recv_msg(sock, iov, 1, NULL)) < 0) goto fail;
+        off += rcvd;
+    }
+    *typ = hdr.typ;
+    if (hdr.len > 0) {
+        *data = buff;
+    } else {
+        free(buff);
+    }
+    return hdr.len;
+
+ fail:
+    free(buff);
+    if (*fd >= 0) close(*fd);
+    *fd = -1;
+    return -1;
+}
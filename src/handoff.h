@@ -0,0 +1,47 @@
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* hot upgrade: a running l3tc hands its tun, listeners and peer conns (with their compression state)
+   over to a new process on a UNIX seqpacket socket, without the peers or routing noticing (see io.c).
+
+   A record is a type, at most one fd (SCM_RIGHTS) and a blob. The first message carries a header, the
+   fd and the start of the blob, the rest of the blob follows in as many messages as it takes. */
+
+#define HANDOFF_VERSION 5
+#define HANDOFF_CHUNK (64 * 1024)
+#define HANDOFF_MAX_RECORD (256 * 1024 * 1024)
+
+#define HANDOFF_HELLO 1 /* successor -> running process: handoff_hello_t */
+#define HANDOFF_TUN 2
+#define HANDOFF_LSTN 3
+#define HANDOFF_CONN 4 /* blob is io's conn state */
+#define HANDOFF_DONE 5 /* last record, the successor owns everything from here on */
+
+struct handoff_hello_s {
+    uint32_t version;
+    char impl[8]; /* COMPRESSION_IMPL */
+};
+
+typedef struct handoff_hello_s handoff_hello_t;
+
+/* bound and listening, a stale socket file at path is replaced. Returns fd, -1 on failure */
+int handoff_listen(const char *path);
+
+/* connected to the process listening at path, -1 on failure */
+int handoff_connect(const char *path);
+
+/* blocking, fd < 0 => no fd. Returns 0 on success */
+int handoff_send(int sock, int typ, int fd, const void *data, size_t len);
+
+/* blocking, the next record. *data (malloc'd, NULL if the blob is empty) and *fd (-1 if none) belong to
+   the caller. Returns blob length, -1 on failure or when the other side is gone */
+ssize_t handoff_recv(int sock, int *typ, int *fd, void **data);
+
+#endif
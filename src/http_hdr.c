@@ -0,0 +1,358 @@
+#include "http_hdr.h"
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#define OP_END 0x00
+#define OP_LITERAL 0x01
+#define OP_NAME 0x02
+#define OP_LINE 0x03
+#define OP_LINE_SHORT 0x80
+
+#define VARINT_MAX 5
+
+/* part of the wire format, append only */
+static const char *static_tab[] = {
+    "HTTP/1.1 200 OK",
+    "HTTP/1.1 304 Not Modified",
+    "HTTP/1.1 404 Not Found",
+    "HTTP/1.1 301 Moved Permanently",
+    "HTTP/1.1 302 Found",
+    "HTTP/1.0 200 OK",
+    "Host:",
+    "User-Agent:",
+    "Accept: */*",
+    "Accept:",
+    "Accept-Language:",
+    "Accept-Encoding: gzip, deflate",
+    "Accept-Encoding: gzip, deflate, br",
+    "Accept-Encoding:",
+    "Accept-Charset:",
+    "Accept-Ranges: bytes",
+    "Connection: keep-alive",
+    "Connection: close",
+    "Connection:",
+    "Keep-Alive:",
+    "Cookie:",
+    "Set-Cookie:",
+    "Referer:",
+    "Origin:",
+    "Authorization:",
+    "Cache-Control: no-cache",
+    "Cache-Control: max-age=0",
+    "Cache-Control:",
+    "Pragma: no-cache",
+    "If-Modified-Since:",
+    "If-None-Match:",
+    "Upgrade-Insecure-Requests: 1",
+    "Content-Type: text/html",
+    "Content-Type: text/html; charset=utf-8",
+    "Content-Type: text/html; charset=UTF-8",
+    "Content-Type: application/json",
+    "Content-Type:",
+    "Content-Length:",
+    "Content-Encoding: gzip",
+    "Content-Encoding:",
+    "Content-Range:",
+    "Transfer-Encoding: chunked",
+    "Date:",
+    "Server:",
+    "Last-Modified:",
+    "ETag:",
+    "Expires:",
+    "Age:",
+    "Location:",
+    "Vary: Accept-Encoding",
+    "Vary:",
+    "Range:",
+    "X-Forwarded-For:",
+    "X-Requested-With:",
+    "Access-Control-Allow-Origin:",
+};
+
+#define STATIC_ENTRIES ((int) (sizeof(static_tab) / sizeof(static_tab[0])))
+
+static const char *methods[] = {"GET ", "POST ", "PUT ", "HEAD ", "DELETE ", "OPTIONS ", "PATCH ", "CONNECT ", "TRACE ", "HTTP/1."};
+
+void http_hdr_init(http_hdr_tab_t *t) {
+    memset(t, 0, sizeof(*t));
+}
+
+void http_hdr_destroy(http_hdr_tab_t *t) {
+    free(t->lines);
+    t->lines = NULL;
+}
+
+void http_hdr_reset(http_hdr_tab_t *t) {
+    t->count = t->newest = t->n_pending = 0;
+}
+
+int http_hdr_is_encoded(const uint8_t *pkt, size_t len) {
+    if (len >= 20 && (pkt[0] & 0xF0) == 0x40) return pkt[9] == HTTP_HDR_IPPROTO;
+    if (len >= 40 && (pkt[0] & 0xF0) == 0x60) return pkt[6] == HTTP_HDR_IPPROTO;
+    return 0;
+}
+
+/* offset of the TCP payload of a pkt whose IP header says it carries proto and is len long, 0 if it isn't one */
+static size_t payload_off(const uint8_t *pkt, size_t len, uint8_t proto) {
+    size_t l3_len;
+    if (len >= 20 && (pkt[0] & 0xF0) == 0x40) {
+        l3_len = (pkt[0] & 0x0F) * 4;
+        if (l3_len < 20 || pkt[9] != proto || rd16(pkt + 2) != len || (rd16(pkt + 6) & 0x3FFF) != 0) return 0;
+    } else if (len >= 40 && (pkt[0] & 0xF0) == 0x60) {
+        l3_len = 40;
+        if (pkt[6] != proto || rd16(pkt + 4) + 40u != len) return 0;
+    } else {
+        return 0;
+    }
+    if (len < l3_len + 20) return 0;
+    size_t l4_len = (pkt[l3_len + 12] >> 4) * 4;
+    if (l4_len < 20 || len < l3_len + l4_len) return 0;
+    return l3_len + l4_len;
+}
+
+/* protocol and length fields of a pkt copied with a payload of another size */
+static void set_proto_and_len(uint8_t *pkt, uint8_t proto, size_t len) {
+    if ((pkt[0] & 0xF0) == 0x40) {
+        pkt[9] = proto;
+        wr16(pkt + 2, len);
+    } else {
+        pkt[6] = proto;
+        wr16(pkt + 4, len - 40);
+    }
+}
+
+static int starts_http(const uint8_t *p, size_t len) {
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        size_t l = strlen(methods[i]);
+        if (len >= l && memcmp(p, methods[i], l) == 0) return 1;
+    }
+    return 0;
+}
+
+static const uint8_t *entry(const http_hdr_tab_t *t, uint32_t idx, size_t *len) {
+    if (idx < (uint32_t) STATIC_ENTRIES) {
+        *len = strlen(static_tab[idx]);
+        return (const uint8_t *) static_tab[idx];
+    }
+    idx -= STATIC_ENTRIES;
+    if (idx >= (uint32_t) t->count) {
+        *len = 0;
+        return NULL;
+    }
+    int slot = (t->newest - (int) idx + HTTP_HDR_ENTRIES) % HTTP_HDR_ENTRIES;
+    *len = t->len[slot];
+    return t->lines + slot * HTTP_HDR_ENTRY_MAX;
+}
+
+static int find_line(const http_hdr_tab_t *t, const uint8_t *line, size_t len) {
+    for (int i = 0; i < STATIC_ENTRIES + t->count; i++) {
+        size_t l;
+        const uint8_t *e = entry(t, i, &l);
+        if (l == len && e[0] == line[0] && memcmp(e, line, len) == 0) return i;
+    }
+    return -1;
+}
+
+static int find_name(const http_hdr_tab_t *t, const uint8_t *line, size_t name_len) {
+    for (int i = 0; i < STATIC_ENTRIES + t->count; i++) {
+        size_t l;
+        const uint8_t *e = entry(t, i, &l);
+        if (l >= name_len && e[name_len - 1] == ':' && e[0] == line[0] && memcmp(e, line, name_len) == 0) return i;
+    }
+    return -1;
+}
+
+static uint8_t *put_varint(uint8_t *o, uint32_t v) {
+    while (v >= 0x80) {
+        *o++ = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    *o++ = v;
+    return o;
+}
+
+static int get_varint(const uint8_t **in, const uint8_t *end, uint32_t *v) {
+    *v = 0;
+    for (int i = 0; i < VARINT_MAX && *in < end; i++) {
+        uint8_t b = *(*in)++;
+        *v |= (uint32_t) (b & 0x7F) << (7 * i);
+        if (! (b & 0x80)) return 0;
+    }
+    return -1;
+}
+
+static int alloc_lines(http_hdr_tab_t *t) {
+    if (t->lines == NULL && (t->lines = malloc(HTTP_HDR_ENTRIES * HTTP_HDR_ENTRY_MAX)) == NULL) return -1;
+    return 0;
+}
+
+static void add_pending(http_hdr_tab_t *t, size_t off, size_t len) {
+    if (len > HTTP_HDR_ENTRY_MAX) return;
+    t->pending[t->n_pending].off = off;
+    t->pending[t->n_pending].len = len;
+    t->n_pending++;
+}
+
+ssize_t http_hdr_encode(http_hdr_tab_t *t, const uint8_t *pkt, size_t len, uint8_t *out, size_t capacity) {
+    size_t off = payload_off(pkt, len, IPPROTO_TCP);
+    if (off == 0 || off > capacity || ! starts_http(pkt + off, len - off)) return -1;
+    const uint8_t *p = pkt + off, *end = pkt + len;
+    uint8_t *o = out + off, *o_end = out + capacity;
+    int lines = 0;
+    memcpy(out, pkt, off);
+    t->n_pending = 0;
+    while (lines < HTTP_HDR_MAX_LINES) {
+        const uint8_t *crlf = p;
+        while (crlf + 1 < end && ! (crlf[0] == '\r' && crlf[1] == '\n')) crlf++;
+        if (crlf + 1 >= end || crlf == p) break; /* incomplete line, or the empty one ending the headers */
+        size_t line_len = crlf - p;
+        if ((size_t) (o_end - o) < 1 + 2 * VARINT_MAX + line_len) return -1;
+        int idx = find_line(t, p, line_len);
+        if (idx >= 0) {
+            if (idx < 0x80) {
+                *o++ = OP_LINE_SHORT | idx;
+            } else {
+                *o++ = OP_LINE;
+                o = put_varint(o, idx);
+            }
+        } else {
+            const uint8_t *colon = memchr(p, ':', line_len);
+            size_t name_len = (colon != NULL) ? (size_t) (colon - p) + 1 : 0;
+            idx = (name_len > 0) ? find_name(t, p, name_len) : -1;
+            if (idx >= 0) {
+                *o++ = OP_NAME;
+                o = put_varint(o, idx);
+                o = put_varint(o, line_len - name_len);
+                memcpy(o, p + name_len, line_len - name_len);
+                o += line_len - name_len;
+            } else {
+                *o++ = OP_LITERAL;
+                o = put_varint(o, line_len);
+                memcpy(o, p, line_len);
+                o += line_len;
+            }
+            add_pending(t, p - pkt, line_len);
+        }
+        lines++;
+        p = crlf + 2;
+    }
+    if (lines == 0 || (size_t) (o_end - o) < (size_t) (1 + end - p) || (t->n_pending > 0 && alloc_lines(t) != 0)) return -1;
+    *o++ = OP_END;
+    memcpy(o, p, end - p);
+    o += end - p;
+    size_t total = o - out;
+    if (total >= len) return -1;
+    set_proto_and_len(out, HTTP_HDR_IPPROTO, total);
+    return total;
+}
+
+ssize_t http_hdr_decode(http_hdr_tab_t *t, const uint8_t *pkt, size_t len, uint8_t *out, size_t capacity) {
+    size_t off = payload_off(pkt, len, HTTP_HDR_IPPROTO);
+    if (off == 0 || off > capacity) return -1;
+    const uint8_t *in = pkt + off, *end = pkt + len;
+    uint8_t *o = out + off, *o_end = out + capacity;
+    memcpy(out, pkt, off);
+    t->n_pending = 0;
+    for (int lines = 0;; lines++) {
+        if (in >= end) return -1;
+        uint8_t op = *in++;
+        if (op == OP_END) break;
+        if (lines == HTTP_HDR_MAX_LINES) return -1;
+        uint32_t idx, l;
+        size_t e_len;
+        const uint8_t *e;
+        uint8_t *line = o;
+        if (op & OP_LINE_SHORT || op == OP_LINE) {
+            if (op & OP_LINE_SHORT) {
+                idx = op & ~OP_LINE_SHORT;
+            } else if (get_varint(&in, end, &idx) != 0) {
+                return -1;
+            }
+            if (idx >= STATIC_ENTRIES + (uint32_t) t->count) return -1;
+            if ((e = entry(t, idx, &e_len)) == NULL || (size_t) (o_end - o) < e_len + 2) return -1;
+            memcpy(o, e, e_len);
+            o += e_len;
+        } else if (op == OP_NAME) {
+            if (get_varint(&in, end, &idx) != 0 || get_varint(&in, end, &l) != 0 || (size_t) (end - in) < l) return -1;
+            if (idx >= STATIC_ENTRIES + (uint32_t) t->count) return -1;
+            if ((e = entry(t, idx, &e_len)) == NULL) return -1;
+            const uint8_t *colon = memchr(e, ':', e_len);
+            if (colon == NULL) return -1;
+            e_len = colon - e + 1;
+            if ((size_t) (o_end - o) < e_len + l + 2) return -1;
+            memcpy(o, e, e_len);
+            memcpy(o + e_len, in, l);
+            o += e_len + l;
+            in += l;
+            add_pending(t, line - out, o - line);
+        } else if (op == OP_LITERAL) {
+            if (get_varint(&in, end, &l) != 0 || (size_t) (end - in) < l || (size_t) (o_end - o) < l + 2) return -1;
+            memcpy(o, in, l);
+            o += l;
+            in += l;
+            add_pending(t, line - out, l);
+        } else {
+            return -1;
+        }
+        *o++ = '\r';
+        *o++ = '\n';
+    }
+    if ((size_t) (o_end - o) < (size_t) (end - in) || (t->n_pending > 0 && alloc_lines(t) != 0)) return -1;
+    memcpy(o, in, end - in);
+    o += end - in;
+    size_t total = o - out;
+    if (total > 0xFFFF + ((out[0] & 0xF0) == 0x60 ? 40 : 0)) return -1;
+    set_proto_and_len(out, IPPROTO_TCP, total);
+    return total;
+}
+
+static void add_line(http_hdr_tab_t *t, const uint8_t *line, size_t len) {
+    t->newest = (t->newest + 1) % HTTP_HDR_ENTRIES;
+    memcpy(t->lines + t->newest * HTTP_HDR_ENTRY_MAX, line, len);
+    t->len[t->newest] = len;
+    if (t->count < HTTP_HDR_ENTRIES) t->count++;
+}
+
+void http_hdr_commit(http_hdr_tab_t *t, const uint8_t *pkt) {
+    for (int i = 0; i < t->n_pending; i++) add_line(t, pkt + t->pending[i].off, t->pending[i].len);
+    t->n_pending = 0;
+}
+
+size_t http_hdr_export_sz(const http_hdr_tab_t *t) {
+    size_t sz = 1;
+    for (int i = 0; i < t->count; i++) {
+        size_t l;
+        entry(t, STATIC_ENTRIES + i, &l);
+        sz += 1 + l;
+    }
+    return sz;
+}
+
+/* count, then lines oldest first (length, bytes) */
+void http_hdr_export(const http_hdr_tab_t *t, uint8_t *out) {
+    *out++ = t->count;
+    for (int i = t->count - 1; i >= 0; i--) {
+        size_t l;
+        const uint8_t *e = entry(t, STATIC_ENTRIES + i, &l);
+        *out++ = l;
+        memcpy(out, e, l);
+        out += l;
+    }
+}
+
+int http_hdr_import(http_hdr_tab_t *t, const uint8_t *in, size_t len) {
+    const uint8_t *end = in + len;
+    http_hdr_reset(t);
+    if (len < 1 || *in > HTTP_HDR_ENTRIES) return -1;
+    int n = *in++;
+    if (n > 0 && alloc_lines(t) != 0) return -1;
+    for (int i = 0; i < n; i++) {
+        if (in >= end || (size_t) (end - in) < 1u + *in) return -1;
+        add_line(t, in + 1, *in);
+        in += 1 + *in;
+    }
+    return (in == end) ? 0 : -1;
+}
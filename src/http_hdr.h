@@ -0,0 +1,75 @@
+#ifndef _HTTP_HDR_H
+#define _HTTP_HDR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* HTTP/1.x header tokenizing ahead of compression (opt-in, both peers of a conn need it). A TCP
+   pkt whose payload starts an HTTP/1.x request or response has its complete header lines replaced by
+   references into a table of lines both ends of a conn keep in step (HPACK-like: a static table of common
+   lines and names, then the 128 lines added last, newest first), anything after the headers (or the first
+   incomplete line) is left as is. The pkt keeps its IP and TCP headers with the IP protocol switched to
+   HTTP_HDR_IPPROTO and the length fixed, decoding restores it byte for byte (checksums are untouched).
+
+   Tokens ahead of the raw rest of the payload (indexes and lengths are LEB128 varints):
+
+       0x00                  end of tokens
+       0x01 len line         literal line, added to the table
+       0x02 idx len value    name (up to and including ':') of entry idx followed by value, added
+       0x03 idx              line of entry idx
+       0x80 | idx            same, idx < 128
+
+   Lines are without their CRLF, lines longer than HTTP_HDR_ENTRY_MAX aren't added. A pkt only references
+   what the table had before it and its lines are added once the pkt is taken (http_hdr_commit), so a pkt
+   that's dropped (or has to be retried) leaves the table alone. */
+
+#define HTTP_HDR_IPPROTO 254 /* RFC 3692, experimentation */
+#define HTTP_HDR_ENTRIES 128
+#define HTTP_HDR_ENTRY_MAX 255
+#define HTTP_HDR_MAX_LINES 64 /* per pkt */
+
+struct http_hdr_line_s {
+    uint32_t off, len; /* in the (decoded) pkt */
+};
+
+typedef struct http_hdr_line_s http_hdr_line_t;
+
+struct http_hdr_tab_s {
+    uint8_t *lines; /* HTTP_HDR_ENTRIES * HTTP_HDR_ENTRY_MAX, allocated when the first pkt with lines to add is coded */
+    uint8_t len[HTTP_HDR_ENTRIES];
+    int newest, count;
+    http_hdr_line_t pending[HTTP_HDR_MAX_LINES]; /* lines of the last pkt coded, for http_hdr_commit */
+    int n_pending;
+};
+
+typedef struct http_hdr_tab_s http_hdr_tab_t;
+
+void http_hdr_init(http_hdr_tab_t *t);
+
+void http_hdr_destroy(http_hdr_tab_t *t);
+
+/* both ends start over (stream restarted) */
+void http_hdr_reset(http_hdr_tab_t *t);
+
+/* pkt is an encoded one (only the IP header is looked at) */
+int http_hdr_is_encoded(const uint8_t *pkt, size_t len);
+
+/* encoded pkt in out, -1 if pkt doesn't start HTTP/1.x headers, encoding wouldn't make it smaller (or the
+   table couldn't be allocated) */
+ssize_t http_hdr_encode(http_hdr_tab_t *t, const uint8_t *pkt, size_t len, uint8_t *out, size_t capacity);
+
+/* decoded pkt in out, -1 if pkt is malformed (or references what the table doesn't have) */
+ssize_t http_hdr_decode(http_hdr_tab_t *t, const uint8_t *pkt, size_t len, uint8_t *out, size_t capacity);
+
+/* adds the lines of the pkt last coded, pkt is the original (resp. decoded) one */
+void http_hdr_commit(http_hdr_tab_t *t, const uint8_t *pkt);
+
+/* table as a blob (for hot upgrade), export_sz bytes */
+size_t http_hdr_export_sz(const http_hdr_tab_t *t);
+
+void http_hdr_export(const http_hdr_tab_t *t, uint8_t *out);
+
+int http_hdr_import(http_hdr_tab_t *t, const uint8_t *in, size_t len);
+
+#endif
@@ -3,6 +3,26 @@
 #include "ba_htab.h"
 #include "log.h"
 #include "compress.h"
+#include "ring.h"
+#include "lpm.h"
+#include "reinject.h"
+#include "pkt_ring.h"
+#include "flow_group.h"
+#include "flow_ctx.h"
+#include "ctl.h"
+#include "profile.h"
+#include "handoff.h"
+#include "session.h"
+#include "retx.h"
+#include "pep.h"
+#include "mss.h"
+#include "http_hdr.h"
+#include "bypass.h"
+#include "maglev.h"
+#include "shm_ring.h"
+#ifdef USE_NFQUEUE
+#include "nfq.h"
+#endif
 
 #include <stdio.h>
 #include <sys/types.h>
@@ -21,6 +41,8 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <time.h>
+#include <inttypes.h>
+#include <ifaddrs.h>
 
 #define LISTEN_BACKLOG 1024
 #define INET_ADDR_STRING_LEN 48
@@ -33,25 +55,55 @@
 #define DISABLE_DELAYED_ACK 2
 #define DISABLE_NAGLE_ALGO 1
 
+#define FLUSH_BATCH_MAX_PKTS 64
+#define RELAY_UNIT_MAX (256 * 1024) /* frames of one relayed pkt, a peer sending more is cut off */
+#define RELAY_ROUTES_MAX 1024 /* per conn, streams to further destinations are dropped without notice */
+
 typedef struct io_ctx_s io_ctx_t;
 typedef struct io_sock_s io_sock_t;
+typedef struct relay_peer_s relay_peer_t;
 
-typedef struct ring_buff_s ring_buff_t;
-
-struct ring_buff_s {
-    void *buff;
-    ssize_t sz, start, end, max;
-    int wraped;
-	int resizable;
+struct pep_stats_s {
+    uint64_t opened, refused, closed, reset;
+    uint64_t stray; /* messages for flows that are gone (or were never known) */
+    uint64_t up, down; /* bytes of flows that are gone */
 };
 
+typedef struct pep_stats_s pep_stats_t;
+
 struct tun_pkt_buff_s {
     void *buff;
-    ssize_t capacity, len, current_pkt_len;
+    ssize_t capacity, len;
+    relay_peer_t *relay; /* set by dest_conn, the pkt goes to this peer through the conn's peer (hub) */
+    int internal; /* made here (pep messages), not read off tun */
 };
 
 typedef struct tun_pkt_buff_s tun_pkt_buff_t;
 
+/* a whole batch of tun reads, held so it can be compressed a flow at a time (IO_FLUSH_FLOW) */
+struct tun_batch_s {
+    uint8_t *buff;
+    ssize_t off[FLUSH_BATCH_MAX_PKTS], len[FLUSH_BATCH_MAX_PKTS];
+    uint64_t key[FLUSH_BATCH_MAX_PKTS];
+    uint8_t order[FLUSH_BATCH_MAX_PKTS];
+};
+
+typedef struct tun_batch_s tun_batch_t;
+
+struct io_ctr_s {
+    uint32_t b, p;
+};
+
+typedef struct io_ctr_s io_ctr_t;
+
+/* stream with a co-located peer (see shm_ring.h), the peer closing sock means it is gone */
+struct shm_conn_s {
+    shm_chan_t chan;
+    int sock;
+};
+
+typedef struct shm_conn_s shm_conn_t;
+
 struct io_sock_s {
     LIST_ENTRY(io_sock_s) link;
     int fd;
@@ -59,7 +111,18 @@ struct io_sock_s {
     enum {
 		lstn,
 		conn,
-		tun
+		tun,
+		nfq,
+		ring,
+		ctl_lstn,
+		ctl,
+		upg_lstn,
+		upg,
+		hs,
+		pep_lstn,
+		pep,
+		shm_lstn,
+		shm_hs
 	} typ;
     int alive;
     struct epoll_event evt;
@@ -70,11 +133,78 @@ struct io_sock_s {
             int outbound;
             ring_buff_t rx, tx;
             compress_t comp;
+            flow_ctx_tab_t *fc; /* per-flow compression ctxs (framed stream), NULL when off */
+            LIST_ENTRY(io_sock_s) flush_link;
+            int flush_pending;
+            int flush_stalled; /* ring had no room for the flush, retried once socket is writable */
+            ring_buff_t tun_q; /* pkts from this peer waiting for tun to take them, allocated on first use */
+            TAILQ_ENTRY(io_sock_s) tun_q_link;
+            int tun_q_listed; /* in ctx->tun_backlogged */
+            ssize_t tun_deficit; /* DRR credit (bytes) for writing tun_q to tun */
+            LIST_ENTRY(io_sock_s) rx_stalled_link;
+            int rx_stalled; /* tun_q was full, rx is resumed once it drains */
+            io_ctr_t tun_q_in; /* pkts that had to wait in tun_q (reset with the periodic stats) */
+            uint32_t tun_q_full;
+            ssize_t tun_q_peak;
+            link_profile_t profile; /* peer-file settings the conn was set up with, overriding ctx's */
+            int inherited; /* taken over from the previous process (hot upgrade), its routes are already in place */
+            int handed_off; /* went to the successor (hot upgrade), routes stay */
+            session_t sess; /* only with ctx->resume_grace */
+            int hello_pending; /* connecting side, nothing goes out till the peer's hello is in */
+            int connecting; /* non-blocking connect of a resume attempt */
+            int suspended; /* conn broke (or is being re-established), session waits in ctx->suspended */
+            time_t resume_by; /* session is dropped if the peer isn't back by then */
+            time_t attempt_by; /* resume attempt in progress is given up */
+            LIST_ENTRY(io_sock_s) suspended_link;
+            uint32_t resumes;
+            uint64_t gen; /* changes whenever the conn's stream starts over */
+            flow_ctx_relay_t relay_cb;
+            uint8_t *relay_buff; /* hub, frames of the pkt being relayed for the peer */
+            ssize_t relay_len, relay_sz, relay_frame_in;
+            uint8_t relay_dest[MAX_NW_ADDR_LEN];
+            LIST_HEAD(rrt, relay_route_s) relay_routes; /* hub, streams the peer has going through us */
+            int relay_routes_n;
+            LIST_ENTRY(io_sock_s) relay_kick_link;
+            int relay_kick; /* relayed frames went to its ring, in ctx->relay_kicks */
+            uint64_t tx_queued; /* bytes ever put in tx, those not in it anymore went out */
+            http_hdr_tab_t hdr_tx, hdr_rx; /* HTTP header tables, in step with the peer's as long as the stream is */
+            struct shm_conn_s *shm; /* co-located peer over shared memory (fd is the doorbell), NULL => TCP */
         } conn;
         struct {
-            ring_buff_t tx;
-            tun_pkt_buff_t r_buff, w_buff;
+            tun_pkt_buff_t r_buff;
+            tun_batch_t *batch; /* only with IO_FLUSH_FLOW */
         } tun;
+#ifdef USE_NFQUEUE
+        struct {
+            nfq_capture_t *capture; /* owns the fd */
+        } nfq;
+#endif
+        struct {
+            pkt_ring_t *r; /* owns the fd (rx side) */
+        } ring;
+        struct {
+            ctl_client_t *client;
+        } ctl;
+        struct { /* accepted with sessions on, it becomes a conn once the peer's hello is in */
+            uint8_t peer[MAX_NW_ADDR_LEN];
+            int af;
+            uint8_t hello[SESSION_HELLO_SZ];
+            int hello_len;
+        } hs;
+        struct { /* flow terminated here (split-TCP PEP), in ctx->pep_flows */
+            pep_stream_t st;
+            ring_buff_t rx; /* data from the other end the socket hasn't taken yet */
+            uint8_t *out; /* DATA message the conn had no room for yet (out_len > 0) */
+            ssize_t out_len, out_data;
+            uint8_t via[MAX_NW_ADDR_LEN]; /* peer whose conn the flow's messages go out on */
+            uint64_t via_gen; /* of that conn's stream, 0 => nothing went out yet */
+            int connecting; /* server side, connect to the destination in progress */
+            int open_pending, eof, fin_sent, fin_rcvd, shut;
+            int reset; /* PEP_RESET_*, flow is given up on next time it's kicked */
+            int closed; /* both ways done, the socket is closed cleanly */
+            TAILQ_ENTRY(io_sock_s) kick_link;
+            int kicked; /* in ctx->pep_kicks */
+        } pep;
     } d;
 };
 
@@ -90,38 +220,193 @@ struct passive_peer_s {
 
 typedef struct passive_peer_s passive_peer_t;
 
+struct route_member_s {
+    NET_ADDR(addr);
+    int af;
+    uint64_t pkts, bytes; /* hashed to it (gateway groups only) */
+};
+
+typedef struct route_member_s route_member_t;
+
+/* next-hop of routes. Peers configuring the same subnet make a gateway group, flows to it are spread
+   over the members with conns (consistently, see maglev.h) */
+struct route_nh_s {
+    int n;
+    route_member_t *m; /* ordered by address */
+    maglev_t mg; /* n > 1 */
+    uint64_t built_at; /* ctx->route_epoch mg was built at */
+};
+
+typedef struct route_nh_s route_nh_t;
+
+/* indexed by lpm next-hop, nh[0] is unused */
+struct route_tab_s {
+    route_nh_t *nh;
+    int n;
+};
+
+typedef struct route_tab_s route_tab_t;
+
+/* subnets configured behind a peer (in the peer-file), routed to it by longest-prefix-match */
+struct peer_subnets_s {
+    NET_ADDR(addr);
+    int af;
+    int num_subnets;
+    lpm_prefix_t *subnets;
+    route_nh_t **nhs; /* per subnet, in the route_tab built along with it */
+    uint16_t nh; /* routes to it alone */
+};
+
+typedef struct peer_subnets_s peer_subnets_t;
+
+/* profile (see profile.h) a peer-file line gave a peer, one per address it resolves to */
+struct peer_profile_s {
+    NET_ADDR(addr);
+    link_profile_t p;
+};
+
+typedef struct peer_profile_s peer_profile_t;
+
+/* peer reached through a hub (via= in its profile), the stream with it runs inside the conn to the hub */
+struct relay_peer_s {
+    NET_ADDR(addr);
+    int af;
+    uint8_t via[MAX_NW_ADDR_LEN];
+    compress_t comp; /* one stream each way, reset independently */
+    uint64_t via_gen; /* of the conn to the hub tx stream was started on */
+    int tx_reset_pending;
+    uint64_t tx_pkts, tx_in, tx_out;
+    uint64_t rx_frames;
+    uint32_t restarts;
+};
+
+/* hub, stream from a conn's peer to dest. Units after a drop are dropped too, till one carrying
+   FLOW_CTX_RESET comes along */
+struct relay_route_s {
+    LIST_ENTRY(relay_route_s) link;
+    uint8_t dest[MAX_NW_ADDR_LEN];
+    uint64_t synced_gen; /* dest conn's stream the route is in step with, 0 => none */
+    uint64_t noticed_gen; /* dest conn's stream the sender was told about (FLOW_CTX_RELAY_LOST) */
+};
+
+typedef struct relay_route_s relay_route_t;
+
+struct relay_stats_s {
+    uint64_t units, bytes;
+    uint64_t dropped, dropped_bytes;
+    uint64_t lost_sent;
+    uint64_t busy_ns;
+};
+
+typedef struct relay_stats_s relay_stats_t;
+
+/* peer-file line added or removed over the control socket, keyed by its first word (host[:port]). Kept
+   across SIGHUP, the file's line for the same peer is ignored */
+struct ctl_peer_s {
+    LIST_ENTRY(ctl_peer_s) link;
+    int removed;
+    char line[MAX_ADDR_LEN];
+};
+
+typedef struct ctl_peer_s ctl_peer_t;
+
 #define USING_IPV4 0x1
 #define USING_IPV6 0x2
 
-struct io_ctr_s {
-    uint32_t b, p;
+/* where pkts from peers go when there is no tun (NFQUEUE reinjection, packet ring), there is no
+   backlog behind these, a pkt that can't go out right away is dropped (like a busy NIC would) */
+struct l3_sink_s {
+    ssize_t (*send)(void *dev, void *b1, ssize_t len1, void *b2, ssize_t len2);
+    void (*kick)(void *dev); /* once a batch of pkts is sent, may be NULL */
+    void *dev;
+    io_ctr_t drop;
 };
 
-typedef struct io_ctr_s io_ctr_t;
+typedef struct l3_sink_s l3_sink_t;
+
+/* pkt source / sink, one of tun_fd (>= 0), nfq or ring */
+struct io_dev_s {
+    int tun_fd;
+    const nfq_cfg_t *nfq;
+    const pkt_ring_cfg_t *ring;
+    int tun_mtu; /* > 0 => MSS of SYNs through tun clamped to fit it */
+};
+
+typedef struct io_dev_s io_dev_t;
 
 struct io_ctx_s {
     LIST_HEAD(all, io_sock_s) non_conns;
     batab_t live_conns; /* to passive and active peers */
     LIST_HEAD(dpp, passive_peer_s) disconnected_passive_peers;
     batab_t passive_peers;
+    LIST_HEAD(fp, io_sock_s) flush_pending; /* conns with compressed data held back till the end of tun-read batch */
+    TAILQ_HEAD(tbl, io_sock_s) tun_backlogged; /* conns with pkts in tun_q, in deficit-round-robin order */
+    LIST_HEAD(rxs, io_sock_s) rx_stalled;
+    int flush_policy;
+    int flow_ctxs; /* dedicated compression ctxs per conn, 0 => plain stream */
+    uint8_t *frame_buff; /* frames of a pkt are put together here before going to the conn's ring */
+    ssize_t frame_buff_sz;
     int tun_fd;
     int epoll_fd;
     NET_ADDR(self_v4);
     NET_ADDR(self_v6);
     int using_af;
-    ring_buff_t *tun_tx;
+    l3_sink_t sink; /* used instead of tun_fd when sink.send is set */
+    reinject_t reinject;
+    int reinjecting;
+    pkt_ring_t pkt_ring;
     const char *ipset_name;
+    char *ipset_name_v6; /* ipset sets are single-family, IPv6 entries go to <ipset_name>6 */
     int low_lat_mode;
     io_ctr_t tx_drop, tx_partial_compress_drop;
+    io_ctr_t tx_reserved_drop; /* pkts off tun of the IP protocols l3tc's own messages travel as (while in use) */
     int compression_level;
     ssize_t tun_ring_sz;
     ssize_t conn_ring_sz;
 	ssize_t max_allowed_ring_sz;
 	int resize_rings;
+    lpm_t routes; /* next-hop is an index into route_tab */
+    batab_t peer_subnets;
+    route_tab_t route_tab;
+    uint64_t route_epoch; /* moves as conns come, go, break or resume (gateway groups rebuild on it) */
+    const char *ctl_path; /* control socket, NULL => none */
+    LIST_HEAD(cps, ctl_peer_s) ctl_peers;
+    profile_set_t profiles;
+    batab_t peer_profiles; /* applied to conns as they are set up */
+    int profile_flow_grouping; /* some peer has flush=flow, tun reads are flow-grouped regardless of flush_policy */
+    const char *upgrade_path; /* a successor takes over through this socket (hot upgrade), NULL => none */
+    const char *shm_path; /* co-located peers connect over shared memory through this socket, NULL => none */
+    io_sock_t *handoff; /* successor being handed over to, conns are draining to a handoff point */
+    time_t handoff_deadline; /* conns not at a handoff point by now are dropped (and reconnect) */
+    int routes_inherited; /* conns were taken over, their ipset entries already exist */
+    int resume_grace; /* secs a broken conn's session is kept for the peer to resume, 0 => sessions off */
+    LIST_HEAD(sus, io_sock_s) suspended;
+    time_t sessions_tended_at;
+    uint64_t conn_gens;
+    int relay; /* hub, passes relay frames on between peers */
+    relay_stats_t relay_stats;
+    LIST_HEAD(rks, io_sock_s) relay_kicks;
+    batab_t relay_peers; /* streams with peers behind hubs, kept till exit (a decoder may be mid-frame on one) */
+    int via_peers; /* peers in peer_profiles reached through a hub */
+    retx_tab_t retx; /* inner TCP retransmission suppression, slots NULL => off */
+    int pep_port; /* split-TCP PEP listens here (TPROXY), 0 => off */
+    batab_t pep_flows;
+    TAILQ_HEAD(pks, io_sock_s) pep_kicks; /* flows with messages to send, or waiting for conn room */
+    uint8_t *pep_rx_buff; /* message wrapping around the end of a conn's rx ring, made contiguous (PEP_MSG_MAX) */
+    pep_stats_t pep_stats;
+    int tun_mtu;
+    uint64_t mss_clamped_out, mss_clamped_in; /* SYNs read from / written to tun */
+    int http_hdrs; /* HTTP/1.x headers of pkts to peers are tokenized and coded pkts from them decoded (see http_hdr.h) */
+    uint8_t *hdr_buff; /* coded pkt, then an encoded pkt wrapping around the end of a conn's rx ring made contiguous */
+    uint64_t hdr_coded, hdr_coded_in, hdr_coded_out, hdr_decoded, hdr_decode_errs;
+    bypass_tab_t bypass; /* steering feedback, slots NULL => off */
+    char *bypass_set, *bypass_set_v6; /* <ipset_name>-bypass, <ipset_name>-bypass6 */
 };
 
 static inline void destroy_sock(io_sock_t *sock);
 
+static void destroy_route_tab(route_tab_t *t);
+
 static inline void destroy_io_ctx(io_ctx_t *ctx) {
     if (ctx == NULL) return;
 
@@ -134,23 +419,71 @@ static inline void destroy_io_ctx(io_ctx_t *ctx) {
 
     while (ctx->non_conns.lh_first != NULL)
         destroy_sock(ctx->non_conns.lh_first);
+    batab_destory(&ctx->pep_flows);
+    free(ctx->pep_rx_buff);
+    free(ctx->hdr_buff);
 
     batab_destory(&ctx->passive_peers);
 
+    batab_destory(&ctx->peer_subnets);
+    lpm_destroy(&ctx->routes);
+    destroy_route_tab(&ctx->route_tab);
+    batab_destory(&ctx->peer_profiles);
+    profile_set_destroy(&ctx->profiles);
+    batab_destory(&ctx->relay_peers);
+    retx_destroy(&ctx->retx);
+    bypass_destroy(&ctx->bypass);
+    free(ctx->bypass_set);
+    free(ctx->bypass_set_v6);
+    free(ctx->ipset_name_v6);
+    free(ctx->frame_buff);
+
+    ctl_peer_t *cp;
+    while ((cp = LIST_FIRST(&ctx->ctl_peers)) != NULL) {
+        LIST_REMOVE(cp, link);
+        free(cp);
+    }
+
+    if (ctx->reinjecting) reinject_destroy(&ctx->reinject);
+
     free(ctx);
 }
 
-static inline void destroy_ring_buff(ring_buff_t *ring) {
-    DBG("io", L("destroying ring: %p { sz=%zd, start=%zd, end=%zd, wrapped=%d }"), ring, ring->sz, ring->start, ring->end, ring->wraped);
-    free(ring->buff);
+/* the doorbell is closed by whoever got it as fd (the conn, or add_sock failing) */
+static void destroy_shm_conn(io_ctx_t *ctx, shm_conn_t *shm) {
+    shm->chan.bell_fd = -1;
+    shm_chan_destroy(&shm->chan);
+    epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, shm->sock, NULL); /* only polled once a conn has it */
+    close(shm->sock);
+    free(shm);
 }
 
 static inline void destroy_conn_sock_data(io_sock_t *sock) {
     io_ctx_t *ctx = sock->ctx;
     assert(sock->typ == conn);
+    if (sock->d.conn.flush_pending) LIST_REMOVE(sock, d.conn.flush_link);
+    if (sock->d.conn.tun_q_listed) TAILQ_REMOVE(&ctx->tun_backlogged, sock, d.conn.tun_q_link);
+    if (sock->d.conn.rx_stalled) LIST_REMOVE(sock, d.conn.rx_stalled_link);
+    if (sock->d.conn.suspended) LIST_REMOVE(sock, d.conn.suspended_link);
+    if (sock->d.conn.relay_kick) LIST_REMOVE(sock, d.conn.relay_kick_link);
+    relay_route_t *rr;
+    while ((rr = LIST_FIRST(&sock->d.conn.relay_routes)) != NULL) {
+        LIST_REMOVE(rr, link);
+        free(rr);
+    }
+    free(sock->d.conn.relay_buff);
+    if (sock->d.conn.tun_q.buff != NULL) destroy_ring_buff(&sock->d.conn.tun_q);
+    if (sock->d.conn.fc != NULL) {
+        flow_ctx_destroy(sock->d.conn.fc);
+        free(sock->d.conn.fc);
+    }
     destroy_compression_ctx(&sock->d.conn.comp);
-    if (sock->fd >= 0) {
+    session_destroy(&sock->d.conn.sess);
+    http_hdr_destroy(&sock->d.conn.hdr_tx);
+    http_hdr_destroy(&sock->d.conn.hdr_rx);
+    if ((sock->fd >= 0 || sock->d.conn.suspended) && batab_get(&ctx->live_conns, sock->d.conn.peer) == sock) { /* a re-connect from the same peer may have replaced us */
         batab_remove(&ctx->live_conns, sock->d.conn.peer);
+        ctx->route_epoch++;
         if (sock->d.conn.outbound) {
             passive_peer_t *pp = batab_get(&ctx->passive_peers, sock->d.conn.peer);
             assert(pp != NULL);
@@ -159,18 +492,136 @@ static inline void destroy_conn_sock_data(io_sock_t *sock) {
     }
     destroy_ring_buff(&sock->d.conn.tx);
     destroy_ring_buff(&sock->d.conn.rx);
+    if (sock->d.conn.shm != NULL) destroy_shm_conn(ctx, sock->d.conn.shm);
 }
 
 static inline void destroy_tun_sock_data(io_sock_t *sock) {
-    destroy_ring_buff(&sock->d.tun.tx);
-    free(sock->d.tun.w_buff.buff);
     free(sock->d.tun.r_buff.buff);
+    if (sock->d.tun.batch != NULL) free(sock->d.tun.batch->buff);
+    free(sock->d.tun.batch);
+}
+
+static inline void destroy_ctl_sock_data(io_sock_t *sock) {
+    if (sock->d.ctl.client == NULL) return;
+    ctl_client_destroy(sock->d.ctl.client);
+    free(sock->d.ctl.client);
+}
+
+static inline void destroy_ring_sock_data(io_sock_t *sock) {
+    pkt_ring_close(sock->d.ring.r);
+    sock->fd = -1;
+}
+
+static inline void destroy_pep_sock_data(io_sock_t *sock) {
+    io_ctx_t *ctx = sock->ctx;
+    pep_stream_t *st = &sock->d.pep.st;
+    if (sock->d.pep.kicked) TAILQ_REMOVE(&ctx->pep_kicks, sock, d.pep.kick_link);
+    if (batab_get(&ctx->pep_flows, st->tuple) == sock) batab_remove(&ctx->pep_flows, st->tuple);
+    if (! sock->d.pep.closed && sock->fd >= 0) { /* the local end sees a reset, not a clean close of a cut stream */
+        struct linger l = {1, 0};
+        setsockopt(sock->fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    }
+    ctx->pep_stats.up += st->up;
+    ctx->pep_stats.down += st->down;
+    if (sock->d.pep.rx.buff != NULL) destroy_ring_buff(&sock->d.pep.rx);
+    free(sock->d.pep.out);
+}
+
+#ifdef USE_NFQUEUE
+static inline void destroy_nfq_sock_data(io_sock_t *sock) {
+    nfq_capture_close(sock->d.nfq.capture);
+    sock->fd = -1;
+}
+#endif
+
+static int run_ipset_on(const char *set, const char *op, const char *entry) {
+    char cmd_buff[MAX_ADDR_LEN + 100];
+
+    int len = snprintf(cmd_buff, sizeof(cmd_buff), "ipset %s %s %s", op, set, entry);
+    assert(len < (int) sizeof(cmd_buff) && len > 0);
+
+    int ret = system(cmd_buff);
+
+    log_warn("io", L("Route-mark update (status: %d) cmd: %s"), ret, cmd_buff);
+
+    return ret;
+}
+
+static int run_ipset(io_ctx_t *ctx, int af, const char *op, const char *entry) {
+    return run_ipset_on((af == AF_INET6) ? ctx->ipset_name_v6 : ctx->ipset_name, op, entry);
+}
+
+/* conn of a route member, the hub's if it is reached through one */
+static io_sock_t *route_member_conn(io_ctx_t *ctx, uint8_t *addr) {
+    io_sock_t *conn = batab_get(&ctx->live_conns, addr);
+    if (conn != NULL) return conn;
+    peer_profile_t *pp = batab_get(&ctx->peer_profiles, addr);
+    return (pp != NULL && (pp->p.set & PROFILE_VIA)) ? batab_get(&ctx->live_conns, pp->p.via) : NULL;
+}
+
+static int lists_subnet(batab_t *peer_subnets, uint8_t *addr, const lpm_prefix_t *p) {
+    peer_subnets_t *ps = batab_get(peer_subnets, addr);
+    for (int i = 0; ps != NULL && i < ps->num_subnets; i++) {
+        lpm_prefix_t *q = &ps->subnets[i];
+        if (q->af == p->af && q->len == p->len && memcmp(q->addr, p->addr, sizeof(q->addr)) == 0) return 1;
+    }
+    return 0;
+}
+
+/* subnet i of ps is a gateway group's, another member with a conn (suspended or not) still lists it in listed */
+static int subnet_kept(io_ctx_t *ctx, peer_subnets_t *ps, int i, batab_t *listed) {
+    route_nh_t *nh = ps->nhs[i];
+    for (int j = 0; j < nh->n; j++) {
+        uint8_t *addr = nh->m[j].addr;
+        if (memcmp(addr, ps->addr, MAX_NW_ADDR_LEN) == 0) continue;
+        if (route_member_conn(ctx, addr) != NULL && lists_subnet(listed, addr, &ps->subnets[i])) return 1;
+    }
+    return 0;
+}
+
+/* members of a gateway group mark its subnets together, the mark goes once the last of them does
+   (listed is the peer-subnets being installed, removal from it counts as going) */
+static int run_ipset_for_listed_subnets(io_ctx_t *ctx, const char *op, peer_subnets_t *ps, batab_t *listed) {
+    char prefix_buff[64];
+    int failures = 0;
+    if (ps == NULL || ctx->ipset_name == NULL) return 0;
+    int del = (strcmp(op, "del") == 0);
+    for (int i = 0; i < ps->num_subnets; i++) {
+        const char *subnet_op = op;
+        if (ps->nhs != NULL && ps->nhs[i]->n > 1) {
+            if (del && subnet_kept(ctx, ps, i, listed)) continue;
+            subnet_op = del ? "-exist del" : "-exist add";
+        }
+        if (run_ipset(ctx, ps->subnets[i].af, subnet_op, lpm_prefix_str(&ps->subnets[i], prefix_buff, sizeof(prefix_buff))) != 0) failures++;
+    }
+    return failures;
+}
+
+static int run_ipset_for_subnets(io_ctx_t *ctx, const char *op, peer_subnets_t *ps) {
+    return run_ipset_for_listed_subnets(ctx, op, ps, &ctx->peer_subnets);
+}
+
+/* peers reached through hub (via=) are routed along with it, unless they have a conn of their own */
+static int run_ipset_for_relayed(io_ctx_t *ctx, const char *op, const uint8_t *hub) {
+    char addr_buff[MAX_ADDR_LEN];
+    int failures = 0;
+    if (ctx->via_peers == 0) return 0;
+    batab_entry_t *e;
+    batab_foreach_do((&ctx->peer_profiles), e) {
+        peer_profile_t *pp = (peer_profile_t *) e->value;
+        if (! (pp->p.set & PROFILE_VIA) || memcmp(pp->p.via, hub, MAX_NW_ADDR_LEN) != 0) continue;
+        if (batab_get(&ctx->live_conns, pp->addr) != NULL) continue;
+        if (inet_ntop(pp->p.via_af, pp->addr, addr_buff, sizeof(addr_buff)) == NULL || run_ipset(ctx, pp->p.via_af, op, addr_buff) != 0) failures++;
+        failures += run_ipset_for_subnets(ctx, op, batab_get(&ctx->peer_subnets, pp->addr));
+    }
+    return failures;
 }
 
 static inline int setup_conn_route(io_sock_t *sock) {
     assert(sock->typ == conn);
+    if (sock->ctx->ipset_name == NULL) return 0;
+
     char addr_buff[MAX_ADDR_LEN];
-    char cmd_buff[MAX_ADDR_LEN + 100];
     int af = sock->d.conn.af;
 
     if (inet_ntop(af, sock->d.conn.peer, addr_buff, sizeof(addr_buff)) == NULL) {
@@ -178,20 +629,22 @@ static inline int setup_conn_route(io_sock_t *sock) {
         return -1;
     }
 
-    int len = snprintf(cmd_buff, sizeof(cmd_buff), "ipset add %s %s", sock->ctx->ipset_name, addr_buff);
-    assert(len < (int) sizeof(cmd_buff) && len > 0);
-
-    int ret = system(cmd_buff);
-
-    log_warn("io", L("Mark routed (status: %d) cmd: %s"), ret, cmd_buff);
+    int ret = run_ipset(sock->ctx, af, "add", addr_buff);
+    if (ret == 0 && run_ipset_for_subnets(sock->ctx, "add", batab_get(&sock->ctx->peer_subnets, sock->d.conn.peer)) != 0) {
+        log_warnx("io", L("Couldn't mark some subnets behind %s routed"), addr_buff);
+    }
+    if (ret == 0 && run_ipset_for_relayed(sock->ctx, "add", sock->d.conn.peer) != 0) {
+        log_warnx("io", L("Couldn't mark some peers relayed by %s routed"), addr_buff);
+    }
 
     return ret;
 }
 
 static inline int drop_conn_route(io_sock_t *sock) {
     assert(sock->typ == conn);
+    if (sock->ctx->ipset_name == NULL) return 0;
+
     char addr_buff[MAX_ADDR_LEN];
-    char cmd_buff[MAX_ADDR_LEN + 100];
     int af = sock->d.conn.af;
 
     if (inet_ntop(af, sock->d.conn.peer, addr_buff, sizeof(addr_buff)) == NULL) {
@@ -199,14 +652,16 @@ static inline int drop_conn_route(io_sock_t *sock) {
         return -1;
     }
 
-    int len = snprintf(cmd_buff, sizeof(cmd_buff), "ipset del %s %s", sock->ctx->ipset_name, addr_buff);
-    assert(len < (int) sizeof(cmd_buff) && len > 0);
-
-    int ret = system(cmd_buff);
+    if (batab_get(&sock->ctx->live_conns, sock->d.conn.peer) == sock) {
+        if (run_ipset_for_subnets(sock->ctx, "del", batab_get(&sock->ctx->peer_subnets, sock->d.conn.peer)) != 0) {
+            log_warnx("io", L("Couldn't unmark some subnets behind %s"), addr_buff);
+        }
+        if (run_ipset_for_relayed(sock->ctx, "del", sock->d.conn.peer) != 0) {
+            log_warnx("io", L("Couldn't unmark some peers relayed by %s"), addr_buff);
+        }
+    }
 
-    log_warn("io", L("Unmark routed (status: %d) cmd: %s"), ret, cmd_buff);
-    
-    return ret;
+    return run_ipset(sock->ctx, af, "del", addr_buff);
 }
 
 static inline void destroy_sock(io_sock_t *sock) {
@@ -214,21 +669,40 @@ static inline void destroy_sock(io_sock_t *sock) {
     log_debug("io", L("destroying socket of type: %d (fd: %d)"), sock->typ, sock->fd);
 
     if (conn == sock->typ) {
-        if (drop_conn_route(sock) != 0) {
+        if (! sock->d.conn.handed_off && drop_conn_route(sock) != 0) {
             log_warn("io", L("Couldn't drop route to %d"), sock->fd);
         }
     } else {
         LIST_REMOVE(sock, link);
     }
     
-    if (epoll_ctl(sock->ctx->epoll_fd, EPOLL_CTL_DEL, sock->fd, NULL)) {
+    if (sock->fd >= 0 && epoll_ctl(sock->ctx->epoll_fd, EPOLL_CTL_DEL, sock->fd, NULL)) {
         log_warn("io", L("removal from epoll context for fd: %d failed"), sock->fd);
     }
     if (conn == sock->typ) {
         destroy_conn_sock_data(sock);
     } else if (tun == sock->typ) {
         destroy_tun_sock_data(sock);
+    } else if (ring == sock->typ) {
+        destroy_ring_sock_data(sock);
+    } else if (ctl == sock->typ) {
+        destroy_ctl_sock_data(sock);
+    } else if (ctl_lstn == sock->typ) {
+        unlink(sock->ctx->ctl_path);
+    } else if (upg_lstn == sock->typ) {
+        unlink(sock->ctx->upgrade_path);
+    } else if (shm_lstn == sock->typ) {
+        unlink(sock->ctx->shm_path);
+    } else if (upg == sock->typ && sock->ctx->handoff == sock) {
+        sock->ctx->handoff = NULL;
+    } else if (pep == sock->typ) {
+        destroy_pep_sock_data(sock);
+    }
+#ifdef USE_NFQUEUE
+    else if (nfq == sock->typ) {
+        destroy_nfq_sock_data(sock);
     }
+#endif
 
     if (sock->fd > 0) {
         close(sock->fd);
@@ -284,7 +758,7 @@ static inline int add_sock(io_ctx_t *ctx, int fd, int typ, type_specific_initial
     }
 
     if (sock->typ == conn) {
-        if (setup_conn_route(sock) != 0) {
+        if (! sock->d.conn.inherited && setup_conn_route(sock) != 0) {
             log_warn("io", L("Route-setup failed, dropping conn."));
             destroy_sock(sock);
             return -1;
@@ -298,93 +772,119 @@ static inline int add_sock(io_ctx_t *ctx, int fd, int typ, type_specific_initial
     return 0;
 }
 
-static inline int init_backlog_ring(ring_buff_t *rbuff, size_t sz, int resizable, size_t max_allowed_sz) {
-    if (NULL == (rbuff->buff = malloc(sz))) {
+#define TUN_BATCH_BUFF_SZ (FLUSH_BATCH_MAX_PKTS * 2048 + MAX_L3_PKT_SZ) /* a batch ends early when a max sized read may not fit */
+
+static tun_batch_t *alloc_tun_batch() {
+    tun_batch_t *b = calloc(1, sizeof(tun_batch_t));
+    if (b == NULL) return NULL;
+    if ((b->buff = malloc(TUN_BATCH_BUFF_SZ)) == NULL) {
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+/* only between events, the batch is empty then */
+static int set_tun_flow_grouping(io_ctx_t *ctx, int on) {
+    io_sock_t *sock;
+    LIST_FOREACH(sock, &ctx->non_conns, link) {
+        if (sock->typ != tun) continue;
+        if (on && sock->d.tun.batch == NULL) {
+            if ((sock->d.tun.batch = alloc_tun_batch()) == NULL) return -1;
+        } else if (! on && sock->d.tun.batch != NULL) {
+            free(sock->d.tun.batch->buff);
+            free(sock->d.tun.batch);
+            sock->d.tun.batch = NULL;
+        }
+    }
+    return 0;
+}
+
+/* tx backlogs are per peer (tun_q of conns), tun only needs a read buffer */
+static int init_tun_sock(io_sock_t *sock, void *io_ctx) {
+    DBG("io", L("initializing tun state"));
+    assert(io_ctx != NULL);
+    io_ctx_t *ctx = (io_ctx_t *) io_ctx;
+    if ((sock->d.tun.r_buff.buff = malloc(MAX_L3_PKT_SZ)) == NULL) {
+        log_crit("io", L("couldn't allocate read-pkt-buff for tun"));
         return -1;
     }
-    rbuff->sz = sz;
-    rbuff->start = rbuff->end = 0;
-    rbuff->wraped = 0;
-	rbuff->resizable = resizable;
-	rbuff->max = max_allowed_sz;
-    DBG("io", L("backlog ring: %p { sz=%zd, start=%zd, end=%zd, wrapped=%d, resizable=%d, max_sz=%zd } initialized"), rbuff, rbuff->sz, rbuff->start, rbuff->end, rbuff->wraped, rbuff->resizable, rbuff->max);
+    if (ctx->flush_policy == IO_FLUSH_FLOW && (sock->d.tun.batch = alloc_tun_batch()) == NULL) {
+        log_crit("io", L("couldn't allocate flow-grouping batch for tun"));
+        free(sock->d.tun.r_buff.buff);
+        return -1;
+    }
+    sock->d.tun.r_buff.capacity = MAX_L3_PKT_SZ;
+    sock->d.tun.r_buff.len = 0;
     return 0;
 }
 
-#define EXPANSION_FACTOR 2
+static void free_passive_peer(void *_pp);
+static void free_peer_subnets(void *_ps);
+static void free_relay_peer(void *_rp);
 
-static inline int expand_ring_buffer(ring_buff_t *rbuff) {
-	assert(rbuff->resizable);
-	
-	ssize_t new_sz = rbuff->sz * EXPANSION_FACTOR;
-	if (new_sz > rbuff->max) {
-		new_sz = rbuff->max;
-	}
-	assert(rbuff->sz != new_sz);
-
-	log_warn("io", L("expanding backlog ring: %p { sz=%zd, start=%zd, end=%zd, wrapped=%d, resizable=%d, max_sz=%zd } to %zd bytes"), rbuff, rbuff->sz, rbuff->start, rbuff->end, rbuff->wraped, rbuff->resizable, rbuff->max, new_sz);
-	
-	void *buff = malloc(new_sz);
-	if (buff == NULL) {
-		log_crit("io", L("allocation for backlog ring expansion failed for: %p"), rbuff);
-		return -1;
-	}
-	
-	ssize_t copied_sz;
-	if (rbuff->wraped) {
-		memcpy(buff, rbuff->buff + rbuff->start, rbuff->sz - rbuff->start);
-		memcpy(buff + rbuff->sz - rbuff->start, rbuff->buff, rbuff->end);
-		copied_sz = rbuff->sz - rbuff->start + rbuff->end;
-	} else {
-		memcpy(buff, rbuff->buff + rbuff->start, rbuff->end - rbuff->start);
-		copied_sz = rbuff->end - rbuff->start;
-	}
-	free(rbuff->buff);
-	
-	rbuff->buff = buff;
-	rbuff->sz = new_sz;
-	rbuff->start = 0;
-	rbuff->end = copied_sz;
-	rbuff->wraped = 0;
-	rbuff->resizable = ((new_sz * EXPANSION_FACTOR) <= rbuff->max);
+static int xmit_captured_pkt(void *pkt, size_t len, void *io_ctx);
 
-	log_info("io", L("expanded backlog ring: %p { sz=%zd, start=%zd, end=%zd, wrapped=%d, resizable=%d, max_sz=%zd }"), rbuff, rbuff->sz, rbuff->start, rbuff->end, rbuff->wraped, rbuff->resizable, rbuff->max);
+static ssize_t pkt_ring_sink_send(void *dev, void *b1, ssize_t len1, void *b2, ssize_t len2) {
+    return pkt_ring_send((pkt_ring_t *) dev, b1, len1, b2, len2);
+}
 
-	return 0;
+static void pkt_ring_sink_kick(void *dev) {
+    pkt_ring_kick((pkt_ring_t *) dev);
 }
 
-#define MAX_L3_PKT_SZ 0xFFFF /* check hop-by-hop stuff for IPv6, 0xFFFF will do for IPv4 though */
+static int init_ring_sock(io_sock_t *sock, void *pkt_ring) {
+    sock->d.ring.r = (pkt_ring_t *) pkt_ring;
+    return 0;
+}
 
-static int init_tun_tx_backlog_ring(io_sock_t *sock, void *io_ctx) {
-    DBG("io", L("initializing tun state"));
-    assert(io_ctx != NULL);
-    io_ctx_t *ctx = (io_ctx_t *) io_ctx;
-    if (init_backlog_ring(&sock->d.tun.tx, ctx->tun_ring_sz, ctx->resize_rings, ctx->max_allowed_ring_sz) != 0) {
-        log_crit("io", L("couldn't allocate tx-backlog ring for tun"));
+static int setup_pkt_ring(io_ctx_t *ctx, const pkt_ring_cfg_t *ring_cfg) {
+    if (pkt_ring_open(&ctx->pkt_ring, ring_cfg->if_name, ring_cfg->next_hop_mac) != 0) {
+        log_crit("io", L("Couldn't open packet ring on %s"), ring_cfg->if_name);
         return -1;
     }
-    if ((sock->d.tun.w_buff.buff = malloc(MAX_L3_PKT_SZ)) == NULL) {
-        log_crit("io", L("couldn't allocate write-pkt-buff for tun"));
-        destroy_ring_buff(&sock->d.tun.tx);
+    if (add_sock(ctx, ctx->pkt_ring.rx_fd, ring, init_ring_sock, &ctx->pkt_ring) != 0) {
+        log_crit("io", L("Couldn't add packet ring to io-ctx"));
         return -1;
     }
-    if ((sock->d.tun.r_buff.buff = malloc(MAX_L3_PKT_SZ)) == NULL) {
-        log_crit("io", L("couldn't allocate read-pkt-buff for tun"));
-        free(sock->d.tun.w_buff.buff);
-        destroy_ring_buff(&sock->d.tun.tx);
+    ctx->sink.send = pkt_ring_sink_send;
+    ctx->sink.kick = pkt_ring_sink_kick;
+    ctx->sink.dev = &ctx->pkt_ring;
+    return 0;
+}
+
+#ifdef USE_NFQUEUE
+static ssize_t reinject_sink_send(void *dev, void *b1, ssize_t len1, void *b2, ssize_t len2) {
+    return reinject_pkt((reinject_t *) dev, b1, len1, b2, len2);
+}
+
+static int init_nfq_sock(io_sock_t *sock, void *capture) {
+    sock->d.nfq.capture = (nfq_capture_t *) capture;
+    return 0;
+}
+
+static int setup_nfq(io_ctx_t *ctx, const nfq_cfg_t *nfq_cfg) {
+    if (reinject_init(&ctx->reinject, nfq_cfg->reinject_mark) != 0) {
+        log_crit("io", L("Couldn't setup raw sockets for reinjecting pkts from peers"));
+        return -1;
+    }
+    ctx->reinjecting = 1;
+    ctx->sink.send = reinject_sink_send;
+    ctx->sink.dev = &ctx->reinject;
+    nfq_capture_t *capture = nfq_capture_open(nfq_cfg, xmit_captured_pkt, ctx);
+    if (capture == NULL) {
+        log_crit("io", L("Couldn't open nfqueue capture"));
+        return -1;
+    }
+    if (add_sock(ctx, nfq_capture_fd(capture), nfq, init_nfq_sock, capture) != 0) {
+        log_crit("io", L("Couldn't add nfqueue socket to io-ctx"));
         return -1;
     }
-    sock->d.tun.r_buff.capacity = sock->d.tun.w_buff.capacity = MAX_L3_PKT_SZ;
-    sock->d.tun.r_buff.len = sock->d.tun.w_buff.len = 0;
-    sock->d.tun.r_buff.current_pkt_len = sock->d.tun.w_buff.current_pkt_len = 0;
-    
-    ctx->tun_tx = &sock->d.tun.tx;
     return 0;
 }
+#endif
 
-static void free_passive_peer(void *_pp);
-
-static io_ctx_t * init_io_ctx(int tun_fd, const char *self_addr_v4, const char *self_addr_v6, const char *ipset_name, int compression_level, int low_latency_aggressiveness, ring_sz_t *ring_sz) {
+static io_ctx_t * init_io_ctx(const io_dev_t *dev, const char *self_addr_v4, const char *self_addr_v6, const char *ipset_name, int compression_level, int flush_policy, int flow_ctxs, int low_latency_aggressiveness, const ring_sz_t *ring_sz) {
     int epoll_fd;
     
 #	if defined(EPOLL_CLOEXEC) && defined(HAVE_EPOLL_CREATE1)
@@ -411,9 +911,27 @@ static io_ctx_t * init_io_ctx(int tun_fd, const char *self_addr_v4, const char *
     }
 
     ctx->compression_level = compression_level;
+    ctx->flush_policy = flush_policy;
+    ctx->flow_ctxs = flow_ctxs;
     ctx->epoll_fd = epoll_fd;
-    ctx->tun_fd = tun_fd;
+    ctx->tun_fd = dev->tun_fd;
+    ctx->tun_mtu = dev->tun_mtu;
+    ctx->route_epoch = 1; /* tables start out built at 0 */
+    if ((ctx->hdr_buff = malloc(2 * MAX_L3_PKT_SZ)) == NULL) {
+        log_crit("io", L("couldn't allocate HTTP header coding buffer"));
+        destroy_io_ctx(ctx);
+        return NULL;
+    }
     ctx->ipset_name = ipset_name;
+    if (ipset_name != NULL) {
+        size_t name_len = strlen(ipset_name) + 2;
+        if ((ctx->ipset_name_v6 = malloc(name_len)) == NULL) {
+            log_crit("io", L("Couldn't allocate IPv6 ipset name"));
+            destroy_io_ctx(ctx);
+            return NULL;
+        }
+        snprintf(ctx->ipset_name_v6, name_len, "%s6", ipset_name);
+    }
     ctx->low_lat_mode = low_latency_aggressiveness;
     ctx->tun_ring_sz = ring_sz->tun;
     ctx->conn_ring_sz = ring_sz->conn;
@@ -421,6 +939,13 @@ static io_ctx_t * init_io_ctx(int tun_fd, const char *self_addr_v4, const char *
 	ctx->resize_rings = ring_sz->do_resize;
     LIST_INIT(&ctx->disconnected_passive_peers);
     LIST_INIT(&ctx->non_conns);
+    LIST_INIT(&ctx->flush_pending);
+    TAILQ_INIT(&ctx->tun_backlogged);
+    LIST_INIT(&ctx->rx_stalled);
+    LIST_INIT(&ctx->ctl_peers);
+    LIST_INIT(&ctx->suspended);
+    LIST_INIT(&ctx->relay_kicks);
+    TAILQ_INIT(&ctx->pep_kicks);
     if (self_addr_v4 != NULL) {
         if (inet_pton(AF_INET, self_addr_v4, ctx->self_v4) != 1 /* 1 => success */) {
             log_crit("io", L("Could not convert given IPv4 self-address (%s) to binary"), self_addr_v4);
@@ -452,8 +977,50 @@ static io_ctx_t * init_io_ctx(int tun_fd, const char *self_addr_v4, const char *
         destroy_io_ctx(ctx);
         return NULL;
     }
-    DBG("io", L("adding tun: %d"), tun_fd);
-    if (add_sock(ctx, tun_fd, tun, init_tun_tx_backlog_ring, ctx) != 0) {
+    lpm_init(&ctx->routes);
+    if (batab_init(&ctx->peer_subnets, offsetof(peer_subnets_t, addr), MAX_NW_ADDR_LEN, free_peer_subnets, "peer-subnets") != 0) {
+        log_crit("io", L("Couldn't initialize peer-subnets map"));
+        destroy_io_ctx(ctx);
+        return NULL;
+    }
+    profile_set_init(&ctx->profiles);
+    if (batab_init(&ctx->peer_profiles, offsetof(peer_profile_t, addr), MAX_NW_ADDR_LEN, free, "peer-profiles") != 0) {
+        log_crit("io", L("Couldn't initialize peer-profiles map"));
+        destroy_io_ctx(ctx);
+        return NULL;
+    }
+    if (batab_init(&ctx->relay_peers, offsetof(relay_peer_t, addr), MAX_NW_ADDR_LEN, free_relay_peer, "relay-peers") != 0) {
+        log_crit("io", L("Couldn't initialize relay-peers map"));
+        destroy_io_ctx(ctx);
+        return NULL;
+    }
+    if (batab_init(&ctx->pep_flows, offsetof(io_sock_t, d.pep.st.tuple), PEP_TUPLE_SZ, NULL, "pep-flows") != 0) {
+        log_crit("io", L("Couldn't initialize pep-flows map"));
+        destroy_io_ctx(ctx);
+        return NULL;
+    }
+    if (dev->ring != NULL) {
+        if (setup_pkt_ring(ctx, dev->ring) != 0) {
+            destroy_io_ctx(ctx);
+            return NULL;
+        }
+        return ctx;
+    }
+    if (dev->nfq != NULL) {
+#ifdef USE_NFQUEUE
+        if (setup_nfq(ctx, dev->nfq) != 0) {
+            destroy_io_ctx(ctx);
+            return NULL;
+        }
+#else
+        log_crit("io", L("Built without NFQUEUE support (see --enable-nfqueue)"));
+        destroy_io_ctx(ctx);
+        return NULL;
+#endif
+        return ctx;
+    }
+    DBG("io", L("adding tun: %d"), dev->tun_fd);
+    if (add_sock(ctx, dev->tun_fd, tun, init_tun_sock, ctx) != 0) {
         log_crit("io", L("Couldn't add tun to io-ctx"));
     }
     return ctx;
@@ -465,7 +1032,7 @@ static int setup_listener(io_ctx_t *ctx, int listener_port) {
     int max_socks, num_socks;
     memset(&hints, 0, sizeof(hints));
 	hints.ai_flags = AI_PASSIVE;
-	hints.ai_family = AF_INET; /* hardcode IPv4 for now, debug why it delivers AF_INET connection as IPv6 on the other side */
+	hints.ai_family = AF_UNSPEC; /* one socket per family, IPv6 one is V6ONLY so IPv4 peers aren't seen as v4-mapped */
 	hints.ai_socktype = SOCK_STREAM;
     snprintf(buff, sizeof(buff), "%d", listener_port);
     int ret = getaddrinfo(NULL, buff, &hints, &res);
@@ -491,6 +1058,12 @@ static int setup_listener(io_ctx_t *ctx, int listener_port) {
 			continue;
 		}
 
+        if (r->ai_family == AF_INET6 && setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &on, sizeof(on)) < 0) {
+            log_warn("io", L("setting v6-only failed"));
+            close(sock);
+            continue;
+        }
+
         int sockflags;
 
         if ((sockflags = fcntl(sock, F_GETFL)) == -1) {
@@ -543,25 +1116,138 @@ static int setup_listener(io_ctx_t *ctx, int listener_port) {
 
 static int do_peer_reset = 0;
 static int do_stop = 0;
+static io_loop_stats_t loop_stats;
+
+
+/* a conn as handed to the successor (HANDOFF_CONN record, the socket goes along as the fd), followed by
+   comp_len bytes of compression state (export_compression_state), the contents of tx, rx and tun_q, the
+   session's retained stream (sess_id 0 => sessions off) and the HTTP header tables (http_hdr_export) */
+struct handoff_conn_s {
+    uint8_t peer[MAX_NW_ADDR_LEN];
+    int32_t af;
+    link_profile_t profile;
+    uint32_t comp_len, tx_len, rx_len, tun_q_len, retx_len, hdr_tx_len, hdr_rx_len;
+    uint64_t sess_id, rx_seq, tx_seq;
+};
 
+typedef struct handoff_conn_s handoff_conn_t;
 
 struct conn_sock_info_s {
     uint8_t *addr;
     int af;
+    const handoff_conn_t *handed; /* taken over from the previous process, NULL => new conn */
+    const session_hello_t *hello; /* accepted with sessions on, the session the peer opened */
+    shm_conn_t *shm; /* co-located peer, the conn takes it over (it is set to NULL then) */
 };
 
 typedef struct conn_sock_info_s conn_sock_info_t;
 
+static inline int conn_low_lat_mode(io_sock_t *conn) {
+    link_profile_t *p = &conn->d.conn.profile;
+    return (p->set & PROFILE_LOWLAT) ? p->low_lat_mode : conn->ctx->low_lat_mode;
+}
+
+static inline int conn_flush_policy(io_sock_t *conn) {
+    link_profile_t *p = &conn->d.conn.profile;
+    return (p->set & PROFILE_FLUSH) ? p->flush_policy : conn->ctx->flush_policy;
+}
+
+/* prio and rate go to the kernel (qdisc band and TCP pacing), failing them isn't fatal. Shm conns have
+   no socket to apply them to */
+static void apply_conn_sock_profile(io_sock_t *sock) {
+    if (sock->d.conn.shm != NULL) return;
+    if (conn_low_lat_mode(sock) >= DISABLE_NAGLE_ALGO) {
+        if (setsockopt(sock->fd, IPPROTO_TCP, TCP_NODELAY, (int[]){1}, sizeof(int)) != 0) {
+            log_warn("io", L("Failed to turn-off Nagle's algorithm for sock: %d"), sock->fd);
+        }
+    }
+    link_profile_t *p = &sock->d.conn.profile;
+    if ((p->set & PROFILE_PRIO) && setsockopt(sock->fd, SOL_SOCKET, SO_PRIORITY, &p->prio, sizeof(p->prio)) != 0) {
+        log_warn("io", L("Failed to set priority %d for sock: %d"), p->prio, sock->fd);
+    }
+    if (p->set & PROFILE_RATE) {
+        unsigned int bytes_per_sec = (p->rate_kbit * 125 >= UINT_MAX) ? (UINT_MAX - 1) : (unsigned int) (p->rate_kbit * 125);
+        if (setsockopt(sock->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &bytes_per_sec, sizeof(bytes_per_sec)) != 0) {
+            log_warn("io", L("Failed to set pacing rate %" PRIu64 " kbit/s for sock: %d"), p->rate_kbit, sock->fd);
+        }
+    }
+}
+
+static int send_hello(io_sock_t *conn, int flags) {
+    uint8_t hello[SESSION_HELLO_SZ];
+    session_hello_encode(&conn->d.conn.sess, flags, hello);
+    if (send(conn->fd, hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)) {
+        log_warn("io", L("couldn't send session hello on sock: %d"), conn->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/* compression state and ring contents of a conn taken over from the previous process */
+static int load_handed_conn(io_sock_t *sock, const handoff_conn_t *h) {
+    io_ctx_t *ctx = sock->ctx;
+    const uint8_t *d = (const uint8_t *) (h + 1);
+    if (ctx->flow_ctxs > 0) {
+        log_warnx("io", L("handed over stream of sock: %d has no flow-ctx framing, dropping it"), sock->fd);
+        return -1;
+    }
+    if (init_compression_ctx_from(&sock->d.conn.comp, d, h->comp_len) != 0) {
+        log_crit("io", L("couldn't pick up handed over compression for sock: %d"), sock->fd);
+        return -1;
+    }
+    d += h->comp_len;
+    if (ring_load(&sock->d.conn.tx, d, h->tx_len) != 0 || ring_load(&sock->d.conn.rx, d + h->tx_len, h->rx_len) != 0) return -1;
+    d += h->tx_len + h->rx_len;
+    sock->d.conn.tx_queued = h->tx_len;
+    if (h->tun_q_len > 0) {
+        if (init_backlog_ring(&sock->d.conn.tun_q, ctx->tun_ring_sz, ctx->resize_rings, ctx->max_allowed_ring_sz) != 0) {
+            log_crit("io", L("couldn't allocate tun egress queue for sock: %d"), sock->fd);
+            return -1;
+        }
+        if (ring_load(&sock->d.conn.tun_q, d, h->tun_q_len) != 0) return -1;
+        d += h->tun_q_len;
+    }
+    if (ctx->resume_grace > 0 && h->sess_id != 0 &&
+        session_restore(&sock->d.conn.sess, h->sess_id, h->rx_seq, h->tx_seq, d, h->retx_len) != 0) return -1;
+    d += h->retx_len;
+    if (http_hdr_import(&sock->d.conn.hdr_tx, d, h->hdr_tx_len) != 0 || http_hdr_import(&sock->d.conn.hdr_rx, d + h->hdr_tx_len, h->hdr_rx_len) != 0) {
+        log_crit("io", L("couldn't pick up handed over HTTP header tables for sock: %d"), sock->fd);
+        return -1;
+    }
+    sock->d.conn.inherited = 1;
+    return 0;
+}
+
+static compress_t *relay_rx_comp(void *conn_, const uint8_t *src);
+static int relay_forward(void *conn_, const uint8_t *hdr, const uint8_t *piece, ssize_t len);
+static void relay_lost(void *conn_, const uint8_t *dest);
+
 static int init_conn_sock(io_sock_t *sock, void *_addr_info) {
     conn_sock_info_t * addr_info = (conn_sock_info_t *) _addr_info;
     io_ctx_t *ctx = sock->ctx;
     memcpy(sock->d.conn.peer, addr_info->addr, MAX_NW_ADDR_LEN);
     sock->d.conn.af = addr_info->af;
-    if (init_backlog_ring(&sock->d.conn.tx, ctx->conn_ring_sz, ctx->resize_rings, ctx->max_allowed_ring_sz) != 0) {
+    sock->d.conn.shm = addr_info->shm; /* goes with the conn even if it doesn't make it */
+    addr_info->shm = NULL;
+    sock->d.conn.gen = ++ctx->conn_gens;
+    sock->d.conn.relay_cb = (flow_ctx_relay_t) {sock, relay_rx_comp, relay_forward, relay_lost};
+    peer_profile_t *pp = batab_get(&ctx->peer_profiles, sock->d.conn.peer);
+    if (addr_info->handed != NULL) {
+        sock->d.conn.profile = addr_info->handed->profile;
+    } else if (pp != NULL) {
+        sock->d.conn.profile = pp->p;
+    }
+    link_profile_t *p = &sock->d.conn.profile;
+    int level = (p->set & PROFILE_LEVEL) ? p->level : ctx->compression_level;
+    ssize_t ring_sz = (p->set & PROFILE_RING) ? p->ring_sz : ctx->conn_ring_sz;
+    ssize_t max_ring_sz = (p->set & PROFILE_MAX_RING) ? p->max_ring_sz : ctx->max_allowed_ring_sz;
+    if (ring_sz < compress_ring_min_sz()) ring_sz = compress_ring_min_sz();
+    int resize_rings = (p->set & PROFILE_MAX_RING) ? (max_ring_sz > ring_sz) : ctx->resize_rings;
+    if (init_backlog_ring(&sock->d.conn.tx, ring_sz, resize_rings, max_ring_sz) != 0) {
         log_crit("io", L("couldn't allocate tx-backlog ring for sock: %d"), sock->fd);
         return -1;
     }
-    if (init_backlog_ring(&sock->d.conn.rx, ctx->conn_ring_sz, ctx->resize_rings, ctx->max_allowed_ring_sz) != 0) {
+    if (init_backlog_ring(&sock->d.conn.rx, ring_sz, resize_rings, max_ring_sz) != 0) {
         log_crit("io", L("couldn't allocate rx-backlog ring for sock: %d"), sock->fd);
         return -1;
     }
@@ -569,13 +1255,38 @@ static int init_conn_sock(io_sock_t *sock, void *_addr_info) {
         log_crit("io", L("couldn't wire-up lookup for sock: %d"), sock->fd);
         return -1;
     }
-    if (init_compression_ctx(&sock->d.conn.comp, ctx->compression_level) != 0) {
+    ctx->route_epoch++;
+    if (ctx->resume_grace > 0 && sock->d.conn.shm == NULL && session_init(&sock->d.conn.sess, SESSION_RETX_SZ) != 0) return -1;
+    http_hdr_init(&sock->d.conn.hdr_tx);
+    http_hdr_init(&sock->d.conn.hdr_rx);
+    if (addr_info->handed != NULL) {
+        if (load_handed_conn(sock, addr_info->handed) != 0) return -1;
+    } else if (init_compression_ctx(&sock->d.conn.comp, level) != 0) {
         log_crit("io", L("couldn't initialize compression for sock: %d"), sock->fd);
         return -1;
     }
-    if (sock->ctx->low_lat_mode >= DISABLE_NAGLE_ALGO) {
-        if (setsockopt(sock->fd, IPPROTO_TCP, TCP_NODELAY, (int[]){1}, sizeof(int)) != 0) {
-            log_warn("io", L("Failed to turn-off Nagle's algorithm for sock: %d"), sock->fd);
+    if (ctx->flow_ctxs > 0) {
+        if ((sock->d.conn.fc = malloc(sizeof(flow_ctx_tab_t))) == NULL) {
+            log_crit("io", L("couldn't allocate flow-ctx table for sock: %d"), sock->fd);
+            return -1;
+        }
+        if (flow_ctx_init(sock->d.conn.fc, &sock->d.conn.comp, ctx->flow_ctxs, level) != 0) {
+            free(sock->d.conn.fc);
+            sock->d.conn.fc = NULL;
+            return -1;
+        }
+        sock->d.conn.fc->relay = &sock->d.conn.relay_cb;
+    }
+    apply_conn_sock_profile(sock);
+    if (ctx->resume_grace > 0 && addr_info->hello != NULL) { /* answer, anything else goes out after it */
+        sock->d.conn.sess.id = addr_info->hello->id;
+        if (send_hello(sock, 0) != 0) return -1;
+    }
+    if (sock->d.conn.shm != NULL) { /* peer going away shows up as a hang-up of the socket the channel came over */
+        struct epoll_event evt = {.events = EPOLLRDHUP | EPOLLET, .data.ptr = sock};
+        if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, sock->d.conn.shm->sock, &evt) != 0) {
+            log_warn("io", L("failed to add shm socket of conn: %d to polling context"), sock->fd);
+            return -1;
         }
     }
     return 0;
@@ -583,15 +1294,56 @@ static int init_conn_sock(io_sock_t *sock, void *_addr_info) {
 
 static int init_out_conn_sock(io_sock_t *sock, void *_peer) {
     passive_peer_t *peer = (passive_peer_t *) _peer;
-    conn_sock_info_t addr_info = { .addr = peer->addr, .af = peer->addr_info->ai_family};
+    conn_sock_info_t addr_info = { .addr = peer->addr, .af = peer->addr_info->ai_family, .handed = NULL, .hello = NULL};
     int ret = init_conn_sock(sock, &addr_info);
     sock->d.conn.outbound = 1;
+    if (ret == 0 && sock->ctx->resume_grace > 0) {
+        sock->d.conn.hello_pending = 1;
+        ret = send_hello(sock, 0);
+    }
     return ret;
 }
 
+/* sessions are of no use on one host, a broken shm conn is simply set up again */
+static int init_out_shm_conn_sock(io_sock_t *sock, void *addr_info) {
+    int ret = init_conn_sock(sock, addr_info);
+    sock->d.conn.outbound = 1;
+    return ret;
+}
+
+/* co-located peer (shm= in its profile), the hello tells it which peer we are */
+static int setup_shm_connection(io_ctx_t *ctx, passive_peer_t *peer, const link_profile_t *p) {
+    shm_hello_t hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.af = peer->addr_info->ai_family;
+    memcpy(hello.addr, (hello.af == AF_INET6) ? ctx->self_v6 : ctx->self_v4, sizeof(hello.addr));
+    ssize_t ring_sz = (p->set & PROFILE_RING) ? p->ring_sz : ctx->conn_ring_sz;
+    shm_conn_t *shm = malloc(sizeof(shm_conn_t));
+    if (shm == NULL) {
+        log_warn("io", L("couldn't allocate shm conn for peer: %s"), peer->humanified_address);
+        return -1;
+    }
+    if ((shm->sock = shm_connect(p->shm_path, ring_sz, &hello, &shm->chan)) < 0) {
+        log_warn("io", L("failed to connect to peer: %s over shared memory at %s, will try later"), peer->humanified_address, p->shm_path);
+        free(shm);
+        return -1;
+    }
+    int fd = shm->chan.bell_fd;
+    conn_sock_info_t addr_info = {.addr = peer->addr, .af = hello.af, .handed = NULL, .hello = NULL, .shm = shm};
+    if (add_sock(ctx, fd, conn, init_out_shm_conn_sock, &addr_info) != 0) {
+        log_warn("io", L("Failed to add passive-peer %s shm conn to io-ctx"), peer->humanified_address);
+        if (addr_info.shm != NULL) destroy_shm_conn(ctx, shm);
+        return -1;
+    }
+    log_info("io", L("connnected as client to peer: %s over shared memory at %s (%zu byte rings)"), peer->humanified_address, p->shm_path, shm->chan.sz);
+    return fd;
+}
+
 static int setup_outbound_connection(io_ctx_t *ctx, passive_peer_t *peer) {
     struct addrinfo *r = peer->addr_info;
     assert(peer->addr_info != NULL);
+    peer_profile_t *pp = batab_get(&ctx->peer_profiles, peer->addr);
+    if (pp != NULL && (pp->p.set & PROFILE_SHM)) return setup_shm_connection(ctx, peer, &pp->p);
     int c_fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
     int failed = 0;
     if (c_fd < 0) {
@@ -659,8 +1411,17 @@ static int capture_passive_peer(batab_t *tab, uint8_t *nw_addr, struct addrinfo
 static void disconnect_and_discard_passive_peer(io_ctx_t *ctx, passive_peer_t *peer);
 static void connect_and_add_passive_peer(io_ctx_t *ctx, passive_peer_t *peer);
 
+/* host, host:port, IPv6-addr or [IPv6-addr]:port */
 static void separate_peer_port(char *peer_str, char *port_dest_buff, size_t port_dest_sz, const char *default_port) {
-    char *port_frag_start = strchr(peer_str, ':');
+    char *port_frag_start;
+    if (*peer_str == '[' && (port_frag_start = strchr(peer_str, ']')) != NULL) {
+        memmove(peer_str, peer_str + 1, port_frag_start - peer_str - 1);
+        *(port_frag_start - 1) = '\0';
+        port_frag_start = (*(port_frag_start + 1) == ':') ? port_frag_start + 1 : NULL;
+    } else {
+        port_frag_start = strchr(peer_str, ':');
+        if (port_frag_start != NULL && strchr(port_frag_start + 1, ':') != NULL) port_frag_start = NULL; /* bare IPv6 address */
+    }
     if (port_frag_start == NULL) {
         strncpy(port_dest_buff, default_port, port_dest_sz);
     } else {
@@ -671,6 +1432,324 @@ static void separate_peer_port(char *peer_str, char *port_dest_buff, size_t port
     }
 }
 
+static void free_peer_subnets(void *_ps) {
+    peer_subnets_t *ps = (peer_subnets_t *) _ps;
+    assert(ps != NULL);
+    free(ps->subnets);
+    free(ps->nhs);
+    free(ps);
+}
+
+static void free_relay_peer(void *_rp) {
+    relay_peer_t *rp = (relay_peer_t *) _rp;
+    destroy_compression_ctx(&rp->comp);
+    free(rp);
+}
+
+/* whitespace separated list of prefixes and profile words (@profile, key=value) following host[:port]
+   on a peer-file line */
+static int parse_subnets(char *subnets_str, const char *peer, const profile_set_t *profiles, link_profile_t *profile, lpm_prefix_t **subnets, int *num_subnets) {
+    char *tok, *save_ptr = NULL;
+    int capacity = 0;
+    *subnets = NULL;
+    *num_subnets = 0;
+    memset(profile, 0, sizeof(*profile));
+    for (tok = strtok_r(subnets_str, " \t\r", &save_ptr); tok != NULL; tok = strtok_r(NULL, " \t\r", &save_ptr)) {
+        int ret = profile_apply_word(profiles, tok, profile);
+        if (ret < 0) log_warnx("io", L("ignoring invalid setting '%s' for peer: %s"), tok, peer);
+        if (ret != 0) continue;
+        if (*num_subnets == capacity) {
+            capacity = capacity ? capacity * 2 : 4;
+            lpm_prefix_t *p = realloc(*subnets, capacity * sizeof(lpm_prefix_t));
+            if (p == NULL) {
+                log_warn("io", L("Couldn't allocate subnets for peer: %s"), peer);
+                free(*subnets);
+                *subnets = NULL;
+                *num_subnets = 0;
+                return 1;
+            }
+            *subnets = p;
+        }
+        if (lpm_parse_prefix(tok, &(*subnets)[*num_subnets]) != 0) {
+            log_warnx("io", L("ignoring invalid subnet '%s' for peer: %s"), tok, peer);
+            continue;
+        }
+        (*num_subnets)++;
+    }
+    return 0;
+}
+
+/* subnets go to the first address a peer resolves to, the peer-subnets entry takes ownership of them */
+static int capture_peer_subnets(batab_t *tab, uint8_t *nw_addr, int af, lpm_prefix_t **subnets, int num_subnets, const char *host_buff) {
+    if (*subnets == NULL) return 0;
+    if (batab_get(tab, nw_addr) != NULL) {
+        log_info("io", L("subnets for %s already configured (ignoring)"), host_buff);
+        return 0;
+    }
+    peer_subnets_t *ps = malloc(sizeof(peer_subnets_t));
+    if (ps == NULL) {
+        log_warn("io", L("Couldn't allocate peer-subnets for %s"), host_buff);
+        return 1;
+    }
+    memcpy(ps->addr, nw_addr, MAX_NW_ADDR_LEN);
+    ps->af = af;
+    ps->subnets = *subnets;
+    ps->num_subnets = num_subnets;
+    ps->nhs = NULL;
+    if (batab_put(tab, ps, NULL) != 0) {
+        log_warn("io", L("Couldn't add peer-subnets for %s"), host_buff);
+        free(ps);
+        return 1;
+    }
+    *subnets = NULL;
+    return 0;
+}
+
+static int capture_peer_profile(batab_t *tab, uint8_t *nw_addr, const link_profile_t *profile, const char *host_buff) {
+    if (profile->set == 0) return 0;
+    if (batab_get(tab, nw_addr) != NULL) {
+        log_info("io", L("profile for %s already configured (ignoring)"), host_buff);
+        return 0;
+    }
+    peer_profile_t *pp = malloc(sizeof(peer_profile_t));
+    if (pp == NULL) {
+        log_warn("io", L("Couldn't allocate peer-profile for %s"), host_buff);
+        return 1;
+    }
+    memcpy(pp->addr, nw_addr, MAX_NW_ADDR_LEN);
+    pp->p = *profile;
+    if (batab_put(tab, pp, NULL) != 0) {
+        log_warn("io", L("Couldn't add peer-profile for %s"), host_buff);
+        free(pp);
+        return 1;
+    }
+    return 0;
+}
+
+static void destroy_route_tab(route_tab_t *t) {
+    for (int i = 1; i < t->n; i++) {
+        free(t->nh[i].m);
+        maglev_destroy(&t->nh[i].mg);
+    }
+    free(t->nh);
+    t->nh = NULL;
+    t->n = 0;
+}
+
+static int prefix_cmp(const lpm_prefix_t *a, const lpm_prefix_t *b) {
+    if (a->af != b->af) return a->af - b->af;
+    if (a->len != b->len) return a->len - b->len;
+    return memcmp(a->addr, b->addr, sizeof(a->addr));
+}
+
+struct route_entry_s {
+    peer_subnets_t *ps;
+    int i; /* subnet */
+};
+
+typedef struct route_entry_s route_entry_t;
+
+/* by subnet, then by peer */
+static int route_entry_cmp(const void *a_, const void *b_) {
+    const route_entry_t *a = (const route_entry_t *) a_, *b = (const route_entry_t *) b_;
+    int c = prefix_cmp(&a->ps->subnets[a->i], &b->ps->subnets[b->i]);
+    return c ? c : memcmp(a->ps->addr, b->ps->addr, MAX_NW_ADDR_LEN);
+}
+
+static route_nh_t *add_route_nh(route_tab_t *t, peer_subnets_t **members, int n) {
+    route_nh_t *nh = &t->nh[t->n];
+    if ((nh->m = calloc(n, sizeof(route_member_t))) == NULL || (n > 1 && maglev_init(&nh->mg) != 0)) {
+        log_crit("io", L("Couldn't allocate route next-hop"));
+        free(nh->m);
+        nh->m = NULL;
+        return NULL;
+    }
+    t->n++;
+    nh->n = n;
+    for (int i = 0; i < n; i++) {
+        memcpy(nh->m[i].addr, members[i]->addr, MAX_NW_ADDR_LEN);
+        nh->m[i].af = members[i]->af;
+    }
+    return nh;
+}
+
+/* next-hop of the gateway group with these members, added unless another subnet has it already */
+static route_nh_t *group_route_nh(route_tab_t *t, int first_group, peer_subnets_t **members, int n) {
+    for (int g = first_group; g < t->n; g++) {
+        route_nh_t *nh = &t->nh[g];
+        int same = (nh->n == n);
+        for (int i = 0; same && i < n; i++) same = (memcmp(nh->m[i].addr, members[i]->addr, MAX_NW_ADDR_LEN) == 0);
+        if (same) return nh;
+    }
+    return add_route_nh(t, members, n);
+}
+
+/* a next-hop per peer with subnets, then one per gateway group (peers listing the same subnet). Tab
+   is left for the caller to destroy, built or not */
+static int build_routes(batab_t *peer_subnets, lpm_t *routes, route_tab_t *t) {
+    unsigned n = batab_sz(peer_subnets);
+    if (n > LPM_MAX_NH) {
+        log_crit("io", L("too many peers with subnets (%u, max: %d)"), n, LPM_MAX_NH);
+        return -1;
+    }
+    size_t num = 0, k = 0;
+    batab_entry_t *e;
+    batab_foreach_do(peer_subnets, e) {
+        num += ((peer_subnets_t *) e->value)->num_subnets;
+    }
+    route_entry_t *ents = malloc((num + 1) * sizeof(route_entry_t));
+    if (ents == NULL || (t->nh = calloc(n + num + 1, sizeof(route_nh_t))) == NULL) {
+        log_crit("io", L("Couldn't allocate route next-hop table"));
+        free(ents);
+        return -1;
+    }
+    t->n = 1;
+    batab_foreach_do(peer_subnets, e) {
+        peer_subnets_t *ps = (peer_subnets_t *) e->value;
+        ps->nh = t->n;
+        if (add_route_nh(t, &ps, 1) == NULL || (ps->num_subnets > 0 && (ps->nhs = calloc(ps->num_subnets, sizeof(route_nh_t *))) == NULL)) {
+            free(ents);
+            return -1;
+        }
+        for (int i = 0; i < ps->num_subnets; i++) ents[k++] = (route_entry_t) {ps, i};
+    }
+    qsort(ents, num, sizeof(route_entry_t), route_entry_cmp);
+
+    int first_group = t->n, ret = 0;
+    char prefix_buff[64];
+    for (size_t i = 0, j; ret == 0 && i < num; i = j) {
+        peer_subnets_t *members[MAGLEV_MAX_MEMBERS];
+        lpm_prefix_t *prefix = &ents[i].ps->subnets[ents[i].i];
+        int m = 0;
+        for (j = i; j < num && prefix_cmp(&ents[j].ps->subnets[ents[j].i], prefix) == 0; j++) {
+            if (m > 0 && members[m - 1] == ents[j].ps) continue; /* listed twice */
+            if (m == MAGLEV_MAX_MEMBERS) {
+                log_warnx("io", L("subnet %s has more than %d gateways, ignoring the rest"), lpm_prefix_str(prefix, prefix_buff, sizeof(prefix_buff)), m);
+                continue;
+            }
+            members[m++] = ents[j].ps;
+        }
+        route_nh_t *nh = (m == 1) ? &t->nh[members[0]->nh] : group_route_nh(t, first_group, members, m);
+        if (nh == NULL) {
+            ret = -1;
+            break;
+        }
+        for (size_t l = i; l < j; l++) ents[l].ps->nhs[ents[l].i] = nh;
+        if (t->n - 1 > LPM_MAX_NH) {
+            log_crit("io", L("too many route next-hops (peers with subnets and gateway groups, max: %d)"), LPM_MAX_NH);
+            ret = -1;
+        } else if (lpm_add(routes, prefix, (uint16_t) (nh - t->nh)) != 0) {
+            log_crit("io", L("Couldn't add route"));
+            ret = -1;
+        }
+    }
+    free(ents);
+    if (ret == 0 && t->n > first_group) log_info("io", L("gateway groups: %d"), t->n - first_group);
+    return (ret == 0) ? lpm_build(routes) : -1;
+}
+
+static int same_subnets(peer_subnets_t *a, peer_subnets_t *b) {
+    if (a == NULL || b == NULL) return a == b;
+    if (a->num_subnets != b->num_subnets) return 0;
+    for (int i = 0; i < a->num_subnets; i++) {
+        lpm_prefix_t *x = &a->subnets[i], *y = &b->subnets[i];
+        if (x->af != y->af || x->len != y->len || memcmp(x->addr, y->addr, sizeof(x->addr)) != 0) return 0;
+    }
+    return 1;
+}
+
+/* re-marks subnets of live peers whose subnets changed and installs the new tables, old ones are handed back for destruction */
+static void swap_routes(io_ctx_t *ctx, lpm_t *routes, batab_t *peer_subnets, route_tab_t *route_tab) {
+    const char *add = ctx->routes_inherited ? "-exist add" : "add"; /* taken over conns' subnets are marked already */
+    batab_entry_t *e;
+    batab_foreach_do((&ctx->live_conns), e) {
+        io_sock_t *sock = (io_sock_t *) e->value;
+        peer_subnets_t *old = batab_get(&ctx->peer_subnets, sock->d.conn.peer);
+        peer_subnets_t *new = batab_get(peer_subnets, sock->d.conn.peer);
+        if (same_subnets(old, new)) continue;
+        if (run_ipset_for_listed_subnets(ctx, "del", old, peer_subnets) != 0 || run_ipset_for_subnets(ctx, add, new) != 0) {
+            log_warnx("io", L("Couldn't update route-marks for subnets behind fd: %d"), sock->fd);
+        }
+    }
+    ctx->routes_inherited = 0;
+    lpm_t tmp_routes = ctx->routes;
+    ctx->routes = *routes;
+    *routes = tmp_routes;
+    batab_t tmp_peer_subnets = ctx->peer_subnets;
+    ctx->peer_subnets = *peer_subnets;
+    *peer_subnets = tmp_peer_subnets;
+    route_tab_t tmp_route_tab = ctx->route_tab;
+    ctx->route_tab = *route_tab;
+    *route_tab = tmp_route_tab;
+}
+
+static int set_tun_flow_grouping(io_ctx_t *ctx, int on);
+
+/* profiles apply to conns set up from now on, live conns keep the settings they were set up with */
+static void swap_profiles(io_ctx_t *ctx, profile_set_t *profiles, batab_t *peer_profiles) {
+    profile_set_t tmp_profiles = ctx->profiles;
+    ctx->profiles = *profiles;
+    *profiles = tmp_profiles;
+    batab_t tmp_peer_profiles = ctx->peer_profiles;
+    ctx->peer_profiles = *peer_profiles;
+    *peer_profiles = tmp_peer_profiles;
+
+    ctx->profile_flow_grouping = 0;
+    ctx->via_peers = 0;
+    ctx->route_epoch++; /* via= may have moved group members to other hubs */
+    batab_entry_t *e;
+    batab_foreach_do((&ctx->peer_profiles), e) {
+        link_profile_t *p = &((peer_profile_t *) e->value)->p;
+        if ((p->set & PROFILE_FLUSH) && p->flush_policy == IO_FLUSH_FLOW) ctx->profile_flow_grouping = 1;
+        if (p->set & PROFILE_VIA) ctx->via_peers++;
+    }
+    if (set_tun_flow_grouping(ctx, ctx->flush_policy == IO_FLUSH_FLOW || ctx->profile_flow_grouping) != 0) {
+        log_warn("io", L("Couldn't allocate flow-grouping batch, tun reads aren't grouped by flow"));
+    }
+}
+
+static inline size_t first_word_len(const char *line) {
+    return strcspn(line, " \t\r\n");
+}
+
+static ctl_peer_t *find_ctl_peer(io_ctx_t *ctx, const char *line) {
+    size_t len = first_word_len(line);
+    ctl_peer_t *cp;
+    LIST_FOREACH(cp, &ctx->ctl_peers, link) {
+        if (first_word_len(cp->line) == len && strncmp(cp->line, line, len) == 0) return cp;
+    }
+    return NULL;
+}
+
+struct peer_lines_s {
+    FILE *f;
+    int file_done;
+    ctl_peer_t *next;
+};
+
+typedef struct peer_lines_s peer_lines_t;
+
+/* peer-file lines (except those for peers the control socket added or removed), then lines added over
+   the control socket */
+static int next_peer_line(io_ctx_t *ctx, peer_lines_t *src, char *line) {
+    while (! src->file_done) {
+        if (src->f == NULL || fgets(line, MAX_ADDR_LEN, src->f) == NULL) {
+            src->file_done = 1;
+            src->next = LIST_FIRST(&ctx->ctl_peers);
+        } else if (find_ctl_peer(ctx, line) == NULL) {
+            return 1;
+        }
+    }
+    while (src->next != NULL) {
+        ctl_peer_t *cp = src->next;
+        src->next = LIST_NEXT(cp, link);
+        if (cp->removed) continue;
+        strcpy(line, cp->line);
+        return 1;
+    }
+    return 0;
+}
+
 static int reset_peers(io_ctx_t *ctx, const char* peer_file_path, int expected_port) {
     char peer[MAX_ADDR_LEN];
     char host_buff[MAX_ADDR_LEN];
@@ -683,8 +1762,31 @@ static int reset_peers(io_ctx_t *ctx, const char* peer_file_path, int expected_p
         log_crit("io", L("failed to initialize current-passive-peers tracker"));
         return -1;
     }
+
+    lpm_t updated_routes;
+    batab_t updated_peer_subnets;
+    route_tab_t updated_route_tab = {NULL, 0};
+    lpm_init(&updated_routes);
+    if (batab_init(&updated_peer_subnets, offsetof(peer_subnets_t, addr), MAX_NW_ADDR_LEN, free_peer_subnets, "current-peer-subnets") != 0) {
+        log_crit("io", L("failed to initialize current-peer-subnets tracker"));
+        batab_destory(&updated_passive_peers);
+        return -1;
+    }
+
+    profile_set_t updated_profiles;
+    batab_t updated_peer_profiles;
+    link_profile_t profile;
+    profile_set_init(&updated_profiles);
+    if (batab_init(&updated_peer_profiles, offsetof(peer_profile_t, addr), MAX_NW_ADDR_LEN, free, "current-peer-profiles") != 0) {
+        log_crit("io", L("failed to initialize current-peer-profiles tracker"));
+        batab_destory(&updated_passive_peers);
+        batab_destory(&updated_peer_subnets);
+        return -1;
+    }
     
     FILE *f = fopen(peer_file_path, "r");
+    if (f == NULL) log_warn("io", L("couldn't open peer file %s, using peers added over control socket only"), peer_file_path);
+    peer_lines_t lines = {f, 0, NULL};
 
     struct addrinfo hints, *res, *r, *p;
     
@@ -696,16 +1798,26 @@ static int reset_peers(io_ctx_t *ctx, const char* peer_file_path, int expected_p
 
     int encountered_failure = 0;
     
-    while (fgets(peer, MAX_ADDR_LEN, f) != NULL) {
+    while (next_peer_line(ctx, &lines, peer)) {
         char *pos;
         if ((pos=strchr(peer, '\n')) != NULL)
             *pos = '\0';
+        if (peer[strspn(peer, " \t\r")] == '\0' || peer[0] == '#') continue;
+        char *subnets_str = peer + strcspn(peer, " \t\r");
+        if (*subnets_str != '\0') *subnets_str++ = '\0';
+        if (strcmp(peer, "profile") == 0) {
+            if (profile_define(&updated_profiles, subnets_str) != 0) log_warnx("io", L("ignoring invalid profile line"));
+            continue;
+        }
         separate_peer_port(peer, port_buff, sizeof(port_buff), default_port_buff);
         res = NULL;
         if (getaddrinfo(peer, port_buff, &hints, &res) != 0) {
             log_warn("io", L("ignoring peer: %s"), peer);
             continue;
         }
+        lpm_prefix_t *subnets;
+        int num_subnets;
+        encountered_failure |= parse_subnets(subnets_str, peer, &updated_profiles, &profile, &subnets, &num_subnets);
         log_info("io", L("processing peer: %s"), peer);
 
         r = res;
@@ -728,26 +1840,39 @@ static int reset_peers(io_ctx_t *ctx, const char* peer_file_path, int expected_p
 
             log_info("io", L("found peer: %s == host: %s and port: %s"), peer, host_buff, port_buff);
 
+            if ((profile.set & PROFILE_VIA) && profile.via_af != r->ai_family) {
+                log_warnx("io", L("peer %s (%s) isn't of its hub's address family, ignoring it"), peer, host_buff);
+                p = r;
+                continue;
+            }
             memset(nw_addr, 0, MAX_NW_ADDR_LEN);
             switch (r->ai_family) {
             case AF_INET:
-                if (ctx->using_af | USING_IPV4) {
+                if (ctx->using_af & USING_IPV4) {
                     void *client_addr = (void *)&((struct sockaddr_in *) r->ai_addr)->sin_addr.s_addr;
-                    if (memcmp(client_addr, ctx->self_v4, IPv4_ADDR_LEN) > 0) {
+                    memcpy(nw_addr, client_addr, IPv4_ADDR_LEN);
+                    if (profile.set & PROFILE_VIA) {
+                        log_info("io", L("peer %s is RELAYED"), peer);
+                    } else if (memcmp(client_addr, ctx->self_v4, IPv4_ADDR_LEN) > 0) {
                         log_info("io", L("peer %s is PASSIVE"), peer);
-                        memcpy(nw_addr, client_addr, IPv4_ADDR_LEN);
                         encountered_failure |= capture_passive_peer(&updated_passive_peers, nw_addr, r, host_buff, port_buff, &do_free_addr_info);
                     }
+                    encountered_failure |= capture_peer_subnets(&updated_peer_subnets, nw_addr, r->ai_family, &subnets, num_subnets, host_buff);
+                    encountered_failure |= capture_peer_profile(&updated_peer_profiles, nw_addr, &profile, host_buff);
                 }
                 break;
             case AF_INET6:
-                if (ctx->using_af | USING_IPV6) {
+                if (ctx->using_af & USING_IPV6) {
                     void *client_addr = (void *)((struct sockaddr_in6 *) r->ai_addr)->sin6_addr.s6_addr;
-                    if (memcmp(client_addr, ctx->self_v6, IPv6_ADDR_LEN) > 0) {
+                    memcpy(nw_addr, client_addr, IPv6_ADDR_LEN);
+                    if (profile.set & PROFILE_VIA) {
+                        log_info("io", L("peer %s is RELAYED"), peer);
+                    } else if (memcmp(client_addr, ctx->self_v6, IPv6_ADDR_LEN) > 0) {
                         log_info("io", L("peer %s is PASSIVE"), peer);
-                        memcpy(nw_addr, client_addr, IPv6_ADDR_LEN);
                         encountered_failure |= capture_passive_peer(&updated_passive_peers, nw_addr, r, host_buff, port_buff, &do_free_addr_info);
                     }
+                    encountered_failure |= capture_peer_subnets(&updated_peer_subnets, nw_addr, r->ai_family, &subnets, num_subnets, host_buff);
+                    encountered_failure |= capture_peer_profile(&updated_peer_profiles, nw_addr, &profile, host_buff);
                 }
                 break;
             default:
@@ -756,10 +1881,19 @@ static int reset_peers(io_ctx_t *ctx, const char* peer_file_path, int expected_p
             p = r;
         }
         if (do_free_addr_info && p != NULL) freeaddrinfo(p);
+        free(subnets);
+    }
+
+    if (! encountered_failure) {
+        encountered_failure = (build_routes(&updated_peer_subnets, &updated_routes, &updated_route_tab) != 0);
     }
 
     if (! encountered_failure) {
         DBG("io", L("found a total of %u passive peers"), batab_sz(&updated_passive_peers));
+        DBG("io", L("found subnets behind %u peers"), batab_sz(&updated_peer_subnets));
+
+        swap_routes(ctx, &updated_routes, &updated_peer_subnets, &updated_route_tab);
+        swap_profiles(ctx, &updated_profiles, &updated_peer_profiles);
         
         batab_entry_t *e;
         batab_foreach_do((&ctx->passive_peers), e) {
@@ -781,8 +1915,13 @@ static int reset_peers(io_ctx_t *ctx, const char* peer_file_path, int expected_p
     }
 
     batab_destory(&updated_passive_peers);
+    batab_destory(&updated_peer_subnets);
+    lpm_destroy(&updated_routes);
+    destroy_route_tab(&updated_route_tab);
+    batab_destory(&updated_peer_profiles);
+    profile_set_destroy(&updated_profiles);
 
-    fclose(f);
+    if (f != NULL) fclose(f);
 
     return 0;
 }
@@ -803,6 +1942,12 @@ static void connect_and_add_passive_peer(io_ctx_t *ctx, passive_peer_t *peer) {
     assert(peer_copy->addr_info != NULL);
     peer->addr_info = NULL; /* so it doesn't get free'd */
     assert(peer_copy->addr_info != NULL);
+
+    io_sock_t *inherited = batab_get(&ctx->live_conns, peer_copy->addr);
+    if (inherited != NULL && inherited->d.conn.inherited) { /* connected by the previous process (hot upgrade) */
+        inherited->d.conn.outbound = 1;
+        return;
+    }
     
     if (setup_outbound_connection(ctx, peer_copy) < 0) {
         log_warn("io", L("Failed to setup connection to peer: %s, adding disconnected"), peer_copy->humanified_address);
@@ -829,6 +1974,38 @@ void trigger_io_loop_stop() {
     do_stop = 1;
 }
 
+void io_loop_stats(io_loop_stats_t *stats) {
+    memcpy(stats, &loop_stats, sizeof(loop_stats));
+}
+
+static inline uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static inline void record_loop_iteration(int num_evts, uint64_t busy_ns) {
+    uint64_t us = busy_ns / 1000;
+    int b = 0;
+    while (us > 0 && b < (IO_LOOP_LAT_BUCKETS - 1)) {
+        us >>= 1;
+        b++;
+    }
+    loop_stats.iterations++;
+    loop_stats.events += (num_evts > 0) ? num_evts : 0;
+    loop_stats.busy_ns += busy_ns;
+    if (busy_ns > loop_stats.max_busy_ns) loop_stats.max_busy_ns = busy_ns;
+    loop_stats.lat_hist[b]++;
+}
+
+/* accepted with sessions on, becomes (or resumes) a conn once the peer's hello is in */
+static int init_hs_sock(io_sock_t *sock, void *_addr_info) {
+    conn_sock_info_t *addr_info = (conn_sock_info_t *) _addr_info;
+    memcpy(sock->d.hs.peer, addr_info->addr, MAX_NW_ADDR_LEN);
+    sock->d.hs.af = addr_info->af;
+    return 0;
+}
+
 static inline int do_accept(io_sock_t *listener_sock) {
     DBG("io", L("called to ACCEPT"));
     struct sockaddr_storage remote_addr;
@@ -842,6 +2019,7 @@ static inline int do_accept(io_sock_t *listener_sock) {
     memset(nw_addr, 0, MAX_NW_ADDR_LEN);
     void *client_addr;
     struct sockaddr *r = (struct sockaddr *) &remote_addr;
+    int af = r->sa_family;
     switch (r->sa_family) {
     case AF_INET:
         client_addr = (void *)&((struct sockaddr_in *) r)->sin_addr.s_addr;
@@ -849,31 +2027,105 @@ static inline int do_accept(io_sock_t *listener_sock) {
         break;
     case AF_INET6:
         client_addr = (void *)&((struct sockaddr_in6 *) r)->sin6_addr.s6_addr;
-        memcpy(nw_addr, client_addr, IPv6_ADDR_LEN);
+        if (IN6_IS_ADDR_V4MAPPED(client_addr)) { /* listener is v6-only, but keep lookups keyed on the plain IPv4 addr regardless */
+            memcpy(nw_addr, ((uint8_t *) client_addr) + IPv6_ADDR_LEN - IPv4_ADDR_LEN, IPv4_ADDR_LEN);
+            af = AF_INET;
+        } else {
+            memcpy(nw_addr, client_addr, IPv6_ADDR_LEN);
+        }
         break;
     default:
         log_warn("io", L("Encountered unexpected address-family: %d in inbound socket"), r->sa_family);
     }
 
-    conn_sock_info_t addr_info = {.addr = nw_addr, .af = r->sa_family};
-    if (add_sock(listener_sock->ctx, conn_fd, conn, init_conn_sock, &addr_info) != 0) {
+    conn_sock_info_t addr_info = {.addr = nw_addr, .af = af, .handed = NULL, .hello = NULL};
+    int sessions = (listener_sock->ctx->resume_grace > 0); /* peer's hello decides between a new conn and resuming one */
+    if (add_sock(listener_sock->ctx, conn_fd, sessions ? hs : conn, sessions ? init_hs_sock : init_conn_sock, &addr_info) != 0) {
         log_warn("io", L("Couldn't plug inbound socket into io-ctx"));
     }
     return 1;
 }
 
-#define CONN_IO_OK 0
-#define CONN_IO_OK_EXHAUSTED 1
-#define CONN_KILL -1
-#define CONN_UNKNOWN_ERR -2
-#define CONN_IO_OK_NOT_ENOUGH_SPACE -3
-#define CONN_OTHER_TRANSIENT_ERRORS -4
+/* co-located peers (shm= in our line of their peer-file) connect over shared memory, see shm_ring.h */
+static int setup_shm(io_ctx_t *ctx) {
+    if (ctx->shm_path == NULL) return 0;
+    int fd = shm_listen(ctx->shm_path);
+    if (fd < 0) return -1;
+    if (add_sock(ctx, fd, shm_lstn, NULL, NULL) != 0) {
+        log_crit("io", L("couldn't add shm socket to io-ctx"));
+        unlink(ctx->shm_path);
+        return -1;
+    }
+    log_info("io", L("co-located peers can connect over shared memory at %s"), ctx->shm_path);
+    return 0;
+}
+
+/* accepted shm socket, polled till the peer's offer is in */
+static inline int do_shm_accept(io_sock_t *lstn) {
+    int fd = accept4(lstn->fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) log_warn("io", L("failed to accept shm peer"));
+        return 0;
+    }
+    if (add_sock(lstn->ctx, fd, shm_hs, NULL, NULL) != 0) {
+        log_warn("io", L("Couldn't plug shm socket into io-ctx"));
+    }
+    return 1;
+}
+
+/* the offer on an accepted shm socket, 1 once sock is gone (channel taken or turned away), 0 if it isn't in yet */
+static int take_shm_offer(io_sock_t *sock) {
+    io_ctx_t *ctx = sock->ctx;
+    shm_hello_t hello;
+    NET_ADDR(nw_addr);
+    int fd = sock->fd;
+    shm_conn_t *shm = malloc(sizeof(shm_conn_t));
+    int ret = (shm == NULL) ? -1 : shm_accept(fd, &hello, &shm->chan);
+    if (ret == 1) {
+        free(shm);
+        return 0;
+    }
+    if (ret != 0) {
+        log_warnx("io", L("couldn't take shm channel from a co-located peer"));
+        free(shm);
+        destroy_sock(sock);
+        return 1;
+    }
+    int af_in_use = (hello.af == AF_INET) ? (ctx->using_af & USING_IPV4) : (hello.af == AF_INET6) ? (ctx->using_af & USING_IPV6) : 0;
+    if (! af_in_use) {
+        log_warnx("io", L("shm peer of address-family: %d isn't one we use, turning it away"), hello.af);
+        shm_chan_destroy(&shm->chan);
+        free(shm);
+        destroy_sock(sock);
+        return 1;
+    }
+    if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, fd, NULL) != 0) {
+        log_warn("io", L("removal from epoll context for fd: %d failed"), fd);
+    }
+    sock->fd = -1; /* goes to the conn */
+    destroy_sock(sock);
+    shm->sock = fd;
+    memset(nw_addr, 0, MAX_NW_ADDR_LEN);
+    memcpy(nw_addr, hello.addr, (hello.af == AF_INET) ? IPv4_ADDR_LEN : IPv6_ADDR_LEN);
+    conn_sock_info_t addr_info = {.addr = nw_addr, .af = hello.af, .handed = NULL, .hello = NULL, .shm = shm};
+    if (add_sock(ctx, shm->chan.bell_fd, conn, init_conn_sock, &addr_info) != 0) {
+        log_warn("io", L("Couldn't plug shm peer into io-ctx"));
+        if (addr_info.shm != NULL) destroy_shm_conn(ctx, shm);
+    }
+    return 1;
+}
+
+static inline void shm_hs_io(uint32_t event, io_sock_t *sock) {
+    if ((event & EPOLLIN) && take_shm_offer(sock)) return;
+    if (event & (EPOLLHUP | EPOLLRDHUP)) destroy_sock(sock);
+}
 
 static inline int connection_practically_dead(int io_status) {
     return CONN_KILL == io_status || CONN_UNKNOWN_ERR == io_status;
 }
 
-static inline int send_bl_batch(int fd, void *buff, ssize_t len, ssize_t *start, void *ignore, ssize_t ignore_) {
+/* sess (may be NULL) retains what went out */
+static inline int send_bl_batch(int fd, void *buff, ssize_t len, ssize_t *start, void *sess, ssize_t ignore_) {
     ssize_t sent = send(fd, buff, len, MSG_NOSIGNAL);
     DBG("io", L("sent: %zd bytes to fd %d, wanted to send: %zd from %p"), sent, fd, len, buff);
     if (sent < 0) {
@@ -891,144 +2143,53 @@ static inline int send_bl_batch(int fd, void *buff, ssize_t len, ssize_t *start,
         }
         return CONN_UNKNOWN_ERR;
     } else {
+        if (sess != NULL) session_sent((session_t *) sess, buff, sent);
         *start += sent;
         return CONN_IO_OK;
     }
 }
 
-/* additional_len identifies additional-capacity available due to ring-buff wrap-around
-   this is important for writes requiring atomicity semantics (its only a pessimistic promise
-   for future io-handler call and should not be used immediately) */
-typedef int (io_handler_fn_t)(int fd, void *buff, ssize_t len, ssize_t *tracker, void *hdlr_ctx, ssize_t additional_len);
-
-#define BUFF_STATE_FORAMT_STR "ring: %p { sz=%zd, start=%zd, end=%zd, wrapped=%d }"
-
-#define BUFF_STATE_VARS(r)                      \
-    r, r->sz, r->start, r->end, r->wraped
-
-static inline int drain_ring(int fd, ring_buff_t *r, io_handler_fn_t *io_hdlr, void *hdlr_ctx) {
-    DBG("io", L("fd %d, "BUFF_STATE_FORAMT_STR", io_hdlr: %p, ctx: %p"), fd, BUFF_STATE_VARS(r), io_hdlr, hdlr_ctx);
+static inline session_t *conn_session(io_sock_t *conn) {
+    return (conn->ctx->resume_grace > 0 && conn->d.conn.shm == NULL) ? &conn->d.conn.sess : NULL;
+}
 
-    int ret = CONN_IO_OK;
-    do {
-        if (r->wraped) {
-            DBG("io", L("wrapped"));
-            if (r->sz == r->start) {
-                DBG("io", L("resetting start as tail drained out"));
-                r->start = 0;
-                r->wraped = 0;
-                continue;
-            }
-            ssize_t len = r->sz - r->start;
-            ssize_t additional_len = r->end;
-            DBG("io", L("calling io-hdlr while wrapped, space-advertized %zd, additional %zd, buff-start-offset: %zd (buff_base: %p) "BUFF_STATE_FORAMT_STR), len, additional_len, (ssize_t) r->buff + r->start, r->buff, BUFF_STATE_VARS(r));
-            ret = io_hdlr(fd, r->buff + r->start, len, &r->start, hdlr_ctx, additional_len);
-            DBG("io", L("after io-hdlr call(ret: %d): "BUFF_STATE_FORAMT_STR), ret, BUFF_STATE_VARS(r));
-        } else {
-            DBG("io", L("NOT wrapped"));
-            if (r->end == r->start) {
-                DBG("io", L("ring is empty, breaking"));
-                break;
-            }
-            ssize_t len = r->end - r->start;
-            ssize_t additional_len = 0;
-            DBG("io", L("calling io-hdlr while wrapped, space-advertized %zd, additional %zd, buff-start-offset: %zd (buff_base: %p)"BUFF_STATE_FORAMT_STR), len, additional_len, (ssize_t) r->buff + r->start, r->buff, BUFF_STATE_VARS(r));
-            ret = io_hdlr(fd, r->buff + r->start, len, &r->start, hdlr_ctx, additional_len);
-            DBG("io", L("after io-hdlr call(ret: %d): "BUFF_STATE_FORAMT_STR), ret, BUFF_STATE_VARS(r));
-        }
-        DBG("io", L("ret: %d, ring: %p { sz=%zd, start=%zd, end=%zd, wrapped=%d }"), ret, r, r->sz, r->start, r->end, r->wraped);
-    } while(CONN_IO_OK == ret);
-    return ret;
+/* send_bl_batch of shm conns, chan in place of sess */
+static inline int send_shm_batch(int fd, void *buff, ssize_t len, ssize_t *start, void *chan, ssize_t ignore_) {
+    ssize_t sent = shm_write((shm_chan_t *) chan, buff, len);
+    DBG("io", L("sent: %zd bytes to shm of fd %d, wanted to send: %zd from %p"), sent, fd, len, buff);
+    if (sent < 0) {
+        log_warnx("io", L("shm tx ring of conn: %d is corrupt"), fd);
+        return CONN_KILL;
+    }
+    if (sent == 0) return CONN_IO_OK_EXHAUSTED; /* peer rings once it makes room */
+    *start += sent;
+    return CONN_IO_OK;
 }
 
-typedef ssize_t (data_push_fn_t)(void *b1, ssize_t len1, void *b2, ssize_t len2, void *hdlr_ctx);
+static inline int send_conn_batch(io_sock_t *conn, void *buff, ssize_t len, ssize_t *start) {
+    if (conn->d.conn.shm != NULL) return send_shm_batch(conn->fd, buff, len, start, &conn->d.conn.shm->chan, 0);
+    return send_bl_batch(conn->fd, buff, len, start, conn_session(conn), 0);
+}
 
-static inline int fill_ring(int fd, ring_buff_t *r, io_handler_fn_t *io_hdlr, data_push_fn_t *data_pusher, void *hdlr_ctx) {
-    DBG("io", L("fd %d, "BUFF_STATE_FORAMT_STR", io_hdlr: %p, data_pusher: %p, ctx: %p"), fd, BUFF_STATE_VARS(r), io_hdlr, data_pusher, hdlr_ctx);
-    int ret = CONN_IO_OK;
-    int full = 0;
-    do {
-        if (r->wraped) {
-            DBG("io", L("wrapped"));
-            if (r->start == r->end) {
-                DBG("io", L("Buffer full, not calling io-handler"));
-                full = 1;
-            } else {
-                DBG("io", L("before io-hdlr call "BUFF_STATE_FORAMT_STR), BUFF_STATE_VARS(r));
-                ret = io_hdlr(fd, r->buff + r->end, r->start - r->end, &r->end, hdlr_ctx, 0);
-                DBG("io", L("after io-hdlr call(ret: %d) "BUFF_STATE_FORAMT_STR), ret, BUFF_STATE_VARS(r));
-            }
-        } else {
-            if (r->sz == r->end) {
-                DBG("io", L("Fill-area reached end-of-buffer, wrapping"));
-                r->end = 0;
-                r->wraped = 1;
-                continue;
-            }
-            DBG("io", L("before io-hdlr call "BUFF_STATE_FORAMT_STR), BUFF_STATE_VARS(r));
-            ret = io_hdlr(fd, r->buff + r->end, r->sz - r->end, &r->end, hdlr_ctx, r->start);
-            DBG("io", L("after io-hdlr call(ret: %d) "BUFF_STATE_FORAMT_STR), ret, BUFF_STATE_VARS(r));
-        }
-		if ((ret == CONN_IO_OK_NOT_ENOUGH_SPACE) && r->resizable) {
-			DBG("io", L("attempting ring-buffer expansion "BUFF_STATE_FORAMT_STR), BUFF_STATE_VARS(r));
-			if (expand_ring_buffer(r) == 0)	{
-				ret = CONN_IO_OK;
-				continue;
-			}
-		}
-        /* try to push data, fakers like write-to-tun don't provide this, hence nullable */
-        if (data_pusher != NULL) {
-            if (r->wraped) {
-                ssize_t len1 = r->sz - r->start;
-                ssize_t len2 = r->end;
-                int called = 0;
-                ssize_t moved = 0;
-                if ((len1 + len2) > 0) {
-                    if (len1 == 0) {
-                        moved = data_pusher(r->buff, len2, NULL, 0, hdlr_ctx);
-                    } else {
-                        moved = data_pusher(r->buff + r->start, len1, r->buff, len2, hdlr_ctx);
-                    }
-                    called = 1;
-                    if (moved > 0) {
-                        full = 0;
-                        if (moved > len1) {
-                            r->start = moved - len1;
-                            r->wraped = 0;
-                        } else {
-                            r->start += moved;
-                        }
-                    }
-                }
-                DBG("io", L("data-pusher called(%d) (with wrapped buff) with len1: %zd and len2: %zd and moved: %zd "BUFF_STATE_FORAMT_STR), called, len1, len2, moved, BUFF_STATE_VARS(r));
-            } else {
-                ssize_t len1 = r->end - r->start;
-                ssize_t moved = 0;
-                int called = 0;
-                if (len1 > 0) {
-                    called = 1;
-                    moved = data_pusher(r->buff + r->start, len1, NULL, 0, hdlr_ctx);
-                }
-                if (moved > 0) {
-                    full = 0;
-                    r->start += moved;
-                }
-                DBG("io", L("data-pusher called(%d) with len1: %zd and moved: %zd "BUFF_STATE_FORAMT_STR), called, len1, moved, BUFF_STATE_VARS(r));
-            }
-        }
-    } while((CONN_IO_OK == ret) || full);
-    DBG("io", L("return: %d"), ret);
-    return ret;
+static inline int drain_conn_tx(io_sock_t *conn) {
+    if (conn->d.conn.shm != NULL) return drain_ring(conn->fd, &conn->d.conn.tx, send_shm_batch, &conn->d.conn.shm->chan);
+    return drain_ring(conn->fd, &conn->d.conn.tx, send_bl_batch, conn_session(conn));
 }
 
-static inline int ring_empty(ring_buff_t *r) {
-    return (! r->wraped) && (r->start == r->end);
+/* suspended conns and ones waiting for the hello exchange hold on to what they have to send */
+static inline int conn_can_send(io_sock_t *conn) {
+    return conn->fd >= 0 && ! conn->d.conn.hello_pending;
 }
 
+static void drop_conn(io_sock_t *conn);
+
 struct tun_tx_s {
-    ring_buff_t *backlog;
+    io_sock_t *conn; /* pkts wait in its tun_q when tun pushes back */
     int fd;
+    l3_sink_t *sink; /* non-NULL => no tun, no backlog */
     compress_t *comp;
+    int q_full;
+    int malformed; /* stream can't be split into pkts any more */
 };
 
 typedef struct tun_tx_s tun_tx_t;
@@ -1054,40 +2215,121 @@ static inline ssize_t playback_tun_write_single_src_buf(void *playback_target_bu
 static int playback_tun_write_buf(int ignore_fd, void *playback_target_buff, ssize_t max_playback_len, ssize_t *actual_playback_len, void *opaq_tun_write_buff, ssize_t promised_future_playback_len) {
     tun_write_buff_t *b = (tun_write_buff_t *) opaq_tun_write_buff;
     if ((b->len1 + b->len2) > (max_playback_len + promised_future_playback_len)) return CONN_IO_OK_EXHAUSTED; /* because we don't want half-written packets */
+    ssize_t written;
     if (b->len1 > 0) {
-        playback_tun_write_single_src_buf(playback_target_buff, &max_playback_len, actual_playback_len, b->b1, &b->len1);
+        written = playback_tun_write_single_src_buf(playback_target_buff, &max_playback_len, actual_playback_len, b->b1, &b->len1);
+        b->b1 += written; /* rest of it goes in after wrap-around */
+        playback_target_buff += written;
         if (b->len1 > 0) return CONN_IO_OK;
     }
     if (b->len2 > 0) {
-        playback_tun_write_single_src_buf(playback_target_buff, &max_playback_len, actual_playback_len, b->b2, &b->len2);
+        written = playback_tun_write_single_src_buf(playback_target_buff, &max_playback_len, actual_playback_len, b->b2, &b->len2);
+        b->b2 += written;
         if (b->len2 > 0) return CONN_IO_OK;
     }
     return CONN_IO_OK_EXHAUSTED;
 }
 
+#define TUN_DRR_QUANTUM (16 * 1024) /* bytes a backlogged peer gets to write to tun per round */
+
+static inline ssize_t tun_drr_quantum(io_sock_t *conn) {
+    link_profile_t *p = &conn->d.conn.profile;
+    return (p->set & PROFILE_WEIGHT) ? (TUN_DRR_QUANTUM * p->weight) : TUN_DRR_QUANTUM;
+}
+
+static inline void list_tun_backlogged(io_ctx_t *ctx, io_sock_t *conn) {
+    if (conn->d.conn.tun_q_listed) return;
+    conn->d.conn.tun_deficit = tun_drr_quantum(conn);
+    TAILQ_INSERT_TAIL(&ctx->tun_backlogged, conn, d.conn.tun_q_link);
+    conn->d.conn.tun_q_listed = 1;
+}
+
 static inline ssize_t push_pkt_to_tun_backlog_ring(tun_tx_t *tun_tx, void *b1, ssize_t len1, void *b2, ssize_t len2, int *full) {
-    tun_write_buff_t tun_write_buf = {.b1 = b1, .len1 = len1, .b2 = b2, .len2 = len2};
-    fill_ring(-1, tun_tx->backlog, playback_tun_write_buf, NULL, &tun_write_buf);
+    io_sock_t *conn = tun_tx->conn;
+    io_ctx_t *ctx = conn->ctx;
+    ring_buff_t *q = &conn->d.conn.tun_q;
     ssize_t total = len1 + len2;
+    if (q->buff == NULL && init_backlog_ring(q, ctx->tun_ring_sz, ctx->resize_rings, ctx->max_allowed_ring_sz) != 0) {
+        log_crit("io", L("couldn't allocate tun egress queue for sock: %d, dropping pkt"), conn->fd);
+        return total;
+    }
+    tun_write_buff_t tun_write_buf = {.b1 = b1, .len1 = len1, .b2 = b2, .len2 = len2};
+    fill_ring(-1, q, playback_tun_write_buf, NULL, &tun_write_buf);
     ssize_t remaining = tun_write_buf.len1 + tun_write_buf.len2;
     if (remaining != 0) {
         *full = 1;
+        tun_tx->q_full = 1;
         assert(remaining == total);
         return 0;
     }
+    conn->d.conn.tun_q_in.p++;
+    conn->d.conn.tun_q_in.b += total;
+    if (ring_used(q) > conn->d.conn.tun_q_peak) conn->d.conn.tun_q_peak = ring_used(q);
+    list_tun_backlogged(ctx, conn);
     return total;
 }
 
-static inline ssize_t push_pkt_to_tun_or_ring(tun_tx_t *tun_tx, void *b1, ssize_t len1, void *b2, ssize_t len2, int *full) {
-    if (ring_empty(tun_tx->backlog)) {
+static inline ssize_t send_to_sink_or_drop(l3_sink_t *sink, void *b1, ssize_t len1, void *b2, ssize_t len2) {
+    if (sink->send(sink->dev, b1, len1, b2, len2) < 0) {
+        DBG("io", L("Failed to send %zd bytes to sink, dropping pkt"), len1 + len2);
+        sink->drop.p++;
+        sink->drop.b += len1 + len2;
+    }
+    return len1 + len2;
+}
+
+static void pep_rx(io_ctx_t *ctx, const uint8_t *pkt, ssize_t len);
+
+/* pep messages (see pep.h) end here instead of tun, ip is the (peek bytes of) IP header. Peers don't
+   forward the protocol from tun, so only their own messages carry it. Longer than any message is dropped */
+static inline int take_pep_msg(io_ctx_t *ctx, const uint8_t *ip, ssize_t peek, void *b1, ssize_t len1, void *b2, ssize_t len2) {
+    if (ctx->pep_port == 0 || ! pep_is_msg(ip, peek)) return 0;
+    ssize_t len = len1 + len2;
+    if (len > PEP_MSG_MAX) {
+        ctx->pep_stats.stray++;
+        return 1;
+    }
+    uint8_t *pkt = b1;
+    if (len2 > 0) { /* wraps around the end of the ring, rare enough to copy */
+        memcpy(ctx->pep_rx_buff, b1, len1);
+        memcpy(ctx->pep_rx_buff + len1, b2, len2);
+        pkt = ctx->pep_rx_buff;
+    }
+    pep_rx(ctx, pkt, len);
+    return 1;
+}
+
+/* headers of a pkt wrapping around the end of the ring are clamped in a copy */
+static inline void clamp_tun_bound_mss(io_ctx_t *ctx, uint8_t *b1, ssize_t len1, uint8_t *b2, ssize_t len2) {
+    if (len2 == 0 || len1 >= MSS_HDRS_MAX) {
+        ctx->mss_clamped_in += mss_clamp(b1, len1, ctx->tun_mtu);
+        return;
+    }
+    uint8_t hdrs[MSS_HDRS_MAX];
+    ssize_t len = (len1 + len2 < MSS_HDRS_MAX) ? len1 + len2 : MSS_HDRS_MAX;
+    memcpy(hdrs, b1, len1);
+    memcpy(hdrs + len1, b2, len - len1);
+    if (mss_clamp(hdrs, len, ctx->tun_mtu)) {
+        memcpy(b1, hdrs, len1);
+        memcpy(b2, hdrs + len1, len - len1);
+        ctx->mss_clamped_in++;
+    }
+}
+
+static inline ssize_t push_decoded_pkt_to_tun_or_ring(tun_tx_t *tun_tx, void *b1, ssize_t len1, void *b2, ssize_t len2, int *full) {
+    if (tun_tx->conn->ctx->tun_mtu > 0) clamp_tun_bound_mss(tun_tx->conn->ctx, b1, len1, b2, len2);
+    if (tun_tx->sink != NULL) {
+        return send_to_sink_or_drop(tun_tx->sink, b1, len1, b2, len2);
+    }
+    if (TAILQ_EMPTY(&tun_tx->conn->ctx->tun_backlogged)) { /* once anyone is queued, new pkts queue up behind them to be drained fairly */
         struct iovec out[2] = {{.iov_base = b1, .iov_len = len1}, {.iov_base = b2, .iov_len = len2}};
         ssize_t written = writev(tun_tx->fd, out, 2);
         if (written < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 return push_pkt_to_tun_backlog_ring(tun_tx, b1, len1, b2, len2, full);
             }
-            log_warn("io", L("Failed to write to tun %zd and %zd bytes from buff %p and %p"), len1, len2, b1, b2);
-            return 0;
+            log_warn("io", L("Failed to write to tun %zd and %zd bytes from buff %p and %p, dropping pkt"), len1, len2, b1, b2);
+            return len1 + len2; /* not retryable (kernel refused the pkt), retrying would wedge the ring */
         } else {
             assert(written == len1 + len2);
             return written;
@@ -1097,7 +2339,46 @@ static inline ssize_t push_pkt_to_tun_or_ring(tun_tx_t *tun_tx, void *b1, ssize_
     }
 }
 
-static inline ssize_t push_to_tun_ipv4(tun_tx_t *tun_tx, void *b1, ssize_t len1, void *b2, ssize_t len2) {
+/* pkt with tokenized HTTP headers, its lines go to the table once it's taken (tun_q included), a pkt tun
+   pushes back on is decoded again when it's retried */
+static inline ssize_t push_hdr_coded_pkt(tun_tx_t *tun_tx, uint8_t *b1, ssize_t len1, uint8_t *b2, ssize_t len2, int *full) {
+    io_ctx_t *ctx = tun_tx->conn->ctx;
+    http_hdr_tab_t *t = &tun_tx->conn->d.conn.hdr_rx;
+    uint8_t *pkt = b1, *out = ctx->hdr_buff;
+    if (len2 > 0) {
+        pkt = ctx->hdr_buff + MAX_L3_PKT_SZ;
+        memcpy(pkt, b1, len1);
+        memcpy(pkt + len1, b2, len2);
+    }
+    ssize_t len = http_hdr_decode(t, pkt, len1 + len2, out, MAX_L3_PKT_SZ);
+    if (len < 0) {
+        log_warnx("io", L("undecodable HTTP header coded pkt (%zd bytes) from sock: %d, dropping it"), len1 + len2, tun_tx->conn->fd);
+        ctx->hdr_decode_errs++;
+        return len1 + len2;
+    }
+    if (push_decoded_pkt_to_tun_or_ring(tun_tx, out, len, NULL, 0, full) == 0) return 0;
+    http_hdr_commit(t, out);
+    ctx->hdr_decoded++;
+    return len1 + len2;
+}
+
+static inline ssize_t push_pkt_to_tun_or_ring(tun_tx_t *tun_tx, void *b1, ssize_t len1, void *b2, ssize_t len2, int *full) {
+    const uint8_t *ip = b1;
+    uint8_t hdrs[40];
+    ssize_t peek = (len1 + len2 < (ssize_t) sizeof(hdrs)) ? len1 + len2 : (ssize_t) sizeof(hdrs);
+    if (len2 > 0 && len1 < peek) { /* IP header wraps around the end of the ring */
+        memcpy(hdrs, b1, len1);
+        memcpy(hdrs + len1, b2, peek - len1);
+        ip = hdrs;
+    }
+    if (take_pep_msg(tun_tx->conn->ctx, ip, peek, b1, len1, b2, len2)) return len1 + len2;
+    if (tun_tx->conn->ctx->http_hdrs && http_hdr_is_encoded(ip, peek)) { /* without -Y it's just another protocol */
+        return push_hdr_coded_pkt(tun_tx, b1, len1, b2, len2, full);
+    }
+    return push_decoded_pkt_to_tun_or_ring(tun_tx, b1, len1, b2, len2, full);
+}
+
+static inline ssize_t push_pkts_to_tun(tun_tx_t *tun_tx, void *b1, ssize_t len1, void *b2, ssize_t len2) {
     assert(len1 > 0);
 
     ssize_t overall_pushed = 0;
@@ -1105,8 +2386,20 @@ static inline ssize_t push_to_tun_ipv4(tun_tx_t *tun_tx, void *b1, ssize_t len1,
     int full = 0;
 
     do {
-        uint16_t pkt_len = parse_ipv4_pkt_sz(b1, len1, b2, len2);
-        DBG("io", L("Overall pushed: %zd till now, this pkg_len: %hu, len1: %zd, len2: %zd (buffers: 1: %p and 2: %p)"), overall_pushed, pkt_len, len1, len2, b1, b2);
+        if (len1 + len2 == 0) return overall_pushed;
+        uint8_t ip_v = *(uint8_t *) (len1 > 0 ? b1 : b2) & 0xF0;
+        if (ip_v != 0x40 && ip_v != 0x60) {
+            log_crit("io", L("encountered an unknown packet-type (L3 protocol version: %d), won't handle, will let backlog build"), ip_v >> 4);
+            return overall_pushed;
+        }
+        size_t pkt_sz = parse_l3_pkt_sz(b1, len1, b2, len2);
+        if (pkt_sz == L3_PKT_MALFORMED) {
+            log_warnx("io", L("pkt longer than %d bytes in stream of sock: %d, can't go on with it"), MAX_L3_PKT_SZ, tun_tx->conn->fd);
+            tun_tx->malformed = 1;
+            return overall_pushed;
+        }
+        ssize_t pkt_len = pkt_sz;
+        DBG("io", L("Overall pushed: %zd till now, this pkg_len: %zd, len1: %zd, len2: %zd (buffers: 1: %p and 2: %p)"), overall_pushed, pkt_len, len1, len2, b1, b2);
         if ((pkt_len == 0) || ((len1 + len2) < pkt_len)) {
             DBG("io", L("Postponing push to tun, not enough data. Overall pushed till return: %zd"), overall_pushed);
             return overall_pushed;
@@ -1136,64 +2429,26 @@ static inline ssize_t push_to_tun_ipv4(tun_tx_t *tun_tx, void *b1, ssize_t len1,
     return overall_pushed;
 }
 
-static inline ssize_t push_to_tun_ipv6(tun_tx_t *tun_tx, void *b1, ssize_t len1, void *b2, ssize_t len2) {
-    log_crit("log", L("IPv6 packet-hanlding not implemented yet"));
-    return 0;
-}
-
+/* the stream carries IPv4 and IPv6 pkts back to back, framing is decided per pkt */
 static ssize_t push_to_tun(void *b1, ssize_t len1, void *b2, ssize_t len2, void *hdlr_ctx) {
     assert(hdlr_ctx != NULL);
     tun_tx_t *tun_tx = (tun_tx_t *) hdlr_ctx;
     DBG("io", L("buff1: %p, len1: %zd, buff2: %p, len2: %zd"), b1, len1, b2, len2);
-    uint8_t octate_1;
     assert(len1 + len2 > 0);
-    if (len1 > 0) {
-        octate_1 = *(uint8_t *)b1;
-    } else {
-        octate_1 = *(uint8_t *)b2;
-    }
-    ssize_t pushed = 0;
-    switch (octate_1 & 0xF0) {
-    case 0x40:
-        pushed = push_to_tun_ipv4(tun_tx, len1 > 0 ? b1 : b2, len1 > 0 ? len1 : len2, len1 > 0 ? b2 : NULL, len1 > 0 ? len2 : 0);
-        DBG("io", L("IPv4, pushed: %zd"), pushed);
-        break;
-    case 0x60:
-        pushed = push_to_tun_ipv6(tun_tx, len1 > 0 ? b1 : b2, len1 > 0 ? len1 : len2, len1 > 0 ? b2 : NULL, len1 > 0 ? len2 : 0);
-        DBG("io", L("IPv6, pushed: %zd"), pushed);
-        break;
-    default:
-        log_crit("io", L("encountered an unknown packet-type (L3 protocol version: %d), won't handle, will let backlog build"), octate_1 >> 4);
-    }
+    ssize_t pushed = push_pkts_to_tun(tun_tx, len1 > 0 ? b1 : b2, len1 > 0 ? len1 : len2, len1 > 0 ? b2 : NULL, len1 > 0 ? len2 : 0);
+    DBG("io", L("pushed: %zd"), pushed);
     return pushed;
 }
 
-static inline int recv_compressed_data(int fd, void *buff, ssize_t max_sz, ssize_t *end, void *tun_tx_, ssize_t ignore_) {
-    assert(tun_tx_ != NULL);
-    tun_tx_t *tun_tx = (tun_tx_t *) tun_tx_;
-    compress_t *comp = tun_tx->comp;
-
-    ssize_t written = 0;
-
-    if (comp->inflatable_bytes > 0) {
-        written = do_decompress(comp, buff, max_sz);
-        DBG("io", L("decompressed (surplus) %zd bytes of conn: %d (total buff available was: %zd)"), written, fd, max_sz);
-        *end += written;
-        assert(max_sz - written >= 0);
-        if (max_sz - written == 0) {
-            return CONN_IO_OK;
-        }
-    }
-
-    assert(0 == comp->inflatable_bytes);
-    
-    ssize_t rcvd_compressed = recv(fd, comp->inflate_src_buff, comp->inflate_src_buff_sz, 0);
-    DBG("io", L("rcvd(compressed): %zd bytes from fd %d, wanted to recv upto: %u into %p"), rcvd_compressed, fd, comp->inflate_src_buff_sz, comp->inflate_src_buff);
-    if (0 == rcvd_compressed) {
+/* CONN_IO_OK if something was received */
+static inline int recv_from_conn(int fd, void *buff, ssize_t sz, ssize_t *rcvd) {
+    *rcvd = recv(fd, buff, sz, 0);
+    DBG("io", L("rcvd(compressed): %zd bytes from fd %d, wanted to recv upto: %zd into %p"), *rcvd, fd, sz, buff);
+    if (0 == *rcvd) {
         DBG("io", L("Peer closed the connection, closing it now"));
         return CONN_KILL;
     }
-    if (rcvd_compressed < 0) {
+    if (*rcvd < 0) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             DBG("io", L("recv failed as socket is not read-ready"));
             return CONN_IO_OK_EXHAUSTED;
@@ -1206,271 +2461,2391 @@ static inline int recv_compressed_data(int fd, void *buff, ssize_t max_sz, ssize
             DBG("io", L("recv failed as connection got EINVAL"));
             return CONN_OTHER_TRANSIENT_ERRORS;
         }
-        DBG("io", L("recv failed due to some unknown error: %d"), errno);
-        return CONN_UNKNOWN_ERR;
+        DBG("io", L("recv failed due to some unknown error: %d"), errno);
+        return CONN_UNKNOWN_ERR;
+    }
+    return CONN_IO_OK;
+}
+
+/* recv_from_conn of a conn, whichever way it is connected */
+static inline int recv_conn(io_sock_t *conn, void *buff, ssize_t sz, ssize_t *rcvd) {
+    if (conn->d.conn.shm == NULL) return recv_from_conn(conn->fd, buff, sz, rcvd);
+    *rcvd = shm_read(&conn->d.conn.shm->chan, buff, sz);
+    DBG("io", L("rcvd(compressed): %zd bytes from shm of fd %d, wanted to recv upto: %zd into %p"), *rcvd, conn->fd, sz, buff);
+    if (*rcvd < 0) {
+        log_warnx("io", L("shm rx ring of conn: %d is corrupt"), conn->fd);
+        return CONN_KILL;
+    }
+    return (*rcvd == 0) ? CONN_IO_OK_EXHAUSTED : CONN_IO_OK; /* peer rings once it writes */
+}
+
+/* sessions (see session.h): a broken conn is suspended, its compressor, decompressor and rings stay as they
+   are and pkts routed to the peer keep going into tx (till it's full), until the peer is back or
+   resume_grace runs out. Only the connecting side tries to get back, the accepting side waits */
+
+#define SESSION_POLL_MS 1000 /* epoll timeout while sessions are suspended */
+#define SESSION_ATTEMPT_SECS 3 /* for a resume attempt's connect and hello exchange */
+
+static inline int conn_rx(io_sock_t *conn);
+static inline void flush_conn(io_ctx_t *ctx, io_sock_t *conn);
+static int kick_relayed(io_ctx_t *ctx, io_sock_t *rx_conn);
+
+static const char *conn_peer_str(io_sock_t *conn, char *buff) {
+    if (inet_ntop(conn->d.conn.af, conn->d.conn.peer, buff, INET_ADDR_STRING_LEN) == NULL) snprintf(buff, INET_ADDR_STRING_LEN, "fd %d", conn->fd);
+    return buff;
+}
+
+static void suspend_conn(io_sock_t *conn) {
+    io_ctx_t *ctx = conn->ctx;
+    char addr[INET_ADDR_STRING_LEN];
+    if (conn->fd >= 0) {
+        if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL) != 0) {
+            log_warn("io", L("removal from epoll context for fd: %d failed"), conn->fd);
+        }
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->d.conn.hello_pending = conn->d.conn.connecting = 0;
+    if (conn->d.conn.suspended) return; /* a resume attempt failed, the deadline stays */
+    conn->d.conn.suspended = 1;
+    ctx->route_epoch++;
+    conn->d.conn.resume_by = time(NULL) + ctx->resume_grace;
+    LIST_INSERT_HEAD(&ctx->suspended, conn, d.conn.suspended_link);
+    log_info("io", L("conn to %s broke, its session is kept for %d secs"), conn_peer_str(conn, addr), ctx->resume_grace);
+}
+
+/* conn broke, with sessions on it waits for the peer unless its stream never got going */
+static void drop_conn(io_sock_t *conn) {
+    if (conn->ctx->resume_grace == 0 || conn->d.conn.shm != NULL || (conn->d.conn.hello_pending && ! conn->d.conn.suspended)) {
+        destroy_sock(conn);
+    } else {
+        suspend_conn(conn);
+    }
+}
+
+static void end_suspension(io_sock_t *conn) {
+    if (! conn->d.conn.suspended) return;
+    LIST_REMOVE(conn, d.conn.suspended_link);
+    conn->d.conn.suspended = 0;
+    conn->ctx->route_epoch++;
+}
+
+/* fd takes the place of the conn's socket (broken or not), -1 leaves the conn without one */
+static int attach_conn_fd(io_sock_t *conn, int fd) {
+    io_ctx_t *ctx = conn->ctx;
+    if (conn->fd >= 0) {
+        if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL) != 0) {
+            log_warn("io", L("removal from epoll context for fd: %d failed"), conn->fd);
+        }
+        close(conn->fd);
+    }
+    conn->fd = fd;
+    if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, fd, &conn->evt) != 0) {
+        log_warn("io", L("failed to add fd to polling context"));
+        conn->fd = -1;
+        return -1;
+    }
+    apply_conn_sock_profile(conn);
+    return 0;
+}
+
+static ssize_t copy_ring(uint8_t *dest, ring_buff_t *r) {
+    void *b1, *b2;
+    ssize_t len1, len2;
+    if (r->buff == NULL) return 0;
+    ring_peek(r, &b1, &len1, &b2, &len2);
+    memcpy(dest, b1, len1);
+    if (len2 > 0) memcpy(dest + len1, b2, len2);
+    return len1 + len2;
+}
+
+/* what the peer is missing (from its rx-seq on) goes out again, ahead of what tx holds */
+static int replay_conn(io_sock_t *conn, uint64_t seq) {
+    session_t *sess = &conn->d.conn.sess;
+    ring_buff_t *tx = &conn->d.conn.tx;
+    size_t len = sess->tx_seq - seq;
+    if (len == 0) return 0;
+    uint8_t *buff = malloc(len + ring_used(tx));
+    if (buff == NULL) {
+        log_crit("io", L("couldn't allocate %zu bytes to replay the stream of sock: %d"), len + ring_used(tx), conn->fd);
+        return -1;
+    }
+    session_replay(sess, seq, buff);
+    ssize_t total = len + copy_ring(buff + len, tx);
+    int ret = ring_load(tx, buff, total);
+    free(buff);
+    if (ret == 0) conn->d.conn.tx_queued += len;
+    return ret;
+}
+
+static void session_resumed(io_sock_t *conn, size_t replayed) {
+    char addr[INET_ADDR_STRING_LEN];
+    end_suspension(conn);
+    conn->d.conn.hello_pending = 0;
+    conn->d.conn.resumes++;
+    log_info("io", L("session with %s resumed on sock: %d, %zu bytes replayed"), conn_peer_str(conn, addr), conn->fd, replayed);
+}
+
+/* the peer couldn't resume, a new stream starts and whatever the old one held is dropped */
+static int restart_conn_stream(io_sock_t *conn) {
+    compress_t *comp = &conn->d.conn.comp;
+    int level = comp->compression_level;
+    destroy_compression_ctx(comp);
+    memset(comp, 0, sizeof(*comp)); /* zlib wants its alloc hooks zeroed */
+    if (init_compression_ctx(comp, level) != 0) {
+        log_crit("io", L("couldn't initialize compression for sock: %d"), conn->fd);
+        return -1;
+    }
+    flow_ctx_tab_t *fc = conn->d.conn.fc;
+    if (fc != NULL) {
+        int max = fc->max, fc_level = fc->compression_level;
+        flow_ctx_destroy(fc);
+        if (flow_ctx_init(fc, comp, max, fc_level) != 0) {
+            free(fc);
+            conn->d.conn.fc = NULL;
+            return -1;
+        }
+        fc->relay = &conn->d.conn.relay_cb;
+    }
+    conn->d.conn.gen = ++conn->ctx->conn_gens;
+    conn->d.conn.relay_len = conn->d.conn.relay_frame_in = 0;
+    ring_consume(&conn->d.conn.tx, ring_used(&conn->d.conn.tx));
+    ring_consume(&conn->d.conn.rx, ring_used(&conn->d.conn.rx));
+    conn->d.conn.flush_stalled = 0;
+    session_reset(&conn->d.conn.sess, conn->d.conn.sess.id);
+    http_hdr_reset(&conn->d.conn.hdr_tx);
+    http_hdr_reset(&conn->d.conn.hdr_rx);
+    return 0;
+}
+
+/* tx waited for the hello exchange (or was replayed into), the socket may have no edge coming for it.
+   Returns -1 if the conn broke again */
+static int kick_conn_tx(io_sock_t *conn) {
+    int ret = drain_conn_tx(conn);
+    if (connection_practically_dead(ret)) {
+        drop_conn(conn);
+        return -1;
+    }
+    return 0;
+}
+
+/* CONN_IO_OK once the whole hello is in */
+static int recv_hello(int fd, uint8_t *hello, int *len) {
+    while (*len < SESSION_HELLO_SZ) {
+        ssize_t rcvd;
+        int ret = recv_from_conn(fd, hello + *len, SESSION_HELLO_SZ - *len, &rcvd);
+        if (ret != CONN_IO_OK) return ret;
+        *len += rcvd;
+    }
+    return CONN_IO_OK;
+}
+
+/* connecting side, the accepting side's answer is in */
+static int finish_hello(io_sock_t *conn) {
+    session_t *sess = &conn->d.conn.sess;
+    session_hello_t h;
+    char addr[INET_ADDR_STRING_LEN];
+    if (session_hello_decode(sess->hello, &h) != 0 || h.id != sess->id) {
+        log_warnx("io", L("bad session hello on sock: %d"), conn->fd);
+        return -1;
+    }
+    if (h.flags & SESSION_RESUMED) {
+        if (! conn->d.conn.suspended || ! session_can_replay(sess, h.rx_seq)) {
+            log_warnx("io", L("%s resumed a session it can't have on sock: %d"), conn_peer_str(conn, addr), conn->fd);
+            return -1;
+        }
+        size_t replayed = sess->tx_seq - h.rx_seq;
+        if (replay_conn(conn, h.rx_seq) != 0) return -1;
+        session_resumed(conn, replayed);
+    } else if (conn->d.conn.suspended) {
+        log_info("io", L("%s couldn't resume the session, starting a new stream"), conn_peer_str(conn, addr));
+        if (restart_conn_stream(conn) != 0) return -1;
+        end_suspension(conn);
+    }
+    conn->d.conn.hello_pending = 0;
+    return 0;
+}
+
+/* accepting side, the peer resumes conn on fd */
+static void resume_accepted(io_sock_t *conn, int fd, const session_hello_t *h) {
+    size_t replayed = conn->d.conn.sess.tx_seq - h->rx_seq;
+    if (attach_conn_fd(conn, fd) != 0) {
+        close(fd);
+        drop_conn(conn);
+        return;
+    }
+    if (send_hello(conn, SESSION_RESUMED) != 0) {
+        drop_conn(conn);
+        return;
+    }
+    if (replay_conn(conn, h->rx_seq) != 0) {
+        destroy_sock(conn);
+        return;
+    }
+    session_resumed(conn, replayed);
+    if (kick_conn_tx(conn) == 0) conn_rx(conn);
+}
+
+/* accepting side, the hello of a peer that just connected is in */
+static void accept_session(io_sock_t *sock) {
+    io_ctx_t *ctx = sock->ctx;
+    session_hello_t h;
+    NET_ADDR(peer);
+    int af = sock->d.hs.af, fd = sock->fd;
+    if (session_hello_decode(sock->d.hs.hello, &h) != 0 || (h.flags & SESSION_RESUMED)) {
+        log_warnx("io", L("bad session hello on sock: %d, dropping it"), fd);
+        destroy_sock(sock);
+        return;
+    }
+    memcpy(peer, sock->d.hs.peer, MAX_NW_ADDR_LEN);
+    if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, fd, NULL) != 0) {
+        log_warn("io", L("removal from epoll context for fd: %d failed"), fd);
+    }
+    sock->fd = -1; /* goes to the conn */
+    destroy_sock(sock);
+    io_sock_t *old = batab_get(&ctx->live_conns, peer);
+    if (old != NULL && session_can_resume(&old->d.conn.sess, &h)) {
+        resume_accepted(old, fd, &h);
+        return;
+    }
+    if (old != NULL) destroy_sock(old); /* peer started over (or is past what we can replay) */
+    conn_sock_info_t addr_info = {.addr = peer, .af = af, .handed = NULL, .hello = &h};
+    if (add_sock(ctx, fd, conn, init_conn_sock, &addr_info) != 0) {
+        log_warn("io", L("Couldn't plug inbound socket into io-ctx"));
+    }
+}
+
+static inline void hs_io(uint32_t event, io_sock_t *sock) {
+    if (event & EPOLLIN) {
+        int ret = recv_hello(sock->fd, sock->d.hs.hello, &sock->d.hs.hello_len);
+        if (ret == CONN_IO_OK) {
+            accept_session(sock);
+            return;
+        }
+        if (ret != CONN_IO_OK_EXHAUSTED) {
+            destroy_sock(sock);
+            return;
+        }
+    }
+    if (event & (EPOLLHUP | EPOLLRDHUP)) destroy_sock(sock);
+}
+
+/* connecting side, non-blocking connect to get a suspended session back */
+static void try_resume(io_sock_t *conn) {
+    passive_peer_t *pp = batab_get(&conn->ctx->passive_peers, conn->d.conn.peer);
+    if (pp == NULL || pp->addr_info == NULL) return;
+    struct addrinfo *r = pp->addr_info;
+    int fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
+    if (fd < 0) {
+        log_warn("io", L("could not create socket for resuming session with peer: %s"), pp->humanified_address);
+        return;
+    }
+    if (set_no_block(fd) != 0 || (connect(fd, r->ai_addr, r->ai_addrlen) != 0 && errno != EINPROGRESS) || attach_conn_fd(conn, fd) != 0) {
+        DBG("io", L("resume attempt with peer: %s failed"), pp->humanified_address);
+        close(fd);
+        return;
+    }
+    conn->d.conn.connecting = conn->d.conn.hello_pending = 1;
+    conn->d.conn.sess.hello_len = 0;
+    conn->d.conn.attempt_by = time(NULL) + SESSION_ATTEMPT_SECS;
+}
+
+static void resume_connected(uint32_t event, io_sock_t *conn) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (! (event & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+    if ((event & (EPOLLERR | EPOLLHUP)) || getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+        DBG("io", L("resume attempt on sock: %d couldn't connect"), conn->fd);
+        suspend_conn(conn);
+        return;
+    }
+    conn->d.conn.connecting = 0;
+    if (send_hello(conn, 0) != 0) suspend_conn(conn);
+}
+
+/* expires suspended sessions, gets resume attempts going and gives up on stuck ones */
+static void tend_sessions(io_ctx_t *ctx) {
+    time_t now = time(NULL);
+    io_sock_t *conn, *next;
+    char addr[INET_ADDR_STRING_LEN];
+    ctx->sessions_tended_at = now;
+    for (conn = LIST_FIRST(&ctx->suspended); conn != NULL; conn = next) {
+        next = LIST_NEXT(conn, d.conn.suspended_link);
+        if (now >= conn->d.conn.resume_by) {
+            log_info("io", L("session with %s wasn't resumed in %d secs, dropping it"), conn_peer_str(conn, addr), ctx->resume_grace);
+            destroy_sock(conn);
+            continue;
+        }
+        if (conn->fd >= 0 && now >= conn->d.conn.attempt_by) suspend_conn(conn); /* resume attempt went nowhere */
+        if (conn->fd < 0 && conn->d.conn.outbound) try_resume(conn);
+    }
+}
+
+static inline int recv_compressed_data(int fd, void *buff, ssize_t max_sz, ssize_t *end, void *tun_tx_, ssize_t ignore_) {
+    assert(tun_tx_ != NULL);
+    tun_tx_t *tun_tx = (tun_tx_t *) tun_tx_;
+    compress_t *comp = tun_tx->comp;
+
+    ssize_t written = 0;
+
+    if (comp->inflatable_bytes > 0) {
+        written = do_decompress(comp, buff, max_sz);
+        DBG("io", L("decompressed (surplus) %zd bytes of conn: %d (total buff available was: %zd)"), written, fd, max_sz);
+        *end += written;
+        assert(max_sz - written >= 0);
+        if (max_sz - written == 0) {
+            return CONN_IO_OK;
+        }
+        if (comp->handoff && comp->inflatable_bytes > 0) return CONN_IO_OK_EXHAUSTED; /* at a handoff point, rest goes to the successor */
+    }
+
+    assert(0 == comp->inflatable_bytes);
+    
+    ssize_t rcvd_compressed;
+    int ret = recv_conn(tun_tx->conn, comp->inflate_src_buff, comp->inflate_src_buff_sz, &rcvd_compressed);
+    if (ret != CONN_IO_OK) return ret;
+    if (conn_session(tun_tx->conn) != NULL) session_rcvd(&tun_tx->conn->d.conn.sess, rcvd_compressed);
+    comp->inflatable_bytes = rcvd_compressed;
+
+    ssize_t decompressed = do_decompress(comp, buff + written, max_sz - written);
+    DBG("io", L("decompressed freshly read %zd bytes of conn: %d (total buff available was: %zd)"), decompressed, fd, max_sz - written);
+    *end += decompressed;
+    assert((written + decompressed == max_sz) || (comp->inflatable_bytes == 0) || comp->handoff);
+    return CONN_IO_OK;
+}
+
+/* flow ctxs on, frames are decoded till buff is full or one recv worth of frames is used up */
+static inline int recv_framed_data(int fd, void *buff, ssize_t max_sz, ssize_t *end, void *tun_tx_, ssize_t ignore_) {
+    assert(tun_tx_ != NULL);
+    io_sock_t *conn = ((tun_tx_t *) tun_tx_)->conn;
+    flow_ctx_tab_t *fc = conn->d.conn.fc;
+    int rcvd = 0;
+    for (;;) {
+        ssize_t decompressed = flow_ctx_decode(fc, buff, max_sz);
+        if (decompressed < 0) return CONN_KILL;
+        DBG("io", L("decoded %zd bytes of frames from conn: %d (buff available was: %zd)"), decompressed, fd, max_sz);
+        *end += decompressed;
+        buff += decompressed;
+        max_sz -= decompressed;
+        if (max_sz == 0 || rcvd) return CONN_IO_OK;
+        assert(flow_ctx_rx_empty(fc));
+        ssize_t rcvd_framed;
+        int ret = recv_conn(conn, fc->rx_buff, fc->rx_buff_sz, &rcvd_framed);
+        if (ret != CONN_IO_OK) return ret;
+        if (conn_session(conn) != NULL) session_rcvd(&conn->d.conn.sess, rcvd_framed);
+        fc->rx_off = 0;
+        fc->rx_len = rcvd_framed;
+        rcvd = 1;
+    }
+}
+
+/* returns -1 if conn was destroyed (or suspended) */
+static inline int conn_rx(io_sock_t *conn) {
+    io_ctx_t *ctx = conn->ctx;
+    if (conn->fd < 0 || conn->d.conn.connecting) return 0;
+    if (conn->d.conn.hello_pending) { /* connecting side, waiting for the answer to its hello */
+        session_t *sess = &conn->d.conn.sess;
+        int ret = recv_hello(conn->fd, sess->hello, &sess->hello_len);
+        if (ret == CONN_IO_OK_EXHAUSTED || ret == CONN_OTHER_TRANSIENT_ERRORS) return 0;
+        if (ret != CONN_IO_OK) {
+            drop_conn(conn);
+            return -1;
+        }
+        if (finish_hello(conn) != 0) {
+            destroy_sock(conn);
+            return -1;
+        }
+        if (kick_conn_tx(conn) != 0) return -1;
+    }
+    tun_tx_t tun_tx;
+    tun_tx.fd = ctx->tun_fd;
+    tun_tx.conn = conn;
+    tun_tx.sink = (ctx->sink.send != NULL) ? &ctx->sink : NULL;
+    tun_tx.comp = &conn->d.conn.comp;
+    tun_tx.q_full = 0;
+    tun_tx.malformed = 0;
+    int ret = fill_ring(conn->fd, &conn->d.conn.rx, (conn->d.conn.fc != NULL) ? recv_framed_data : recv_compressed_data, push_to_tun, &tun_tx);
+    if (tun_tx.sink != NULL && tun_tx.sink->kick != NULL) tun_tx.sink->kick(tun_tx.sink->dev);
+    if (tun_tx.malformed) {
+        destroy_sock(conn); /* a fresh stream, replaying this one (-R) would only hit it again */
+        kick_relayed(ctx, NULL);
+        return -1;
+    }
+    if (connection_practically_dead(ret)) {
+        log_warn("io", L("Recv failed, connection id being dropped for sock: %d"), conn->fd);
+        drop_conn(conn);
+        kick_relayed(ctx, NULL);
+        return -1;
+    }
+    if (! LIST_EMPTY(&ctx->relay_kicks) && kick_relayed(ctx, conn) != 0) return -1;
+    if (tun_tx.q_full && ! conn->d.conn.rx_stalled) { /* only this peer waits, others keep going */
+        DBG("io", L("tun egress queue full, rx stalled for sock: %d"), conn->fd);
+        LIST_INSERT_HEAD(&ctx->rx_stalled, conn, d.conn.rx_stalled_link);
+        conn->d.conn.rx_stalled = 1;
+        conn->d.conn.tun_q_full++;
+    }
+    return 0;
+}
+
+static inline void conn_io(uint32_t event, io_sock_t *conn) {
+    int ret;
+    if (conn->d.conn.connecting) {
+        resume_connected(event, conn);
+        return;
+    }
+    if (conn->d.conn.shm != NULL && (event & EPOLLIN)) { /* doorbell, either ring may have moved */
+        shm_clear_bell(&conn->d.conn.shm->chan);
+        event |= EPOLLOUT;
+    }
+    if ((event & EPOLLOUT) && conn_can_send(conn)) {
+        DBG("io", L("called for %d OUT"), conn->fd);
+        ret = drain_conn_tx(conn);
+        if (connection_practically_dead(ret)) {
+            log_warn("io", L("Send failed, connection is being dropped for sock: %d"), conn->fd); 
+            drop_conn(conn);
+            return;
+        }
+    }
+    if (event & EPOLLIN) {
+        DBG("io", L("called for %d IN"), conn->fd);
+        if (conn_rx(conn) != 0) return;
+    }
+    if (event & (EPOLLRDHUP | EPOLLHUP)) {
+        log_warn("io", L("Connection closed, connection id being dropped for sock: %d"), conn->fd);
+        drop_conn(conn);
+        return;
+    }
+    if (conn->d.conn.shm == NULL && conn_low_lat_mode(conn) >= DISABLE_DELAYED_ACK) {
+        if (setsockopt(conn->fd, IPPROTO_TCP, TCP_QUICKACK, (int[]){1}, sizeof(int)) != 0) {
+            log_warn("io", L("Failed to turn-off delayed ack for sock: %d"), conn->fd); 
+        }
+    }
+    if ((event & EPOLLOUT) && conn->d.conn.flush_stalled) {
+        flush_conn(conn->ctx, conn); /* last, may destroy conn */
+    }
+}
+
+/* writes pkts from the head of conn's tun_q while its DRR deficit covers them. Returns 1 once the
+   queue is empty, 0 when the deficit ran out and -1 when tun pushed back */
+static int write_tun_q(int fd, io_sock_t *conn) {
+    ring_buff_t *q = &conn->d.conn.tun_q;
+    while (! ring_empty(q)) {
+        void *b1, *b2;
+        ssize_t len1, len2;
+        ring_peek(q, &b1, &len1, &b2, &len2);
+        ssize_t pkt_len = parse_l3_pkt_sz(b1, len1, b2, len2);
+        assert(pkt_len > 0 && pkt_len <= len1 + len2); /* only whole pkts of known versions are queued */
+        if (pkt_len > conn->d.conn.tun_deficit) return 0;
+        struct iovec out[2] = {{.iov_base = b1, .iov_len = (len1 < pkt_len) ? len1 : pkt_len},
+                               {.iov_base = b2, .iov_len = (len1 < pkt_len) ? (pkt_len - len1) : 0}};
+        ssize_t written = writev(fd, out, 2);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return -1;
+            log_crit("io", L("failed to write to tun dev, dropping pkt of len: %zd"), pkt_len);
+        } else {
+            assert(written == pkt_len);
+        }
+        ring_consume(q, pkt_len);
+        conn->d.conn.tun_deficit -= pkt_len;
+    }
+    return 1;
+}
+
+static void resume_stalled_rx(io_ctx_t *ctx) {
+    io_sock_t *conn, *next;
+    for (conn = LIST_FIRST(&ctx->rx_stalled); conn != NULL; conn = next) {
+        next = LIST_NEXT(conn, d.conn.rx_stalled_link);
+        if (ring_used(&conn->d.conn.tun_q) > conn->d.conn.tun_q.sz / 2) continue; /* resuming for a few pkts would just stall again */
+        LIST_REMOVE(conn, d.conn.rx_stalled_link);
+        conn->d.conn.rx_stalled = 0;
+        conn_rx(conn); /* data may be sitting in rx ring and socket with no edge coming for it */
+    }
+}
+
+/* deficit round robin across peers' tun_q, so a peer flooding tun only delays itself */
+static void drain_tun_queues(io_ctx_t *ctx) {
+    io_sock_t *conn;
+    while ((conn = TAILQ_FIRST(&ctx->tun_backlogged)) != NULL) {
+        int ret = write_tun_q(ctx->tun_fd, conn);
+        if (ret < 0) break; /* head keeps its place and deficit till the next EPOLLOUT */
+        TAILQ_REMOVE(&ctx->tun_backlogged, conn, d.conn.tun_q_link);
+        if (ret == 0) {
+            conn->d.conn.tun_deficit += tun_drr_quantum(conn);
+            TAILQ_INSERT_TAIL(&ctx->tun_backlogged, conn, d.conn.tun_q_link);
+        } else {
+            conn->d.conn.tun_q_listed = 0;
+        }
+    }
+    resume_stalled_rx(ctx);
+}
+
+struct conn_bound_pkt_s {
+    tun_pkt_buff_t *pkt_buff;
+    io_sock_t *conn;
+    ssize_t already_consumed;
+    int started;
+    ssize_t produced;
+};
+
+typedef struct conn_bound_pkt_s conn_bound_pkt_t;
+
+static int read_from_tun_buff(int fd, void *to_buff, ssize_t capacity, ssize_t *end, void *hdlr_ctx, ssize_t additional_capacity) {
+    conn_bound_pkt_t *pkt = (conn_bound_pkt_t *) hdlr_ctx;
+
+    compress_t *comp = &pkt->conn->d.conn.comp;
+
+    if (! pkt->started) { /* first invocation */
+        if (worst_case_compressed_out_sz(comp, pkt->pkt_buff->len) > (capacity + additional_capacity)) {
+            return CONN_IO_OK_NOT_ENOUGH_SPACE;
+        }
+        setup_compress_input(comp, pkt->pkt_buff->buff, pkt->pkt_buff->len);
+        pkt->started = 1;
+    }
+
+    ssize_t consumed = 0;
+    int complete = 0;
+    ssize_t written = do_compress(comp, to_buff, capacity, &consumed, &complete);
+
+    *end += written;
+    pkt->produced += written;
+    pkt->already_consumed += consumed;
+    
+    if ((! complete) && additional_capacity == 0) {
+        return CONN_KILL;
+    }
+    
+    if (pkt->pkt_buff->len == 0 && written == capacity) { /* pure flush that filled the region, may have more to emit */
+        return CONN_IO_OK;
+    }
+
+    return (pkt->already_consumed == pkt->pkt_buff->len) ? CONN_IO_OK_EXHAUSTED : CONN_IO_OK;
+}
+
+static ssize_t write_passthru_to_conn(void *b1, ssize_t len1, void *b2, ssize_t len2, void *hdlr_ctx) {
+    assert(hdlr_ctx != NULL);
+    conn_bound_pkt_t *pkt = (conn_bound_pkt_t *) hdlr_ctx;
+    if (! conn_can_send(pkt->conn)) return 0; /* stays in the ring */
+    int dest_fd = pkt->conn->fd;
+    DBG("io", L("dest_fd: %d, buff1: %p, len1: %zd, buff2: %p, len2: %zd"), dest_fd, b1, len1, b2, len2);
+    ssize_t written = 0;
+    if (len1 > 0) {
+        send_conn_batch(pkt->conn, b1, len1, &written);
+    }
+    if ((written == len1) && len2 > 0) {
+        send_conn_batch(pkt->conn, b2, len2, &written);
+    }
+    DBG("io", L("wrote %zd bytes to sock: %d"), written, dest_fd);
+    return written;
+}
+
+/* room for len more bytes in tx, checked upfront as compressor state can't be rolled back */
+static inline int tx_room(ring_buff_t *tx, ssize_t len) {
+    while ((tx->sz - ring_used(tx)) < len) {
+        if ((! tx->resizable) || expand_ring_buffer(tx) != 0) return -1;
+    }
+    return 0;
+}
+
+static int frame_buff_room(io_ctx_t *ctx, ssize_t len) {
+    if (len <= ctx->frame_buff_sz) return 0;
+    uint8_t *b = realloc(ctx->frame_buff, len);
+    if (b == NULL) {
+        log_crit("io", L("couldn't grow frame buffer to %zd bytes"), len);
+        return -1;
+    }
+    ctx->frame_buff = b;
+    ctx->frame_buff_sz = len;
+    return 0;
+}
+
+/* whole frames to conn's ring (tx_room must hold), sent right away if drain is set and the conn can send */
+static int queue_frames(io_sock_t *conn, void *frames, ssize_t len, int drain) {
+    ring_buff_t *tx = &conn->d.conn.tx;
+    tun_write_buff_t b = {.b1 = frames, .len1 = len, .b2 = NULL, .len2 = 0};
+    int ret = fill_ring(-1, tx, playback_tun_write_buf, NULL, &b);
+    assert(ret == CONN_IO_OK_EXHAUSTED && b.len1 == 0);
+    conn->d.conn.tx_queued += len;
+    if (! drain || ! conn_can_send(conn)) return CONN_IO_OK_EXHAUSTED;
+    ret = drain_conn_tx(conn);
+    return connection_practically_dead(ret) ? ret : CONN_IO_OK_EXHAUSTED;
+}
+
+/* frames for pkt (NULL => flush of the open ctx) compressed with ctx id, written to conn's ring whole */
+static int put_frames(io_ctx_t *ctx, io_sock_t *conn, int id, void *pkt, ssize_t len, int defer, int drain) {
+    flow_ctx_tab_t *fc = conn->d.conn.fc;
+    ssize_t bound = flow_ctx_encode_bound(fc, id, len);
+    if (bound < 0 || tx_room(&conn->d.conn.tx, bound) != 0 || frame_buff_room(ctx, bound) != 0) return CONN_IO_OK_NOT_ENOUGH_SPACE;
+    ssize_t framed = flow_ctx_encode(fc, id, pkt, len, defer, ctx->frame_buff, ctx->frame_buff_sz);
+    if (framed < 0) return CONN_IO_OK_NOT_ENOUGH_SPACE;
+    if (framed == 0) return CONN_IO_OK_EXHAUSTED;
+    return queue_frames(conn, ctx->frame_buff, framed, drain);
+}
+
+/* flow ctxs on, same contract as fill_ring with read_from_tun_buff */
+/* coded is what goes out (pkt_buff with its HTTP headers tokenized, or pkt_buff itself), the flow is picked by the original */
+static int write_framed_to_conn(io_ctx_t *ctx, io_sock_t *conn, tun_pkt_buff_t *pkt_buff, tun_pkt_buff_t *coded, int defer) {
+    flow_ctx_tab_t *fc = conn->d.conn.fc;
+    int id = (pkt_buff->len > 0) ? flow_ctx_pick(fc, pkt_buff->buff, pkt_buff->len) : 0;
+    if (fc->tx_open >= 0 && (pkt_buff->len == 0 || fc->tx_open != id)) { /* on its own, so the ring only needs room for one ctx's worst case */
+        int ret = put_frames(ctx, conn, fc->tx_open, NULL, 0, 0, 1);
+        if (ret != CONN_IO_OK_EXHAUSTED) return ret;
+    }
+    if (pkt_buff->len == 0) return CONN_IO_OK_EXHAUSTED;
+    return put_frames(ctx, conn, id, coded->buff, coded->len, defer, 1);
+}
+
+/* stream with the peer at addr if it is reached through a hub (via=), set up on first use */
+static relay_peer_t *relay_peer(io_ctx_t *ctx, const uint8_t *addr) {
+    peer_profile_t *pp = batab_get(&ctx->peer_profiles, (uint8_t *) addr);
+    if (pp == NULL || ! (pp->p.set & PROFILE_VIA)) return NULL;
+    relay_peer_t *rp = batab_get(&ctx->relay_peers, (uint8_t *) addr);
+    if (rp == NULL) {
+        if ((rp = calloc(1, sizeof(relay_peer_t))) == NULL) {
+            log_crit("io", L("couldn't allocate relay-peer"));
+            return NULL;
+        }
+        memcpy(rp->addr, addr, MAX_NW_ADDR_LEN);
+        if (init_compression_ctx(&rp->comp, (pp->p.set & PROFILE_LEVEL) ? pp->p.level : ctx->compression_level) != 0) {
+            log_crit("io", L("couldn't initialize compression for relay-peer"));
+            free(rp);
+            return NULL;
+        }
+        if (batab_put(&ctx->relay_peers, rp, NULL) != 0) {
+            log_crit("io", L("couldn't add relay-peer"));
+            free_relay_peer(rp);
+            return NULL;
+        }
+    }
+    if (memcmp(rp->via, pp->p.via, MAX_NW_ADDR_LEN) != 0) { /* (re)configured to go through another hub */
+        memcpy(rp->via, pp->p.via, MAX_NW_ADDR_LEN);
+        rp->af = pp->p.via_af;
+        rp->via_gen = 0;
+    }
+    return rp;
+}
+
+/* pkt for a peer behind conn's peer (hub), compressed with the stream to it and flushed right away as
+   the hub passes on whole pkts only. Same contract as write_to_conn */
+static int write_relayed(io_ctx_t *ctx, io_sock_t *conn, tun_pkt_buff_t *pkt_buff) {
+    relay_peer_t *rp = pkt_buff->relay;
+    flow_ctx_tab_t *fc = conn->d.conn.fc;
+    int ret = CONN_IO_OK_NOT_ENOUGH_SPACE;
+    if (fc == NULL) {
+        DBG("io", L("relaying needs flow ctxs (-x) on sock: %d, dropping packet"), conn->fd);
+    } else {
+        if (rp->via_gen != conn->d.conn.gen) { /* conn to the hub started over (or the hub lost some of it) */
+            reset_compress_stream(&rp->comp);
+            rp->tx_reset_pending = 1;
+            rp->via_gen = conn->d.conn.gen;
+            rp->restarts++;
+        }
+        ssize_t bound = flow_ctx_relay_bound(fc, &rp->comp, pkt_buff->len);
+        if (tx_room(&conn->d.conn.tx, bound) == 0 && frame_buff_room(ctx, bound) == 0) {
+            ssize_t framed = flow_ctx_encode_relay(fc, &rp->comp, rp->addr, rp->tx_reset_pending, pkt_buff->buff, pkt_buff->len, ctx->frame_buff, ctx->frame_buff_sz);
+            rp->tx_reset_pending = 0;
+            rp->tx_pkts++;
+            rp->tx_in += pkt_buff->len;
+            rp->tx_out += framed;
+            ret = queue_frames(conn, ctx->frame_buff, framed, 1);
+        }
+    }
+    if (ret == CONN_IO_OK_EXHAUSTED) return 0;
+    if (connection_practically_dead(ret)) {
+        ctx->tx_partial_compress_drop.p++;
+        log_warn("io", L("Partial packet-write, connection is being dropped for sock: %d"), conn->fd);
+        drop_conn(conn); /* send failed, the frames are in the ring */
+    }
+    ctx->tx_drop.p++;
+    ctx->tx_drop.b += pkt_buff->len;
+    return -1;
+}
+
+/* frames from the hub, for the stream from src */
+static compress_t *relay_rx_comp(void *conn_, const uint8_t *src) {
+    io_sock_t *conn = (io_sock_t *) conn_;
+    relay_peer_t *rp = (conn->ctx->via_peers > 0) ? relay_peer(conn->ctx, src) : NULL;
+    if (rp == NULL || memcmp(rp->via, conn->d.conn.peer, MAX_NW_ADDR_LEN) != 0) {
+        DBG("io", L("relayed frames from a peer not configured behind sock: %d, skipping them"), conn->fd);
+        return NULL;
+    }
+    rp->rx_frames++;
+    return &rp->comp;
+}
+
+/* hub dropped some of the stream to dest, it starts over with the next pkt */
+static void relay_lost(void *conn_, const uint8_t *dest) {
+    io_sock_t *conn = (io_sock_t *) conn_;
+    relay_peer_t *rp = batab_get(&conn->ctx->relay_peers, (uint8_t *) dest);
+    if (rp == NULL || memcmp(rp->via, conn->d.conn.peer, MAX_NW_ADDR_LEN) != 0) return;
+    DBG("io", L("hub on sock: %d lost relayed frames, restarting stream"), conn->fd);
+    rp->via_gen = 0;
+}
+
+/* hub, conn has relayed frames (or a lost notice) in its ring, it is drained once the rx at hand is done */
+static void relay_kick_later(io_ctx_t *ctx, io_sock_t *conn) {
+    if (conn->d.conn.relay_kick) return;
+    LIST_INSERT_HEAD(&ctx->relay_kicks, conn, d.conn.relay_kick_link);
+    conn->d.conn.relay_kick = 1;
+}
+
+/* returns -1 if rx_conn was among the conns that broke (it may be NULL) */
+static int kick_relayed(io_ctx_t *ctx, io_sock_t *rx_conn) {
+    int ret = 0;
+    io_sock_t *conn;
+    while ((conn = LIST_FIRST(&ctx->relay_kicks)) != NULL) {
+        LIST_REMOVE(conn, d.conn.relay_kick_link);
+        conn->d.conn.relay_kick = 0;
+        if (conn_can_send(conn) && kick_conn_tx(conn) != 0 && conn == rx_conn) ret = -1;
+    }
+    return ret;
+}
+
+static relay_route_t *relay_route(io_sock_t *conn, const uint8_t *dest) {
+    relay_route_t *r;
+    LIST_FOREACH(r, &conn->d.conn.relay_routes, link) {
+        if (memcmp(r->dest, dest, MAX_NW_ADDR_LEN) == 0) return r;
+    }
+    if (conn->d.conn.relay_routes_n >= RELAY_ROUTES_MAX || (r = calloc(1, sizeof(relay_route_t))) == NULL) return NULL;
+    memcpy(r->dest, dest, MAX_NW_ADDR_LEN);
+    r->noticed_gen = UINT64_MAX;
+    LIST_INSERT_HEAD(&conn->d.conn.relay_routes, r, link);
+    conn->d.conn.relay_routes_n++;
+    return r;
+}
+
+/* hub, frames for dest's peer go after whatever its open ctx holds (receiver's pkt stream stays whole) */
+static int pass_relayed(io_ctx_t *ctx, io_sock_t *dest, void *frames, ssize_t len) {
+    flow_ctx_tab_t *fc = dest->d.conn.fc;
+    if (fc->tx_open >= 0 && put_frames(ctx, dest, fc->tx_open, NULL, 0, 0, 0) != CONN_IO_OK_EXHAUSTED) return -1;
+    if (tx_room(&dest->d.conn.tx, len) != 0) return -1;
+    queue_frames(dest, frames, len, 0);
+    relay_kick_later(ctx, dest);
+    return 0;
+}
+
+/* hub, frames of one pkt from src's peer to dest_addr are in src's relay_buff. They go on whole or
+   not at all, once some are dropped the rest of the stream is too till the sender starts it over */
+static void relay_unit(io_ctx_t *ctx, io_sock_t *src, const uint8_t *dest_addr) {
+    uint8_t *frames = src->d.conn.relay_buff;
+    ssize_t len = src->d.conn.relay_len;
+    relay_route_t *r = NULL;
+    io_sock_t *dest = NULL;
+    if (! ctx->relay) {
+        DBG("io", L("relayed frames from sock: %d, but not relaying (-H), dropping them"), src->fd);
+    } else if ((r = relay_route(src, dest_addr)) != NULL) {
+        dest = batab_get(&ctx->live_conns, (uint8_t *) dest_addr);
+    }
+    uint64_t gen = (dest != NULL) ? dest->d.conn.gen : 0;
+    if (r != NULL && (frames[1] & FLOW_CTX_RESET)) r->synced_gen = gen;
+    if (dest != NULL && dest != src && dest->d.conn.fc != NULL && r->synced_gen == gen &&
+        pass_relayed(ctx, dest, frames, len) == 0) {
+        r->noticed_gen = UINT64_MAX;
+        ctx->relay_stats.units++;
+        ctx->relay_stats.bytes += len;
+        return;
+    }
+    ctx->relay_stats.dropped++;
+    ctx->relay_stats.dropped_bytes += len;
+    if (r == NULL) return;
+    r->synced_gen = 0;
+    if (r->noticed_gen == gen) return;
+    uint8_t notice[FLOW_CTX_RELAY_HDR_SZ];
+    flow_ctx_relay_hdr(notice, FLOW_CTX_RELAY_FROM | FLOW_CTX_RELAY_LOST, dest_addr, 0);
+    if (tx_room(&src->d.conn.tx, sizeof(notice)) != 0) return; /* next drop tries again */
+    queue_frames(src, notice, sizeof(notice), 0);
+    relay_kick_later(ctx, src);
+    r->noticed_gen = gen;
+    ctx->relay_stats.lost_sent++;
+}
+
+/* hub, next piece of a relay frame from conn's peer. Frames of a pkt are put together (headers
+   rewritten to say where they came from) and passed on once the last one is in */
+static int relay_forward(void *conn_, const uint8_t *hdr, const uint8_t *piece, ssize_t len) {
+    io_sock_t *conn = (io_sock_t *) conn_;
+    io_ctx_t *ctx = conn->ctx;
+    uint64_t start = mono_ns();
+    const uint8_t *dest = hdr + FLOW_CTX_HDR_SZ;
+    ssize_t frame_len = flow_ctx_relay_len(hdr);
+    int frame_start = (conn->d.conn.relay_frame_in == 0);
+    ssize_t need = conn->d.conn.relay_len + len + (frame_start ? FLOW_CTX_RELAY_HDR_SZ : 0);
+    if (need > conn->d.conn.relay_sz) {
+        if (need > RELAY_UNIT_MAX) {
+            log_warnx("io", L("relayed pkt from sock: %d runs past %d bytes of frames"), conn->fd, RELAY_UNIT_MAX);
+            return -1;
+        }
+        uint8_t *b = realloc(conn->d.conn.relay_buff, RELAY_UNIT_MAX);
+        if (b == NULL) {
+            log_crit("io", L("couldn't allocate relay buffer for sock: %d"), conn->fd);
+            return -1;
+        }
+        conn->d.conn.relay_buff = b;
+        conn->d.conn.relay_sz = RELAY_UNIT_MAX;
+    }
+    uint8_t *out = conn->d.conn.relay_buff + conn->d.conn.relay_len;
+    if (frame_start) {
+        if (conn->d.conn.relay_len == 0) {
+            memcpy(conn->d.conn.relay_dest, dest, MAX_NW_ADDR_LEN);
+        } else if (memcmp(conn->d.conn.relay_dest, dest, MAX_NW_ADDR_LEN) != 0) {
+            log_warnx("io", L("relayed pkt from sock: %d changes destination midway"), conn->fd);
+            return -1;
+        }
+        flow_ctx_relay_hdr(out, FLOW_CTX_RELAY_FROM | (hdr[1] & (FLOW_CTX_RESET | FLOW_CTX_MORE)), conn->d.conn.peer, frame_len);
+        out += FLOW_CTX_RELAY_HDR_SZ;
+        conn->d.conn.relay_len += FLOW_CTX_RELAY_HDR_SZ;
+    }
+    if (len > 0) memcpy(out, piece, len);
+    conn->d.conn.relay_len += len;
+    conn->d.conn.relay_frame_in += len;
+    if (conn->d.conn.relay_frame_in == frame_len) {
+        conn->d.conn.relay_frame_in = 0;
+        if (! (hdr[1] & FLOW_CTX_MORE)) {
+            relay_unit(ctx, conn, conn->d.conn.relay_dest);
+            conn->d.conn.relay_len = 0;
+        }
+    }
+    ctx->relay_stats.busy_ns += mono_ns() - start;
+    return 0;
+}
+
+/* compressed size of a pkt is what its compression put in the conn's ring, output held back for a
+   deferred flush goes uncounted (destinations look more compressible than they are, never less) */
+static inline void account_bypass(io_ctx_t *ctx, tun_pkt_buff_t *pkt_buff, uint64_t out) {
+    uint8_t key[BYPASS_KEY_SZ];
+    if (bypass_key(pkt_buff->buff, pkt_buff->len, key) != 0) return;
+    bypass_account(&ctx->bypass, key, pkt_buff->len, out, time(NULL));
+}
+
+/* returns 0 if pkt was taken (compressed into conn's ring), -1 if it was dropped */
+static inline int write_to_conn(io_ctx_t *ctx, io_sock_t *conn, tun_pkt_buff_t *pkt_buff) {
+    if (conn == NULL) {
+        DBG("io", L("trying to write to unknown connection, dropping packet"));
+        ctx->tx_drop.p++;
+        ctx->tx_drop.b += pkt_buff->len;
+        return -1;
+    }
+    if (! pkt_buff->internal && ((ctx->pep_port != 0 && pep_is_msg(pkt_buff->buff, pkt_buff->len)) || (ctx->http_hdrs && http_hdr_is_encoded(pkt_buff->buff, pkt_buff->len)))) {
+        ctx->tx_reserved_drop.p++; /* the peer would take it for one of ours */
+        ctx->tx_reserved_drop.b += pkt_buff->len;
+        return -1;
+    }
+    if (pkt_buff->relay != NULL) return write_relayed(ctx, conn, pkt_buff);
+
+    retx_seg_t seg = {0};
+    if (ctx->retx.slots != NULL && pkt_buff->len > 0 &&
+        retx_check(&ctx->retx, pkt_buff->buff, pkt_buff->len, conn->d.conn.gen, conn->d.conn.tx_queued - ring_used(&conn->d.conn.tx), &seg)) {
+        return 0; /* the conn has the original */
+    }
+
+    uint64_t queued = conn->d.conn.tx_queued;
+    tun_pkt_buff_t coded = *pkt_buff;
+    if (ctx->http_hdrs && pkt_buff->len > 0) {
+        ssize_t len = http_hdr_encode(&conn->d.conn.hdr_tx, pkt_buff->buff, pkt_buff->len, ctx->hdr_buff, MAX_L3_PKT_SZ);
+        if (len > 0) {
+            coded.buff = ctx->hdr_buff;
+            coded.len = len;
+        }
+    }
+
+    int defer = (conn_flush_policy(conn) != IO_FLUSH_PKT) && (pkt_buff->len > 0);
+    flow_ctx_tab_t *fc = conn->d.conn.fc;
+
+    int ret;
+    if (fc != NULL) {
+        ret = write_framed_to_conn(ctx, conn, pkt_buff, &coded, defer);
+    } else {
+        conn_bound_pkt_t pkt = {&coded, conn, 0, 0, 0};
+        conn->d.conn.comp.defer_flush = defer;
+        ret = fill_ring(-1, &conn->d.conn.tx, read_from_tun_buff, write_passthru_to_conn, &pkt);
+        conn->d.conn.tx_queued += pkt.produced;
+    }
+
+    int dropped = 0;
+
+    if (connection_practically_dead(ret)) {
+        ctx->tx_partial_compress_drop.p++;
+        log_warn("io", L("Partial packet-write, connection is being dropped for sock: %d"), conn->fd);
+        if (fc != NULL) {
+            drop_conn(conn); /* send failed, the frames are in the ring */
+        } else {
+            destroy_sock(conn);
+        }
+        dropped = 1;
+    }
+    
+    if (CONN_IO_OK_NOT_ENOUGH_SPACE == ret) {
+        if (pkt_buff->len == 0) {
+            DBG("io", L("ring full, flush deferred till sock: %d is writable"), conn->fd);
+            conn->d.conn.flush_stalled = 1;
+            return 0;
+        }
+        DBG("io", L("ring full, dropping packet"));
+        dropped = 1;
+    }
+
+    if (dropped) {
+        ctx->tx_drop.p++;
+        ctx->tx_drop.b += pkt_buff->len;
+        return -1;
+    }
+
+    assert(ret == CONN_IO_OK_EXHAUSTED);
+    retx_taken(&ctx->retx, &seg, conn->d.conn.gen, conn->d.conn.tx_queued);
+    if (coded.buff != pkt_buff->buff) {
+        http_hdr_commit(&conn->d.conn.hdr_tx, pkt_buff->buff);
+        ctx->hdr_coded++;
+        ctx->hdr_coded_in += pkt_buff->len;
+        ctx->hdr_coded_out += coded.len;
+    }
+    if (ctx->bypass.slots != NULL && pkt_buff->len > 0) account_bypass(ctx, pkt_buff, conn->d.conn.tx_queued - queued);
+
+    if (pkt_buff->len == 0) {
+        conn->d.conn.flush_stalled = 0;
+    } else if (defer) {
+        if (! conn->d.conn.flush_pending) {
+            LIST_INSERT_HEAD(&ctx->flush_pending, conn, d.conn.flush_link);
+            conn->d.conn.flush_pending = 1;
+        }
+        compress_t *held = (fc != NULL) ? flow_ctx_open_comp(fc) : &conn->d.conn.comp;
+        if (held != NULL && held->unflushed_bytes > conn->d.conn.tx.sz / 4) { /* keep worst-case bound of held-back input well within the ring */
+            flush_conn(ctx, conn);
+        }
+    }
+    return 0;
+}
+
+static inline void flush_conn(io_ctx_t *ctx, io_sock_t *conn) {
+    tun_pkt_buff_t nothing = {NULL, 0, 0, NULL};
+    if (conn->d.conn.flush_pending) {
+        LIST_REMOVE(conn, d.conn.flush_link);
+        conn->d.conn.flush_pending = 0;
+    }
+    write_to_conn(ctx, conn, &nothing); /* empty input with defer_flush cleared => sync-flush */
+}
+
+static inline void flush_pending_conns(io_ctx_t *ctx) {
+    io_sock_t *conn;
+    while ((conn = LIST_FIRST(&ctx->flush_pending)) != NULL) {
+        flush_conn(ctx, conn);
+    }
+}
+
+/* conn to the hub of a peer reached through one (pkt_buff->relay is set), NULL if addr isn't such a peer */
+static inline io_sock_t *relay_conn(io_ctx_t *ctx, const uint8_t *addr, tun_pkt_buff_t *pkt_buff) {
+    if (ctx->via_peers == 0) return NULL;
+    relay_peer_t *rp = relay_peer(ctx, addr);
+    if (rp == NULL) return NULL;
+    pkt_buff->relay = rp;
+    return batab_get(&ctx->live_conns, rp->via);
+}
+
+/* member of a gateway group the pkt's flow hashes to, members whose conns are gone or suspended are
+   left out (their flows move, the rest stay put) */
+static inline route_member_t *gateway_member(io_ctx_t *ctx, route_nh_t *nh, tun_pkt_buff_t *pkt_buff) {
+    if (nh->built_at != ctx->route_epoch) {
+        uint8_t keys[MAGLEV_MAX_MEMBERS * MAX_NW_ADDR_LEN], up[MAGLEV_MAX_MEMBERS];
+        for (int i = 0; i < nh->n; i++) {
+            io_sock_t *conn = route_member_conn(ctx, nh->m[i].addr);
+            memcpy(keys + i * MAX_NW_ADDR_LEN, nh->m[i].addr, MAX_NW_ADDR_LEN);
+            up[i] = (conn != NULL && ! conn->d.conn.suspended);
+        }
+        maglev_build(&nh->mg, keys, MAX_NW_ADDR_LEN, nh->n, up);
+        nh->built_at = ctx->route_epoch;
+    }
+    int i = maglev_lookup(&nh->mg, flow_group_key(pkt_buff->buff, pkt_buff->len));
+    if (i < 0) return &nh->m[0]; /* none up, held on to (or dropped) as for a lone peer */
+    nh->m[i].pkts++;
+    nh->m[i].bytes += pkt_buff->len;
+    return &nh->m[i];
+}
+
+/* conn to the peer a subnet is routed through (nh from lpm_lookup_v4/v6) */
+static inline io_sock_t *routed_conn(io_ctx_t *ctx, uint16_t nh, tun_pkt_buff_t *pkt_buff) {
+    if (nh == 0) return NULL;
+    route_nh_t *r = &ctx->route_tab.nh[nh];
+    route_member_t *m = (r->n > 1) ? gateway_member(ctx, r, pkt_buff) : &r->m[0];
+    io_sock_t *conn = batab_get(&ctx->live_conns, m->addr);
+    return (conn != NULL) ? conn : relay_conn(ctx, m->addr, pkt_buff);
+}
+
+/* conn a pkt should go out on, exact match on a peer first, then subnets behind peers (either may be
+   reached through a hub). nw_addr is scratch space, for IPv4 only the first 4 bytes are written (rest must stay zeroed) */
+static inline io_sock_t *dest_conn(io_ctx_t *ctx, tun_pkt_buff_t *pkt_buff, uint8_t *nw_addr) {
+    io_sock_t *dest_sock;
+    uint8_t ip_v = (*(uint8_t *) pkt_buff->buff) & 0xF0;
+    pkt_buff->relay = NULL;
+    switch(ip_v) {
+    case 0x40:
+        assert(pkt_buff->len > 20);
+        *(uint32_t *) nw_addr = *(((uint32_t *) pkt_buff->buff) + 4);
+        dest_sock = batab_get(&ctx->live_conns, nw_addr);
+        if (dest_sock == NULL) dest_sock = relay_conn(ctx, nw_addr, pkt_buff);
+        if (dest_sock == NULL && pkt_buff->relay == NULL) dest_sock = routed_conn(ctx, lpm_lookup_v4(&ctx->routes, nw_addr), pkt_buff);
+        return dest_sock;
+    case 0x60:
+        assert(pkt_buff->len >= 40);
+        memcpy(nw_addr, ((uint8_t *) pkt_buff->buff) + 24, IPv6_ADDR_LEN); /* destination, fixed header */
+        dest_sock = batab_get(&ctx->live_conns, nw_addr);
+        if (dest_sock == NULL) dest_sock = relay_conn(ctx, nw_addr, pkt_buff);
+        if (dest_sock == NULL && pkt_buff->relay == NULL) dest_sock = routed_conn(ctx, lpm_lookup_v6(&ctx->routes, nw_addr), pkt_buff);
+        return dest_sock;
+    default:
+        log_crit("io", L("Unknown IP version: %d"), ip_v);
+        return NULL;
+    }
+}
+
+/* IO_FLUSH_FLOW, a batch is read whole and then compressed a flow at a time */
+static inline void read_tun_and_xmit_flow_grouped(io_sock_t *tun) {
+    int fd = tun->fd;
+    io_ctx_t *ctx = tun->ctx;
+    tun_batch_t *b = tun->d.tun.batch;
+    NET_ADDR(nw_addr);
+    int n, more = 1;
+
+    while (more) {
+        ssize_t used = 0;
+        for (n = 0; n < FLUSH_BATCH_MAX_PKTS && (TUN_BATCH_BUFF_SZ - used) >= MAX_L3_PKT_SZ; n++) {
+            ssize_t len = read(fd, b->buff + used, MAX_L3_PKT_SZ);
+            DBG("io", L("read %zd bytes from tun"), len);
+            if (len <= 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    log_crit("io", L("Unexpected error in tun-read"));
+                more = 0;
+                break;
+            }
+            b->off[n] = used;
+            b->len[n] = len;
+            b->key[n] = flow_group_key(b->buff + used, len);
+            used += len;
+        }
+        flow_group_order(b->key, n, b->order);
+        for (int i = 0; i < n; i++) {
+            int j = b->order[i];
+            tun_pkt_buff_t pkt_buff = {b->buff + b->off[j], b->len[j], b->len[j], NULL};
+            if (ctx->tun_mtu > 0) ctx->mss_clamped_out += mss_clamp(pkt_buff.buff, pkt_buff.len, ctx->tun_mtu);
+            memset(nw_addr, 0, MAX_NW_ADDR_LEN);
+            write_to_conn(ctx, dest_conn(ctx, &pkt_buff, nw_addr), &pkt_buff);
+        }
+        flush_pending_conns(ctx);
+    }
+}
+
+static inline void read_tun_and_xmit(io_sock_t *tun) {
+    if (tun->d.tun.batch != NULL) {
+        read_tun_and_xmit_flow_grouped(tun);
+        return;
+    }
+    int fd = tun->fd;
+    io_ctx_t *ctx = tun->ctx;
+    tun_pkt_buff_t *pkt_buff = &tun->d.tun.r_buff;
+    NET_ADDR(nw_addr);
+    uint8_t prev_ip_v = 0xF0;
+    int batched = 0;
+
+    do {
+        if (++batched > FLUSH_BATCH_MAX_PKTS) {
+            flush_pending_conns(ctx);
+            batched = 1;
+        }
+        pkt_buff->len = read(fd, pkt_buff->buff, pkt_buff->capacity);
+        DBG("io", L("read %zd bytes from tun"), pkt_buff->len);
+        if (pkt_buff->len <= 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_crit("io", L("Unexpected error in tun-read"));
+            break;
+        }
+        uint8_t ip_v = (*(uint8_t *) pkt_buff->buff) & 0xF0;
+        if (ip_v < prev_ip_v) {
+            memset(nw_addr, 0, MAX_NW_ADDR_LEN);
+            prev_ip_v = ip_v;
+        }
+        if (ctx->tun_mtu > 0) ctx->mss_clamped_out += mss_clamp(pkt_buff->buff, pkt_buff->len, ctx->tun_mtu);
+        write_to_conn(ctx, dest_conn(ctx, pkt_buff, nw_addr), pkt_buff);
+    } while (1);
+
+    flush_pending_conns(ctx);
+}
+
+static inline void tun_io(uint32_t event, io_sock_t *tun) {
+    if (event & EPOLLOUT) {
+        DBG("io", L("called for %d OUT"), tun->fd);
+        drain_tun_queues(tun->ctx);
+    }
+    if ((event & EPOLLIN) && tun->ctx->handoff == NULL) { /* while handing off pkts wait in tun for the successor */
+        DBG("io", L("called for %d IN"), tun->fd);
+        read_tun_and_xmit(tun);
+    }
+}
+
+/* pkts without a live conn to the destination are left alone (not counted as drops), NFQUEUE lets them
+   through uncompressed, on a packet ring the kernel has its own copy */
+static int xmit_captured_pkt(void *pkt, size_t len, void *io_ctx) {
+    io_ctx_t *ctx = (io_ctx_t *) io_ctx;
+    tun_pkt_buff_t pkt_buff = {pkt, len, len, NULL};
+    NET_ADDR(nw_addr);
+    memset(nw_addr, 0, MAX_NW_ADDR_LEN);
+    uint8_t ip_v = *(uint8_t *) pkt & 0xF0;
+    if ((ip_v != 0x40 || len <= 20) && (ip_v != 0x60 || len < 40)) return -1;
+    io_sock_t *dest_sock = dest_conn(ctx, &pkt_buff, nw_addr);
+    if (dest_sock == NULL) return -1;
+    return write_to_conn(ctx, dest_sock, &pkt_buff);
+}
+
+static inline void ring_io(uint32_t event, io_sock_t *sock) {
+    if (! (event & EPOLLIN)) return;
+    while (pkt_ring_read(sock->d.ring.r, 1, xmit_captured_pkt, sock->ctx) > 0) { /* edge-triggered, walk all retired blocks */
+        flush_pending_conns(sock->ctx);
+    }
+}
+
+#ifdef USE_NFQUEUE
+static inline void nfq_io(uint32_t event, io_sock_t *sock) {
+    if (! (event & EPOLLIN)) return;
+    int n;
+    do { /* edge-triggered, read till the socket is drained */
+        n = nfq_capture_read(sock->d.nfq.capture, FLUSH_BATCH_MAX_PKTS);
+        flush_pending_conns(sock->ctx);
+    } while (n == FLUSH_BATCH_MAX_PKTS);
+}
+#endif
+
+/* split-TCP PEP (see pep.h). Flows are sockets of their own, messages to the other end go out on the conn
+   the flow's pkts would take and messages from it are taken off the stream before tun. Nothing goes to a
+   conn while one is being read (the conn could go away under it), flows are kicked instead and have their
+   say once the round of events is over */
+
+#define PEP_RESET_TELL 1 /* the other end gets a PEP_RST */
+#define PEP_RESET_QUIET 2
+
+struct pep_sock_info_s {
+    const uint8_t *tuple;
+    int server_side;
+};
+
+typedef struct pep_sock_info_s pep_sock_info_t;
+
+static inline void kick_pep(io_sock_t *sock) {
+    if (sock->d.pep.kicked) return;
+    TAILQ_INSERT_TAIL(&sock->ctx->pep_kicks, sock, d.pep.kick_link);
+    sock->d.pep.kicked = 1;
+}
+
+static socklen_t pep_sockaddr(const uint8_t *tuple, int server, struct sockaddr_storage *ss) {
+    uint16_t port;
+    const uint8_t *addr = pep_tuple_addr(tuple, server, &port);
+    memset(ss, 0, sizeof(*ss));
+    if (pep_tuple_af(tuple) == AF_INET6) {
+        struct sockaddr_in6 *a = (struct sockaddr_in6 *) ss;
+        a->sin6_family = AF_INET6;
+        a->sin6_port = htons(port);
+        memcpy(&a->sin6_addr, addr, IPv6_ADDR_LEN);
+        return sizeof(*a);
+    }
+    struct sockaddr_in *a = (struct sockaddr_in *) ss;
+    a->sin_family = AF_INET;
+    a->sin_port = htons(port);
+    memcpy(&a->sin_addr, addr, IPv4_ADDR_LEN);
+    return sizeof(*a);
+}
+
+static char *pep_flow_str(io_sock_t *sock, char *buff, size_t sz) {
+    char c[INET_ADDR_STRING_LEN], s[INET_ADDR_STRING_LEN];
+    uint16_t cport, sport;
+    const uint8_t *tuple = sock->d.pep.st.tuple;
+    int af = pep_tuple_af(tuple);
+    if (inet_ntop(af, pep_tuple_addr(tuple, 0, &cport), c, sizeof(c)) == NULL) snprintf(c, sizeof(c), "?");
+    if (inet_ntop(af, pep_tuple_addr(tuple, 1, &sport), s, sizeof(s)) == NULL) snprintf(s, sizeof(s), "?");
+    snprintf(buff, sz, (af == AF_INET6) ? "[%s]:%u > [%s]:%u" : "%s:%u > %s:%u", c, cport, s, sport);
+    return buff;
+}
+
+static void log_pep_flow(io_sock_t *sock, const char *what) {
+    char flow[2 * INET_ADDR_STRING_LEN + 32];
+    pep_stream_t *st = &sock->d.pep.st;
+    uint64_t ns = mono_ns() - st->started_ns;
+    log_info("io", L("pep flow %s %s after %.1f s, up: %" PRIu64 " bytes (%.2f Mbit/s), down: %" PRIu64 " bytes (%.2f Mbit/s)"),
+             pep_flow_str(sock, flow, sizeof(flow)), what, ns / 1e9, st->up, pep_mbps(st->up, ns), st->down, pep_mbps(st->down, ns));
+}
+
+static int init_pep_sock(io_sock_t *sock, void *info_) {
+    pep_sock_info_t *info = (pep_sock_info_t *) info_;
+    io_ctx_t *ctx = sock->ctx;
+    pep_stream_init(&sock->d.pep.st, info->tuple, info->server_side, mono_ns());
+    if (batab_get(&ctx->pep_flows, sock->d.pep.st.tuple) != NULL) {
+        log_warnx("io", L("pep flow of sock: %d is known already"), sock->fd);
+        return -1;
+    }
+    if (init_backlog_ring(&sock->d.pep.rx, PEP_WINDOW, 0, PEP_WINDOW) != 0 || (sock->d.pep.out = malloc(PEP_MSG_MAX)) == NULL) {
+        log_crit("io", L("couldn't allocate pep buffers for sock: %d"), sock->fd);
+        return -1;
+    }
+    if (batab_put(&ctx->pep_flows, sock, NULL) != 0) {
+        log_crit("io", L("couldn't add pep flow of sock: %d"), sock->fd);
+        return -1;
+    }
+    ctx->pep_stats.opened++;
+    if (info->server_side) {
+        struct sockaddr_storage ss;
+        socklen_t len = pep_sockaddr(info->tuple, 1, &ss);
+        if (connect(sock->fd, (struct sockaddr *) &ss, len) == 0 || errno == EINPROGRESS) {
+            sock->d.pep.connecting = 1;
+        } else {
+            ctx->pep_stats.refused++;
+            sock->d.pep.reset = PEP_RESET_TELL;
+        }
+    } else {
+        sock->d.pep.open_pending = 1;
+    }
+    kick_pep(sock);
+    return 0;
+}
+
+/* 0 once the conn took msg, 1 if it has to wait for room, -1 if the flow has no conn (or another one) now */
+static int pep_send(io_sock_t *sock, uint8_t *msg, ssize_t len) {
+    io_ctx_t *ctx = sock->ctx;
+    NET_ADDR(nw_addr);
+    memset(nw_addr, 0, MAX_NW_ADDR_LEN);
+    tun_pkt_buff_t pkt_buff = {msg, len, len, NULL, 1};
+    io_sock_t *conn = dest_conn(ctx, &pkt_buff, nw_addr);
+    if (conn == NULL || pkt_buff.relay != NULL) return -1; /* not through hubs, they drop what doesn't fit */
+    if (sock->d.pep.via_gen == 0) {
+        memcpy(sock->d.pep.via, conn->d.conn.peer, MAX_NW_ADDR_LEN);
+        sock->d.pep.via_gen = conn->d.conn.gen;
+    } else if (conn->d.conn.gen != sock->d.pep.via_gen || memcmp(conn->d.conn.peer, sock->d.pep.via, MAX_NW_ADDR_LEN) != 0) {
+        return -1; /* earlier messages may not have made it */
+    }
+    ring_buff_t *tx = &conn->d.conn.tx;
+    if (ring_used(tx) > tx->sz / 4) return 1; /* flows don't crowd out the conn's other traffic */
+    return (write_to_conn(ctx, conn, &pkt_buff) == 0) ? 0 : 1;
+}
+
+static int pep_send_ctl(io_sock_t *sock, int op, uint32_t arg) {
+    uint8_t msg[PEP_MSG_MAX - PEP_CHUNK];
+    pep_msg_t m = {op, sock->d.pep.st.server_side ? PEP_FROM_SERVER : 0, arg, {0}, NULL, 0};
+    memcpy(m.tuple, sock->d.pep.st.tuple, PEP_TUPLE_SZ);
+    return pep_send(sock, msg, pep_encode(&m, msg));
+}
+
+/* next DATA message (or EOF) from the socket, 0 if it has nothing for now or credit ran out */
+static int pep_read(io_sock_t *sock) {
+    pep_stream_t *st = &sock->d.pep.st;
+    size_t credit = pep_credit(st);
+    if (credit == 0) return 0;
+    ssize_t r = recv(sock->fd, sock->d.pep.out + pep_hdr_len(st->tuple), credit, 0);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+    if (r < 0) {
+        DBG("io", L("pep sock: %d recv failed, resetting flow"), sock->fd);
+        sock->d.pep.reset = PEP_RESET_TELL;
+    } else if (r == 0) {
+        sock->d.pep.eof = 1;
+    } else {
+        pep_msg_t m = {PEP_DATA, st->server_side ? PEP_FROM_SERVER : 0, 0, {0}, NULL, r};
+        memcpy(m.tuple, st->tuple, PEP_TUPLE_SZ);
+        sock->d.pep.out_len = pep_encode(&m, sock->d.pep.out);
+        sock->d.pep.out_data = r;
+    }
+    return 1;
+}
+
+static void pep_reset(io_sock_t *sock) {
+    if (sock->d.pep.reset == PEP_RESET_TELL) pep_send_ctl(sock, PEP_RST, 0); /* best effort */
+    sock->ctx->pep_stats.reset++;
+    log_pep_flow(sock, "reset");
+    destroy_sock(sock);
+}
+
+/* says whatever the flow has to say to the other end, reading the socket for as long as credit and the
+   conn's room allow. A flow that has to wait for room stays kicked. Returns -1 if sock is gone */
+static int pep_pump(io_sock_t *sock) {
+    pep_stream_t *st = &sock->d.pep.st;
+    for (;;) {
+        int ret = 0;
+        if (sock->d.pep.reset) {
+            pep_reset(sock);
+            return -1;
+        }
+        if (sock->d.pep.open_pending) {
+            if ((ret = pep_send_ctl(sock, PEP_OPEN, 0)) == 0) sock->d.pep.open_pending = 0;
+        } else if (pep_ack_due(st)) {
+            if ((ret = pep_send_ctl(sock, PEP_ACK, st->rx_out)) == 0) pep_ack(st);
+        } else if (sock->d.pep.out_len > 0) {
+            if ((ret = pep_send(sock, sock->d.pep.out, sock->d.pep.out_len)) == 0) {
+                pep_sent(st, sock->d.pep.out_data);
+                sock->d.pep.out_len = 0;
+            }
+        } else if (sock->d.pep.eof && ! sock->d.pep.fin_sent) {
+            if ((ret = pep_send_ctl(sock, PEP_FIN, 0)) == 0) sock->d.pep.fin_sent = 1;
+        } else if (sock->d.pep.eof || sock->d.pep.connecting || ! pep_read(sock)) {
+            break;
+        }
+        if (ret > 0) {
+            kick_pep(sock);
+            return 0;
+        }
+        if (ret < 0) sock->d.pep.reset = PEP_RESET_QUIET;
+    }
+    if (sock->d.pep.fin_sent && sock->d.pep.shut) {
+        sock->d.pep.closed = 1;
+        sock->ctx->pep_stats.closed++;
+        log_pep_flow(sock, "closed");
+        destroy_sock(sock);
+        return -1;
+    }
+    return 0;
+}
+
+/* hands what the other end sent to the socket, shuts its write side once the other end is done */
+static void pep_drain(io_sock_t *sock) {
+    ring_buff_t *rx = &sock->d.pep.rx;
+    if (sock->d.pep.connecting || sock->d.pep.shut || sock->d.pep.reset) return;
+    ssize_t before = ring_used(rx);
+    int ret = drain_ring(sock->fd, rx, send_bl_batch, NULL);
+    pep_passed(&sock->d.pep.st, before - ring_used(rx));
+    if (connection_practically_dead(ret)) {
+        sock->d.pep.reset = PEP_RESET_TELL;
+        kick_pep(sock);
+        return;
+    }
+    if (pep_ack_due(&sock->d.pep.st)) kick_pep(sock);
+    if (sock->d.pep.fin_rcvd && ring_empty(rx)) {
+        shutdown(sock->fd, SHUT_WR);
+        sock->d.pep.shut = 1;
+        kick_pep(sock);
+    }
+}
+
+/* addr is one of this host's own */
+static int local_addr(int af, const uint8_t *addr) {
+    struct ifaddrs *ifs;
+    if (getifaddrs(&ifs) != 0) return 1; /* can't tell, so assume it is */
+    int found = 0;
+    for (struct ifaddrs *i = ifs; i != NULL && ! found; i = i->ifa_next) {
+        if (i->ifa_addr == NULL || i->ifa_addr->sa_family != af) continue;
+        if (af == AF_INET) {
+            found = memcmp(&((struct sockaddr_in *) i->ifa_addr)->sin_addr, addr, IPv4_ADDR_LEN) == 0;
+        } else {
+            found = memcmp(&((struct sockaddr_in6 *) i->ifa_addr)->sin6_addr, addr, IPv6_ADDR_LEN) == 0;
+        }
+    }
+    freeifaddrs(ifs);
+    return found;
+}
+
+/* flows only go out to hosts beyond this one, not to itself (loopback or local addresses), nor back
+   into the tunnel (peers, subnets behind them) */
+static int pep_dest_ok(io_ctx_t *ctx, const uint8_t *tuple) {
+    uint16_t port;
+    int af = pep_tuple_af(tuple);
+    const uint8_t *addr = pep_tuple_addr(tuple, 1, &port);
+    if (port == 0) return 0;
+    if (af == AF_INET) {
+        if (addr[0] == 0 || addr[0] == 127 || addr[0] >= 224) return 0; /* this network, loopback, multicast and up */
+    } else {
+        struct in6_addr a6;
+        memcpy(&a6, addr, sizeof(a6));
+        if (IN6_IS_ADDR_UNSPECIFIED(&a6) || IN6_IS_ADDR_LOOPBACK(&a6) || IN6_IS_ADDR_MULTICAST(&a6) || IN6_IS_ADDR_V4MAPPED(&a6)) return 0;
+    }
+    NET_ADDR(nw_addr);
+    memset(nw_addr, 0, MAX_NW_ADDR_LEN);
+    memcpy(nw_addr, addr, (af == AF_INET) ? IPv4_ADDR_LEN : IPv6_ADDR_LEN);
+    if (batab_get(&ctx->live_conns, nw_addr) != NULL || (ctx->via_peers && relay_peer(ctx, nw_addr) != NULL)) return 0;
+    if (((af == AF_INET) ? lpm_lookup_v4(&ctx->routes, nw_addr) : lpm_lookup_v6(&ctx->routes, nw_addr)) != 0) return 0;
+    return ! local_addr(af, addr);
+}
+
+/* server side, the other end accepted a flow to a destination behind us */
+static void pep_open(io_ctx_t *ctx, const uint8_t *tuple) {
+    if (! pep_dest_ok(ctx, tuple)) {
+        log_warnx("io", L("refusing pep flow to a local destination or one back into the tunnel"));
+        ctx->pep_stats.refused++;
+        return;
+    }
+    int fd = socket(pep_tuple_af(tuple), SOCK_STREAM, 0);
+    pep_sock_info_t info = {tuple, 1};
+    if (fd < 0 || add_sock(ctx, fd, pep, init_pep_sock, &info) != 0) {
+        log_warn("io", L("couldn't set up a pep flow to the destination"));
+        ctx->pep_stats.refused++;
+    }
+}
+
+static void pep_rx(io_ctx_t *ctx, const uint8_t *pkt, ssize_t len) {
+    pep_msg_t m;
+    if (pep_decode(pkt, len, &m) != 0) {
+        ctx->pep_stats.stray++;
+        return;
+    }
+    int from_server = (m.flags & PEP_FROM_SERVER) != 0;
+    io_sock_t *sock = batab_get(&ctx->pep_flows, m.tuple);
+    if (sock == NULL || sock->d.pep.st.server_side == from_server) {
+        if (sock == NULL && m.op == PEP_OPEN && ! from_server) {
+            pep_open(ctx, m.tuple);
+        } else {
+            ctx->pep_stats.stray++;
+        }
+        return;
+    }
+    if (sock->d.pep.reset) return;
+    pep_stream_t *st = &sock->d.pep.st;
+    if (m.op == PEP_DATA) {
+        if (sock->d.pep.fin_rcvd || pep_rcvd(st, m.len) != 0) {
+            log_warnx("io", L("pep sock: %d got data past the window (or its end), resetting flow"), sock->fd);
+            sock->d.pep.reset = PEP_RESET_TELL;
+            kick_pep(sock);
+            return;
+        }
+        tun_write_buff_t b = {.b1 = (void *) m.data, .len1 = m.len, .b2 = NULL, .len2 = 0};
+        fill_ring(-1, &sock->d.pep.rx, playback_tun_write_buf, NULL, &b);
+        assert(b.len1 == 0);
+        pep_drain(sock);
+    } else if (m.op == PEP_ACK) {
+        if (pep_acked(st, m.arg) != 0) sock->d.pep.reset = PEP_RESET_TELL;
+        kick_pep(sock);
+    } else if (m.op == PEP_FIN) {
+        sock->d.pep.fin_rcvd = 1;
+        pep_drain(sock);
+    } else if (m.op == PEP_RST) {
+        sock->d.pep.reset = PEP_RESET_QUIET;
+        kick_pep(sock);
+    }
+}
+
+static inline void pep_io(uint32_t event, io_sock_t *sock) {
+    io_ctx_t *ctx = sock->ctx;
+    if (sock->d.pep.connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (! (event & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+        if ((event & (EPOLLERR | EPOLLHUP)) || getsockopt(sock->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+            ctx->pep_stats.refused++;
+            sock->d.pep.reset = PEP_RESET_TELL;
+        }
+        sock->d.pep.connecting = 0;
+    }
+    pep_drain(sock);
+    pep_pump(sock);
+    flush_pending_conns(ctx);
+}
+
+/* flows kicked during the round of events, once each (ones still waiting for room stay kicked) */
+static void kick_pep_flows(io_ctx_t *ctx) {
+    io_sock_t *last = TAILQ_LAST(&ctx->pep_kicks, pks), *sock;
+    int done = 0;
+    while (! done && (sock = TAILQ_FIRST(&ctx->pep_kicks)) != NULL) {
+        done = (sock == last);
+        TAILQ_REMOVE(&ctx->pep_kicks, sock, d.pep.kick_link);
+        sock->d.pep.kicked = 0;
+        pep_pump(sock);
+    }
+    flush_pending_conns(ctx);
+}
+
+/* flows whose conn went away or started over may have lost messages, each end gives up on its side */
+static void check_pep_flows(io_ctx_t *ctx) {
+    batab_entry_t *e;
+    batab_foreach_do((&ctx->pep_flows), e) {
+        io_sock_t *sock = (io_sock_t *) e->value;
+        if (sock->d.pep.via_gen == 0) continue;
+        io_sock_t *conn = batab_get(&ctx->live_conns, sock->d.pep.via);
+        if (conn == NULL || conn->d.conn.gen != sock->d.pep.via_gen) {
+            sock->d.pep.reset = PEP_RESET_QUIET;
+            kick_pep(sock);
+        }
+    }
+}
+
+/* every flow gives up (telling the other end), for a hot upgrade */
+static void reset_pep_flows(io_ctx_t *ctx) {
+    batab_entry_t *e;
+    batab_foreach_do((&ctx->pep_flows), e) {
+        io_sock_t *sock = (io_sock_t *) e->value;
+        sock->d.pep.reset = PEP_RESET_TELL;
+        pep_pump(sock);
+    }
+}
+
+static int pep_accepted_tuple(uint8_t *tuple, struct sockaddr_storage *client, struct sockaddr_storage *server) {
+    if (client->ss_family != server->ss_family) return -1;
+    if (client->ss_family == AF_INET) {
+        struct sockaddr_in *c = (struct sockaddr_in *) client, *s = (struct sockaddr_in *) server;
+        pep_tuple(tuple, AF_INET, &c->sin_addr, ntohs(c->sin_port), &s->sin_addr, ntohs(s->sin_port));
+    } else if (client->ss_family == AF_INET6) {
+        struct sockaddr_in6 *c = (struct sockaddr_in6 *) client, *s = (struct sockaddr_in6 *) server;
+        pep_tuple(tuple, AF_INET6, &c->sin6_addr, ntohs(c->sin6_port), &s->sin6_addr, ntohs(s->sin6_port));
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* client side, the local address of a transparently accepted socket is the flow's destination */
+static int do_pep_accept(io_sock_t *lstn) {
+    io_ctx_t *ctx = lstn->ctx;
+    struct sockaddr_storage client, server;
+    socklen_t client_len = sizeof(client), server_len = sizeof(server);
+    uint8_t tuple[PEP_TUPLE_SZ];
+    int fd = accept(lstn->fd, (struct sockaddr *) &client, &client_len);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) log_warn("io", L("failed to accept pep flow"));
+        return 0;
+    }
+    if (getsockname(fd, (struct sockaddr *) &server, &server_len) != 0 || pep_accepted_tuple(tuple, &client, &server) != 0) {
+        log_warn("io", L("couldn't tell the destination of pep flow on sock: %d"), fd);
+        close(fd);
+        ctx->pep_stats.refused++;
+        return 1;
+    }
+    pep_sock_info_t info = {tuple, 0};
+    if (add_sock(ctx, fd, pep, init_pep_sock, &info) != 0) ctx->pep_stats.refused++;
+    return 1;
+}
+
+static int pep_listen(io_ctx_t *ctx, int af, int port) {
+    struct sockaddr_storage ss;
+    socklen_t len;
+    int on = 1;
+    memset(&ss, 0, sizeof(ss));
+    if (af == AF_INET6) {
+        ((struct sockaddr_in6 *) &ss)->sin6_family = AF_INET6;
+        ((struct sockaddr_in6 *) &ss)->sin6_port = htons(port);
+        len = sizeof(struct sockaddr_in6);
+    } else {
+        ((struct sockaddr_in *) &ss)->sin_family = AF_INET;
+        ((struct sockaddr_in *) &ss)->sin_port = htons(port);
+        len = sizeof(struct sockaddr_in);
+    }
+    int fd = socket(af, SOCK_STREAM, 0);
+    if (fd < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        (af == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) != 0) ||
+        setsockopt(fd, (af == AF_INET6) ? IPPROTO_IPV6 : IPPROTO_IP, (af == AF_INET6) ? IPV6_TRANSPARENT : IP_TRANSPARENT, &on, sizeof(on)) != 0 ||
+        bind(fd, (struct sockaddr *) &ss, len) != 0 ||
+        listen(fd, LISTEN_BACKLOG) != 0) {
+        log_warn("io", L("couldn't set up transparent %s pep listener on port %d"), (af == AF_INET6) ? "IPv6" : "IPv4", port);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return add_sock(ctx, fd, pep_lstn, NULL, NULL);
+}
+
+static int setup_pep(io_ctx_t *ctx, int port) {
+    if (port == 0) return 0;
+    if ((ctx->pep_rx_buff = malloc(PEP_MSG_MAX)) == NULL) {
+        log_crit("io", L("couldn't allocate pep rx buffer"));
+        return -1;
+    }
+    int v4 = pep_listen(ctx, AF_INET, port), v6 = pep_listen(ctx, AF_INET6, port);
+    if (v4 != 0 && v6 != 0) {
+        log_crit("io", L("no pep listener (transparent sockets need CAP_NET_ADMIN)"));
+        return -1;
+    }
+    ctx->pep_port = port;
+    log_info("io", L("pep listening on port %d"), port);
+    return 0;
+}
+
+/* destinations found not to compress go to the bypass set (the routing rules skip it), the kernel takes
+   them out again once their timeout runs out */
+static void apply_bypass(io_ctx_t *ctx) {
+    bypass_dest_t *d;
+    uint32_t hold;
+    char entry[MAX_ADDR_LEN + 32];
+    while ((d = bypass_next(&ctx->bypass, &hold)) != NULL) {
+        int af;
+        if (bypass_entry_str(d->key, entry, sizeof(entry) - 20, &af) != 0) {
+            bypass_undo(&ctx->bypass, d);
+            continue;
+        }
+        size_t len = strlen(entry);
+        snprintf(entry + len, sizeof(entry) - len, " timeout %u", hold);
+        if (run_ipset_on((af == AF_INET6) ? ctx->bypass_set_v6 : ctx->bypass_set, "add -exist", entry) != 0) {
+            log_warnx("io", L("couldn't bypass %s, judging it again"), entry);
+            bypass_undo(&ctx->bypass, d);
+            continue;
+        }
+        log_info("io", L("bypassing %s (last window: %d%% of its size)"), entry, d->last_pct);
+    }
+}
+
+static int setup_bypass(io_ctx_t *ctx, int threshold) {
+    if (threshold == 0) return 0;
+    if (ctx->ipset_name == NULL) {
+        log_crit("io", L("bypass needs an ipset name (the bypass set is named after it)"));
+        return -1;
+    }
+    size_t len = strlen(ctx->ipset_name) + sizeof("-bypass6");
+    if ((ctx->bypass_set = malloc(len)) == NULL || (ctx->bypass_set_v6 = malloc(len)) == NULL) {
+        log_crit("io", L("couldn't allocate bypass set names"));
+        return -1;
+    }
+    snprintf(ctx->bypass_set, len, "%s-bypass", ctx->ipset_name);
+    snprintf(ctx->bypass_set_v6, len, "%s-bypass6", ctx->ipset_name);
+    if (bypass_init(&ctx->bypass, threshold) != 0) return -1;
+    log_info("io", L("bypassing destinations compressing to %d%% or more (sets: %s, %s)"), threshold, ctx->bypass_set, ctx->bypass_set_v6);
+    return 0;
+}
+
+/* control socket commands, requests come in between events (never in the middle of a tun-read batch) */
+
+static int init_ctl_sock(io_sock_t *sock, void *ignore) {
+    if ((sock->d.ctl.client = calloc(1, sizeof(ctl_client_t))) == NULL) {
+        log_warn("io", L("couldn't allocate control client for fd: %d"), sock->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static int setup_ctl(io_ctx_t *ctx) {
+    if (ctx->ctl_path == NULL) return 0;
+    int fd = ctl_listen(ctx->ctl_path);
+    if (fd < 0) return -1;
+    if (add_sock(ctx, fd, ctl_lstn, NULL, NULL) != 0) {
+        log_crit("io", L("couldn't add control socket to io-ctx"));
+        unlink(ctx->ctl_path);
+        return -1;
+    }
+    log_info("io", L("control socket listening at %s"), ctx->ctl_path);
+    return 0;
+}
+
+static inline int do_ctl_accept(io_sock_t *lstn) {
+    int fd = accept(lstn->fd, NULL, NULL);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) log_warn("io", L("failed to accept control client"));
+        return 0;
+    }
+    if (add_sock(lstn->ctx, fd, ctl, init_ctl_sock, NULL) != 0) {
+        log_warn("io", L("Couldn't plug control client into io-ctx"));
+    }
+    return 1;
+}
+
+static int parse_long(const char *s, long min, long max, long *val) {
+    char *end;
+    errno = 0;
+    *val = strtol(s, &end, 0);
+    return (errno != 0 || end == s || *end != '\0' || *val < min || *val > max) ? -1 : 0;
+}
+
+typedef void (conn_visitor_t)(io_sock_t *conn, void *arg);
+
+/* who is a peer address (of a live conn) or "all" */
+static int for_conns(io_ctx_t *ctx, const char *who, conn_visitor_t *fn, void *arg, ctl_out_t *out) {
+    if (strcmp(who, "all") == 0) {
+        batab_entry_t *e;
+        batab_foreach_do((&ctx->live_conns), e) {
+            fn((io_sock_t *) e->value, arg);
+        }
+        return 0;
+    }
+    NET_ADDR(nw_addr);
+    memset(nw_addr, 0, MAX_NW_ADDR_LEN);
+    if (inet_pton(AF_INET, who, nw_addr) != 1 && inet_pton(AF_INET6, who, nw_addr) != 1) {
+        return ctl_error(out, "'%s' is neither a peer address nor 'all'", who);
+    }
+    io_sock_t *conn = batab_get(&ctx->live_conns, nw_addr);
+    if (conn == NULL) return ctl_error(out, "no connection to %s", who);
+    fn(conn, arg);
+    return 0;
+}
+
+static void ring_stats(ctl_out_t *out, const char *name, ring_buff_t *r) {
+    if (r->buff == NULL) {
+        ctl_printf(out, " %s: -", name);
+    } else {
+        ctl_printf(out, " %s: %zd/%zd (max: %zd%s)", name, ring_used(r), r->sz, r->max, r->resizable ? "" : ", fixed");
+    }
+}
+
+static const char *flush_policy_names[] = {"pkt", "batch", "flow"};
+
+static int cmd_stats(void *ctx_, int argc, char **argv, ctl_out_t *out) {
+    io_ctx_t *ctx = (io_ctx_t *) ctx_;
+    char addr[INET_ADDR_STRING_LEN];
+    ctl_printf(out, "loop: iterations: %" PRIu64 ", events: %" PRIu64 ", busy-ms: %" PRIu64 ", max-busy-us: %" PRIu64 "\n",
+               loop_stats.iterations, loop_stats.events, loop_stats.busy_ns / 1000000, loop_stats.max_busy_ns / 1000);
+    ctl_printf(out, "config: level: %d, flush: %s, low-latency: %d, flow-contexts: %d, conn-ring: %zd, max-ring: %zd%s\n",
+               ctx->compression_level, flush_policy_names[ctx->flush_policy], ctx->low_lat_mode, ctx->flow_ctxs,
+               ctx->conn_ring_sz, ctx->max_allowed_ring_sz, ctx->resize_rings ? " (adaptive)" : "");
+    if (ctx->http_hdrs || ctx->hdr_decoded > 0 || ctx->hdr_decode_errs > 0) {
+        ctl_printf(out, "http-headers: coded: %" PRIu64 " pkts, %" PRIu64 " => %" PRIu64 " bytes, decoded: %" PRIu64 " pkts, undecodable: %" PRIu64 "\n",
+                   ctx->hdr_coded, ctx->hdr_coded_in, ctx->hdr_coded_out, ctx->hdr_decoded, ctx->hdr_decode_errs);
+    }
+    if (ctx->bypass.slots != NULL) {
+        bypass_stats_t *bs = &ctx->bypass.stats;
+        ctl_printf(out, "bypass: threshold: %d%%, windows: %" PRIu64 " (poor: %" PRIu64 "), bypassed: %" PRIu64 ", reprobed: %" PRIu64 ", failed: %" PRIu64 ", untracked-pkts: %" PRIu64 "\n",
+                   ctx->bypass.threshold, bs->windows, bs->poor_windows, bs->bypassed, bs->reprobed, bs->failed, bs->untracked_pkts);
+        time_t now = time(NULL);
+        char entry[MAX_ADDR_LEN + 32];
+        int af;
+        for (int i = 0; i < BYPASS_SLOTS; i++) {
+            bypass_dest_t *d = &ctx->bypass.slots[i];
+            if (d->until <= now || bypass_entry_str(d->key, entry, sizeof(entry), &af) != 0) continue;
+            ctl_printf(out, "bypass-dest: %s, left: %lds of %us, last-window: %d%%\n", entry, (long) (d->until - now), d->held, d->last_pct);
+        }
+    }
+    if (ctx->tun_mtu > 0) {
+        ctl_printf(out, "mss: tun-mtu: %d, clamped-syns: out: %" PRIu64 ", in: %" PRIu64 "\n", ctx->tun_mtu, ctx->mss_clamped_out, ctx->mss_clamped_in);
+    }
+    ctl_printf(out, "drops: pkt: %u, bytes: %u, partial-compress-pkt: %u, sink-pkt: %u, reserved-proto-pkt: %u (since last periodic report)\n",
+               ctx->tx_drop.p, ctx->tx_drop.b, ctx->tx_partial_compress_drop.p, ctx->sink.drop.p, ctx->tx_reserved_drop.p);
+    batab_entry_t *e;
+    batab_foreach_do((&ctx->live_conns), e) {
+        io_sock_t *conn = (io_sock_t *) e->value;
+        compress_t *comp = &conn->d.conn.comp;
+        if (inet_ntop(conn->d.conn.af, conn->d.conn.peer, addr, sizeof(addr)) == NULL) snprintf(addr, sizeof(addr), "?");
+        ctl_printf(out, "peer %s: fd: %d, %s, level: %d%s,", addr, conn->fd, conn->d.conn.outbound ? "outbound" : "inbound",
+                   comp->compression_level, comp->level_change_pending ? " (pending)" : "");
+        ring_stats(out, "tx", &conn->d.conn.tx);
+        ring_stats(out, "rx", &conn->d.conn.rx);
+        ring_stats(out, "tun-q", &conn->d.conn.tun_q);
+        char profile[256];
+        ctl_printf(out, " profile: %s\n", profile_str(&conn->d.conn.profile, profile, sizeof(profile)));
+        shm_conn_t *shm = conn->d.conn.shm;
+        if (shm != NULL) {
+            ctl_printf(out, "  shm: ring: %zu, tx-used: %zu, woke-peer: %" PRIu64 "\n", shm->chan.sz, shm_tx_used(&shm->chan), shm->chan.rung);
+        }
+        flow_ctx_tab_t *fc = conn->d.conn.fc;
+        if (fc != NULL) {
+            flow_ctx_stats_t *st = &fc->stats;
+            ctl_printf(out, "  flow-ctx: shared: %" PRIu64 " => %" PRIu64 ", dedicated: %" PRIu64 " => %" PRIu64 ", live: %d, promoted: %u, evicted: %u\n",
+                       st->shared.in, st->shared.out, st->dedicated.in, st->dedicated.out, fc->tx_live, st->promoted, st->evicted);
+        }
+        session_t *sess = conn_session(conn);
+        if (sess != NULL) {
+            ctl_printf(out, "  session: id: %016" PRIx64 ", rx: %" PRIu64 ", tx: %" PRIu64 ", retained: %" PRIu64 ", resumes: %u%s\n",
+                       sess->id, sess->rx_seq, sess->tx_seq, sess->tx_seq - sess->tx_lo, conn->d.conn.resumes,
+                       conn->d.conn.suspended ? ", suspended" : "");
+        }
+    }
+    if (ctx->relay) {
+        relay_stats_t *rs = &ctx->relay_stats;
+        ctl_printf(out, "relay: passed: %" PRIu64 " pkts, %" PRIu64 " bytes, dropped: %" PRIu64 " pkts, %" PRIu64 " bytes, lost-notices: %" PRIu64 ", cpu: %.2f ns/byte\n",
+                   rs->units, rs->bytes, rs->dropped, rs->dropped_bytes, rs->lost_sent,
+                   (rs->bytes + rs->dropped_bytes > 0) ? (double) rs->busy_ns / (rs->bytes + rs->dropped_bytes) : 0.0);
+    }
+    if (ctx->retx.slots != NULL) {
+        retx_stats_t *rs = &ctx->retx.stats;
+        ctl_printf(out, "retx: suppressed queued: %" PRIu64 " pkts, %" PRIu64 " bytes, sent: %" PRIu64 " pkts, %" PRIu64 " bytes, passed: %" PRIu64 " pkts\n",
+                   rs->queued_pkts, rs->queued_bytes, rs->sent_pkts, rs->sent_bytes, rs->passed_pkts);
+    }
+    if (ctx->pep_port != 0) {
+        pep_stats_t *ps = &ctx->pep_stats;
+        ctl_printf(out, "pep: port: %d, open: %u, opened: %" PRIu64 ", refused: %" PRIu64 ", closed: %" PRIu64 ", reset: %" PRIu64 ", stray-msgs: %" PRIu64 ", up: %" PRIu64 " bytes, down: %" PRIu64 " bytes (closed flows)\n",
+                   ctx->pep_port, batab_sz(&ctx->pep_flows), ps->opened, ps->refused, ps->closed, ps->reset, ps->stray, ps->up, ps->down);
+        uint64_t now = mono_ns();
+        batab_foreach_do((&ctx->pep_flows), e) {
+            io_sock_t *sock = (io_sock_t *) e->value;
+            pep_stream_t *st = &sock->d.pep.st;
+            char flow[2 * INET_ADDR_STRING_LEN + 32];
+            uint64_t ns = now - st->started_ns;
+            ctl_printf(out, "pep-flow %s: %s, up: %" PRIu64 " bytes (%.2f Mbit/s), down: %" PRIu64 " bytes (%.2f Mbit/s), age: %.1f s, buffered: %zu, in-flight: %u\n",
+                       pep_flow_str(sock, flow, sizeof(flow)), st->server_side ? "server" : "client", st->up, pep_mbps(st->up, ns),
+                       st->down, pep_mbps(st->down, ns), ns / 1e9, pep_buffered(st), st->tx_seq - st->tx_acked);
+        }
+    }
+    batab_foreach_do((&ctx->relay_peers), e) {
+        relay_peer_t *rp = (relay_peer_t *) e->value;
+        char via[INET_ADDR_STRING_LEN];
+        if (inet_ntop(rp->af, rp->addr, addr, sizeof(addr)) == NULL) snprintf(addr, sizeof(addr), "?");
+        if (inet_ntop(rp->af, rp->via, via, sizeof(via)) == NULL) snprintf(via, sizeof(via), "?");
+        ctl_printf(out, "relayed-peer %s: via: %s, tx: %" PRIu64 " pkts, %" PRIu64 " => %" PRIu64 " bytes, rx-frames: %" PRIu64 ", restarts: %u\n",
+                   addr, via, rp->tx_pkts, rp->tx_in, rp->tx_out, rp->rx_frames, rp->restarts);
+    }
+    for (int g = 1; g < ctx->route_tab.n; g++) {
+        route_nh_t *nh = &ctx->route_tab.nh[g];
+        if (nh->n == 1) continue;
+        uint64_t total = 0;
+        for (int i = 0; i < nh->n; i++) total += nh->m[i].bytes;
+        for (int i = 0; i < nh->n; i++) {
+            route_member_t *m = &nh->m[i];
+            io_sock_t *conn = route_member_conn(ctx, m->addr);
+            if (inet_ntop(m->af, m->addr, addr, sizeof(addr)) == NULL) snprintf(addr, sizeof(addr), "?");
+            ctl_printf(out, "gateway-group %d member %s: %s, %" PRIu64 " pkts, %" PRIu64 " bytes (%.1f%%)\n", g, addr,
+                       (conn == NULL) ? "down" : (conn->d.conn.suspended ? "suspended" : "up"), m->pkts, m->bytes,
+                       (total > 0) ? 100.0 * m->bytes / total : 0.0);
+        }
     }
-    comp->inflatable_bytes = rcvd_compressed;
+    passive_peer_t *pp;
+    LIST_FOREACH(pp, &ctx->disconnected_passive_peers, link) {
+        ctl_printf(out, "peer %s: disconnected\n", pp->humanified_address);
+    }
+    ctl_peer_t *cp;
+    LIST_FOREACH(cp, &ctx->ctl_peers, link) {
+        ctl_printf(out, "control-socket %s: %s\n", cp->removed ? "removed" : "added", cp->line);
+    }
+    return 0;
+}
 
-    ssize_t decompressed = do_decompress(comp, buff + written, max_sz - written);
-    DBG("io", L("decompressed freshly read %zd bytes of conn: %d (total buff available was: %zd)"), decompressed, fd, max_sz - written);
-    *end += decompressed;
-    assert((written + decompressed == max_sz) || (comp->inflatable_bytes == 0));
-    return CONN_IO_OK;
+/* host must resolve and subnets and settings must parse, a bad line would otherwise spoil every later peer reset */
+static int check_peer_line(io_ctx_t *ctx, char **words, int n, ctl_out_t *out) {
+    char host[MAX_ADDR_LEN], port[MAX_ADDR_LEN];
+    strcpy(host, words[0]);
+    separate_peer_port(host, port, sizeof(port), "1");
+    long port_num;
+    if (parse_long(port, 1, 0xFFFF, &port_num) != 0) return ctl_error(out, "bad port in '%s'", words[0]);
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_NUMERICSERV;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) return ctl_error(out, "couldn't resolve '%s'", host);
+    freeaddrinfo(res);
+    link_profile_t profile;
+    memset(&profile, 0, sizeof(profile));
+    for (int i = 1; i < n; i++) {
+        lpm_prefix_t p;
+        int ret = profile_apply_word(&ctx->profiles, words[i], &profile);
+        if (ret < 0) return ctl_error(out, "bad setting '%s'", words[i]);
+        if (ret == 0 && lpm_parse_prefix(words[i], &p) != 0) return ctl_error(out, "bad subnet '%s'", words[i]);
+    }
+    return 0;
 }
 
-static inline void conn_io(uint32_t event, io_sock_t *conn) {
-    int ret;
-    if (event & EPOLLOUT) {
-        DBG("io", L("called for %d OUT"), conn->fd);
-        ret = drain_ring(conn->fd, &conn->d.conn.tx, send_bl_batch, NULL);
-        if (connection_practically_dead(ret)) {
-            log_warn("io", L("Send failed, connection is being dropped for sock: %d"), conn->fd); 
-            destroy_sock(conn);
-            return;
+static int cmd_peer(void *ctx_, int argc, char **argv, ctl_out_t *out) {
+    io_ctx_t *ctx = (io_ctx_t *) ctx_;
+    int removing = (strcmp(argv[1], "del") == 0);
+    if (! removing && strcmp(argv[1], "add") != 0) return ctl_error(out, "expected add or del, got '%s'", argv[1]);
+    if (removing && argc != 3) return ctl_error(out, "peer del takes the peer only");
+    ctl_peer_t *cp = calloc(1, sizeof(ctl_peer_t));
+    if (cp == NULL) return ctl_error(out, "out of memory");
+    size_t len = 0;
+    for (int i = 2; i < argc; i++) {
+        len += snprintf(cp->line + len, sizeof(cp->line) - len, "%s%s", (i > 2) ? " " : "", argv[i]);
+        if (len >= sizeof(cp->line)) {
+            free(cp);
+            return ctl_error(out, "peer line longer than %d bytes", MAX_ADDR_LEN - 1);
         }
     }
-    if (event & EPOLLIN) {
-        DBG("io", L("called for %d IN"), conn->fd);
-        tun_tx_t tun_tx;
-        tun_tx.fd = conn->ctx->tun_fd;
-        tun_tx.backlog = conn->ctx->tun_tx;
-        tun_tx.comp = &conn->d.conn.comp;
-        ret = fill_ring(conn->fd, &conn->d.conn.rx, recv_compressed_data, push_to_tun, &tun_tx);
-        if (connection_practically_dead(ret)) {
-            log_warn("io", L("Recv failed, connection id being dropped for sock: %d"), conn->fd);
-            destroy_sock(conn);
-            return;
-        }
+    if (! removing && check_peer_line(ctx, argv + 2, argc - 2, out) != 0) {
+        free(cp);
+        return -1;
     }
-    if (event & (EPOLLRDHUP | EPOLLHUP)) {
-        log_warn("io", L("Connection closed, connection id being dropped for sock: %d"), conn->fd);
-        destroy_sock(conn);
-        return;
+    cp->removed = removing;
+    ctl_peer_t *old = find_ctl_peer(ctx, cp->line);
+    if (old != NULL) {
+        LIST_REMOVE(old, link);
+        free(old);
     }
-    if (conn->ctx->low_lat_mode >= DISABLE_DELAYED_ACK) {
-        if (setsockopt(conn->fd, IPPROTO_TCP, TCP_QUICKACK, (int[]){1}, sizeof(int)) != 0) {
-            log_warn("io", L("Failed to turn-off delayed ack for sock: %d"), conn->fd); 
-        }
+    LIST_INSERT_HEAD(&ctx->ctl_peers, cp, link);
+    log_info("io", L("peer %s over control socket: %s"), removing ? "removed" : "added", cp->line);
+    trigger_peer_reset(); /* picked up by the io-loop once this iteration's events are handled */
+    return 0;
+}
+
+static void set_conn_level(io_sock_t *conn, void *level_) {
+    int level = *(int *) level_;
+    set_compression_level(&conn->d.conn.comp, level);
+    flow_ctx_tab_t *fc = conn->d.conn.fc;
+    if (fc == NULL) return;
+    fc->compression_level = level;
+    for (int i = 1; i <= fc->max; i++) {
+        if (fc->ctx[i].comp != NULL) set_compression_level(fc->ctx[i].comp, level);
     }
 }
 
-static inline int expand_tun_wbuff_if_necessary(tun_pkt_buff_t *wbuff, ssize_t additional_space_required) {
-    if (additional_space_required > (wbuff->capacity - wbuff->len)) {
-        ssize_t new_cap = wbuff->capacity * 2;
-        if (new_cap < (additional_space_required + wbuff->len)) {
-            new_cap = additional_space_required + wbuff->len;
-        }
-        void *expanded_buff = realloc(wbuff->buff, new_cap);
-        if (NULL == expanded_buff) {
-            log_crit("io", L("failed to expand tun-write pkt-buff, was trying allocation sz: %zd"), new_cap);
-            return -1;
-        }
-        log_warn("io", L("expanded tun wbuff from %zd to %zd"), wbuff->capacity, new_cap);
-        wbuff->buff = expanded_buff;
-        wbuff->capacity = new_cap;
+static int cmd_level(void *ctx_, int argc, char **argv, ctl_out_t *out) {
+    io_ctx_t *ctx = (io_ctx_t *) ctx_;
+    long level;
+    if (parse_long(argv[2], NO_COMPRESSION_LEVEL, MAX_COMPRESSION_LEVEL, &level) != 0 ||
+        (level < MIN_COMPRESSION_LEVEL && level != NO_COMPRESSION_LEVEL)) {
+        return ctl_error(out, "level must be %d (none) or between %d and %d", NO_COMPRESSION_LEVEL, MIN_COMPRESSION_LEVEL, MAX_COMPRESSION_LEVEL);
     }
+    int lvl = level;
+    int all = (strcmp(argv[1], "all") == 0);
+    if (! COMPRESSION_LIVE_LEVEL_CHANGE) { /* only the next frame would take it, and the stream is one endless frame */
+        if (! all) return ctl_error(out, "%s can't change the level of a live connection, 'level all' sets it for new ones", COMPRESSION_IMPL);
+        ctx->compression_level = lvl;
+        return 0;
+    }
+    if (for_conns(ctx, argv[1], set_conn_level, &lvl, out) != 0) return -1;
+    if (all) ctx->compression_level = lvl;
     return 0;
 }
 
-static inline int write_to_tun(int fd, void *buff, ssize_t len, ssize_t *start, void *_tun_write_buff, ssize_t additional_len) {
-    tun_pkt_buff_t *wbuff = (tun_pkt_buff_t *) _tun_write_buff;
-    int ret = CONN_IO_OK;
-    uint16_t pkt_len;
+static void set_ring_max(ring_buff_t *r, ssize_t max) {
+    if (r->buff == NULL) return;
+    r->max = max;
+    r->resizable = (r->sz < max);
+}
 
-    do {
-        ssize_t written = 0;
-        if (wbuff->current_pkt_len == 0) { /* start of a new pkt */
-            pkt_len = parse_ipv4_pkt_sz(buff, len, NULL, 0);
-            if (pkt_len > 0) {
-                if (pkt_len <= len) {
-                    written = write(fd, buff, pkt_len);
-                    if (written > 0) {
-                        assert(written == pkt_len);
-                        buff += written;
-                        len -= written;
-                    }
-                } else {
-                    if (expand_tun_wbuff_if_necessary(wbuff, pkt_len) != 0) return CONN_UNKNOWN_ERR;
-                    wbuff->current_pkt_len = pkt_len;
-                    memcpy(wbuff->buff, buff, len);
-                    wbuff->len += len;
-                    len = 0;
-                }
-            }
-        } else {
-            ssize_t deficit = wbuff->current_pkt_len - wbuff->len;
-            if (len >= deficit) {
-                struct iovec out[2] = {{.iov_base = wbuff->buff, .iov_len = wbuff->len}, {.iov_base = buff, .iov_len = deficit}};
-                written = writev(fd, out, 2);
-                if (written > 0) {
-                    assert(written == (wbuff->len + deficit));
-                    buff += deficit;
-                    len -= deficit;
-                    wbuff->len = 0;
-                    wbuff->current_pkt_len = 0;
-                }
-            } else {
-                memcpy(wbuff->buff + wbuff->len, buff, len);
-                wbuff->len += len;
-                len = 0;
-            }
-        }
+static void set_conn_ring_max(io_sock_t *conn, void *max_) {
+    ssize_t max = *(ssize_t *) max_;
+    set_ring_max(&conn->d.conn.tx, max);
+    set_ring_max(&conn->d.conn.rx, max);
+    set_ring_max(&conn->d.conn.tun_q, max);
+}
 
-        if (written < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                ret = CONN_IO_OK_EXHAUSTED;
-            } else {
-                log_crit("io", L("failed to write to tun dev"));
-                ret = CONN_UNKNOWN_ERR;
-            }
-        }
-    } while((ret == CONN_IO_OK) && (len > 0) && (pkt_len > 0));
+/* rings grow (never shrink) up to the new budget, it applies to rings allocated later too with "all" */
+static int cmd_ring(void *ctx_, int argc, char **argv, ctl_out_t *out) {
+    io_ctx_t *ctx = (io_ctx_t *) ctx_;
+    long max;
+    if (parse_long(argv[2], 1, LONG_MAX, &max) != 0) return ctl_error(out, "bad ring size '%s'", argv[2]);
+    ssize_t m = max;
+    if (for_conns(ctx, argv[1], set_conn_ring_max, &m, out) != 0) return -1;
+    if (strcmp(argv[1], "all") == 0) {
+        ctx->max_allowed_ring_sz = m;
+        ctx->resize_rings = 1;
+    }
+    return 0;
+}
 
-    return ret;
+static int cmd_flush(void *ctx_, int argc, char **argv, ctl_out_t *out) {
+    io_ctx_t *ctx = (io_ctx_t *) ctx_;
+    int policy;
+    for (policy = IO_FLUSH_PKT; policy <= IO_FLUSH_FLOW && strcmp(argv[1], flush_policy_names[policy]) != 0; policy++);
+    if (policy > IO_FLUSH_FLOW) return ctl_error(out, "unknown flush policy '%s'", argv[1]);
+    if (set_tun_flow_grouping(ctx, policy == IO_FLUSH_FLOW || ctx->profile_flow_grouping) != 0) return ctl_error(out, "couldn't allocate flow-grouping batch");
+    ctx->flush_policy = policy;
+    return 0;
 }
 
-struct conn_bound_pkt_s {
-    tun_pkt_buff_t *pkt_buff;
-    io_sock_t *conn;
-    ssize_t already_consumed;
+/* conns with lowlat in their profile keep it */
+static void set_conn_nodelay(io_sock_t *conn, void *on) {
+    if ((conn->d.conn.profile.set & PROFILE_LOWLAT) || conn->fd < 0 || conn->d.conn.shm != NULL) return; /* suspended ones get it on resume */
+    if (setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, (int *) on, sizeof(int)) != 0) {
+        log_warn("io", L("Failed to change Nagle's algorithm setting for sock: %d"), conn->fd);
+    }
+}
+
+static int cmd_lowlat(void *ctx_, int argc, char **argv, ctl_out_t *out) {
+    io_ctx_t *ctx = (io_ctx_t *) ctx_;
+    long mode;
+    if (parse_long(argv[1], 0, DISABLE_DELAYED_ACK, &mode) != 0) return ctl_error(out, "low-latency mode must be between 0 and %d", DISABLE_DELAYED_ACK);
+    int nodelay = (mode >= DISABLE_NAGLE_ALGO);
+    if ((ctx->low_lat_mode >= DISABLE_NAGLE_ALGO) != nodelay) for_conns(ctx, "all", set_conn_nodelay, &nodelay, out);
+    ctx->low_lat_mode = mode;
+    return 0;
+}
+
+static const ctl_cmd_t ctl_cmds[] = {
+    {"stats", 0, 0, cmd_stats, "stats"},
+    {"peer", 2, CTL_MAX_ARGS - 1, cmd_peer, "peer add <host[:port]> [subnet|@profile|key=value ...] | peer del <host[:port]>"},
+    {"level", 2, 2, cmd_level, "level <peer-addr|all> <compression-level>"},
+    {"ring", 2, 2, cmd_ring, "ring <peer-addr|all> <max-bytes>"},
+    {"flush", 1, 1, cmd_flush, "flush <pkt|batch|flow>"},
+    {"lowlat", 1, 1, cmd_lowlat, "lowlat <0|1|2>"},
+    {NULL, 0, 0, NULL, NULL}
 };
 
-typedef struct conn_bound_pkt_s conn_bound_pkt_t;
+static inline void ctl_io(uint32_t event, io_sock_t *sock) {
+    int ret = 0;
+    if (event & EPOLLOUT) ret = ctl_flush(sock->fd, sock->d.ctl.client);
+    if (ret == 0 && (event & EPOLLIN)) ret = ctl_serve(sock->fd, sock->d.ctl.client, ctl_cmds, sock->ctx);
+    if (ret != 0 || (event & EPOLLHUP)) destroy_sock(sock);
+}
 
-static int read_from_tun_buff(int fd, void *to_buff, ssize_t capacity, ssize_t *end, void *hdlr_ctx, ssize_t additional_capacity) {
-    conn_bound_pkt_t *pkt = (conn_bound_pkt_t *) hdlr_ctx;
+/* hot upgrade: a successor connects to upgrade_path and says hello, conns are then drained to a point
+   where their streams can be picked up (see set_compression_handoff) while tun and listeners are left
+   alone. Once all are there (or HANDOFF_DRAIN_SECS pass, stragglers are dropped and reconnect) tun,
+   listeners and conns with their state and rings go to the successor and this process stops */
+
+#define HANDOFF_DRAIN_SECS 2
+#define HANDOFF_POLL_MS 100 /* epoll timeout while draining */
+#define HANDOFF_MAX_LSTNS 8
+
+static int setup_upgrade(io_ctx_t *ctx) {
+    if (ctx->upgrade_path == NULL) return 0;
+    int fd = handoff_listen(ctx->upgrade_path);
+    if (fd < 0) return -1;
+    if (add_sock(ctx, fd, upg_lstn, NULL, NULL) != 0) {
+        log_crit("io", L("couldn't add upgrade socket to io-ctx"));
+        unlink(ctx->upgrade_path);
+        return -1;
+    }
+    log_info("io", L("successor can take over at %s"), ctx->upgrade_path);
+    return 0;
+}
 
-    compress_t *comp = &pkt->conn->d.conn.comp;
+static inline int do_upg_accept(io_sock_t *lstn) {
+    int fd = accept(lstn->fd, NULL, NULL);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) log_warn("io", L("failed to accept successor"));
+        return 0;
+    }
+    if (lstn->ctx->handoff != NULL) {
+        log_warnx("io", L("already handing off, turning away another successor"));
+        close(fd);
+    } else if (add_sock(lstn->ctx, fd, upg, NULL, NULL) != 0) {
+        log_warn("io", L("Couldn't plug successor into io-ctx"));
+    }
+    return 1;
+}
 
-    if (pkt->already_consumed == 0) { /* first invocation */
-        if (worst_case_compressed_out_sz(comp, pkt->pkt_buff->len) > (capacity + additional_capacity)) {
-            return CONN_IO_OK_NOT_ENOUGH_SPACE;
-        }
-        setup_compress_input(comp, pkt->pkt_buff->buff, pkt->pkt_buff->len);
+/* conns may be destroyed while walking them, so they are walked by peer address. Returns count, -1 on failure */
+static int live_peers(io_ctx_t *ctx, uint8_t **addrs) {
+    int n = 0;
+    *addrs = malloc(MAX_NW_ADDR_LEN * (batab_sz(&ctx->live_conns) + 1));
+    if (*addrs == NULL) {
+        log_crit("io", L("couldn't allocate peer list"));
+        return -1;
     }
+    batab_entry_t *e;
+    batab_foreach_do((&ctx->live_conns), e) {
+        memcpy(*addrs + MAX_NW_ADDR_LEN * n++, ((io_sock_t *) e->value)->d.conn.peer, MAX_NW_ADDR_LEN);
+    }
+    return n;
+}
 
-    ssize_t consumed = 0;
-    int complete = 0;
-    ssize_t written = do_compress(comp, to_buff, capacity, &consumed, &complete);
+static inline int at_handoff_point(io_sock_t *conn) {
+    return conn_can_send(conn) && conn->d.conn.fc == NULL && conn->d.conn.shm == NULL && ! conn->d.conn.flush_stalled && compression_at_handoff_point(&conn->d.conn.comp);
+}
 
-    *end += written;
-    pkt->already_consumed += consumed;
-    
-    if ((! complete) && additional_capacity == 0) {
-        return CONN_KILL;
+static void begin_handoff(io_sock_t *sock) {
+    io_ctx_t *ctx = sock->ctx;
+    uint8_t *addrs;
+    int n = live_peers(ctx, &addrs);
+    if (n < 0) {
+        destroy_sock(sock);
+        return;
     }
-    
-    return (pkt->already_consumed == pkt->pkt_buff->len) ? CONN_IO_OK_EXHAUSTED : CONN_IO_OK;
+    log_info("io", L("handing off to successor, draining %d conns"), n);
+    ctx->handoff = sock;
+    ctx->handoff_deadline = time(NULL) + HANDOFF_DRAIN_SECS;
+    reset_pep_flows(ctx); /* flows aren't handed over, their RSTs go out with the drain */
+    for (int i = 0; i < n; i++) {
+        io_sock_t *conn = batab_get(&ctx->live_conns, addrs + MAX_NW_ADDR_LEN * i);
+        if (conn == NULL || conn->d.conn.fc != NULL || conn->d.conn.shm != NULL) continue; /* flow-ctx and shm conns aren't handed over */
+        if (! conn_can_send(conn)) { /* suspended (or still saying hello), the peer starts over with the successor */
+            destroy_sock(conn);
+            continue;
+        }
+        set_compression_handoff(&conn->d.conn.comp, 1);
+        flush_conn(ctx, conn);
+        if ((conn = batab_get(&ctx->live_conns, addrs + MAX_NW_ADDR_LEN * i)) != NULL) conn_rx(conn); /* decompress what's already here up to a handoff point */
+    }
+    free(addrs);
 }
 
-static ssize_t write_passthru_to_conn(void *b1, ssize_t len1, void *b2, ssize_t len2, void *hdlr_ctx) {
-    assert(hdlr_ctx != NULL);
-    conn_bound_pkt_t *pkt = (conn_bound_pkt_t *) hdlr_ctx;
-    int dest_fd = pkt->conn->fd;
-    assert(dest_fd > 0);
-    DBG("io", L("dest_fd: %d, buff1: %p, len1: %zd, buff2: %p, len2: %zd"), dest_fd, b1, len1, b2, len2);
-    ssize_t written = 0;
-    if (len1 > 0) {
-        send_bl_batch(dest_fd, b1, len1, &written, NULL, 0);
+/* successor went away mid-drain, carry on as if nothing happened */
+static void abort_handoff(io_ctx_t *ctx) {
+    log_warnx("io", L("successor went away, handoff aborted"));
+    destroy_sock(ctx->handoff);
+    ctx->handoff = NULL;
+    uint8_t *addrs;
+    int n = live_peers(ctx, &addrs);
+    for (int i = 0; i < n; i++) {
+        io_sock_t *conn = batab_get(&ctx->live_conns, addrs + MAX_NW_ADDR_LEN * i);
+        if (conn == NULL) continue;
+        set_compression_handoff(&conn->d.conn.comp, 0);
+        conn_rx(conn); /* input held back at the handoff point has no edge coming for it */
     }
-    if ((written == len1) && len2 > 0) {
-        send_bl_batch(dest_fd, b2, len2, &written, NULL, 0);
+    if (n >= 0) free(addrs);
+    io_sock_t *sock;
+    LIST_FOREACH(sock, &ctx->non_conns, link) { /* their edges were spent while handing off */
+        if (sock->typ == tun) read_tun_and_xmit(sock);
+        if (sock->typ == lstn) while (do_accept(sock));
     }
-    DBG("io", L("wrote %zd bytes to sock: %d"), written, dest_fd);
-    return written;
 }
 
-static inline void write_to_conn(io_ctx_t *ctx, io_sock_t *conn, tun_pkt_buff_t *pkt_buff) {
-    if (conn == NULL) {
-        DBG("io", L("trying to write to unknown connection, dropping packet"));
-        ctx->tx_drop.p++;
-        ctx->tx_drop.b += pkt_buff->len;
+static int send_handoff_conn(int upg_fd, io_sock_t *conn) {
+    uint8_t *state;
+    ssize_t comp_len = export_compression_state(&conn->d.conn.comp, &state);
+    if (comp_len < 0) return -1;
+    ring_buff_t *tun_q = &conn->d.conn.tun_q;
+    handoff_conn_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.peer, conn->d.conn.peer, MAX_NW_ADDR_LEN);
+    h.af = conn->d.conn.af;
+    h.profile = conn->d.conn.profile;
+    h.comp_len = comp_len;
+    h.tx_len = ring_used(&conn->d.conn.tx);
+    h.rx_len = ring_used(&conn->d.conn.rx);
+    h.tun_q_len = (tun_q->buff != NULL) ? ring_used(tun_q) : 0;
+    session_t *sess = conn_session(conn);
+    if (sess != NULL) {
+        h.sess_id = sess->id;
+        h.rx_seq = sess->rx_seq;
+        h.tx_seq = sess->tx_seq;
+        h.retx_len = sess->tx_seq - sess->tx_lo;
+    }
+    h.hdr_tx_len = http_hdr_export_sz(&conn->d.conn.hdr_tx);
+    h.hdr_rx_len = http_hdr_export_sz(&conn->d.conn.hdr_rx);
+    size_t len = sizeof(h) + h.comp_len + h.tx_len + h.rx_len + h.tun_q_len + h.retx_len + h.hdr_tx_len + h.hdr_rx_len;
+    uint8_t *buff = malloc(len);
+    if (buff == NULL) {
+        log_crit("io", L("couldn't allocate %zu bytes of handoff state for sock: %d"), len, conn->fd);
+        free(state);
+        return -1;
+    }
+    uint8_t *d = buff;
+    memcpy(d, &h, sizeof(h));
+    d += sizeof(h);
+    memcpy(d, state, comp_len);
+    d += comp_len;
+    d += copy_ring(d, &conn->d.conn.tx);
+    d += copy_ring(d, &conn->d.conn.rx);
+    d += copy_ring(d, tun_q);
+    if (h.retx_len > 0) session_copy(sess, sess->tx_lo, d);
+    d += h.retx_len;
+    http_hdr_export(&conn->d.conn.hdr_tx, d);
+    http_hdr_export(&conn->d.conn.hdr_rx, d + h.hdr_tx_len);
+    int ret = handoff_send(upg_fd, HANDOFF_CONN, conn->fd, buff, len);
+    free(buff);
+    free(state);
+    return ret;
+}
+
+static void do_handoff(io_ctx_t *ctx) {
+    io_sock_t *upg_sock = ctx->handoff, *sock, *next;
+    uint8_t *addrs;
+    int n = live_peers(ctx, &addrs);
+    if (n < 0) {
+        abort_handoff(ctx);
         return;
     }
+    int handed = 0;
+    for (int i = 0; i < n; i++) {
+        io_sock_t *conn = batab_get(&ctx->live_conns, addrs + MAX_NW_ADDR_LEN * i);
+        if (conn == NULL) continue;
+        if (at_handoff_point(conn)) {
+            handed++;
+        } else {
+            log_warnx("io", L("conn sock: %d isn't at a handoff point, dropping it"), conn->fd);
+            destroy_sock(conn);
+        }
+    }
+    for (sock = LIST_FIRST(&ctx->non_conns); sock != NULL; sock = next) { /* the successor sets these up again at the same paths */
+        next = LIST_NEXT(sock, link);
+        if (sock->typ == ctl_lstn || sock->typ == upg_lstn) {
+            destroy_sock(sock);
+        } else if (sock->typ == hs) {
+            destroy_sock(sock); /* peer tries again, with the successor */
+        } else if (sock->typ == pep_lstn || sock->typ == pep) {
+            destroy_sock(sock); /* successor listens again, flows were reset */
+        } else if (sock->typ == shm_lstn || sock->typ == shm_hs) {
+            destroy_sock(sock); /* successor listens again, shm peers reconnect to it */
+        }
+    }
 
-    conn_bound_pkt_t pkt = {pkt_buff, conn, 0};
+    int flags = fcntl(upg_sock->fd, F_GETFL);
+    int failed = (flags == -1 || fcntl(upg_sock->fd, F_SETFL, flags & ~O_NONBLOCK) == -1);
+    failed = failed || handoff_send(upg_sock->fd, HANDOFF_TUN, ctx->tun_fd, NULL, 0) != 0;
+    LIST_FOREACH(sock, &ctx->non_conns, link) {
+        if (sock->typ == lstn) failed = failed || handoff_send(upg_sock->fd, HANDOFF_LSTN, sock->fd, NULL, 0) != 0;
+    }
+    for (int i = 0; i < n && ! failed; i++) {
+        io_sock_t *conn = batab_get(&ctx->live_conns, addrs + MAX_NW_ADDR_LEN * i);
+        if (conn != NULL) failed = (send_handoff_conn(upg_sock->fd, conn) != 0);
+    }
+    failed = failed || handoff_send(upg_sock->fd, HANDOFF_DONE, -1, NULL, 0) != 0;
 
-    int ret = fill_ring(-1, &conn->d.conn.tx, read_from_tun_buff, write_passthru_to_conn, &pkt);
+    if (failed) {
+        log_crit("io", L("handoff to successor failed, carrying on"));
+        abort_handoff(ctx);
+        if (setup_ctl(ctx) != 0 || setup_upgrade(ctx) != 0) log_warnx("io", L("control or upgrade socket couldn't be set up again"));
+    } else {
+        for (int i = 0; i < n; i++) {
+            io_sock_t *conn = batab_get(&ctx->live_conns, addrs + MAX_NW_ADDR_LEN * i);
+            if (conn != NULL) conn->d.conn.handed_off = 1;
+        }
+        log_info("io", L("handed off tun and %d conns to successor, stopping"), handed);
+        do_stop = 1;
+    }
+    free(addrs);
+}
 
-    int dropped = 0;
+static void check_handoff(io_ctx_t *ctx) {
+    if (ctx->handoff == NULL) return;
+    int all_there = 1;
+    batab_entry_t *e;
+    batab_foreach_do((&ctx->live_conns), e) {
+        all_there = all_there && at_handoff_point((io_sock_t *) e->value);
+    }
+    if (all_there || time(NULL) >= ctx->handoff_deadline) do_handoff(ctx);
+}
 
-    if (connection_practically_dead(ret)) {
-        ctx->tx_partial_compress_drop.p++;
-        log_warn("io", L("Partial packet-write, connection is being dropped for sock: %d"), conn->fd);
-        destroy_sock(conn);
-        dropped = 1;
+static inline void upg_io(uint32_t event, io_sock_t *sock) {
+    io_ctx_t *ctx = sock->ctx;
+    if (ctx->handoff == sock) { /* successor only listens till DONE, anything else means it's gone */
+        if (event & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) abort_handoff(ctx);
+        return;
     }
-    
-    if (CONN_IO_OK_NOT_ENOUGH_SPACE == ret) {
-        DBG("io", L("ring full, dropping packet"));
-        dropped = 1;
+    if (! (event & EPOLLIN)) {
+        if (event & (EPOLLHUP | EPOLLRDHUP)) destroy_sock(sock);
+        return;
     }
-
-    if (dropped) {
-        ctx->tx_drop.p++;
-        ctx->tx_drop.b += pkt_buff->len;
+    int typ, fd;
+    void *data;
+    ssize_t len = handoff_recv(sock->fd, &typ, &fd, &data);
+    handoff_hello_t *hello = (handoff_hello_t *) data;
+    if (fd >= 0) close(fd);
+    if (len != sizeof(*hello) || typ != HANDOFF_HELLO) {
+        log_warnx("io", L("successor didn't say hello, turning it away"));
+    } else if (hello->version != HANDOFF_VERSION || strncmp(hello->impl, COMPRESSION_IMPL, sizeof(hello->impl)) != 0) {
+        log_warnx("io", L("successor speaks handoff v%u (%.8s), this is v%d (" COMPRESSION_IMPL "), turning it away"), hello->version, hello->impl, HANDOFF_VERSION);
+    } else if (ctx->tun_fd < 0) {
+        log_warnx("io", L("hot upgrade needs tun, turning successor away"));
+    } else {
+        free(data);
+        begin_handoff(sock);
         return;
     }
+    free(data);
+    destroy_sock(sock);
+}
 
-    assert(ret == CONN_IO_OK_EXHAUSTED);
+/* successor side: everything the previous process handed over, taken into the io-ctx once it's all here */
+
+struct handed_conn_s {
+    int fd;
+    handoff_conn_t *h;
+};
+
+typedef struct handed_conn_s handed_conn_t;
+
+struct handed_over_s {
+    int tun_fd;
+    int lstn_fds[HANDOFF_MAX_LSTNS];
+    int num_lstns;
+    handed_conn_t *conns;
+    int num_conns;
+};
+
+typedef struct handed_over_s handed_over_t;
+
+static void release_handed_over(handed_over_t *in) {
+    if (in->tun_fd >= 0) close(in->tun_fd);
+    for (int i = 0; i < in->num_lstns; i++) {
+        if (in->lstn_fds[i] >= 0) close(in->lstn_fds[i]);
+    }
+    for (int i = 0; i < in->num_conns; i++) {
+        if (in->conns[i].fd >= 0) close(in->conns[i].fd);
+        free(in->conns[i].h);
+    }
+    free(in->conns);
+    memset(in, 0, sizeof(*in));
+    in->tun_fd = -1;
 }
 
-static inline void read_tun_and_xmit(io_sock_t *tun) {
-    int fd = tun->fd;
-    io_ctx_t *ctx = tun->ctx;
-    tun_pkt_buff_t *pkt_buff = &tun->d.tun.r_buff;
-    NET_ADDR(nw_addr);
-    uint8_t prev_ip_v = 0xF0;
-    uint32_t *nw_addr_ipv4 = (uint32_t *) nw_addr;
+static int valid_handoff_conn(const handoff_conn_t *h, ssize_t len) {
+    if (len < (ssize_t) sizeof(*h)) return 0;
+    uint64_t expected = sizeof(*h) + (uint64_t) h->comp_len + h->tx_len + h->rx_len + h->tun_q_len + h->retx_len + h->hdr_tx_len + h->hdr_rx_len;
+    return expected == (uint64_t) len && (h->af == AF_INET || h->af == AF_INET6);
+}
 
-    do {
-        pkt_buff->len = read(fd, pkt_buff->buff, pkt_buff->capacity);
-        DBG("io", L("read %zd bytes from tun"), pkt_buff->len);
-        if (pkt_buff->len <= 0) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK)
-                log_crit("io", L("Unexpected error in tun-read"));
+/* takes fd and data on success */
+static int add_handed_over(handed_over_t *in, int typ, int fd, void *data, ssize_t len) {
+    if (typ == HANDOFF_TUN && fd >= 0 && in->tun_fd < 0) {
+        in->tun_fd = fd;
+    } else if (typ == HANDOFF_LSTN && fd >= 0 && in->num_lstns < HANDOFF_MAX_LSTNS) {
+        in->lstn_fds[in->num_lstns++] = fd;
+    } else if (typ == HANDOFF_CONN && fd >= 0 && valid_handoff_conn(data, len)) {
+        handed_conn_t *conns = realloc(in->conns, sizeof(handed_conn_t) * (in->num_conns + 1));
+        if (conns == NULL) {
+            log_crit("io", L("couldn't allocate handed over conns"));
+            return -1;
+        }
+        in->conns = conns;
+        conns[in->num_conns].fd = fd;
+        conns[in->num_conns++].h = data;
+        return 0;
+    } else {
+        log_warnx("io", L("unexpected handoff record (type: %d, fd: %d, len: %zd)"), typ, fd, len);
+        return -1;
+    }
+    free(data);
+    return 0;
+}
+
+static int receive_handoff(const char *upgrade_path, handed_over_t *in) {
+    int sock = handoff_connect(upgrade_path);
+    if (sock < 0) return -1;
+    handoff_hello_t hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.version = HANDOFF_VERSION;
+    strncpy(hello.impl, COMPRESSION_IMPL, sizeof(hello.impl));
+    if (handoff_send(sock, HANDOFF_HELLO, -1, &hello, sizeof(hello)) != 0) {
+        close(sock);
+        return -1;
+    }
+    log_info("io", L("waiting for the running process at %s to hand over"), upgrade_path);
+    for (;;) {
+        int typ, fd;
+        void *data;
+        ssize_t len = handoff_recv(sock, &typ, &fd, &data);
+        if (len < 0) {
+            log_crit("io", L("running process didn't hand everything over"));
             break;
         }
-        uint8_t ip_v = (*(uint8_t *) pkt_buff->buff) & 0xF0;
-        if (ip_v < prev_ip_v) {
-            memset(nw_addr, 0, MAX_NW_ADDR_LEN);
-            prev_ip_v = ip_v;
+        if (typ == HANDOFF_DONE) {
+            free(data);
+            if (fd >= 0) close(fd);
+            close(sock);
+            if (in->tun_fd >= 0) return 0;
+            log_crit("io", L("no tun was handed over"));
+            release_handed_over(in);
+            return -1;
         }
-        switch(ip_v) {
-        case 0x40:
-            assert(pkt_buff->len > 20);
-            *nw_addr_ipv4 = *(((uint32_t *) pkt_buff->buff) + 4);
-            io_sock_t *dest_sock = batab_get(&ctx->live_conns, nw_addr);
-            write_to_conn(ctx, dest_sock, pkt_buff);
+        if (add_handed_over(in, typ, fd, data, len) != 0) {
+            free(data);
+            if (fd >= 0) close(fd);
             break;
-        case 0x60: /* implement me! */
-        default:
-            log_crit("io", L("Unknown IP version: %d"), ip_v);
         }
-    } while (1);
+    }
+    close(sock);
+    release_handed_over(in);
+    return -1;
 }
 
-static inline void tun_io(uint32_t event, io_sock_t *tun) {
-    if (event & EPOLLOUT) {
-        DBG("io", L("called for %d OUT"), tun->fd);
-        if (CONN_UNKNOWN_ERR == drain_ring(tun->fd, &tun->d.tun.tx, write_to_tun, &tun->d.tun.w_buff))
-            log_warn("io", L("TUN write failed. Fd: %d"), tun->fd); 
+static int take_over_handed(io_ctx_t *ctx, handed_over_t *in, int listener_port) {
+    int lstns = 0, conns = 0;
+    for (int i = 0; i < in->num_lstns; i++) {
+        if (add_sock(ctx, in->lstn_fds[i], lstn, NULL, NULL) == 0) lstns++;
+        in->lstn_fds[i] = -1;
     }
-    if (event & EPOLLIN) {
-        DBG("io", L("called for %d IN"), tun->fd);
-        read_tun_and_xmit(tun);
+    if (lstns == 0 && setup_listener(ctx, listener_port) != 0) return -1;
+    for (int i = 0; i < in->num_conns; i++) {
+        handoff_conn_t *h = in->conns[i].h;
+        conn_sock_info_t addr_info = {.addr = h->peer, .af = h->af, .handed = h};
+        int ret = add_sock(ctx, in->conns[i].fd, conn, init_conn_sock, &addr_info);
+        in->conns[i].fd = -1;
+        io_sock_t *sock = batab_get(&ctx->live_conns, h->peer);
+        if (ret != 0 || sock == NULL) continue;
+        conns++;
+        if (sock->d.conn.tun_q.buff != NULL && ! ring_empty(&sock->d.conn.tun_q)) list_tun_backlogged(ctx, sock);
+    }
+    ctx->routes_inherited = 1;
+    for (int i = 0; i < in->num_conns; i++) { /* input held back at the handoff point, socket may not have an edge coming */
+        io_sock_t *sock = batab_get(&ctx->live_conns, in->conns[i].h->peer);
+        if (sock != NULL) conn_rx(sock);
     }
+    log_info("io", L("took over tun, %d listeners and %d of %d conns"), lstns, conns, in->num_conns);
+    return 0;
 }
 
 static inline void handle_io_evt(uint32_t event, io_sock_t *sock) {
     DBG("io", L("event: %x for fd: %d (typ: %d)"), event, sock->fd, sock->typ);
     if (sock->typ == tun) {
         tun_io(event, sock);
+    } else if (sock->typ == ring) {
+        ring_io(event, sock);
+#ifdef USE_NFQUEUE
+    } else if (sock->typ == nfq) {
+        nfq_io(event, sock);
+#endif
     } else if (sock->typ == conn) {
         conn_io(event, sock);
+    } else if (sock->typ == hs) {
+        hs_io(event, sock);
+    } else if (sock->typ == ctl) {
+        ctl_io(event, sock);
+    } else if (sock->typ == ctl_lstn) {
+        while (do_ctl_accept(sock));
+    } else if (sock->typ == upg_lstn) {
+        while (do_upg_accept(sock));
+    } else if (sock->typ == upg) {
+        upg_io(event, sock);
+    } else if (sock->typ == pep) {
+        pep_io(event, sock);
+    } else if (sock->typ == pep_lstn) {
+        if (sock->ctx->handoff == NULL) while (do_pep_accept(sock));
+    } else if (sock->typ == shm_lstn) {
+        if (sock->ctx->handoff == NULL) while (do_shm_accept(sock));
+    } else if (sock->typ == shm_hs) {
+        shm_hs_io(event, sock);
     } else {
         assert(sock->typ == lstn);
-        while(do_accept(sock));
+        if (sock->ctx->handoff == NULL) while(do_accept(sock)); /* while handing off, new conns wait in the backlog for the successor */
     }
 }
 
@@ -1482,6 +4857,43 @@ static inline void handle_io_evt(uint32_t event, io_sock_t *sock) {
 #define	LIST_NEXT(elm, field)		((elm)->field.le_next)
 #endif
 
+/* only peers that had to queue for tun since the last report */
+static void log_tun_backlog_stats(io_ctx_t *ctx) {
+    batab_entry_t *e;
+    char addr[INET_ADDR_STRING_LEN];
+    batab_foreach_do((&ctx->live_conns), e) {
+        io_sock_t *conn = (io_sock_t *) e->value;
+        if (conn->d.conn.tun_q_in.p == 0 && conn->d.conn.tun_q_full == 0) continue;
+        if (inet_ntop(conn->d.conn.af, conn->d.conn.peer, addr, sizeof(addr)) == NULL) snprintf(addr, sizeof(addr), "fd %d", conn->fd);
+        log_info("io", L("Tun backlog stats for %s: queued-pkt: %u, queued-bytes: %u, queue-full: %u, peak-bytes: %zd, now-bytes: %zd"),
+                 addr, conn->d.conn.tun_q_in.p, conn->d.conn.tun_q_in.b, conn->d.conn.tun_q_full, conn->d.conn.tun_q_peak, ring_used(&conn->d.conn.tun_q));
+        conn->d.conn.tun_q_in.p = conn->d.conn.tun_q_in.b = conn->d.conn.tun_q_full = 0;
+        conn->d.conn.tun_q_peak = ring_used(&conn->d.conn.tun_q);
+    }
+}
+
+static inline double ratio(flow_ctx_ratio_t *r) {
+    return (r->out > 0) ? ((double) r->in / r->out) : 0;
+}
+
+/* ratio of the shared ctx vs dedicated ones (frame headers included), only for conns that sent something */
+static void log_flow_ctx_stats(io_ctx_t *ctx) {
+    batab_entry_t *e;
+    char addr[INET_ADDR_STRING_LEN];
+    batab_foreach_do((&ctx->live_conns), e) {
+        io_sock_t *conn = (io_sock_t *) e->value;
+        flow_ctx_tab_t *fc = conn->d.conn.fc;
+        if (fc == NULL || (fc->stats.shared.in + fc->stats.dedicated.in) == 0) continue;
+        flow_ctx_stats_t *st = &fc->stats;
+        if (inet_ntop(conn->d.conn.af, conn->d.conn.peer, addr, sizeof(addr)) == NULL) snprintf(addr, sizeof(addr), "fd %d", conn->fd);
+        double shared = ratio(&st->shared), dedicated = ratio(&st->dedicated);
+        log_info("io", L("Flow-ctx stats for %s: shared: %" PRIu64 " => %" PRIu64 " bytes (ratio: %.2f), dedicated: %" PRIu64 " => %" PRIu64 " bytes (ratio: %.2f, gain over shared: %.2fx), live: %d, promoted: %u, evicted: %u"),
+                 addr, st->shared.in, st->shared.out, shared, st->dedicated.in, st->dedicated.out, dedicated, (shared > 0) ? dedicated / shared : 0,
+                 fc->tx_live, st->promoted, st->evicted);
+        memset(st, 0, sizeof(*st));
+    }
+}
+
 static void fix_broken_connections(io_ctx_t *ctx) {
     int success, total;
     success = total = 0;
@@ -1513,21 +4925,61 @@ static void fix_broken_connections(io_ctx_t *ctx) {
         log_warn("io", L("Drop stats: drop-pkt: %d, drop-bytes: %d, drop-partial-compress-pkt: %d"), ctx->tx_drop.p, ctx->tx_drop.b, ctx->tx_partial_compress_drop.p);
         ctx->tx_drop.p = ctx->tx_drop.b = ctx->tx_partial_compress_drop.p = 0;
     }
+    if (ctx->tx_reserved_drop.p > 0) {
+        log_warn("io", L("Reserved protocol drop stats: drop-pkt: %d, drop-bytes: %d"), ctx->tx_reserved_drop.p, ctx->tx_reserved_drop.b);
+        ctx->tx_reserved_drop.p = ctx->tx_reserved_drop.b = 0;
+    }
+    if (ctx->sink.drop.p > 0) {
+        log_warn("io", L("Sink drop stats: drop-pkt: %d, drop-bytes: %d"), ctx->sink.drop.p, ctx->sink.drop.b);
+        ctx->sink.drop.p = ctx->sink.drop.b = 0;
+    }
+    log_tun_backlog_stats(ctx);
+    log_flow_ctx_stats(ctx);
+    check_pep_flows(ctx);
+    retx_stats_t *rs = &ctx->retx.stats;
+    if (rs->queued_pkts + rs->sent_pkts > 0) { /* totals, ctl reports them too */
+        log_info("io", L("Retransmit suppression: queued: %" PRIu64 " pkts, %" PRIu64 " bytes, sent: %" PRIu64 " pkts, %" PRIu64 " bytes, passed: %" PRIu64 " pkts"),
+                 rs->queued_pkts, rs->queued_bytes, rs->sent_pkts, rs->sent_bytes, rs->passed_pkts);
+    }
 }
 
 #define MAX_POLLED_EVENTS 256
 
-int io(int tun_fd, const char* peer_file_path, const char *self_addr_v4, const char *self_addr_v6, int listener_port, const char *ipset_name, int try_reconnect_itvl, int compression_level, int low_latency_aggressiveness, ring_sz_t *ring_sz) {
+static int io_loop(const io_dev_t *dev, const io_cfg_t *cfg) {
     int ret = -1;
     io_ctx_t *ctx;
     time_t last_reconnect_at = time(NULL);
-    if ((ctx = init_io_ctx(tun_fd, self_addr_v4, self_addr_v6, ipset_name, compression_level, low_latency_aggressiveness, ring_sz)) != NULL) {
-        if (setup_listener(ctx, listener_port) == 0) {
+    handed_over_t handed = {.tun_fd = -1};
+    io_dev_t taken_dev;
+    memset(&loop_stats, 0, sizeof(loop_stats));
+    if (cfg->take_over) {
+        if (receive_handoff(cfg->upgrade_path, &handed) != 0) return -1;
+        taken_dev = *dev;
+        taken_dev.tun_fd = handed.tun_fd;
+        handed.tun_fd = -1; /* tun sock owns it now */
+        dev = &taken_dev;
+    }
+    if ((ctx = init_io_ctx(dev, cfg->self_addr_v4, cfg->self_addr_v6, cfg->ipset_name, cfg->compression_level, cfg->flush_policy, cfg->flow_ctxs, cfg->low_latency_aggressiveness, &cfg->ring_sz)) != NULL) {
+        ctx->ctl_path = cfg->ctl_path;
+        ctx->upgrade_path = cfg->upgrade_path;
+        ctx->shm_path = cfg->shm_path;
+        ctx->resume_grace = cfg->resume_grace;
+        ctx->relay = cfg->relay;
+        ctx->http_hdrs = cfg->http_hdrs;
+        int listening = cfg->take_over ? take_over_handed(ctx, &handed, cfg->listener_port) : setup_listener(ctx, cfg->listener_port);
+        if (listening == 0 && (! cfg->suppress_retx || retx_init(&ctx->retx) == 0) && setup_pep(ctx, cfg->pep_port) == 0 && setup_bypass(ctx, cfg->bypass_pct) == 0 && setup_ctl(ctx) == 0 && setup_upgrade(ctx) == 0 && setup_shm(ctx) == 0) {
             trigger_peer_reset();
             int num_evts;
             struct epoll_event evts[MAX_POLLED_EVENTS];
             while ( ! do_stop) {
-                num_evts = epoll_wait(ctx->epoll_fd, evts, MAX_POLLED_EVENTS, try_reconnect_itvl * 1000); /* timeout is ms */
+                int timeout = cfg->try_reconnect_itvl * 1000; /* ms */
+                if (ctx->handoff != NULL) {
+                    timeout = HANDOFF_POLL_MS;
+                } else if (! LIST_EMPTY(&ctx->suspended) && timeout > SESSION_POLL_MS) {
+                    timeout = SESSION_POLL_MS;
+                }
+                num_evts = epoll_wait(ctx->epoll_fd, evts, MAX_POLLED_EVENTS, timeout);
+                uint64_t woke_at = mono_ns();
                 if (num_evts < 0) {
                     log_warn("io", L("io-poll failed"));
                 } else {
@@ -1535,19 +4987,50 @@ int io(int tun_fd, const char* peer_file_path, const char *self_addr_v4, const c
                         handle_io_evt(evts[i].events, (io_sock_t *) evts[i].data.ptr);
                     }
                 }
+                if (! TAILQ_EMPTY(&ctx->pep_kicks)) kick_pep_flows(ctx);
+                if (ctx->bypass.n_pending > 0) apply_bypass(ctx);
+                if (ctx->handoff != NULL) {
+                    check_handoff(ctx); /* peer changes and reconnects are left to the successor */
+                    record_loop_iteration(num_evts, mono_ns() - woke_at);
+                    continue;
+                }
                 if (do_peer_reset) {
-                    reset_peers(ctx, peer_file_path, listener_port);
+                    reset_peers(ctx, cfg->peer_file_path, cfg->listener_port);
                     do_peer_reset = 0;
                 }
                 time_t now = time(NULL);
-                if ((now - last_reconnect_at) > try_reconnect_itvl) {
+                if (! LIST_EMPTY(&ctx->suspended) && now != ctx->sessions_tended_at) tend_sessions(ctx);
+                if ((now - last_reconnect_at) > cfg->try_reconnect_itvl) {
                     fix_broken_connections(ctx);
                     last_reconnect_at = now;
                 }
+                record_loop_iteration(num_evts, mono_ns() - woke_at);
             }
             ret = 0;
         }
     }
+    release_handed_over(&handed);
     destroy_io_ctx(ctx);
     return ret;
 }
+
+int io(int tun_fd, int tun_mtu, const io_cfg_t *cfg) {
+    io_dev_t dev = {tun_fd, NULL, NULL, tun_mtu};
+    return io_loop(&dev, cfg);
+}
+
+int io_nfq(const nfq_cfg_t *nfq_cfg, const io_cfg_t *cfg) {
+    io_dev_t dev = {-1, nfq_cfg, NULL};
+    io_cfg_t c = *cfg;
+    c.upgrade_path = NULL;
+    c.take_over = 0;
+    return io_loop(&dev, &c);
+}
+
+int io_pkt_ring(const pkt_ring_cfg_t *ring_cfg, const io_cfg_t *cfg) {
+    io_dev_t dev = {-1, NULL, ring_cfg};
+    io_cfg_t c = *cfg;
+    c.upgrade_path = NULL;
+    c.take_over = 0;
+    return io_loop(&dev, &c);
+}
@@ -5,6 +5,7 @@
 #  include <config.h>
 #endif
 #include <unistd.h>
+#include <stdint.h>
 
 
 struct ring_sz_s {
@@ -16,10 +17,80 @@ struct ring_sz_s {
 
 typedef struct ring_sz_s ring_sz_t;
 
-int io(int tun_fd, const char* peer_file_path, const char *self_addr_v4, const char *self_addr_v6, int listener_port, const char *ipset_name, int try_reconect_interval, int compression_level, int low_latency_aggressiveness, ring_sz_t *ring_sz);
+/* NFQUEUE interception (instead of tun + routing), pkts from peers are reinjected over raw sockets */
+struct nfq_cfg_s {
+    int first_queue, last_queue; /* queue range of the NFQUEUE rule (--queue-num or --queue-balance first:last) */
+    uint32_t reinject_mark; /* set on reinjected pkts, NFQUEUE rule must not match it */
+    int mtu; /* GSO super-pkts are segmented to this before compression (0 => never, they are let through) */
+};
+
+typedef struct nfq_cfg_s nfq_cfg_t;
+
+/* packet-ring mode, pkts are taken off / put on an interface directly (AF_PACKET TPACKET_V3), bypassing tun and routing */
+struct pkt_ring_cfg_s {
+    const char *if_name;
+    uint8_t next_hop_mac[6]; /* destination of frames carrying pkts from peers */
+};
+
+typedef struct pkt_ring_cfg_s pkt_ring_cfg_t;
+
+/* when to sync-flush the compressor of a connection */
+#define IO_FLUSH_PKT 0 /* after every packet, lowest latency */
+#define IO_FLUSH_BATCH 1 /* once per batch of packets read from tun, better ratio for small packets */
+#define IO_FLUSH_FLOW 2 /* as batch, but a batch is reordered to keep pkts of a flow together (per-flow order is kept), same as batch without tun */
+
+#define IO_LOOP_LAT_BUCKETS 32
+
+/* time spent between epoll_wait returning and the loop going back to wait (event handling + housekeeping) */
+struct io_loop_stats_s {
+    uint64_t iterations;
+    uint64_t events;
+    uint64_t busy_ns;
+    uint64_t max_busy_ns;
+    uint64_t lat_hist[IO_LOOP_LAT_BUCKETS]; /* bucket b: iterations that took < 2^b us (and >= 2^(b-1) us), last bucket is open ended */
+};
+
+typedef struct io_loop_stats_s io_loop_stats_t;
+
+/* what io, io_nfq and io_pkt_ring run with */
+struct io_cfg_s {
+    const char *peer_file_path;
+    const char *self_addr_v4, *self_addr_v6;
+    int listener_port;
+    const char *ipset_name; /* NULL => routes for peers are expected to be managed externally */
+    const char *ctl_path; /* where the control socket (see ctl.h) listens, NULL => none */
+    const char *shm_path; /* where co-located peers connect over shared memory instead of TCP (see shm_ring.h), NULL => none */
+    const char *upgrade_path; /* where a successor can take over (see handoff.h), NULL => none, tun only */
+    int take_over; /* this process is the successor, tun, listeners and conns come from the one at upgrade_path (tun_fd is ignored) */
+    int try_reconnect_itvl; /* secs */
+    int resume_grace; /* > 0 => conn streams are resumable (see session.h), a broken conn is kept that many secs for the peer to come back to, peers must agree */
+    int compression_level;
+    int flush_policy; /* IO_FLUSH_* */
+    int flow_ctxs; /* > 0 => conns carry the framed per-flow-ctx stream (see flow_ctx.h), peers must agree */
+    int relay; /* pass relay frames on between peers as a hub (see flow_ctx.h), needs flow_ctxs */
+    int suppress_retx; /* drop inner TCP retransmissions of segments a conn already took (see retx.h) */
+    int pep_port; /* > 0 => inner TCP flows redirected (TPROXY) to this port are terminated and their bytes carried to the peer, which re-originates them (see pep.h), peers must agree */
+    int http_hdrs; /* tokenize HTTP/1.x headers of pkts to peers against per-conn tables (see http_hdr.h) and decode theirs, peers must agree */
+    int bypass_pct; /* > 0 => destinations (address and port) whose traffic compresses to no less than this percent go in the <ipset_name>-bypass set for a while (see bypass.h), needs ipset_name */
+    int low_latency_aggressiveness;
+    ring_sz_t ring_sz;
+};
+
+typedef struct io_cfg_s io_cfg_t;
+
+/* tun_mtu > 0 clamps the MSS of TCP SYNs read from or written to tun to fit it (see mss.h) */
+int io(int tun_fd, int tun_mtu, const io_cfg_t *cfg);
+
+/* same as io, but pkts are pulled from netfilter queues instead of a tun device (needs --enable-nfqueue), upgrade_path and take_over are ignored */
+int io_nfq(const nfq_cfg_t *nfq, const io_cfg_t *cfg);
+
+/* same as io, but pkts are taken from and put on an interface's packet rings, upgrade_path and take_over are ignored */
+int io_pkt_ring(const pkt_ring_cfg_t *ring, const io_cfg_t *cfg);
 
 void trigger_peer_reset();
 
 void trigger_io_loop_stop();
 
+void io_loop_stats(io_loop_stats_t *stats);
+
 #endif
@@ -31,12 +31,18 @@
 #include <signal.h>
 #include "constants.h"
 #include "compress.h"
+#include "calibrate.h"
+#include "flow_ctx.h"
 
 extern const char *__progname;
 
 #define MAX_FILE_PATH_LEN 1024
 #define DEFAULT_LISTNER_PORT 15
 #define MAX_IPSET_NAME_LEN 64
+#define DEFAULT_REINJECT_MARK 0x13c
+#define DEFAULT_NFQ_MTU 1500
+#define MIN_TUN_MTU 1280 /* IPv6 minimum */
+#define MAX_TUN_MTU 0xFFFF
 
 static void usage(void) {
 	/* TODO:3002 Don't forget to update the usage block with the most
@@ -54,18 +60,76 @@ static void usage(void) {
     fprintf(stderr, " -6, --selfIpv6  <addr>                           hosts own address as seen by peers (IP v6)\n");
     fprintf(stderr, " -c, --compLvl  <compression-level>               compression level(impl: %s) between (no-compression-supported: %s (value: %d), %d:fast ... %d:default ... %d:best)\n",
             COMPRESSION_IMPL, (NO_COMPRESSION_LEVEL > 0) ? "yes": "no", NO_COMPRESSION_LEVEL, MIN_COMPRESSION_LEVEL, DEFAULT_COMPRESSION_LEVEL, MAX_COMPRESSION_LEVEL);
+    fprintf(stderr, " -C, --calibrate <Mbit/s>                         measure compression speed at startup and pick the highest level sustaining this throughput (overrides -c)\n");
     fprintf(stderr, " -s, --setName  <ipset>                           ipset set-name to be used to record peers for selectively compressing flows\n");
     fprintf(stderr, " -u, --upScript <route-up cmd>                    command for setting-up routing (run once tunnel is up)\n");
     fprintf(stderr, " -r, --tryReconnectInterval <seconds>             least number of seconds to wait before re-attempting connect with failed peers\n");
+    fprintf(stderr, " -R, --resumeGrace <seconds>                      keep a broken connection's stream this long for it to be resumed where it broke (0: off, default, peers must agree)\n");
     fprintf(stderr, " -L, --lowLatencyMode <level>                     aggressiveness of low-latency-mode (0: disable, 1: turn on TCP_NODELAY, 2: turn on TCP_QUICKACK)\n");
+    fprintf(stderr, " -F, --flushPolicy <pkt|batch|flow>               flush compressed stream after every packet (default) or once per batch read from tunnel (flow: batch, compressed a flow at a time)\n");
+    fprintf(stderr, " -x, --flowContexts <n>                           give up to n heavy flows per peer their own compression context (0: off, default, max: %d, peers must agree)\n", FLOW_CTX_MAX);
+    fprintf(stderr, " -H, --relay                                      act as a hub, passing streams on between peers that name this host with via= (needs -x)\n");
+    fprintf(stderr, " -X, --suppressRetx                               drop inner TCP retransmissions of segments a connection already carries (or carried)\n");
+    fprintf(stderr, " -Y, --httpHeaders                                tokenize HTTP/1.x headers against tables kept per peer before compressing (peers need it too to decode them)\n");
+    fprintf(stderr, " -b, --bypass <percent>                           route destinations (address and port) compressing to no better than this natively for a while (0: off, default, needs -s)\n");
+    fprintf(stderr, " -o, --tunMtu <bytes>                             set this MTU (%d - %d) on tun and clamp the MSS of TCP SYNs through it to fit (default: leave it to up-cmd)\n", MIN_TUN_MTU, MAX_TUN_MTU);
+    fprintf(stderr, " -P, --pep <port>                                 terminate TCP flows redirected (TPROXY) to this port and have the peer re-originate them (0: off, default, peers must agree)\n");
     fprintf(stderr, " -e, --externalRingSz <sz>                        size for ring-buffers behind connections (bytes) \n");
-    fprintf(stderr, " -t, --tunRingSz <sz>                             size for ring-buffers behind tunnel (bytes) \n");
+    fprintf(stderr, " -t, --tunRingSz <sz>                             size of per-peer queues for packets waiting to be written to tunnel (bytes, allocated once a peer has to queue) \n");
 	fprintf(stderr, " -a, --adaptiveRingSz                             enable adaptive-sizing for ring-buffers (expand as needed) \n");
 	fprintf(stderr, " -M, --maxRingSz <sz>                             maximum allowed size of a ring (bytes) \n");
+    fprintf(stderr, " -Q, --nfQueue <first[:last]>                     intercept pkts from these NFQUEUE queues instead of routing them over tun (up-cmd sets up the queueing rules)\n");
+    fprintf(stderr, " -k, --reinjectMark <mark>                        fwmark for pkts from peers reinjected in NFQUEUE mode (default: %#x)\n", DEFAULT_REINJECT_MARK);
+    fprintf(stderr, " -i, --ringIface <iface>                          take pkts off / put pkts on this interface directly (TPACKET_V3 rings) instead of tun, ipset is not used\n");
+    fprintf(stderr, " -N, --nextHopMac <mac>                           destination mac for pkts from peers put on --ringIface\n");
+    fprintf(stderr, " -S, --ctlSocket <path>                           serve runtime control requests (stats, peers, level, rings, flush policy) on this UNIX socket\n");
+    fprintf(stderr, " -K, --shmSocket <path>                           let co-located peers (shm= in their peer-file) connect over shared memory through this UNIX socket\n");
+    fprintf(stderr, " -U, --upgradeSocket <path>                       let a successor (started with -T) take over tun, listeners and connections through this UNIX socket (zlib builds only)\n");
+    fprintf(stderr, " -T, --takeOver                                   take over from the process running with the same -U instead of opening tun (up-cmd is not run)\n");
+    fprintf(stderr, " -m, --mtu <bytes>                                segment GSO pkts to this size before compressing in NFQUEUE mode (default: %d)\n", DEFAULT_NFQ_MTU);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "see manual page " PACKAGE "(8) for more information\n");
 }
 
+static char nfq_first_var[32];
+static char nfq_last_var[32];
+static char reinject_mark_var[32];
+static char ipset_name_var[100];
+
+static int run_nfqueue_up_cmd(const char *up_cmd, const char *ipset_name, const nfq_cfg_t *nfq) {
+    snprintf(nfq_first_var, sizeof(nfq_first_var), "NFQUEUE_FIRST=%d", nfq->first_queue);
+    snprintf(nfq_last_var, sizeof(nfq_last_var), "NFQUEUE_LAST=%d", nfq->last_queue);
+    snprintf(reinject_mark_var, sizeof(reinject_mark_var), "REINJECT_MARK=%u", nfq->reinject_mark);
+    int env_var_len = snprintf(ipset_name_var, sizeof(ipset_name_var), "IPSET_NAME=%s", ipset_name);
+    assert(env_var_len > 0 && (unsigned) env_var_len < sizeof(ipset_name_var));
+    assert(putenv(nfq_first_var) == 0);
+    assert(putenv(nfq_last_var) == 0);
+    assert(putenv(reinject_mark_var) == 0);
+    assert(putenv(ipset_name_var) == 0);
+    log_info("main", "Running NFQUEUE up-cmd [%s]", up_cmd);
+    return system(up_cmd);
+}
+
+static int parse_mac(const char *str, uint8_t *mac) {
+    char trailing;
+    return (sscanf(str, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx%c", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5], &trailing) == 6) ? 0 : -1;
+}
+
+static int parse_queue_range(const char *str, nfq_cfg_t *nfq) {
+    char *end;
+    long first = strtol(str, &end, 10), last = first;
+    if (end == str) return -1;
+    if (*end == ':') {
+        const char *s = end + 1;
+        last = strtol(s, &end, 10);
+        if (end == s) return -1;
+    }
+    if (*end != '\0' || first < 0 || last < first || last > 0xFFFF) return -1;
+    nfq->first_queue = first;
+    nfq->last_queue = last;
+    return 0;
+}
+
 void wireup_signals() {
     assert(signal(SIGINT, trigger_io_loop_stop) != SIG_ERR);
     assert(signal(SIGTERM, trigger_io_loop_stop) != SIG_ERR);
@@ -79,12 +143,30 @@ int main(int argc, char *argv[]) {
     char *self_addr_v4 = NULL;
     char *self_addr_v6 = NULL;
     int compression_level = DEFAULT_COMPRESSION_LEVEL;
+    double calibration_target_mbps = 0;
     int listener_port = 15;
     char *ipset_name = NULL;
     char *route_up_cmd = NULL;
     int try_reconnect_itvl = 30;
+    int resume_grace = 0;
     int low_latency_aggressiveness = 0;
+    int flush_policy = IO_FLUSH_PKT;
+    int flow_ctxs = 0;
+    int relay = 0;
+    int suppress_retx = 0;
+    int pep_port = 0;
+    int http_hdrs = 0;
+    int bypass_pct = 0;
+    int tun_mtu = 0;
     ring_sz_t ring_sz = {TUN_RING_SZ, CONN_RING_SZ, MAX_RING_SZ, 0};
+    int use_nfq = 0;
+    nfq_cfg_t nfq = {0, 0, DEFAULT_REINJECT_MARK, DEFAULT_NFQ_MTU};
+    pkt_ring_cfg_t ring = {NULL, {0}};
+    int has_next_hop_mac = 0;
+    char *ctl_path = NULL;
+    char *shm_path = NULL;
+    char *upgrade_path = NULL;
+    int take_over = 0;
 
 	/* TODO:3001 If you want to add more options, add them here. */
 	static struct option long_options[] = {
@@ -96,18 +178,37 @@ int main(int argc, char *argv[]) {
                 { "selfIpv6", required_argument, 0, '6' },
                 { "listenerPort", required_argument, 0, 'l' },
                 { "compLvl", required_argument, 0, 'c' },
+                { "calibrate", required_argument, 0, 'C' },
                 { "setName", required_argument, 0, 's' },
                 { "upCmd", required_argument, 0, 'u' },
                 { "tryReconnectInterval", required_argument, 0, 'r' },
+                { "resumeGrace", required_argument, 0, 'R' },
                 { "lowLatencyMode", required_argument, 0, 'L' },
+                { "flushPolicy", required_argument, 0, 'F' },
+                { "flowContexts", required_argument, 0, 'x' },
+                { "relay", no_argument, 0, 'H' },
+                { "suppressRetx", no_argument, 0, 'X' },
+                { "pep", required_argument, 0, 'P' },
+                { "httpHeaders", no_argument, 0, 'Y' },
+                { "bypass", required_argument, 0, 'b' },
+                { "tunMtu", required_argument, 0, 'o' },
                 { "externalRingSz", required_argument, 0, 'e' },
                 { "tunRingSz", required_argument, 0, 't' },
 				{ "maxRingSz", required_argument, 0, 'M' },
 				{ "adaptiveRingSz", no_argument, 0, 'a' },
+                { "nfQueue", required_argument, 0, 'Q' },
+                { "reinjectMark", required_argument, 0, 'k' },
+                { "mtu", required_argument, 0, 'm' },
+                { "ringIface", required_argument, 0, 'i' },
+                { "nextHopMac", required_argument, 0, 'N' },
+                { "ctlSocket", required_argument, 0, 'S' },
+                { "shmSocket", required_argument, 0, 'K' },
+                { "upgradeSocket", required_argument, 0, 'U' },
+                { "takeOver", no_argument, 0, 'T' },
                 { 0 }};
 	while (1) {
 		int option_index = 0;
-		ch = getopt_long(argc, argv, "hvdD:l:c:p:4:6:s:u:r:L:e:t:aM:",
+		ch = getopt_long(argc, argv, "hvdD:l:c:C:p:4:6:s:u:r:R:L:F:x:HXP:Yb:o:e:t:aM:Q:k:m:i:N:S:K:U:T",
 		    long_options, &option_index);
 		if (ch == -1) break;
 		switch (ch) {
@@ -140,6 +241,9 @@ int main(int argc, char *argv[]) {
 		case 'c':
 			compression_level = atoi(optarg);
 			break;
+		case 'C':
+			calibration_target_mbps = atof(optarg);
+			break;
 		case 'l':
 			listener_port = atoi(optarg);
 			break;
@@ -154,9 +258,71 @@ int main(int argc, char *argv[]) {
         case 'r':
             try_reconnect_itvl = atoi(optarg);
             break;
+        case 'R':
+            resume_grace = atoi(optarg);
+            if (resume_grace < 0) {
+                fprintf(stderr, "resume grace can't be negative\n");
+                usage();
+                exit(1);
+            }
+            break;
         case 'L':
             low_latency_aggressiveness = atoi(optarg);
             break;
+        case 'F':
+            if (strcmp(optarg, "pkt") == 0) {
+                flush_policy = IO_FLUSH_PKT;
+            } else if (strcmp(optarg, "batch") == 0) {
+                flush_policy = IO_FLUSH_BATCH;
+            } else if (strcmp(optarg, "flow") == 0) {
+                flush_policy = IO_FLUSH_FLOW;
+            } else {
+                fprintf(stderr, "unknown flush policy `%s'\n", optarg);
+                usage();
+                exit(1);
+            }
+            break;
+        case 'x':
+            flow_ctxs = atoi(optarg);
+            if (flow_ctxs < 0 || flow_ctxs > FLOW_CTX_MAX) {
+                fprintf(stderr, "flow contexts must be between 0 and %d\n", FLOW_CTX_MAX);
+                usage();
+                exit(1);
+            }
+            break;
+        case 'H':
+            relay = 1;
+            break;
+        case 'X':
+            suppress_retx = 1;
+            break;
+        case 'Y':
+            http_hdrs = 1;
+            break;
+        case 'b':
+            bypass_pct = atoi(optarg);
+            if (bypass_pct < 0 || bypass_pct > 100) {
+                fprintf(stderr, "bypass threshold must be between 0 and 100 (percent)\n");
+                usage();
+                exit(1);
+            }
+            break;
+        case 'o':
+            tun_mtu = atoi(optarg);
+            if (tun_mtu < MIN_TUN_MTU || tun_mtu > MAX_TUN_MTU) {
+                fprintf(stderr, "tun mtu must be between %d and %d\n", MIN_TUN_MTU, MAX_TUN_MTU);
+                usage();
+                exit(1);
+            }
+            break;
+        case 'P':
+            pep_port = atoi(optarg);
+            if (pep_port < 0 || pep_port > 0xFFFF) {
+                fprintf(stderr, "pep port must be between 0 and 65535\n");
+                usage();
+                exit(1);
+            }
+            break;
         case 'e':
             ring_sz.conn = atoi(optarg);
             break;
@@ -168,6 +334,47 @@ int main(int argc, char *argv[]) {
             break;
         case 'M':
             ring_sz.max_allowed = atoi(optarg);
+            break;
+        case 'Q':
+            if (parse_queue_range(optarg, &nfq) != 0) {
+                fprintf(stderr, "bad queue range `%s'\n", optarg);
+                usage();
+                exit(1);
+            }
+            use_nfq = 1;
+            break;
+        case 'k':
+            nfq.reinject_mark = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            nfq.mtu = atoi(optarg);
+            break;
+        case 'i':
+            assert(ring.if_name == NULL);
+            ring.if_name = strndup(optarg, MAX_FILE_PATH_LEN);
+            break;
+        case 'N':
+            if (parse_mac(optarg, ring.next_hop_mac) != 0) {
+                fprintf(stderr, "bad mac `%s'\n", optarg);
+                usage();
+                exit(1);
+            }
+            has_next_hop_mac = 1;
+            break;
+        case 'S':
+            assert(ctl_path == NULL);
+            ctl_path = strndup(optarg, MAX_FILE_PATH_LEN);
+            break;
+        case 'K':
+            assert(shm_path == NULL);
+            shm_path = strndup(optarg, MAX_FILE_PATH_LEN);
+            break;
+        case 'U':
+            assert(upgrade_path == NULL);
+            upgrade_path = strndup(optarg, MAX_FILE_PATH_LEN);
+            break;
+        case 'T':
+            take_over = 1;
             break;
 		default:
 			fprintf(stderr, "unknown option `%c'\n", ch);
@@ -185,6 +392,10 @@ int main(int argc, char *argv[]) {
         log_warn("main", "Enforcing %zd as conn-ring sz, due to compression impl provided lower-bound.", ring_sz.conn);
     }
 
+    if (calibration_target_mbps > 0) {
+        compression_level = calibrate_compression_level(calibration_target_mbps, CALIBRATION_BUDGET_MS, NULL, 0, NULL);
+    }
+
     if ((! error) && (peer_file == NULL || access(peer_file, R_OK) != 0)) {
         error = "Peer file not found";
     }
@@ -193,7 +404,35 @@ int main(int argc, char *argv[]) {
         error = "Self address not provided, please provide either v4 or v6.";
     }
 
-    if ((! error) && (route_up_cmd == NULL)) {
+    if ((! error) && use_nfq && ring.if_name != NULL) {
+        error = "NFQUEUE and packet-ring modes are mutually exclusive";
+    }
+
+    if ((! error) && ring.if_name != NULL && ! has_next_hop_mac) {
+        error = "Next-hop mac not provided for packet-ring mode";
+    }
+
+    if ((! error) && relay && flow_ctxs == 0) {
+        error = "Relaying needs flow contexts (-x)";
+    }
+
+    if ((! error) && bypass_pct > 0 && (ipset_name == NULL || ring.if_name != NULL)) {
+        error = "Bypassing needs the ipset (-s) the routing rules use";
+    }
+
+    if ((! error) && take_over && upgrade_path == NULL) {
+        error = "Take-over needs the upgrade socket (-U) of the running process";
+    }
+
+    if ((! error) && (upgrade_path != NULL) && (use_nfq || ring.if_name != NULL)) {
+        error = "Hot upgrade is only supported with tun";
+    }
+
+    if ((! error) && (upgrade_path != NULL) && ! COMPRESSION_HANDOFF) {
+        error = "Hot upgrade is not supported with " COMPRESSION_IMPL " compression, peers never end the frame it could be handed over at";
+    }
+
+    if ((! error) && (route_up_cmd == NULL) && ring.if_name == NULL && ! take_over) {
         error = "Route-up cmd not provided";
     }
 
@@ -201,10 +440,18 @@ int main(int argc, char *argv[]) {
         ipset_name = strdup("l3tc");
     }
 
-    int tun_fd;
-    if (! error) {
+    int tun_fd = -1;
+    if ((! error) && ring.if_name != NULL) {
+        if (route_up_cmd != NULL && system(route_up_cmd) != 0) {
+            error = "Up-cmd failed";
+        }
+    } else if ((! error) && use_nfq) {
+        if (run_nfqueue_up_cmd(route_up_cmd, ipset_name, &nfq) != 0) {
+            error = "NFQUEUE up-cmd failed";
+        }
+    } else if ((! error) && ! take_over) { /* tun (and routing set up by up-cmd) comes from the running process otherwise */
         log_debug("main", "Allocating tun");
-        tun_fd = alloc_tun(route_up_cmd, ipset_name);
+        tun_fd = alloc_tun(route_up_cmd, ipset_name, tun_mtu);
         if (tun_fd <= 0) {
             error = "Could not open tunnel";
         }
@@ -212,7 +459,36 @@ int main(int argc, char *argv[]) {
 
     if (! error) {
         wireup_signals();
-        if (io(tun_fd, peer_file, self_addr_v4, self_addr_v6, listener_port, ipset_name, try_reconnect_itvl, compression_level, low_latency_aggressiveness, &ring_sz) != 0) error = "io loop failed";
+        io_cfg_t cfg = {
+            .peer_file_path = peer_file,
+            .self_addr_v4 = self_addr_v4,
+            .self_addr_v6 = self_addr_v6,
+            .listener_port = listener_port,
+            .ipset_name = ring.if_name != NULL ? NULL : ipset_name, /* up-cmd sets up routing in packet-ring mode */
+            .ctl_path = ctl_path,
+            .shm_path = shm_path,
+            .upgrade_path = upgrade_path,
+            .take_over = take_over,
+            .try_reconnect_itvl = try_reconnect_itvl,
+            .resume_grace = resume_grace,
+            .compression_level = compression_level,
+            .flush_policy = flush_policy,
+            .flow_ctxs = flow_ctxs,
+            .relay = relay,
+            .suppress_retx = suppress_retx,
+            .pep_port = pep_port,
+            .http_hdrs = http_hdrs,
+            .bypass_pct = bypass_pct,
+            .low_latency_aggressiveness = low_latency_aggressiveness,
+            .ring_sz = ring_sz,
+        };
+        if (ring.if_name != NULL) {
+            if (io_pkt_ring(&ring, &cfg) != 0) error = "io loop failed";
+        } else if (use_nfq) {
+            if (io_nfq(&nfq, &cfg) != 0) error = "io loop failed";
+        } else {
+            if (io(tun_fd, tun_mtu, &cfg) != 0) error = "io loop failed";
+        }
     }
 
     free(self_addr_v4);
@@ -220,6 +496,10 @@ int main(int argc, char *argv[]) {
     free(ipset_name);
     free(route_up_cmd);
     free(peer_file);
+    free(ctl_path);
+    free(shm_path);
+    free(upgrade_path);
+    free((char *) ring.if_name);
     if (tun_fd > 0)
         close(tun_fd);
     
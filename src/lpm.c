@@ -0,0 +1,245 @@
+#include "lpm.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define TBL24_SZ (1 << 24)
+#define TBL8_GROUP_SZ 256
+#define TBL8_EXTENDED 0x8000
+#define MAX_TBL8_GROUPS 0x8000
+
+struct lpm_trie_node_s {
+    uint8_t addr[16];
+    uint8_t len;
+    uint16_t nh; /* 0 => interior node, no route of its own */
+    lpm_trie_node_t *child[2];
+};
+
+void lpm_init(lpm_t *lpm) {
+    memset(lpm, 0, sizeof(*lpm));
+}
+
+static void free_trie(lpm_trie_node_t *n) {
+    if (n == NULL) return;
+    free_trie(n->child[0]);
+    free_trie(n->child[1]);
+    free(n);
+}
+
+void lpm_destroy(lpm_t *lpm) {
+    free(lpm->routes);
+    free(lpm->tbl24);
+    free(lpm->tbl8);
+    free_trie(lpm->root_v6);
+    memset(lpm, 0, sizeof(*lpm));
+}
+
+static void clear_host_bits(lpm_prefix_t *p) {
+    int bytes = (p->af == AF_INET) ? 4 : 16;
+    for (int i = 0; i < bytes; i++) {
+        int bits_in_prefix = p->len - i * 8;
+        if (bits_in_prefix >= 8) continue;
+        p->addr[i] &= (bits_in_prefix <= 0) ? 0 : (uint8_t) (0xFF << (8 - bits_in_prefix));
+    }
+}
+
+int lpm_parse_prefix(const char *str, lpm_prefix_t *prefix) {
+    char buff[64];
+    memset(prefix, 0, sizeof(*prefix));
+    if (strlen(str) >= sizeof(buff)) return -1;
+    strcpy(buff, str);
+    char *slash = strchr(buff, '/');
+    if (slash != NULL) *slash = '\0';
+    if (inet_pton(AF_INET, buff, prefix->addr) == 1) {
+        prefix->af = AF_INET;
+    } else if (inet_pton(AF_INET6, buff, prefix->addr) == 1) {
+        prefix->af = AF_INET6;
+    } else {
+        return -1;
+    }
+    int max_len = (prefix->af == AF_INET) ? 32 : 128;
+    int len = max_len;
+    if (slash != NULL) {
+        char *end;
+        long l = strtol(slash + 1, &end, 10);
+        if (*(slash + 1) == '\0' || *end != '\0' || l < 0 || l > max_len) return -1;
+        len = l;
+    }
+    prefix->len = len;
+    clear_host_bits(prefix);
+    return 0;
+}
+
+const char *lpm_prefix_str(const lpm_prefix_t *prefix, char *buff, size_t len) {
+    char addr[INET6_ADDRSTRLEN];
+    if (inet_ntop(prefix->af, prefix->addr, addr, sizeof(addr)) == NULL) {
+        snprintf(buff, len, "<invalid>");
+    } else {
+        snprintf(buff, len, "%s/%d", addr, prefix->len);
+    }
+    return buff;
+}
+
+int lpm_add(lpm_t *lpm, const lpm_prefix_t *prefix, uint16_t nh) {
+    if (nh == 0 || nh > LPM_MAX_NH) return -1;
+    if (lpm->num_routes == lpm->routes_capacity) {
+        size_t cap = lpm->routes_capacity ? lpm->routes_capacity * 2 : 16;
+        struct lpm_route_s *r = realloc(lpm->routes, cap * sizeof(struct lpm_route_s));
+        if (r == NULL) return -1;
+        lpm->routes = r;
+        lpm->routes_capacity = cap;
+    }
+    lpm->routes[lpm->num_routes].prefix = *prefix;
+    lpm->routes[lpm->num_routes].nh = nh;
+    lpm->routes[lpm->num_routes].seq = lpm->num_routes;
+    lpm->num_routes++;
+    return 0;
+}
+
+static int cmp_route_len(const void *a, const void *b) {
+    const struct lpm_route_s *x = a, *y = b;
+    if (x->prefix.len != y->prefix.len) return ((int) x->prefix.len) - ((int) y->prefix.len);
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static int tbl8_alloc(lpm_t *lpm, uint16_t fill) {
+    if (lpm->num_tbl8_groups == MAX_TBL8_GROUPS) return -1;
+    if (lpm->num_tbl8_groups == lpm->tbl8_capacity) {
+        uint32_t cap = lpm->tbl8_capacity ? lpm->tbl8_capacity * 2 : 16;
+        uint16_t *t = realloc(lpm->tbl8, ((size_t) cap) * TBL8_GROUP_SZ * sizeof(uint16_t));
+        if (t == NULL) return -1;
+        lpm->tbl8 = t;
+        lpm->tbl8_capacity = cap;
+    }
+    uint16_t *g = lpm->tbl8 + ((size_t) lpm->num_tbl8_groups) * TBL8_GROUP_SZ;
+    for (int i = 0; i < TBL8_GROUP_SZ; i++) g[i] = fill;
+    return lpm->num_tbl8_groups++;
+}
+
+/* routes are written shortest first, so a longer prefix always overwrites the ones it is nested in */
+static int write_v4(lpm_t *lpm, struct lpm_route_s *r) {
+    const uint8_t *a = r->prefix.addr;
+    uint32_t addr = (((uint32_t) a[0]) << 24) | (((uint32_t) a[1]) << 16) | (((uint32_t) a[2]) << 8) | a[3];
+    if (r->prefix.len == 0) {
+        lpm->default_nh_v4 = r->nh;
+        return 0;
+    }
+    if (r->prefix.len <= 24) {
+        uint32_t first = addr >> 8, count = 1u << (24 - r->prefix.len);
+        for (uint32_t i = first; i < first + count; i++) lpm->tbl24[i] = r->nh;
+        return 0;
+    }
+    uint16_t *e = &lpm->tbl24[addr >> 8];
+    if (! (*e & TBL8_EXTENDED)) {
+        int g = tbl8_alloc(lpm, *e);
+        if (g < 0) return -1;
+        *e = TBL8_EXTENDED | g;
+    }
+    uint16_t *grp = lpm->tbl8 + (((size_t) (*e & ~TBL8_EXTENDED)) * TBL8_GROUP_SZ);
+    uint32_t first = addr & 0xFF, count = 1u << (32 - r->prefix.len);
+    for (uint32_t i = first; i < first + count; i++) grp[i] = r->nh;
+    return 0;
+}
+
+static inline int bit_at(const uint8_t *addr, int i) {
+    return (addr[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+static int common_prefix_len(const uint8_t *a, const uint8_t *b, int max) {
+    int i = 0;
+    while (i < max && (i & 7) == 0 && (i + 8) <= max && a[i >> 3] == b[i >> 3]) i += 8;
+    while (i < max && bit_at(a, i) == bit_at(b, i)) i++;
+    return i;
+}
+
+static lpm_trie_node_t *new_trie_node(const uint8_t *addr, int len, uint16_t nh) {
+    lpm_trie_node_t *n = calloc(1, sizeof(lpm_trie_node_t));
+    if (n == NULL) return NULL;
+    n->len = len;
+    n->nh = nh;
+    lpm_prefix_t p = {AF_INET6, {0}, len};
+    memcpy(p.addr, addr, sizeof(p.addr));
+    clear_host_bits(&p);
+    memcpy(n->addr, p.addr, sizeof(n->addr));
+    return n;
+}
+
+static int write_v6(lpm_t *lpm, struct lpm_route_s *r) {
+    const uint8_t *addr = r->prefix.addr;
+    int len = r->prefix.len;
+    lpm_trie_node_t **slot = &lpm->root_v6;
+    while (1) {
+        lpm_trie_node_t *n = *slot;
+        if (n == NULL) {
+            return ((*slot = new_trie_node(addr, len, r->nh)) == NULL) ? -1 : 0;
+        }
+        int common = common_prefix_len(n->addr, addr, (n->len < len) ? n->len : len);
+        if (common == n->len && common == len) { /* same prefix, last one wins */
+            n->nh = r->nh;
+            return 0;
+        }
+        if (common == n->len) { /* new prefix is nested below n */
+            slot = &n->child[bit_at(addr, n->len)];
+            continue;
+        }
+        if (common == len) { /* n is nested below new prefix */
+            lpm_trie_node_t *m = new_trie_node(addr, len, r->nh);
+            if (m == NULL) return -1;
+            m->child[bit_at(n->addr, len)] = n;
+            *slot = m;
+            return 0;
+        }
+        lpm_trie_node_t *fork = new_trie_node(addr, common, 0), *leaf = new_trie_node(addr, len, r->nh);
+        if (fork == NULL || leaf == NULL) {
+            free(fork);
+            free(leaf);
+            return -1;
+        }
+        fork->child[bit_at(n->addr, common)] = n;
+        fork->child[bit_at(addr, common)] = leaf;
+        *slot = fork;
+        return 0;
+    }
+}
+
+int lpm_build(lpm_t *lpm) {
+    qsort(lpm->routes, lpm->num_routes, sizeof(struct lpm_route_s), cmp_route_len);
+    for (size_t i = 0; i < lpm->num_routes; i++) {
+        struct lpm_route_s *r = &lpm->routes[i];
+        int ret;
+        if (r->prefix.af == AF_INET) {
+            if (lpm->tbl24 == NULL && r->prefix.len > 0) {
+                if ((lpm->tbl24 = calloc(TBL24_SZ, sizeof(uint16_t))) == NULL) { /* untouched pages stay unbacked */
+                    log_crit("lpm", L("couldn't allocate IPv4 first-level table"));
+                    return -1;
+                }
+            }
+            ret = write_v4(lpm, r);
+        } else {
+            ret = write_v6(lpm, r);
+        }
+        if (ret != 0) {
+            char buff[64];
+            log_crit("lpm", L("couldn't add route for %s"), lpm_prefix_str(&r->prefix, buff, sizeof(buff)));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+uint16_t lpm_lookup_v6(lpm_t *lpm, const uint8_t *addr) {
+    uint16_t best = 0;
+    lpm_trie_node_t *n = lpm->root_v6;
+    while (n != NULL) {
+        if (common_prefix_len(n->addr, addr, n->len) < n->len) break;
+        if (n->nh) best = n->nh;
+        if (n->len == 128) break;
+        n = n->child[bit_at(addr, n->len)];
+    }
+    return best;
+}
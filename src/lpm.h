@@ -0,0 +1,72 @@
+#ifndef _LPM_H
+#define _LPM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* longest-prefix-match tables mapping destination addresses to next-hops (small integers, 0 = no route).
+   IPv4 uses DIR-24-8 (one 16M entry first-level table, lazily paged-in, + 256 entry second-level groups
+   for prefixes longer than /24), IPv6 uses a path-compressed binary trie.
+
+   Tables are built in one go: lpm_add() stages routes, lpm_build() materializes them. Routes are
+   expected to change rarely (peer-file reload), so a change means building a new table and swapping. */
+
+#define LPM_MAX_NH 0x7FFF
+
+struct lpm_prefix_s {
+    int af;
+    uint8_t addr[16]; /* network byte order, host bits cleared */
+    uint8_t len;
+};
+
+typedef struct lpm_prefix_s lpm_prefix_t;
+
+struct lpm_route_s {
+    lpm_prefix_t prefix;
+    uint16_t nh;
+    uint32_t seq; /* for the same prefix added more than once, the last one wins */
+};
+
+typedef struct lpm_trie_node_s lpm_trie_node_t;
+
+struct lpm_s {
+    struct lpm_route_s *routes;
+    size_t num_routes, routes_capacity;
+
+    uint16_t *tbl24;
+    uint16_t *tbl8;
+    uint32_t num_tbl8_groups, tbl8_capacity;
+    uint16_t default_nh_v4;
+
+    lpm_trie_node_t *root_v6;
+};
+
+typedef struct lpm_s lpm_t;
+
+void lpm_init(lpm_t *lpm);
+
+void lpm_destroy(lpm_t *lpm);
+
+/* parses "a.b.c.d/len" or "x:y::z/len" (a bare address means a host route) */
+int lpm_parse_prefix(const char *str, lpm_prefix_t *prefix);
+
+/* buff should be atleast 64 bytes */
+const char *lpm_prefix_str(const lpm_prefix_t *prefix, char *buff, size_t len);
+
+int lpm_add(lpm_t *lpm, const lpm_prefix_t *prefix, uint16_t nh);
+
+/* call once, after all routes are added */
+int lpm_build(lpm_t *lpm);
+
+static inline uint16_t lpm_lookup_v4(lpm_t *lpm, const uint8_t *addr) {
+    if (lpm->tbl24 == NULL) return lpm->default_nh_v4;
+    uint32_t a = (((uint32_t) addr[0]) << 24) | (((uint32_t) addr[1]) << 16) | (((uint32_t) addr[2]) << 8) | addr[3];
+    uint16_t e = lpm->tbl24[a >> 8];
+    if (e & 0x8000) e = lpm->tbl8[(((uint32_t) (e & 0x7FFF)) << 8) | (a & 0xFF)];
+    return e ? e : lpm->default_nh_v4;
+}
+
+uint16_t lpm_lookup_v6(lpm_t *lpm, const uint8_t *addr);
+
+#endif
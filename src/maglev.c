@@ -0,0 +1,55 @@
+#include "maglev.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int maglev_init(maglev_t *m) {
+    if ((m->entry = malloc(MAGLEV_TABLE_SZ)) == NULL) {
+        log_crit("maglev", L("couldn't allocate lookup table"));
+        return -1;
+    }
+    memset(m->entry, MAGLEV_NONE, MAGLEV_TABLE_SZ);
+    return 0;
+}
+
+void maglev_destroy(maglev_t *m) {
+    free(m->entry);
+    m->entry = NULL;
+}
+
+static uint64_t key_hash(const uint8_t *key, size_t sz) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < sz; i++) h = (h ^ key[i]) * 1099511628211ull;
+    h ^= h >> 33; /* fmix64, high and low halves are used independently */
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+int maglev_build(maglev_t *m, const uint8_t *keys, size_t key_sz, int n, const uint8_t *up) {
+    uint32_t offset[MAGLEV_MAX_MEMBERS], skip[MAGLEV_MAX_MEMBERS], next[MAGLEV_MAX_MEMBERS];
+    int live = 0;
+    for (int i = 0; i < n; i++) {
+        uint64_t h = key_hash(keys + i * key_sz, key_sz);
+        offset[i] = (uint32_t) (h % MAGLEV_TABLE_SZ);
+        skip[i] = (uint32_t) ((h >> 32) % (MAGLEV_TABLE_SZ - 1)) + 1;
+        next[i] = 0;
+        if (up[i]) live++;
+    }
+    memset(m->entry, MAGLEV_NONE, MAGLEV_TABLE_SZ);
+    if (live == 0) return 0;
+    for (int filled = 0; ;) {
+        for (int i = 0; i < n; i++) {
+            if (! up[i]) continue;
+            uint32_t c;
+            do {
+                c = (uint32_t) ((offset[i] + (uint64_t) next[i]++ * skip[i]) % MAGLEV_TABLE_SZ);
+            } while (m->entry[c] != MAGLEV_NONE);
+            m->entry[c] = i;
+            if (++filled == MAGLEV_TABLE_SZ) return live;
+        }
+    }
+}
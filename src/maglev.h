@@ -0,0 +1,40 @@
+#ifndef _MAGLEV_H
+#define _MAGLEV_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* consistent hashing of flows onto the members of a group (Maglev, Eisenbud et al. NSDI '16). Each
+   member walks its own permutation of the table (offset and skip from a hash of its key), members take
+   turns claiming the next free slot of theirs till the table is full. Every member up ends up with
+   MAGLEV_TABLE_SZ / n slots give or take one, and a member going down or coming back moves little more
+   than its own share of slots.
+
+   Members are identified by index in the arrays given to maglev_build(), keys mostly decide where they
+   land but the order they take turns in matters a little, so it should be kept stable. */
+
+#define MAGLEV_TABLE_SZ 4099 /* prime, ~100x MAGLEV_MAX_MEMBERS keeps shares even */
+#define MAGLEV_MAX_MEMBERS 40
+#define MAGLEV_NONE 0xFF
+
+struct maglev_s {
+    uint8_t *entry; /* member index per slot, MAGLEV_NONE => no member up */
+};
+
+typedef struct maglev_s maglev_t;
+
+int maglev_init(maglev_t *m);
+
+void maglev_destroy(maglev_t *m);
+
+/* fills the table with members i < n (keys[i * key_sz ...], n <= MAGLEV_MAX_MEMBERS) having up[i] set,
+   returns how many are up */
+int maglev_build(maglev_t *m, const uint8_t *keys, size_t key_sz, int n, const uint8_t *up);
+
+/* member a flow's hash maps to, -1 if none is up */
+static inline int maglev_lookup(const maglev_t *m, uint64_t hash) {
+    uint8_t e = m->entry[hash % MAGLEV_TABLE_SZ];
+    return (e == MAGLEV_NONE) ? -1 : e;
+}
+
+#endif
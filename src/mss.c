@@ -0,0 +1,47 @@
+#include "mss.h"
+#include "common.h"
+
+#include <netinet/in.h>
+
+#define TCP_SYN 0x02
+#define TCP_OPT_END 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_MSS 2
+
+int mss_clamp(uint8_t *pkt, size_t len, size_t mtu) {
+    size_t l3_len, fixed_l3_len;
+    if (len >= 20 && (pkt[0] & 0xF0) == 0x40) {
+        l3_len = (pkt[0] & 0x0F) * 4;
+        fixed_l3_len = 20;
+        if (pkt[9] != IPPROTO_TCP || (rd16(pkt + 6) & 0x1FFF) != 0) return 0;
+    } else if (len >= 40 && (pkt[0] & 0xF0) == 0x60) {
+        l3_len = fixed_l3_len = 40;
+        if (pkt[6] != IPPROTO_TCP) return 0;
+    } else {
+        return 0;
+    }
+    if (l3_len < 20 || len < l3_len + 20 || mtu <= fixed_l3_len + 20) return 0;
+    uint8_t *tcp = pkt + l3_len;
+    size_t tcp_len = (tcp[12] >> 4) * 4;
+    if (! (tcp[13] & TCP_SYN) || tcp_len < 20 || len < l3_len + tcp_len) return 0;
+    size_t limit = mtu - fixed_l3_len - 20;
+    if (limit > 0xFFFF) limit = 0xFFFF;
+    for (size_t i = 20; i < tcp_len;) {
+        uint8_t kind = tcp[i];
+        if (kind == TCP_OPT_END) break;
+        if (kind == TCP_OPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= tcp_len || tcp[i + 1] < 2 || i + tcp[i + 1] > tcp_len) break;
+        if (kind == TCP_OPT_MSS && tcp[i + 1] == 4) {
+            uint16_t mss = rd16(tcp + i + 2);
+            if (mss <= limit) return 0;
+            wr16(tcp + i + 2, limit);
+            wr16(tcp + 16, csum_replace(rd16(tcp + 16), mss, limit));
+            return 1;
+        }
+        i += tcp[i + 1];
+    }
+    return 0;
+}
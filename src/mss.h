@@ -0,0 +1,18 @@
+#ifndef _MSS_H
+#define _MSS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* TCP MSS clamping for a tun with a large MTU. Flows ending on hosts with a large MTU towards the tun
+   pick large segments on their own, MSS options in SYNs crossing the tun (either way) are lowered to
+   what fits its MTU so no end is told it may send more than the tun (or the peer's) takes. */
+
+#define MSS_HDRS_MAX (60 + 60) /* IPv4 header with options + TCP header with options */
+
+/* lowers the MSS option of a TCP SYN (IPv4 or IPv6 without extension headers, not a non-first fragment)
+   to mtu less the fixed IP and TCP headers, fixing the TCP checksum. len may cover only the headers.
+   Returns 1 if the option was lowered, 0 otherwise */
+int mss_clamp(uint8_t *pkt, size_t len, size_t mtu);
+
+#endif
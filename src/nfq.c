@@ -0,0 +1,174 @@
+#include "nfq.h"
+#include "gso.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <libnfnetlink/libnfnetlink.h>
+#include <libnetfilter_queue/libnetfilter_queue.h>
+
+#define NFQ_RECV_BUFF_SZ (0xFFFF + 4096) /* a GSO super-pkt + netlink and nfqueue attributes */
+#define NFQ_QUEUE_MAXLEN 8192
+#define NFQ_SOCK_RCVBUF (16 * 1024 * 1024)
+
+struct nfq_queue_s {
+    nfq_capture_t *c;
+    struct nfq_q_handle *qh;
+    uint16_t num;
+    uint32_t last_taken_id;
+    int verdict_pending;
+};
+
+struct nfq_capture_s {
+    struct nfq_handle *h;
+    int fd;
+    int num_queues;
+    struct nfq_queue_s *queues;
+    size_t mtu;
+    nfq_pkt_hdlr_t *hdlr;
+    void *hdlr_ctx;
+    uint8_t *recv_buff;
+    uint8_t *seg_buff;
+};
+
+static int on_pkt(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struct nfq_data *nfa, void *data) {
+    struct nfq_queue_s *q = (struct nfq_queue_s *) data;
+    struct nfqnl_msg_packet_hdr *ph = nfq_get_msg_packet_hdr(nfa);
+    if (ph == NULL) return 0;
+    uint32_t id = ntohl(ph->packet_id);
+    unsigned char *pkt;
+    int len = nfq_get_payload(nfa, &pkt);
+    nfq_capture_t *c = q->c;
+    /* if only some segments of a super-pkt went out the lot is accepted anyway, TCP copes with duplicates better than with holes */
+    if (len > 0 && gso_deliver(pkt, len, c->mtu, nfq_get_skbinfo(nfa) & NFQA_SKB_CSUMNOTREADY, c->seg_buff, c->hdlr, c->hdlr_ctx) == 0) {
+        q->last_taken_id = id;
+        q->verdict_pending = 1;
+    } else if (nfq_set_verdict(qh, id, NF_ACCEPT, 0, NULL) < 0) {
+        log_warn("nfq", L("couldn't accept pkt %u of queue %d"), id, q->num);
+    }
+    return 0;
+}
+
+/* ids are monotonic per queue, a batch verdict covers every id upto the given one that doesn't have a verdict yet */
+static void issue_batch_verdicts(nfq_capture_t *c) {
+    for (int i = 0; i < c->num_queues; i++) {
+        struct nfq_queue_s *q = &c->queues[i];
+        if (! q->verdict_pending) continue;
+        if (nfq_set_verdict_batch(q->qh, q->last_taken_id, NF_DROP) < 0) {
+            log_warn("nfq", L("couldn't issue batch verdict upto pkt %u of queue %d"), q->last_taken_id, q->num);
+        }
+        q->verdict_pending = 0;
+    }
+}
+
+nfq_capture_t *nfq_capture_open(const nfq_cfg_t *cfg, nfq_pkt_hdlr_t *hdlr, void *hdlr_ctx) {
+    if (cfg->last_queue < cfg->first_queue) {
+        log_crit("nfq", L("bad queue range %d:%d"), cfg->first_queue, cfg->last_queue);
+        return NULL;
+    }
+    nfq_capture_t *c = calloc(1, sizeof(nfq_capture_t));
+    if (c == NULL) {
+        log_crit("nfq", L("couldn't allocate capture ctx"));
+        return NULL;
+    }
+    c->fd = -1;
+    c->mtu = cfg->mtu;
+    c->hdlr = hdlr;
+    c->hdlr_ctx = hdlr_ctx;
+    c->num_queues = cfg->last_queue - cfg->first_queue + 1;
+    c->queues = calloc(c->num_queues, sizeof(struct nfq_queue_s));
+    c->recv_buff = malloc(NFQ_RECV_BUFF_SZ);
+    c->seg_buff = malloc(cfg->mtu > 0 ? cfg->mtu : 1);
+    if (c->queues == NULL || c->recv_buff == NULL || c->seg_buff == NULL) {
+        log_crit("nfq", L("couldn't allocate queue state / buffers"));
+        nfq_capture_close(c);
+        return NULL;
+    }
+    if ((c->h = nfq_open()) == NULL) {
+        log_crit("nfq", L("couldn't open nfqueue handle"));
+        nfq_capture_close(c);
+        return NULL;
+    }
+    int afs[] = {AF_INET, AF_INET6};
+    for (int i = 0; i < 2; i++) {
+        nfq_unbind_pf(c->h, afs[i]); /* no-op on newer kernels, older ones want a fresh bind */
+        if (nfq_bind_pf(c->h, afs[i]) < 0) {
+            log_crit("nfq", L("couldn't bind nfqueue handler for af %d"), afs[i]);
+            nfq_capture_close(c);
+            return NULL;
+        }
+    }
+    for (int i = 0; i < c->num_queues; i++) {
+        struct nfq_queue_s *q = &c->queues[i];
+        q->c = c;
+        q->num = cfg->first_queue + i;
+        if ((q->qh = nfq_create_queue(c->h, q->num, on_pkt, q)) == NULL) {
+            log_crit("nfq", L("couldn't bind to queue %d (is another process bound to it?)"), q->num);
+            nfq_capture_close(c);
+            return NULL;
+        }
+        if (nfq_set_mode(q->qh, NFQNL_COPY_PACKET, 0xFFFF) < 0) {
+            log_crit("nfq", L("couldn't set copy-packet mode for queue %d"), q->num);
+            nfq_capture_close(c);
+            return NULL;
+        }
+        if (nfq_set_queue_maxlen(q->qh, NFQ_QUEUE_MAXLEN) < 0) {
+            log_warn("nfq", L("couldn't set max-len of queue %d"), q->num);
+        }
+        uint32_t flags = NFQA_CFG_F_FAIL_OPEN | NFQA_CFG_F_GSO;
+        if (nfq_set_queue_flags(q->qh, flags, flags) < 0) {
+            log_warn("nfq", L("kernel doesn't support fail-open / GSO for queue %d (pkts will be dropped on overrun and segmented before queueing)"), q->num);
+        }
+    }
+    c->fd = nfq_fd(c->h);
+    if (setsockopt(c->fd, SOL_NETLINK, NETLINK_NO_ENOBUFS, (int[]){1}, sizeof(int)) != 0) {
+        log_warn("nfq", L("couldn't turn-off ENOBUFS reporting on nfqueue socket"));
+    }
+    nfnl_rcvbufsiz(nfq_nfnlh(c->h), NFQ_SOCK_RCVBUF);
+    log_info("nfq", L("capturing from queues %d to %d (mtu: %d)"), cfg->first_queue, cfg->last_queue, cfg->mtu);
+    return c;
+}
+
+int nfq_capture_fd(nfq_capture_t *c) {
+    return c->fd;
+}
+
+int nfq_capture_read(nfq_capture_t *c, int max_msgs) {
+    int n = 0, ret = 0;
+    while (n < max_msgs) {
+        ssize_t r = recv(c->fd, c->recv_buff, NFQ_RECV_BUFF_SZ, MSG_DONTWAIT);
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == ENOBUFS) {
+                log_warn("nfq", L("nfqueue socket overrun, some pkts were failed-open or lost"));
+                continue;
+            }
+            log_warn("nfq", L("nfqueue recv failed"));
+            ret = -1;
+            break;
+        }
+        nfq_handle_packet(c->h, (char *) c->recv_buff, r);
+        n++;
+    }
+    issue_batch_verdicts(c);
+    return ret < 0 ? ret : n;
+}
+
+void nfq_capture_close(nfq_capture_t *c) {
+    if (c == NULL) return;
+    if (c->queues != NULL) {
+        for (int i = 0; i < c->num_queues; i++) {
+            if (c->queues[i].qh != NULL) nfq_destroy_queue(c->queues[i].qh);
+        }
+    }
+    if (c->h != NULL) nfq_close(c->h);
+    free(c->queues);
+    free(c->recv_buff);
+    free(c->seg_buff);
+    free(c);
+}
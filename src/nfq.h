@@ -0,0 +1,27 @@
+#ifndef _NFQ_H
+#define _NFQ_H
+
+#include "io.h"
+#include <stddef.h>
+
+/* pulls pkts from a range of NFQUEUE queues (one netlink socket for the whole range, queues set to
+   fail-open and GSO), each pkt is offered to a handler. Pkts the handler takes are dropped in
+   kernel with one batch verdict per queue once a read-batch is done, the rest are accepted back as is.
+   Needs libnetfilter_queue (--enable-nfqueue). */
+
+/* 0 => pkt was taken (and will be dropped in kernel), otherwise it is accepted unmodified */
+typedef int (nfq_pkt_hdlr_t)(void *pkt, size_t len, void *hdlr_ctx);
+
+typedef struct nfq_capture_s nfq_capture_t;
+
+nfq_capture_t *nfq_capture_open(const nfq_cfg_t *cfg, nfq_pkt_hdlr_t *hdlr, void *hdlr_ctx);
+
+int nfq_capture_fd(nfq_capture_t *c);
+
+/* reads upto max_msgs queued pkts and issues their verdicts, returns number of pkts read
+   (0 => nothing queued) or -1 on error */
+int nfq_capture_read(nfq_capture_t *c, int max_msgs);
+
+void nfq_capture_close(nfq_capture_t *c);
+
+#endif
@@ -0,0 +1,152 @@
+#include "pep.h"
+#include "common.h"
+
+#include <string.h>
+#include <netinet/in.h>
+
+#define IPv4_HDR_SZ 20
+#define IPv6_HDR_SZ 40
+#define MSG_TTL 64
+
+void pep_tuple(uint8_t *tuple, int af, const void *client, uint16_t client_port, const void *server, uint16_t server_port) {
+    size_t alen = (af == AF_INET6) ? 16 : 4;
+    memset(tuple, 0, PEP_TUPLE_SZ);
+    tuple[0] = (af == AF_INET6) ? 6 : 4;
+    memcpy(tuple + 1, client, alen);
+    memcpy(tuple + 17, server, alen);
+    wr16(tuple + 33, client_port);
+    wr16(tuple + 35, server_port);
+}
+
+int pep_tuple_af(const uint8_t *tuple) {
+    return (tuple[0] == 6) ? AF_INET6 : AF_INET;
+}
+
+const uint8_t *pep_tuple_addr(const uint8_t *tuple, int server, uint16_t *port) {
+    *port = rd16(tuple + (server ? 35 : 33));
+    return tuple + (server ? 17 : 1);
+}
+
+int pep_is_msg(const uint8_t *pkt, size_t len) {
+    if (len >= IPv4_HDR_SZ && (pkt[0] & 0xF0) == 0x40) return pkt[9] == PEP_IPPROTO;
+    if (len >= IPv6_HDR_SZ && (pkt[0] & 0xF0) == 0x60) return pkt[6] == PEP_IPPROTO;
+    return 0;
+}
+
+size_t pep_hdr_len(const uint8_t *tuple) {
+    return ((tuple[0] == 6) ? IPv6_HDR_SZ : IPv4_HDR_SZ) + PEP_HDR_SZ;
+}
+
+size_t pep_encode(const pep_msg_t *m, uint8_t *out) {
+    int from_server = (m->flags & PEP_FROM_SERVER) != 0;
+    const uint8_t *src = m->tuple + (from_server ? 17 : 1), *dst = m->tuple + (from_server ? 1 : 17);
+    size_t hl = pep_hdr_len(m->tuple), total = hl + m->len;
+    uint8_t *h = out + hl - PEP_HDR_SZ;
+    if (m->tuple[0] == 6) {
+        memset(out, 0, IPv6_HDR_SZ);
+        out[0] = 0x60;
+        wr16(out + 4, total - IPv6_HDR_SZ);
+        out[6] = PEP_IPPROTO;
+        out[7] = MSG_TTL;
+        memcpy(out + 8, src, 16);
+        memcpy(out + 24, dst, 16);
+    } else {
+        memset(out, 0, IPv4_HDR_SZ);
+        out[0] = 0x45;
+        wr16(out + 2, total);
+        out[8] = MSG_TTL;
+        out[9] = PEP_IPPROTO;
+        memcpy(out + 12, src, 4);
+        memcpy(out + 16, dst, 4);
+        wr16(out + 10, csum_fold(csum_add(0, out, IPv4_HDR_SZ)));
+    }
+    h[0] = m->op;
+    h[1] = m->flags;
+    memcpy(h + 2, m->tuple + (from_server ? 35 : 33), 2);
+    memcpy(h + 4, m->tuple + (from_server ? 33 : 35), 2);
+    h[6] = h[7] = 0;
+    wr32(h + 8, m->arg);
+    return total;
+}
+
+int pep_decode(const uint8_t *pkt, size_t len, pep_msg_t *m) {
+    size_t hl, total;
+    const uint8_t *src, *dst;
+    size_t alen;
+    if (! pep_is_msg(pkt, len)) return -1;
+    if ((pkt[0] & 0xF0) == 0x60) {
+        hl = IPv6_HDR_SZ;
+        total = IPv6_HDR_SZ + rd16(pkt + 4);
+        src = pkt + 8;
+        dst = pkt + 24;
+        alen = 16;
+    } else {
+        hl = (pkt[0] & 0x0F) * 4;
+        total = rd16(pkt + 2);
+        src = pkt + 12;
+        dst = pkt + 16;
+        alen = 4;
+    }
+    if (hl < IPv4_HDR_SZ || total > len || total < hl + PEP_HDR_SZ) return -1;
+    const uint8_t *h = pkt + hl;
+    m->op = h[0];
+    m->flags = h[1];
+    if (m->op < PEP_OPEN || m->op > PEP_RST) return -1;
+    m->arg = rd32(h + 8);
+    int from_server = (m->flags & PEP_FROM_SERVER) != 0;
+    memset(m->tuple, 0, PEP_TUPLE_SZ);
+    m->tuple[0] = (alen == 16) ? 6 : 4;
+    memcpy(m->tuple + 1, from_server ? dst : src, alen);
+    memcpy(m->tuple + 17, from_server ? src : dst, alen);
+    memcpy(m->tuple + 33, h + (from_server ? 4 : 2), 2);
+    memcpy(m->tuple + 35, h + (from_server ? 2 : 4), 2);
+    m->data = h + PEP_HDR_SZ;
+    m->len = total - hl - PEP_HDR_SZ;
+    if (m->len > PEP_CHUNK || (m->len > 0 && m->op != PEP_DATA)) return -1;
+    return 0;
+}
+
+void pep_stream_init(pep_stream_t *s, const uint8_t *tuple, int server_side, uint64_t now_ns) {
+    memset(s, 0, sizeof(*s));
+    memcpy(s->tuple, tuple, PEP_TUPLE_SZ);
+    s->server_side = server_side;
+    s->started_ns = now_ns;
+}
+
+size_t pep_credit(const pep_stream_t *s) {
+    size_t credit = PEP_WINDOW - (uint32_t) (s->tx_seq - s->tx_acked);
+    return (credit < PEP_CHUNK) ? credit : PEP_CHUNK;
+}
+
+void pep_sent(pep_stream_t *s, size_t len) {
+    s->tx_seq += len;
+    if (s->server_side) s->down += len;
+    else s->up += len;
+}
+
+int pep_acked(pep_stream_t *s, uint32_t acked) {
+    if ((uint32_t) (acked - s->tx_acked) > (uint32_t) (s->tx_seq - s->tx_acked)) return -1;
+    s->tx_acked = acked;
+    return 0;
+}
+
+int pep_rcvd(pep_stream_t *s, size_t len) {
+    if (pep_buffered(s) + len > PEP_WINDOW) return -1;
+    s->rx_seq += len;
+    if (s->server_side) s->up += len;
+    else s->down += len;
+    return 0;
+}
+
+int pep_ack_due(const pep_stream_t *s) {
+    return (uint32_t) (s->rx_out - s->rx_acked) >= PEP_WINDOW / 4;
+}
+
+uint32_t pep_ack(pep_stream_t *s) {
+    s->rx_acked = s->rx_out;
+    return s->rx_out;
+}
+
+double pep_mbps(uint64_t bytes, uint64_t ns) {
+    return (ns > 0) ? (bytes * 8.0 * 1000.0) / ns : 0;
+}
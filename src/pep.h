@@ -0,0 +1,109 @@
+#ifndef _PEP_H
+#define _PEP_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* split-TCP performance enhancing proxy (opt-in, both peers must have it on). Inner TCP flows the host
+   redirects to a transparent (TPROXY) listener are terminated here, their bytes go to the peer owning the
+   destination and that peer opens the flow to the destination itself, so each end's congestion control
+   only sees its own LAN. Messages between the two are pkts of their own IP protocol, addressed like the
+   flow's pkts in the direction they travel (routing, compression, sessions and resumption are the conn's):
+
+       | IP header | op (1) | flags (1) | src-port (2) | dst-port (2) | reserved (2) | arg (4) | data |
+
+   (big-endian). OPEN comes first from the side that accepted the flow (client side), then DATA either
+   way, FIN once a side's socket hit EOF and RST to give up on the flow. Each side may have PEP_WINDOW
+   data bytes in flight towards the other, ACK (arg: data bytes passed on to the socket so far, mod 2^32)
+   hands out more. */
+
+#define PEP_IPPROTO 253 /* RFC 3692, experimentation */
+#define PEP_HDR_SZ 12
+#define PEP_CHUNK (16 * 1024) /* data bytes per message */
+#define PEP_WINDOW (256 * 1024)
+#define PEP_MSG_MAX (40 + PEP_HDR_SZ + PEP_CHUNK)
+#define PEP_TUPLE_SZ 37 /* version, client addr, server addr, client port, server port */
+
+#define PEP_OPEN 1
+#define PEP_DATA 2
+#define PEP_ACK 3
+#define PEP_FIN 4
+#define PEP_RST 5
+
+#define PEP_FROM_SERVER 0x1 /* sent by the side that opened the flow to the destination */
+
+struct pep_msg_s {
+    int op, flags;
+    uint32_t arg;
+    uint8_t tuple[PEP_TUPLE_SZ];
+    const uint8_t *data;
+    size_t len;
+};
+
+typedef struct pep_msg_s pep_msg_t;
+
+struct pep_stream_s {
+    uint8_t tuple[PEP_TUPLE_SZ];
+    int server_side;
+    uint32_t tx_seq, tx_acked; /* data bytes sent to the other side, how many of them it passed on */
+    uint32_t rx_seq, rx_out, rx_acked; /* data bytes received from it, passed on to the socket, acked */
+    uint64_t up, down; /* client => server, server => client */
+    uint64_t started_ns;
+};
+
+typedef struct pep_stream_s pep_stream_t;
+
+void pep_tuple(uint8_t *tuple, int af, const void *client, uint16_t client_port, const void *server, uint16_t server_port);
+
+int pep_tuple_af(const uint8_t *tuple);
+
+/* client (0) or server (1) address and port (host order) of the tuple */
+const uint8_t *pep_tuple_addr(const uint8_t *tuple, int server, uint16_t *port);
+
+/* pkt is a pep message (only the IP header is looked at) */
+int pep_is_msg(const uint8_t *pkt, size_t len);
+
+/* IP + pep header length of messages of the flow */
+size_t pep_hdr_len(const uint8_t *tuple);
+
+/* IP + pep header of m to out, m->len data bytes must already be at out + pep_hdr_len. Returns the message's length */
+size_t pep_encode(const pep_msg_t *m, uint8_t *out);
+
+/* -1 if pkt isn't a well-formed message, m->data points into pkt */
+int pep_decode(const uint8_t *pkt, size_t len, pep_msg_t *m);
+
+void pep_stream_init(pep_stream_t *s, const uint8_t *tuple, int server_side, uint64_t now_ns);
+
+/* data bytes the next message may carry, 0 => wait for an ACK */
+size_t pep_credit(const pep_stream_t *s);
+
+void pep_sent(pep_stream_t *s, size_t len);
+
+/* -1 if ACK acks more than was sent */
+int pep_acked(pep_stream_t *s, uint32_t acked);
+
+/* -1 if DATA goes over the window */
+int pep_rcvd(pep_stream_t *s, size_t len);
+
+static inline size_t pep_buffered(const pep_stream_t *s) {
+    return s->rx_seq - s->rx_out;
+}
+
+static inline void pep_passed(pep_stream_t *s, size_t len) {
+    s->rx_out += len;
+}
+
+/* the other side should hear about what was passed on (a quarter of the window since it last did) */
+int pep_ack_due(const pep_stream_t *s);
+
+/* ACK's arg, counted as told */
+uint32_t pep_ack(pep_stream_t *s);
+
+/* Mbit/s over ns */
+double pep_mbps(uint64_t bytes, uint64_t ns);
+
+#endif
@@ -0,0 +1,203 @@
+#include "pkt_ring.h"
+#include "gso.h"
+#include "common.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#define RX_BLK_SZ (1 << 18) /* fits GRO'd 64k pkts */
+#define RX_BLK_NR 64
+#define RX_FRAME_SZ 2048
+#define RX_BLK_TOV_MS 1 /* a partially filled block is handed over after this long */
+#define TX_FRAMES 1024
+#define TX_KICK_BATCH 32
+#define ETH_HDR_LEN 14
+
+#define FRAME_DATA_OFF TPACKET_ALIGN(sizeof(struct tpacket3_hdr)) /* sockaddr_ll on rx, pkt data on tx */
+
+static int if_info(int fd, const char *if_name, int *if_index, int *mtu, uint8_t *mac) {
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    if (strlen(if_name) >= IFNAMSIZ) return -1;
+    strcpy(ifr.ifr_name, if_name);
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) != 0) return -1;
+    *if_index = ifr.ifr_ifindex;
+    if (ioctl(fd, SIOCGIFMTU, &ifr) != 0) return -1;
+    *mtu = ifr.ifr_mtu;
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) != 0) return -1;
+    memcpy(mac, ifr.ifr_hwaddr.sa_data, 6);
+    return 0;
+}
+
+static uint8_t *setup_ring(int fd, int ring_opt, struct tpacket_req3 *req, size_t *map_sz) {
+    int v = TPACKET_V3;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) != 0) return NULL;
+    if (setsockopt(fd, SOL_PACKET, ring_opt, req, sizeof(*req)) != 0) return NULL;
+    *map_sz = ((size_t) req->tp_block_size) * req->tp_block_nr;
+    void *m = mmap(NULL, *map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return (m == MAP_FAILED) ? NULL : m;
+}
+
+static int bind_to_if(int fd, int if_index, uint16_t proto) {
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(proto);
+    sll.sll_ifindex = if_index;
+    return bind(fd, (struct sockaddr *) &sll, sizeof(sll));
+}
+
+static int open_rx(pkt_ring_t *r, int if_index) {
+    if ((r->rx_fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) return -1;
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = RX_BLK_SZ;
+    req.tp_block_nr = RX_BLK_NR;
+    req.tp_frame_size = RX_FRAME_SZ;
+    req.tp_frame_nr = (RX_BLK_SZ / RX_FRAME_SZ) * RX_BLK_NR;
+    req.tp_retire_blk_tov = RX_BLK_TOV_MS;
+    if ((r->rx_map = setup_ring(r->rx_fd, PACKET_RX_RING, &req, &r->rx_map_sz)) == NULL) return -1;
+    r->rx_blk_sz = RX_BLK_SZ;
+    r->rx_blk_nr = RX_BLK_NR;
+#ifdef PACKET_IGNORE_OUTGOING
+    setsockopt(r->rx_fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, (int[]){1}, sizeof(int)); /* also filtered per pkt, for older kernels */
+#endif
+    return bind_to_if(r->rx_fd, if_index, ETH_P_ALL);
+}
+
+static int open_tx(pkt_ring_t *r, int if_index) {
+    if ((r->tx_fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0) return -1; /* protocol 0 => never sees rx */
+    uint32_t frame_sz = 2048, blk_sz;
+    while (frame_sz < FRAME_DATA_OFF + ETH_HDR_LEN + r->mtu) frame_sz <<= 1;
+    blk_sz = (frame_sz > (1 << 16)) ? frame_sz : (1 << 16);
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = blk_sz;
+    req.tp_block_nr = (((size_t) TX_FRAMES) * frame_sz + blk_sz - 1) / blk_sz;
+    req.tp_frame_size = frame_sz;
+    req.tp_frame_nr = (blk_sz / frame_sz) * req.tp_block_nr;
+    setsockopt(r->tx_fd, SOL_PACKET, PACKET_LOSS, (int[]){1}, sizeof(int)); /* malformed frames are skipped, not retried forever */
+#ifdef PACKET_QDISC_BYPASS
+    setsockopt(r->tx_fd, SOL_PACKET, PACKET_QDISC_BYPASS, (int[]){1}, sizeof(int));
+#endif
+    if ((r->tx_map = setup_ring(r->tx_fd, PACKET_TX_RING, &req, &r->tx_map_sz)) == NULL) return -1;
+    r->tx_frame_sz = frame_sz;
+    r->tx_frame_nr = req.tp_frame_nr;
+    return bind_to_if(r->tx_fd, if_index, 0);
+}
+
+int pkt_ring_open(pkt_ring_t *r, const char *if_name, const uint8_t *next_hop_mac) {
+    memset(r, 0, sizeof(*r));
+    r->rx_fd = r->tx_fd = -1;
+    memcpy(r->dst_mac, next_hop_mac, 6);
+    int if_index;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || if_info(fd, if_name, &if_index, &r->mtu, r->src_mac) != 0) {
+        log_crit("pkt_ring", L("couldn't get index / mtu / mac of interface %s"), if_name);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    close(fd);
+    if ((r->seg_buff = malloc(r->mtu)) == NULL) {
+        log_crit("pkt_ring", L("couldn't allocate segmentation buffer"));
+        return -1;
+    }
+    if (open_rx(r, if_index) != 0) {
+        log_crit("pkt_ring", L("couldn't setup TPACKET_V3 rx ring on %s"), if_name);
+        pkt_ring_close(r);
+        return -1;
+    }
+    if (open_tx(r, if_index) != 0) {
+        log_crit("pkt_ring", L("couldn't setup TPACKET_V3 tx ring on %s"), if_name);
+        pkt_ring_close(r);
+        return -1;
+    }
+    log_info("pkt_ring", L("using %s (mtu: %d, rx ring: %zd bytes, tx ring: %u frames of %u bytes)"), if_name, r->mtu, r->rx_map_sz, r->tx_frame_nr, r->tx_frame_sz);
+    return 0;
+}
+
+void pkt_ring_close(pkt_ring_t *r) {
+    if (r->rx_map != NULL) munmap(r->rx_map, r->rx_map_sz);
+    if (r->tx_map != NULL) munmap(r->tx_map, r->tx_map_sz);
+    if (r->rx_fd >= 0) close(r->rx_fd);
+    if (r->tx_fd >= 0) close(r->tx_fd);
+    free(r->seg_buff);
+    r->rx_map = r->tx_map = r->seg_buff = NULL;
+    r->rx_fd = r->tx_fd = -1;
+}
+
+static void take_frame(pkt_ring_t *r, struct tpacket3_hdr *h, pkt_ring_hdlr_t *hdlr, void *hdlr_ctx) {
+    struct sockaddr_ll *sll = (struct sockaddr_ll *) (((uint8_t *) h) + FRAME_DATA_OFF);
+    if (sll->sll_pkttype == PACKET_OUTGOING) return;
+    uint16_t proto = ntohs(sll->sll_protocol);
+    if (proto != ETH_P_IP && proto != ETH_P_IPV6) return;
+    uint8_t *pkt = ((uint8_t *) h) + h->tp_net;
+    ssize_t avail = ((ssize_t) h->tp_snaplen) - (h->tp_net - h->tp_mac);
+    if (avail <= 0) return;
+    size_t len = parse_l3_pkt_sz(pkt, avail, NULL, 0); /* short frames carry link-layer padding */
+    if (len == 0 || len > (size_t) avail) return;
+    gso_deliver(pkt, len, r->mtu, h->tp_status & TP_STATUS_CSUMNOTREADY, r->seg_buff, hdlr, hdlr_ctx);
+}
+
+int pkt_ring_read(pkt_ring_t *r, int max_blocks, pkt_ring_hdlr_t *hdlr, void *hdlr_ctx) {
+    int n = 0;
+    while (n < max_blocks) {
+        struct tpacket_block_desc *bd = (struct tpacket_block_desc *) (r->rx_map + ((size_t) r->rx_blk) * r->rx_blk_sz);
+        if (! (__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) break;
+        struct tpacket3_hdr *h = (struct tpacket3_hdr *) (((uint8_t *) bd) + bd->hdr.bh1.offset_to_first_pkt);
+        for (uint32_t i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+            take_frame(r, h, hdlr, hdlr_ctx);
+            h = (struct tpacket3_hdr *) (((uint8_t *) h) + h->tp_next_offset);
+        }
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        r->rx_blk = (r->rx_blk + 1) % r->rx_blk_nr;
+        n++;
+    }
+    return n;
+}
+
+ssize_t pkt_ring_send(pkt_ring_t *r, void *b1, ssize_t len1, void *b2, ssize_t len2) {
+    ssize_t len = len1 + len2;
+    if (len > r->mtu) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    struct tpacket3_hdr *h = (struct tpacket3_hdr *) (r->tx_map + ((size_t) r->tx_frame) * r->tx_frame_sz);
+    if (__atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE) {
+        pkt_ring_kick(r);
+        errno = EAGAIN;
+        return -1;
+    }
+    uint8_t *d = ((uint8_t *) h) + FRAME_DATA_OFF;
+    int v6 = ((*(uint8_t *) b1) & 0xF0) == 0x60;
+    memcpy(d, r->dst_mac, 6);
+    memcpy(d + 6, r->src_mac, 6);
+    d[12] = v6 ? (ETH_P_IPV6 >> 8) : (ETH_P_IP >> 8);
+    d[13] = v6 ? (ETH_P_IPV6 & 0xFF) : (ETH_P_IP & 0xFF);
+    memcpy(d + ETH_HDR_LEN, b1, len1);
+    if (len2 > 0) memcpy(d + ETH_HDR_LEN + len1, b2, len2);
+    h->tp_len = ETH_HDR_LEN + len;
+    h->tp_next_offset = 0;
+    __atomic_store_n(&h->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    r->tx_frame = (r->tx_frame + 1) % r->tx_frame_nr;
+    if (++r->tx_pending >= TX_KICK_BATCH) pkt_ring_kick(r);
+    return len;
+}
+
+void pkt_ring_kick(pkt_ring_t *r) {
+    if (r->tx_pending == 0) return;
+    if (send(r->tx_fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != ENOBUFS) {
+        log_warn("pkt_ring", L("tx ring kick failed"));
+    }
+    r->tx_pending = 0;
+}
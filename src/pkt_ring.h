@@ -0,0 +1,44 @@
+#ifndef _PKT_RING_H
+#define _PKT_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* packet I/O straight off a NIC (or veth) over AF_PACKET TPACKET_V3 mmapped rings, for boxes that sit in the
+   path instead of routing through tun. rx is block-mode (one wakeup per retired block, pkts walked in place),
+   tx fills ring frames and kicks the kernel once per batch. Frames go out with the interface's mac as source
+   and a fixed next-hop mac as destination. */
+
+struct pkt_ring_s {
+    int rx_fd, tx_fd;
+    uint8_t *rx_map, *tx_map;
+    size_t rx_map_sz, tx_map_sz;
+    uint32_t rx_blk_sz, rx_blk_nr, rx_blk;
+    uint32_t tx_frame_sz, tx_frame_nr, tx_frame;
+    int tx_pending;
+    int mtu;
+    uint8_t src_mac[6], dst_mac[6];
+    uint8_t *seg_buff; /* GRO'd rx pkts larger than mtu are segmented into this */
+};
+
+typedef struct pkt_ring_s pkt_ring_t;
+
+int pkt_ring_open(pkt_ring_t *r, const char *if_name, const uint8_t *next_hop_mac);
+
+void pkt_ring_close(pkt_ring_t *r);
+
+/* 0 => pkt was taken */
+typedef int (pkt_ring_hdlr_t)(void *pkt, size_t len, void *hdlr_ctx);
+
+/* walks upto max_blocks retired rx blocks, hands every IP pkt (L3 onwards, link padding trimmed, checksum
+   completed, segmented to mtu) to hdlr and returns blocks to the kernel. Returns number of blocks walked */
+int pkt_ring_read(pkt_ring_t *r, int max_blocks, pkt_ring_hdlr_t *hdlr, void *hdlr_ctx);
+
+/* queues one L3 pkt (may be split across 2 buffers) for tx, the kernel is kicked every few pkts,
+   pkt_ring_kick pushes out the rest. Returns bytes queued or -1 (errno: EAGAIN ring full, EMSGSIZE) */
+ssize_t pkt_ring_send(pkt_ring_t *r, void *b1, ssize_t len1, void *b2, ssize_t len2);
+
+void pkt_ring_kick(pkt_ring_t *r);
+
+#endif
@@ -0,0 +1,241 @@
+#include "profile.h"
+#include "compress.h"
+#include "io.h"
+#include "log.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROFILE_LOG "profile"
+#define MAX_WEIGHT 64
+#define MAX_UNPRIVILEGED_PRIO 6 /* higher SO_PRIORITY needs CAP_NET_ADMIN */
+
+static const char *flush_names[] = {"pkt", "batch", "flow"}; /* IO_FLUSH_* order */
+
+void profile_set_init(profile_set_t *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+void profile_set_destroy(profile_set_t *s) {
+    free(s->profiles);
+    memset(s, 0, sizeof(*s));
+}
+
+const link_profile_t *profile_find(const profile_set_t *s, const char *name) {
+    for (int i = 0; i < s->n; i++) {
+        if (strcmp(s->profiles[i].name, name) == 0) return &s->profiles[i].p;
+    }
+    return NULL;
+}
+
+static int parse_num(const char *v, long long min, long long max, long long *out) {
+    char *end;
+    errno = 0;
+    long long n = strtoll(v, &end, 10);
+    if (errno != 0 || end == v || *end != '\0' || n < min || n > max) return -1;
+    *out = n;
+    return 0;
+}
+
+/* bytes, with an optional k, M or G (binary) suffix */
+static int parse_size(const char *v, ssize_t *out) {
+    char *end;
+    errno = 0;
+    long long n = strtoll(v, &end, 10);
+    if (errno != 0 || end == v || n <= 0) return -1;
+    int shift = 0;
+    switch (*end) {
+    case '\0': break;
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    default: return -1;
+    }
+    if (*end != '\0' || n > (SSIZE_MAX >> shift)) return -1;
+    *out = (ssize_t) n << shift;
+    return 0;
+}
+
+static int parse_level(const char *v, int *level) {
+    long long n;
+    if (strcmp(v, "none") == 0) {
+        *level = NO_COMPRESSION_LEVEL;
+        return 0;
+    }
+    if (parse_num(v, NO_COMPRESSION_LEVEL, MAX_COMPRESSION_LEVEL, &n) != 0) return -1;
+    if (n < MIN_COMPRESSION_LEVEL && n != NO_COMPRESSION_LEVEL) return -1;
+    *level = n;
+    return 0;
+}
+
+/* key=value, p is only changed when it is valid */
+static int apply_setting(const char *word, link_profile_t *p) {
+    const char *eq = strchr(word, '=');
+    size_t klen = eq - word;
+    const char *v = eq + 1;
+    long long n;
+
+#define KEY(k) (klen == strlen(k) && strncmp(word, k, klen) == 0)
+    if (KEY("level")) {
+        if (parse_level(v, &p->level) != 0) goto bad;
+        p->set |= PROFILE_LEVEL;
+    } else if (KEY("codec")) {
+        if (strcmp(v, "none") == 0) {
+            p->level = NO_COMPRESSION_LEVEL;
+            p->set |= PROFILE_LEVEL;
+        } else if (strcmp(v, COMPRESSION_IMPL) != 0) {
+            log_warnx(PROFILE_LOG, L("codec '%s' isn't available, this build only has " COMPRESSION_IMPL " (or none)"), v);
+            return -1;
+        }
+    } else if (KEY("ring")) {
+        if (parse_size(v, &p->ring_sz) != 0) goto bad;
+        p->set |= PROFILE_RING;
+    } else if (KEY("max-ring")) {
+        if (parse_size(v, &p->max_ring_sz) != 0) goto bad;
+        p->set |= PROFILE_MAX_RING;
+    } else if (KEY("flush")) {
+        int i;
+        for (i = IO_FLUSH_PKT; i <= IO_FLUSH_FLOW && strcmp(v, flush_names[i]) != 0; i++);
+        if (i > IO_FLUSH_FLOW) goto bad;
+        p->flush_policy = i;
+        p->set |= PROFILE_FLUSH;
+    } else if (KEY("lowlat")) {
+        if (parse_num(v, 0, 2, &n) != 0) goto bad;
+        p->low_lat_mode = n;
+        p->set |= PROFILE_LOWLAT;
+    } else if (KEY("weight")) {
+        if (parse_num(v, 1, MAX_WEIGHT, &n) != 0) goto bad;
+        p->weight = n;
+        p->set |= PROFILE_WEIGHT;
+    } else if (KEY("prio")) {
+        if (parse_num(v, 0, MAX_UNPRIVILEGED_PRIO, &n) != 0) goto bad;
+        p->prio = n;
+        p->set |= PROFILE_PRIO;
+    } else if (KEY("rate")) {
+        if (parse_num(v, 1, UINT32_MAX, &n) != 0) goto bad;
+        p->rate_kbit = n;
+        p->set |= PROFILE_RATE;
+    } else if (KEY("via")) {
+        memset(p->via, 0, sizeof(p->via));
+        if (inet_pton(AF_INET, v, p->via) == 1) {
+            p->via_af = AF_INET;
+        } else if (inet_pton(AF_INET6, v, p->via) == 1) {
+            p->via_af = AF_INET6;
+        } else {
+            goto bad;
+        }
+        p->set |= PROFILE_VIA;
+    } else if (KEY("shm")) {
+        if (*v != '/' || strlen(v) >= sizeof(p->shm_path)) goto bad;
+        strcpy(p->shm_path, v);
+        p->set |= PROFILE_SHM;
+    } else {
+        log_warnx(PROFILE_LOG, L("unknown setting '%s'"), word);
+        return -1;
+    }
+#undef KEY
+    return 0;
+
+ bad:
+    log_warnx(PROFILE_LOG, L("bad value in '%s'"), word);
+    return -1;
+}
+
+int profile_apply_word(const profile_set_t *s, const char *word, link_profile_t *p) {
+    if (*word == '@') {
+        const link_profile_t *named = profile_find(s, word + 1);
+        if (named == NULL) {
+            log_warnx(PROFILE_LOG, L("unknown profile '%s'"), word + 1);
+            return -1;
+        }
+        profile_merge(p, named);
+        return 1;
+    }
+    if (strchr(word, '=') == NULL) return 0;
+    link_profile_t tmp = *p;
+    if (apply_setting(word, &tmp) != 0) return -1;
+    *p = tmp;
+    return 1;
+}
+
+int profile_define(profile_set_t *s, char *line) {
+    char *save = NULL;
+    char *name = strtok_r(line, " \t\r\n", &save);
+    if (name == NULL || strlen(name) >= PROFILE_MAX_NAME || strpbrk(name, "@=") != NULL) {
+        log_warnx(PROFILE_LOG, L("profile needs a name (less than %d chars, without '@' or '=')"), PROFILE_MAX_NAME);
+        return -1;
+    }
+    link_profile_t p;
+    memset(&p, 0, sizeof(p));
+    for (char *w = strtok_r(NULL, " \t\r\n", &save); w != NULL; w = strtok_r(NULL, " \t\r\n", &save)) {
+        int ret = profile_apply_word(s, w, &p);
+        if (ret == 0) log_warnx(PROFILE_LOG, L("'%s' in profile %s is neither @profile nor key=value"), w, name);
+        if (ret != 1) return -1;
+    }
+
+    named_profile_t *np = NULL;
+    for (int i = 0; i < s->n; i++) {
+        if (strcmp(s->profiles[i].name, name) == 0) np = &s->profiles[i];
+    }
+    if (np == NULL) {
+        if (s->n == s->cap) {
+            int cap = s->cap ? s->cap * 2 : 8;
+            named_profile_t *profiles = realloc(s->profiles, cap * sizeof(named_profile_t));
+            if (profiles == NULL) {
+                log_warn(PROFILE_LOG, L("couldn't allocate profile %s"), name);
+                return -1;
+            }
+            s->profiles = profiles;
+            s->cap = cap;
+        }
+        np = &s->profiles[s->n++];
+        strcpy(np->name, name);
+    }
+    np->p = p;
+    return 0;
+}
+
+void profile_merge(link_profile_t *dst, const link_profile_t *src) {
+    if (src->set & PROFILE_LEVEL) dst->level = src->level;
+    if (src->set & PROFILE_RING) dst->ring_sz = src->ring_sz;
+    if (src->set & PROFILE_MAX_RING) dst->max_ring_sz = src->max_ring_sz;
+    if (src->set & PROFILE_FLUSH) dst->flush_policy = src->flush_policy;
+    if (src->set & PROFILE_LOWLAT) dst->low_lat_mode = src->low_lat_mode;
+    if (src->set & PROFILE_WEIGHT) dst->weight = src->weight;
+    if (src->set & PROFILE_PRIO) dst->prio = src->prio;
+    if (src->set & PROFILE_RATE) dst->rate_kbit = src->rate_kbit;
+    if (src->set & PROFILE_VIA) {
+        dst->via_af = src->via_af;
+        memcpy(dst->via, src->via, sizeof(dst->via));
+    }
+    if (src->set & PROFILE_SHM) memcpy(dst->shm_path, src->shm_path, sizeof(dst->shm_path));
+    dst->set |= src->set;
+}
+
+const char *profile_str(const link_profile_t *p, char *buff, size_t len) {
+    size_t off = 0;
+    buff[0] = '\0';
+#define ADD(...) if (off < len) off += snprintf(buff + off, len - off, __VA_ARGS__)
+    if (p->set & PROFILE_LEVEL) ADD(" level=%d", p->level);
+    if (p->set & PROFILE_RING) ADD(" ring=%zd", p->ring_sz);
+    if (p->set & PROFILE_MAX_RING) ADD(" max-ring=%zd", p->max_ring_sz);
+    if (p->set & PROFILE_FLUSH) ADD(" flush=%s", flush_names[p->flush_policy]);
+    if (p->set & PROFILE_LOWLAT) ADD(" lowlat=%d", p->low_lat_mode);
+    if (p->set & PROFILE_WEIGHT) ADD(" weight=%d", p->weight);
+    if (p->set & PROFILE_PRIO) ADD(" prio=%d", p->prio);
+    if (p->set & PROFILE_RATE) ADD(" rate=%" PRIu64, p->rate_kbit);
+    if (p->set & PROFILE_VIA) {
+        char via[INET6_ADDRSTRLEN];
+        ADD(" via=%s", inet_ntop(p->via_af, p->via, via, sizeof(via)) ? via : "?");
+    }
+    if (p->set & PROFILE_SHM) ADD(" shm=%s", p->shm_path);
+#undef ADD
+    if (off == 0) snprintf(buff, len, "-");
+    else memmove(buff, buff + 1, strlen(buff)); /* leading space */
+    return buff;
+}
@@ -0,0 +1,83 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* per-peer link settings from the peer file. A profile is defined on its own line and referenced from
+   peer lines (or other profiles) as @name, settings can also be given inline as key=value:
+
+       profile wan level=9 ring=4M max-ring=32M flush=batch
+       profile trading @wan lowlat=2 flush=pkt prio=6
+       10.0.0.2 192.168.10.0/24 @wan rate=20000
+
+   Later words override earlier ones. Settings not given anywhere come from the command line. */
+
+#define PROFILE_MAX_NAME 32
+
+#define PROFILE_LEVEL    0x01
+#define PROFILE_RING     0x02
+#define PROFILE_MAX_RING 0x04
+#define PROFILE_FLUSH    0x08
+#define PROFILE_LOWLAT   0x10
+#define PROFILE_WEIGHT   0x20
+#define PROFILE_PRIO     0x40
+#define PROFILE_RATE     0x80
+#define PROFILE_VIA      0x100
+#define PROFILE_SHM      0x200
+
+#define PROFILE_ADDR_LEN 16
+#define PROFILE_PATH_LEN 108 /* sun_path */
+
+struct link_profile_s {
+    unsigned set; /* PROFILE_* of the fields that were given */
+    int level; /* codec=none is NO_COMPRESSION_LEVEL */
+    ssize_t ring_sz, max_ring_sz; /* conn rings, max > initial size => adaptive */
+    int flush_policy; /* IO_FLUSH_* */
+    int low_lat_mode;
+    int weight; /* multiple of the DRR quantum for pkts from the peer waiting for tun */
+    int prio; /* SO_PRIORITY of the conn, picks the qdisc band (lane) */
+    uint64_t rate_kbit; /* SO_MAX_PACING_RATE of the conn */
+    int via_af;
+    uint8_t via[PROFILE_ADDR_LEN]; /* hub (a peer) the peer is reached through, relayed by it instead of connected to */
+    char shm_path[PROFILE_PATH_LEN]; /* co-located peer, connected to over shared memory (see shm_ring.h) at this socket */
+};
+
+typedef struct link_profile_s link_profile_t;
+
+struct named_profile_s {
+    char name[PROFILE_MAX_NAME];
+    link_profile_t p;
+};
+
+typedef struct named_profile_s named_profile_t;
+
+struct profile_set_s {
+    named_profile_t *profiles;
+    int n, cap;
+};
+
+typedef struct profile_set_s profile_set_t;
+
+void profile_set_init(profile_set_t *s);
+
+void profile_set_destroy(profile_set_t *s);
+
+/* words following "profile" on a peer-file line (modified in place). Redefining a name replaces it,
+   @references must be to profiles defined earlier. Returns -1 (and logs) on a bad line */
+int profile_define(profile_set_t *s, char *line);
+
+const link_profile_t *profile_find(const profile_set_t *s, const char *name);
+
+/* applies a peer-line word to p. Returns 1 if it was a profile word (@name or key=value), 0 if it
+   isn't one (a subnet) and -1 if it is one but is invalid (p is left alone) */
+int profile_apply_word(const profile_set_t *s, const char *word, link_profile_t *p);
+
+/* fields set in src override those in dst */
+void profile_merge(link_profile_t *dst, const link_profile_t *src);
+
+/* key=value list of fields set, "-" when none */
+const char *profile_str(const link_profile_t *p, char *buff, size_t len);
+
+#endif
@@ -0,0 +1,87 @@
+#include "reinject.h"
+#include "log.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+static int open_raw_sock(int af, uint32_t mark) {
+    int fd = socket(af, SOCK_RAW, IPPROTO_RAW); /* IPPROTO_RAW implies header-included, for both families */
+    if (fd < 0) {
+        log_warn("reinject", L("couldn't open raw socket (af: %d)"), af);
+        return -1;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) != 0) {
+        log_warn("reinject", L("couldn't set mark %u on raw socket (af: %d)"), mark, af);
+        close(fd);
+        return -1;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        log_warn("reinject", L("couldn't make raw socket non-blocking (af: %d)"), af);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int reinject_init(reinject_t *r, uint32_t mark) {
+    r->fd_v4 = r->fd_v6 = -1;
+    if ((r->fd_v4 = open_raw_sock(AF_INET, mark)) < 0) return -1;
+    if ((r->fd_v6 = open_raw_sock(AF_INET6, mark)) < 0) {
+        log_warn("reinject", L("IPv6 pkts from peers will be dropped"));
+    }
+    return 0;
+}
+
+void reinject_destroy(reinject_t *r) {
+    if (r->fd_v4 >= 0) close(r->fd_v4);
+    if (r->fd_v6 >= 0) close(r->fd_v6);
+    r->fd_v4 = r->fd_v6 = -1;
+}
+
+/* copies len bytes starting at off of the (possibly split) pkt */
+static void copy_hdr_bytes(void *dest, size_t off, size_t len, uint8_t *b1, ssize_t len1, uint8_t *b2) {
+    for (size_t i = 0; i < len; i++, off++) {
+        ((uint8_t *) dest)[i] = (off < (size_t) len1) ? b1[off] : b2[off - len1];
+    }
+}
+
+ssize_t reinject_pkt(reinject_t *r, void *b1, ssize_t len1, void *b2, ssize_t len2) {
+    union {
+        struct sockaddr_in v4;
+        struct sockaddr_in6 v6;
+    } dst;
+    memset(&dst, 0, sizeof(dst));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    int fd;
+    uint8_t ip_v = *(uint8_t *) b1 & 0xF0;
+    if (ip_v == 0x40 && len1 + len2 >= 20) {
+        dst.v4.sin_family = AF_INET;
+        copy_hdr_bytes(&dst.v4.sin_addr, 16, 4, b1, len1, b2);
+        msg.msg_namelen = sizeof(dst.v4);
+        fd = r->fd_v4;
+    } else if (ip_v == 0x60 && len1 + len2 >= 40) {
+        dst.v6.sin6_family = AF_INET6;
+        copy_hdr_bytes(&dst.v6.sin6_addr, 24, 16, b1, len1, b2);
+        msg.msg_namelen = sizeof(dst.v6);
+        fd = r->fd_v6;
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+    if (fd < 0) {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+    struct iovec iov[2] = {{.iov_base = b1, .iov_len = len1}, {.iov_base = b2, .iov_len = len2}};
+    msg.msg_name = &dst;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    return sendmsg(fd, &msg, 0);
+}
@@ -0,0 +1,24 @@
+#ifndef _REINJECT_H
+#define _REINJECT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* hands decompressed pkts back to the local stack over raw (IPPROTO_RAW, header-included) sockets,
+   used where pkts are intercepted with NFQUEUE and there is no tun device to write them to.
+   Reinjected pkts carry mark, so the NFQUEUE rule can skip them instead of looping them back. */
+
+struct reinject_s {
+    int fd_v4, fd_v6;
+};
+
+typedef struct reinject_s reinject_t;
+
+int reinject_init(reinject_t *r, uint32_t mark);
+
+void reinject_destroy(reinject_t *r);
+
+/* pkt may be split across 2 buffers (ring wrap-around), returns bytes written or -1 with errno set */
+ssize_t reinject_pkt(reinject_t *r, void *b1, ssize_t len1, void *b2, ssize_t len2);
+
+#endif
@@ -0,0 +1,102 @@
+#include "retx.h"
+#include "flow_group.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define MAX_BEHIND (1U << 30) /* further back than this isn't taken for the same stretch of seq space */
+
+static inline int32_t seq_diff(uint32_t a, uint32_t b) {
+    return (int32_t) (a - b);
+}
+
+int retx_init(retx_tab_t *t) {
+    memset(t, 0, sizeof(*t));
+    if ((t->slots = calloc(RETX_SLOTS, sizeof(retx_flow_t))) == NULL) {
+        log_crit("retx", L("couldn't allocate retransmit tracker"));
+        return -1;
+    }
+    return 0;
+}
+
+void retx_destroy(retx_tab_t *t) {
+    free(t->slots);
+    t->slots = NULL;
+}
+
+static inline uint32_t be32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+/* fills seg for a TCP segment with payload that isn't a SYN or RST, 0 if it is one */
+static int parse(const uint8_t *pkt, size_t len, retx_seg_t *seg) {
+    size_t hl, ip_len;
+    memset(seg->tuple, 0, RETX_TUPLE_SZ);
+    if (len >= 20 && (pkt[0] & 0xF0) == 0x40) {
+        hl = (pkt[0] & 0x0F) * 4;
+        ip_len = ((size_t) pkt[2] << 8) | pkt[3];
+        if (pkt[9] != IPPROTO_TCP || (((pkt[6] << 8) | pkt[7]) & 0x3FFF) != 0) return 0; /* fragments aren't looked into */
+        seg->tuple[0] = 4;
+        memcpy(seg->tuple + 1, pkt + 12, 8);
+    } else if (len >= 40 && (pkt[0] & 0xF0) == 0x60) {
+        hl = 40;
+        ip_len = 40 + (((size_t) pkt[4] << 8) | pkt[5]);
+        if (pkt[6] != IPPROTO_TCP) return 0; /* extension headers aren't walked */
+        seg->tuple[0] = 6;
+        memcpy(seg->tuple + 1, pkt + 8, 32);
+    } else {
+        return 0;
+    }
+    if (hl < 20 || ip_len > len || ip_len < hl + 20) return 0;
+    const uint8_t *tcp = pkt + hl;
+    size_t doff = (tcp[12] >> 4) * 4;
+    if (doff < 20 || ip_len < hl + doff || (tcp[13] & (TCP_SYN | TCP_RST))) return 0;
+    size_t payload = ip_len - hl - doff;
+    if (payload == 0) return 0;
+    memcpy(seg->tuple + 33, tcp, 4);
+    seg->seq = be32(tcp + 4);
+    seg->end = seg->seq + (uint32_t) payload;
+    seg->slot = flow_group_key(pkt, len) % RETX_SLOTS;
+    return 1;
+}
+
+int retx_check(retx_tab_t *t, const uint8_t *pkt, size_t len, uint64_t gen, uint64_t sent, retx_seg_t *seg) {
+    if (! (seg->valid = parse(pkt, len, seg))) return 0;
+    retx_flow_t *f = &t->slots[seg->slot];
+    if (f->gen != gen || memcmp(f->tuple, seg->tuple, RETX_TUPLE_SZ) != 0) return 0;
+    int32_t behind = seq_diff(f->end, seg->end);
+    if (behind < 0 || (uint32_t) behind > MAX_BEHIND) return 0;
+    if (sent < f->mark) {
+        t->stats.queued_pkts++;
+        t->stats.queued_bytes += len;
+        return 1;
+    }
+    if (seq_diff(seg->end, f->suppressed_to) > 0) {
+        f->suppressed_to = seg->end;
+        t->stats.sent_pkts++;
+        t->stats.sent_bytes += len;
+        return 1;
+    }
+    t->stats.passed_pkts++;
+    return 0;
+}
+
+void retx_taken(retx_tab_t *t, const retx_seg_t *seg, uint64_t gen, uint64_t mark) {
+    if (! seg->valid) return;
+    retx_flow_t *f = &t->slots[seg->slot];
+    if (f->gen != gen || memcmp(f->tuple, seg->tuple, RETX_TUPLE_SZ) != 0) {
+        memcpy(f->tuple, seg->tuple, RETX_TUPLE_SZ);
+        f->gen = gen;
+        f->end = seg->end;
+        f->suppressed_to = seg->seq;
+        f->mark = mark;
+    } else if (seq_diff(seg->end, f->end) > 0) {
+        f->end = seg->end;
+        f->mark = mark;
+        if ((uint32_t) seq_diff(f->end, f->suppressed_to) > MAX_BEHIND) f->suppressed_to = f->end - MAX_BEHIND; /* stays comparable */
+    }
+}
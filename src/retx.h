@@ -0,0 +1,68 @@
+#ifndef _RETX_H
+#define _RETX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* inner TCP retransmission suppression (opt-in). A conn is a reliable stream, whatever it took will
+   reach the peer unless the stream starts over. A TCP segment whose payload lies wholly below what its
+   flow already had taken by the same stream is a retransmission the far end needs no copy of:
+
+   - while the original is still queued in the conn (tx ring not drained past it) it is dropped,
+   - once the original went out, the first retransmission of a range is dropped and later ones are let
+     through, so a segment lost beyond the far end (its LAN) still gets there, one timeout late.
+
+   Flows are tracked in a direct-mapped table, a flow colliding with another takes its slot over (and
+   nothing of the new flow is suppressed till it sent something through the table). A stream is told
+   apart by its gen, which must change whenever the conn starts over. */
+
+#define RETX_SLOTS 4096
+#define RETX_TUPLE_SZ 37 /* version, addresses, ports */
+
+struct retx_flow_s {
+    uint8_t tuple[RETX_TUPLE_SZ];
+    uint64_t gen; /* 0 => free */
+    uint32_t end; /* seq after the last byte taken */
+    uint32_t suppressed_to; /* retransmissions ending at or below this were dropped once already */
+    uint64_t mark; /* conn's queued-byte count once the segment carrying end was taken */
+};
+
+typedef struct retx_flow_s retx_flow_t;
+
+struct retx_stats_s {
+    uint64_t queued_pkts, queued_bytes; /* dropped, original still in the conn */
+    uint64_t sent_pkts, sent_bytes; /* dropped, original already went out */
+    uint64_t passed_pkts; /* retransmissions let through */
+};
+
+typedef struct retx_stats_s retx_stats_t;
+
+struct retx_tab_s {
+    retx_flow_t *slots; /* NULL => off */
+    retx_stats_t stats;
+};
+
+typedef struct retx_tab_s retx_tab_t;
+
+/* TCP segment with payload (seq .. end) as parsed by retx_check, handed to retx_taken */
+struct retx_seg_s {
+    int valid;
+    unsigned slot;
+    uint8_t tuple[RETX_TUPLE_SZ];
+    uint32_t seq, end;
+};
+
+typedef struct retx_seg_s retx_seg_t;
+
+int retx_init(retx_tab_t *t);
+
+void retx_destroy(retx_tab_t *t);
+
+/* 1 if pkt is a retransmission to drop. sent is how many bytes the conn (stream gen) has let out so
+   far, on the scale of the mark passed to retx_taken. seg is filled for retx_taken */
+int retx_check(retx_tab_t *t, const uint8_t *pkt, size_t len, uint64_t gen, uint64_t sent, retx_seg_t *seg);
+
+/* the conn took seg's pkt, its bytes are out once sent reaches mark */
+void retx_taken(retx_tab_t *t, const retx_seg_t *seg, uint64_t gen, uint64_t mark);
+
+#endif
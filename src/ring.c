@@ -0,0 +1,232 @@
+#include "ring.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+int init_backlog_ring(ring_buff_t *rbuff, size_t sz, int resizable, size_t max_allowed_sz) {
+    if (NULL == (rbuff->buff = malloc(sz))) {
+        return -1;
+    }
+    rbuff->sz = sz;
+    rbuff->start = rbuff->end = 0;
+    rbuff->wraped = 0;
+	rbuff->resizable = resizable;
+	rbuff->max = max_allowed_sz;
+    DBG("ring", L("backlog ring: %p { sz=%zd, start=%zd, end=%zd, wrapped=%d, resizable=%d, max_sz=%zd } initialized"), rbuff, rbuff->sz, rbuff->start, rbuff->end, rbuff->wraped, rbuff->resizable, rbuff->max);
+    return 0;
+}
+
+void destroy_ring_buff(ring_buff_t *ring) {
+    DBG("ring", L("destroying ring: %p { sz=%zd, start=%zd, end=%zd, wrapped=%d }"), ring, ring->sz, ring->start, ring->end, ring->wraped);
+    free(ring->buff);
+}
+
+#define EXPANSION_FACTOR 2
+
+int expand_ring_buffer(ring_buff_t *rbuff) {
+	assert(rbuff->resizable);
+	
+	ssize_t new_sz = rbuff->sz * EXPANSION_FACTOR;
+	if (new_sz > rbuff->max) {
+		new_sz = rbuff->max;
+	}
+	assert(rbuff->sz != new_sz);
+
+	log_warn("ring", L("expanding backlog ring: %p { sz=%zd, start=%zd, end=%zd, wrapped=%d, resizable=%d, max_sz=%zd } to %zd bytes"), rbuff, rbuff->sz, rbuff->start, rbuff->end, rbuff->wraped, rbuff->resizable, rbuff->max, new_sz);
+	
+	void *buff = malloc(new_sz);
+	if (buff == NULL) {
+		log_crit("ring", L("allocation for backlog ring expansion failed for: %p"), rbuff);
+		return -1;
+	}
+	
+	ssize_t copied_sz;
+	if (rbuff->wraped) {
+		memcpy(buff, rbuff->buff + rbuff->start, rbuff->sz - rbuff->start);
+		memcpy(buff + rbuff->sz - rbuff->start, rbuff->buff, rbuff->end);
+		copied_sz = rbuff->sz - rbuff->start + rbuff->end;
+	} else {
+		memcpy(buff, rbuff->buff + rbuff->start, rbuff->end - rbuff->start);
+		copied_sz = rbuff->end - rbuff->start;
+	}
+	free(rbuff->buff);
+	
+	rbuff->buff = buff;
+	rbuff->sz = new_sz;
+	rbuff->start = 0;
+	rbuff->end = copied_sz;
+	rbuff->wraped = 0;
+	rbuff->resizable = ((new_sz * EXPANSION_FACTOR) <= rbuff->max);
+
+	log_info("ring", L("expanded backlog ring: %p { sz=%zd, start=%zd, end=%zd, wrapped=%d, resizable=%d, max_sz=%zd }"), rbuff, rbuff->sz, rbuff->start, rbuff->end, rbuff->wraped, rbuff->resizable, rbuff->max);
+
+	return 0;
+}
+
+int drain_ring(int fd, ring_buff_t *r, io_handler_fn_t *io_hdlr, void *hdlr_ctx) {
+    DBG("ring", L("fd %d, "BUFF_STATE_FORAMT_STR", io_hdlr: %p, ctx: %p"), fd, BUFF_STATE_VARS(r), io_hdlr, hdlr_ctx);
+
+    int ret = CONN_IO_OK;
+    do {
+        if (r->wraped) {
+            DBG("ring", L("wrapped"));
+            if (r->sz == r->start) {
+                DBG("ring", L("resetting start as tail drained out"));
+                r->start = 0;
+                r->wraped = 0;
+                continue;
+            }
+            ssize_t len = r->sz - r->start;
+            ssize_t additional_len = r->end;
+            DBG("ring", L("calling io-hdlr while wrapped, space-advertized %zd, additional %zd, buff-start-offset: %zd (buff_base: %p) "BUFF_STATE_FORAMT_STR), len, additional_len, (ssize_t) r->buff + r->start, r->buff, BUFF_STATE_VARS(r));
+            ret = io_hdlr(fd, r->buff + r->start, len, &r->start, hdlr_ctx, additional_len);
+            DBG("ring", L("after io-hdlr call(ret: %d): "BUFF_STATE_FORAMT_STR), ret, BUFF_STATE_VARS(r));
+        } else {
+            DBG("ring", L("NOT wrapped"));
+            if (r->end == r->start) {
+                DBG("ring", L("ring is empty, breaking"));
+                break;
+            }
+            ssize_t len = r->end - r->start;
+            ssize_t additional_len = 0;
+            DBG("ring", L("calling io-hdlr while wrapped, space-advertized %zd, additional %zd, buff-start-offset: %zd (buff_base: %p)"BUFF_STATE_FORAMT_STR), len, additional_len, (ssize_t) r->buff + r->start, r->buff, BUFF_STATE_VARS(r));
+            ret = io_hdlr(fd, r->buff + r->start, len, &r->start, hdlr_ctx, additional_len);
+            DBG("ring", L("after io-hdlr call(ret: %d): "BUFF_STATE_FORAMT_STR), ret, BUFF_STATE_VARS(r));
+        }
+        DBG("ring", L("ret: %d, ring: %p { sz=%zd, start=%zd, end=%zd, wrapped=%d }"), ret, r, r->sz, r->start, r->end, r->wraped);
+    } while(CONN_IO_OK == ret);
+    return ret;
+}
+
+int fill_ring(int fd, ring_buff_t *r, io_handler_fn_t *io_hdlr, data_push_fn_t *data_pusher, void *hdlr_ctx) {
+    DBG("ring", L("fd %d, "BUFF_STATE_FORAMT_STR", io_hdlr: %p, data_pusher: %p, ctx: %p"), fd, BUFF_STATE_VARS(r), io_hdlr, data_pusher, hdlr_ctx);
+    int ret = CONN_IO_OK;
+    int full = 0;
+    do {
+        if (r->wraped) {
+            DBG("ring", L("wrapped"));
+            if (r->start == r->end) {
+                DBG("ring", L("Buffer full, not calling io-handler"));
+                full = 1;
+            } else {
+                DBG("ring", L("before io-hdlr call "BUFF_STATE_FORAMT_STR), BUFF_STATE_VARS(r));
+                ret = io_hdlr(fd, r->buff + r->end, r->start - r->end, &r->end, hdlr_ctx, 0);
+                DBG("ring", L("after io-hdlr call(ret: %d) "BUFF_STATE_FORAMT_STR), ret, BUFF_STATE_VARS(r));
+            }
+        } else {
+            if (r->sz == r->end) {
+                DBG("ring", L("Fill-area reached end-of-buffer, wrapping"));
+                r->end = 0;
+                r->wraped = 1;
+                continue;
+            }
+            DBG("ring", L("before io-hdlr call "BUFF_STATE_FORAMT_STR), BUFF_STATE_VARS(r));
+            ret = io_hdlr(fd, r->buff + r->end, r->sz - r->end, &r->end, hdlr_ctx, r->start);
+            DBG("ring", L("after io-hdlr call(ret: %d) "BUFF_STATE_FORAMT_STR), ret, BUFF_STATE_VARS(r));
+        }
+		if ((ret == CONN_IO_OK_NOT_ENOUGH_SPACE) && r->resizable) {
+			DBG("ring", L("attempting ring-buffer expansion "BUFF_STATE_FORAMT_STR), BUFF_STATE_VARS(r));
+			if (expand_ring_buffer(r) == 0)	{
+				ret = CONN_IO_OK;
+				continue;
+			}
+		}
+        /* try to push data, fakers like write-to-tun don't provide this, hence nullable */
+        if (data_pusher != NULL) {
+            if (r->wraped) {
+                ssize_t len1 = r->sz - r->start;
+                ssize_t len2 = r->end;
+                int called = 0;
+                ssize_t moved = 0;
+                if ((len1 + len2) > 0) {
+                    if (len1 == 0) {
+                        moved = data_pusher(r->buff, len2, NULL, 0, hdlr_ctx);
+                    } else {
+                        moved = data_pusher(r->buff + r->start, len1, r->buff, len2, hdlr_ctx);
+                    }
+                    called = 1;
+                    if (moved > 0) {
+                        full = 0;
+                        if (moved > len1) {
+                            r->start = moved - len1;
+                            r->wraped = 0;
+                        } else {
+                            r->start += moved;
+                        }
+                    }
+                }
+                DBG("ring", L("data-pusher called(%d) (with wrapped buff) with len1: %zd and len2: %zd and moved: %zd "BUFF_STATE_FORAMT_STR), called, len1, len2, moved, BUFF_STATE_VARS(r));
+            } else {
+                ssize_t len1 = r->end - r->start;
+                ssize_t moved = 0;
+                int called = 0;
+                if (len1 > 0) {
+                    called = 1;
+                    moved = data_pusher(r->buff + r->start, len1, NULL, 0, hdlr_ctx);
+                }
+                if (moved > 0) {
+                    full = 0;
+                    r->start += moved;
+                }
+                DBG("ring", L("data-pusher called(%d) with len1: %zd and moved: %zd "BUFF_STATE_FORAMT_STR), called, len1, moved, BUFF_STATE_VARS(r));
+            }
+        }
+        if (full) { /* nothing could be pushed out, would spin otherwise */
+            DBG("ring", L("Buffer full and nothing moved, giving up "BUFF_STATE_FORAMT_STR), BUFF_STATE_VARS(r));
+            ret = CONN_IO_OK_NOT_ENOUGH_SPACE;
+            break;
+        }
+    } while((CONN_IO_OK == ret) || full);
+    DBG("ring", L("return: %d"), ret);
+    return ret;
+}
+
+void ring_peek(ring_buff_t *r, void **b1, ssize_t *len1, void **b2, ssize_t *len2) {
+    *b2 = NULL;
+    *len2 = 0;
+    if (! r->wraped) {
+        *b1 = r->buff + r->start;
+        *len1 = r->end - r->start;
+    } else if (r->start == r->sz) { /* tail drained, only the wrapped part is left */
+        *b1 = r->buff;
+        *len1 = r->end;
+    } else {
+        *b1 = r->buff + r->start;
+        *len1 = r->sz - r->start;
+        *b2 = r->buff;
+        *len2 = r->end;
+    }
+}
+
+void ring_consume(ring_buff_t *r, ssize_t len) {
+    assert(len <= ring_used(r));
+    if (r->wraped && len >= (r->sz - r->start)) {
+        r->start = len - (r->sz - r->start);
+        r->wraped = 0;
+    } else {
+        r->start += len;
+    }
+    if (ring_empty(r)) r->start = r->end = 0; /* keeps pkts contiguous for longer */
+}
+
+int ring_load(ring_buff_t *r, const void *data, ssize_t len) {
+    if (len > r->sz) {
+        void *buff = malloc(len);
+        if (buff == NULL) {
+            log_crit("ring", L("couldn't allocate %zd bytes to load ring: %p"), len, r);
+            return -1;
+        }
+        free(r->buff);
+        r->buff = buff;
+        r->sz = len;
+        if (r->max < len) r->max = len;
+        r->resizable = r->resizable && ((len * EXPANSION_FACTOR) <= r->max);
+    }
+    memcpy(r->buff, data, len);
+    r->start = 0;
+    r->end = len;
+    r->wraped = 0;
+    return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef _RING_H
+#define _RING_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <sys/types.h>
+
+/* byte ring used for tx/rx backlogs (behind connections and tun) */
+
+typedef struct ring_buff_s ring_buff_t;
+
+struct ring_buff_s {
+    void *buff;
+    ssize_t sz, start, end, max;
+    int wraped;
+	int resizable;
+};
+
+#define CONN_IO_OK 0
+#define CONN_IO_OK_EXHAUSTED 1
+#define CONN_KILL -1
+#define CONN_UNKNOWN_ERR -2
+#define CONN_IO_OK_NOT_ENOUGH_SPACE -3
+#define CONN_OTHER_TRANSIENT_ERRORS -4
+
+/* additional_len identifies additional-capacity available due to ring-buff wrap-around
+   this is important for writes requiring atomicity semantics (its only a pessimistic promise
+   for future io-handler call and should not be used immediately) */
+typedef int (io_handler_fn_t)(int fd, void *buff, ssize_t len, ssize_t *tracker, void *hdlr_ctx, ssize_t additional_len);
+
+#define BUFF_STATE_FORAMT_STR "ring: %p { sz=%zd, start=%zd, end=%zd, wrapped=%d }"
+
+#define BUFF_STATE_VARS(r)                      \
+    r, r->sz, r->start, r->end, r->wraped
+
+typedef ssize_t (data_push_fn_t)(void *b1, ssize_t len1, void *b2, ssize_t len2, void *hdlr_ctx);
+
+int init_backlog_ring(ring_buff_t *rbuff, size_t sz, int resizable, size_t max_allowed_sz);
+
+void destroy_ring_buff(ring_buff_t *ring);
+
+int expand_ring_buffer(ring_buff_t *rbuff);
+
+int drain_ring(int fd, ring_buff_t *r, io_handler_fn_t *io_hdlr, void *hdlr_ctx);
+
+int fill_ring(int fd, ring_buff_t *r, io_handler_fn_t *io_hdlr, data_push_fn_t *data_pusher, void *hdlr_ctx);
+
+static inline int ring_empty(ring_buff_t *r) {
+    return (! r->wraped) && (r->start == r->end);
+}
+
+static inline ssize_t ring_used(ring_buff_t *r) {
+    return r->wraped ? (r->sz - r->start + r->end) : (r->end - r->start);
+}
+
+/* regions holding data (oldest first), b2 is used only when data wraps around the end of ring */
+void ring_peek(ring_buff_t *r, void **b1, ssize_t *len1, void **b2, ssize_t *len2);
+
+/* drops len bytes from the start (len must not exceed ring_used) */
+void ring_consume(ring_buff_t *r, ssize_t len);
+
+/* replaces what the ring holds with len bytes of data (oldest first), a ring too small for them is
+   given a bigger buffer. Returns -1 if that can't be allocated */
+int ring_load(ring_buff_t *r, const void *data, ssize_t len);
+
+#endif
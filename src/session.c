@@ -0,0 +1,124 @@
+#include "session.h"
+#include "log.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SESSION_LOG "session"
+
+static uint64_t new_id() {
+    uint64_t id = 0;
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || read(fd, &id, sizeof(id)) != sizeof(id)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        id = ((uint64_t) ts.tv_sec << 32) ^ ts.tv_nsec ^ ((uint64_t) getpid() << 16);
+    }
+    if (fd >= 0) close(fd);
+    return id;
+}
+
+int session_init(session_t *s, size_t retx_sz) {
+    memset(s, 0, sizeof(*s));
+    if ((s->retx = malloc(retx_sz)) == NULL) {
+        log_crit(SESSION_LOG, L("couldn't allocate %zu bytes of retransmit buffer"), retx_sz);
+        return -1;
+    }
+    s->retx_sz = retx_sz;
+    s->id = new_id();
+    return 0;
+}
+
+void session_destroy(session_t *s) {
+    free(s->retx);
+    s->retx = NULL;
+}
+
+void session_reset(session_t *s, uint64_t id) {
+    s->id = id;
+    s->rx_seq = s->tx_seq = s->tx_lo = 0;
+}
+
+void session_sent(session_t *s, const void *data, size_t len) {
+    const uint8_t *d = (const uint8_t *) data;
+    if (len > s->retx_sz) { /* only the tail can be retained */
+        s->tx_seq += len - s->retx_sz;
+        d += len - s->retx_sz;
+        len = s->retx_sz;
+    }
+    size_t off = s->tx_seq % s->retx_sz;
+    size_t first = (len < s->retx_sz - off) ? len : (s->retx_sz - off);
+    memcpy(s->retx + off, d, first);
+    memcpy(s->retx, d + first, len - first);
+    s->tx_seq += len;
+    if (s->tx_seq - s->tx_lo > s->retx_sz) s->tx_lo = s->tx_seq - s->retx_sz;
+}
+
+int session_can_resume(const session_t *s, const session_hello_t *peer) {
+    return peer->id == s->id && session_can_replay(s, peer->rx_seq) &&
+        peer->tx_lo <= s->rx_seq && s->rx_seq <= peer->tx_seq;
+}
+
+size_t session_copy(const session_t *s, uint64_t seq, void *out) {
+    assert(session_can_replay(s, seq));
+    size_t len = s->tx_seq - seq;
+    size_t off = seq % s->retx_sz;
+    size_t first = (len < s->retx_sz - off) ? len : (s->retx_sz - off);
+    memcpy(out, s->retx + off, first);
+    memcpy((uint8_t *) out + first, s->retx, len - first);
+    return len;
+}
+
+size_t session_replay(session_t *s, uint64_t seq, void *out) {
+    size_t len = session_copy(s, seq, out);
+    s->tx_seq = seq;
+    return len;
+}
+
+int session_restore(session_t *s, uint64_t id, uint64_t rx_seq, uint64_t tx_seq, const void *retx, size_t len) {
+    if (len > s->retx_sz || len > tx_seq) {
+        log_warnx(SESSION_LOG, L("%zu bytes of retained stream don't fit (retransmit buffer: %zu, sent: %llu)"), len, s->retx_sz, (unsigned long long) tx_seq);
+        return -1;
+    }
+    session_reset(s, id);
+    s->tx_seq = s->tx_lo = tx_seq - len;
+    session_sent(s, retx, len);
+    s->tx_lo = tx_seq - len;
+    s->rx_seq = rx_seq;
+    return 0;
+}
+
+static void put_be(uint8_t *b, int n, uint64_t v) {
+    for (int i = n - 1; i >= 0; i--, v >>= 8) b[i] = (uint8_t) v;
+}
+
+static uint64_t get_be(const uint8_t *b, int n) {
+    uint64_t v = 0;
+    for (int i = 0; i < n; i++) v = (v << 8) | b[i];
+    return v;
+}
+
+void session_hello_encode(const session_t *s, int flags, uint8_t *out) {
+    memset(out, 0, SESSION_HELLO_SZ);
+    put_be(out, 4, SESSION_MAGIC);
+    out[4] = SESSION_VERSION;
+    out[5] = (uint8_t) flags;
+    put_be(out + 8, 8, s->id);
+    put_be(out + 16, 8, s->rx_seq);
+    put_be(out + 24, 8, s->tx_seq);
+    put_be(out + 32, 8, s->tx_lo);
+}
+
+int session_hello_decode(const uint8_t *in, session_hello_t *h) {
+    if (get_be(in, 4) != SESSION_MAGIC || in[4] != SESSION_VERSION) return -1;
+    h->flags = in[5];
+    h->id = get_be(in + 8, 8);
+    h->rx_seq = get_be(in + 16, 8);
+    h->tx_seq = get_be(in + 24, 8);
+    h->tx_lo = get_be(in + 32, 8);
+    return (h->tx_lo <= h->tx_seq) ? 0 : -1;
+}
@@ -0,0 +1,85 @@
+#ifndef _SESSION_H
+#define _SESSION_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* resumable conn stream (opt-in, both peers must have it on). Each side counts the stream bytes it sent
+   and received, and keeps the last SESSION_RETX_SZ bytes it sent. A conn opens with a hello each way:
+
+       | magic (4) | version (1) | flags (1) | reserved (2) | session-id (8) | rx-seq (8) | tx-seq (8) | tx-lo (8) |
+
+   (big-endian). The connecting side's hello names the session it wants resumed (a fresh id for a new one)
+   and only once the answer is in does anything else go out. The accepting side answers SESSION_RESUMED
+   when it holds that session and each side can replay what the other is missing (tx-lo .. tx-seq is what
+   the sender still has). Both then send the bytes after the other's rx-seq and carry on with their
+   compressor and decompressor as they were, as if the conn never broke. Otherwise both start a new stream
+   under the connecting side's id. */
+
+#define SESSION_MAGIC 0x4c335453 /* "L3TS" */
+#define SESSION_VERSION 1
+#define SESSION_HELLO_SZ 40
+#define SESSION_RESUMED 0x1
+#define SESSION_RETX_SZ (8 * 1024 * 1024)
+
+struct session_hello_s {
+    int flags;
+    uint64_t id, rx_seq, tx_seq, tx_lo;
+};
+
+typedef struct session_hello_s session_hello_t;
+
+struct session_s {
+    uint64_t id;
+    uint64_t rx_seq; /* stream bytes received */
+    uint64_t tx_seq; /* stream bytes handed to the socket */
+    uint64_t tx_lo; /* oldest of them still in retx */
+    uint8_t *retx; /* byte n of the stream at n % retx_sz */
+    size_t retx_sz;
+    uint8_t hello[SESSION_HELLO_SZ]; /* peer's, as it arrives */
+    int hello_len;
+};
+
+typedef struct session_s session_t;
+
+/* new session with a random id */
+int session_init(session_t *s, size_t retx_sz);
+
+void session_destroy(session_t *s);
+
+/* new stream under id, counters start over and nothing is retained */
+void session_reset(session_t *s, uint64_t id);
+
+void session_sent(session_t *s, const void *data, size_t len);
+
+static inline void session_rcvd(session_t *s, size_t len) {
+    s->rx_seq += len;
+}
+
+/* the stream from seq on is still retained (seq can't be ahead of what was sent) */
+static inline int session_can_replay(const session_t *s, uint64_t seq) {
+    return s->tx_lo <= seq && seq <= s->tx_seq;
+}
+
+/* both sides have what the other one is missing (accepting side, for the connecting side's hello) */
+int session_can_resume(const session_t *s, const session_hello_t *peer);
+
+/* copies the retained stream from seq on to out (session_can_replay must hold), returns the number of bytes */
+size_t session_copy(const session_t *s, uint64_t seq, void *out);
+
+/* session_copy, and tx-seq is rewound to seq so the bytes are counted again as they go out */
+size_t session_replay(session_t *s, uint64_t seq, void *out);
+
+/* state carried over from another process (hot upgrade), retx holds the len bytes sent before tx_seq */
+int session_restore(session_t *s, uint64_t id, uint64_t rx_seq, uint64_t tx_seq, const void *retx, size_t len);
+
+void session_hello_encode(const session_t *s, int flags, uint8_t *out);
+
+/* -1 if in isn't a hello of a version we speak */
+int session_hello_decode(const uint8_t *in, session_hello_t *h);
+
+#endif
@@ -0,0 +1,279 @@
+#include "shm_ring.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define SHM_LOG "shm"
+#define SHM_HDR_SPACE 4096 /* both ring headers, data starts page aligned */
+#define SHM_FDS 3 /* memfd, doorbell of the connecting side, doorbell of the accepting side */
+#define SHM_SEALS (F_SEAL_SHRINK | F_SEAL_GROW) /* neither side can pull pages from under the other's mapping */
+
+static int shm_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        log_crit(SHM_LOG, L("shm socket path too long: %s"), path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int shm_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (shm_addr(path, &addr) != 0) return -1;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) {
+        log_crit(SHM_LOG, L("couldn't create shm socket"));
+        return -1;
+    }
+    if (unlink(path) != 0 && errno != ENOENT) {
+        log_warn(SHM_LOG, L("couldn't remove stale shm socket %s"), path);
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        log_crit(SHM_LOG, L("couldn't bind shm socket to %s"), path);
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, 16) != 0) {
+        log_crit(SHM_LOG, L("couldn't listen on shm socket %s"), path);
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+/* side 0 connected, side 1 accepted */
+static int map_chan(shm_chan_t *c, int mem_fd, size_t ring_sz, int side, int *bells) {
+    c->sz = ring_sz;
+    c->map_sz = SHM_HDR_SPACE + 2 * ring_sz;
+    c->map = mmap(NULL, c->map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    if (c->map == MAP_FAILED) {
+        log_crit(SHM_LOG, L("couldn't map %zu bytes of shm rings"), c->map_sz);
+        c->map = NULL;
+        return -1;
+    }
+    shm_ring_hdr_t *h[2] = {(shm_ring_hdr_t *) c->map, (shm_ring_hdr_t *) (c->map + SHM_HDR_SPACE / 2)};
+    uint8_t *d[2] = {c->map + SHM_HDR_SPACE, c->map + SHM_HDR_SPACE + ring_sz};
+    c->tx = h[side];
+    c->tx_data = d[side];
+    c->rx = h[! side];
+    c->rx_data = d[! side];
+    c->bell_fd = bells[side];
+    c->peer_bell_fd = bells[! side];
+    c->rung = 0;
+    return 0;
+}
+
+static size_t ring_sz_for(size_t want) {
+    size_t sz = SHM_MIN_RING_SZ;
+    while (sz < want && sz < SHM_MAX_RING_SZ) sz <<= 1;
+    return sz;
+}
+
+static int send_offer(int sock, const shm_hello_t *hello, const int *fds) {
+    union {
+        struct cmsghdr align;
+        char buff[CMSG_SPACE(SHM_FDS * sizeof(int))];
+    } ctl;
+    struct iovec iov = {.iov_base = (void *) hello, .iov_len = sizeof(*hello)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctl, 0, sizeof(ctl));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buff;
+    msg.msg_controllen = sizeof(ctl.buff);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(SHM_FDS * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, SHM_FDS * sizeof(int));
+    ssize_t sent;
+    while ((sent = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    if (sent != (ssize_t) sizeof(*hello)) {
+        log_warn(SHM_LOG, L("couldn't offer shm channel"));
+        return -1;
+    }
+    return 0;
+}
+
+int shm_connect(const char *path, size_t ring_sz, const shm_hello_t *hello, shm_chan_t *c) {
+    struct sockaddr_un addr;
+    int fds[SHM_FDS] = {-1, -1, -1};
+    shm_hello_t h = *hello;
+    memset(c, 0, sizeof(*c));
+    c->bell_fd = c->peer_bell_fd = -1;
+    if (shm_addr(path, &addr) != 0) return -1;
+    h.version = SHM_VERSION;
+    h.ring_sz = ring_sz_for(ring_sz);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        log_warn(SHM_LOG, L("couldn't create shm socket"));
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        log_warn(SHM_LOG, L("couldn't connect to shm socket %s"), path);
+        goto fail;
+    }
+    if ((fds[0] = memfd_create("l3tc-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0 || ftruncate(fds[0], SHM_HDR_SPACE + 2 * h.ring_sz) != 0 ||
+        fcntl(fds[0], F_ADD_SEALS, SHM_SEALS | F_SEAL_SEAL) != 0) {
+        log_warn(SHM_LOG, L("couldn't create %llu bytes of shm rings"), (unsigned long long) (SHM_HDR_SPACE + 2 * h.ring_sz));
+        goto fail;
+    }
+    if ((fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 || (fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        log_warn(SHM_LOG, L("couldn't create shm doorbells"));
+        goto fail;
+    }
+    if (map_chan(c, fds[0], h.ring_sz, 0, fds + 1) != 0) goto fail;
+    c->tx->rd_wait = c->rx->rd_wait = 1; /* neither reader has looked yet, first write wakes it */
+    if (send_offer(sock, &h, fds) != 0) goto fail;
+    close(fds[0]); /* mapping keeps it */
+    return sock;
+
+ fail:
+    if (c->map != NULL) munmap(c->map, c->map_sz);
+    for (int i = 0; i < SHM_FDS; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    close(sock);
+    memset(c, 0, sizeof(*c));
+    c->bell_fd = c->peer_bell_fd = -1;
+    return -1;
+}
+
+int shm_accept(int sock, shm_hello_t *hello, shm_chan_t *c) {
+    union {
+        struct cmsghdr align;
+        char buff[CMSG_SPACE(SHM_FDS * sizeof(int))];
+    } ctl;
+    int fds[SHM_FDS] = {-1, -1, -1};
+    struct iovec iov = {.iov_base = hello, .iov_len = sizeof(*hello)};
+    struct msghdr msg;
+    struct stat st;
+    memset(c, 0, sizeof(*c));
+    c->bell_fd = c->peer_bell_fd = -1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buff;
+    msg.msg_controllen = sizeof(ctl.buff);
+    ssize_t rcvd;
+    while ((rcvd = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    if (rcvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); rcvd > 0 && cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS && cm->cmsg_len == CMSG_LEN(SHM_FDS * sizeof(int))) {
+            memcpy(fds, CMSG_DATA(cm), SHM_FDS * sizeof(int));
+        }
+    }
+    if (rcvd != (ssize_t) sizeof(*hello) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || fds[2] < 0) {
+        log_warnx(SHM_LOG, L("bad shm channel offer"));
+        goto fail;
+    }
+    size_t sz = hello->ring_sz;
+    if (hello->version != SHM_VERSION || sz < SHM_MIN_RING_SZ || sz > SHM_MAX_RING_SZ || (sz & (sz - 1)) != 0) {
+        log_warnx(SHM_LOG, L("shm channel offer v%u with %llu byte rings isn't usable"), hello->version, (unsigned long long) hello->ring_sz);
+        goto fail;
+    }
+    int seals = fcntl(fds[0], F_GET_SEALS);
+    if (seals == -1 || (seals & SHM_SEALS) != SHM_SEALS) {
+        log_warnx(SHM_LOG, L("shm rings aren't sealed against resizing"));
+        goto fail;
+    }
+    if (fstat(fds[0], &st) != 0 || st.st_size != (off_t) (SHM_HDR_SPACE + 2 * sz)) {
+        log_warnx(SHM_LOG, L("shm rings aren't the size offered"));
+        goto fail;
+    }
+    if (map_chan(c, fds[0], sz, 1, fds + 1) != 0) goto fail;
+    close(fds[0]);
+    return 0;
+
+ fail:
+    for (int i = 0; i < SHM_FDS; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    memset(c, 0, sizeof(*c));
+    c->bell_fd = c->peer_bell_fd = -1;
+    return -1;
+}
+
+void shm_chan_destroy(shm_chan_t *c) {
+    if (c->map != NULL) munmap(c->map, c->map_sz);
+    if (c->bell_fd >= 0) close(c->bell_fd);
+    if (c->peer_bell_fd >= 0) close(c->peer_bell_fd);
+    memset(c, 0, sizeof(*c));
+    c->bell_fd = c->peer_bell_fd = -1;
+}
+
+static void ring_peer(shm_chan_t *c) {
+    uint64_t one = 1;
+    if (write(c->peer_bell_fd, &one, sizeof(one)) == sizeof(one)) c->rung++; /* EAGAIN => counter is maxed out, it is rung regardless */
+}
+
+/* the other side said it waits (flag is set), flag goes back to 0 with the wakeup. The store of the
+   position that was moved and this load are both seq-cst, as are the other side's store of the flag and
+   its re-check of the position, so one of the two sides always sees the other's move */
+static void wake_waiter(shm_chan_t *c, uint32_t *flag) {
+    if (__atomic_load_n(flag, __ATOMIC_SEQ_CST) && __atomic_exchange_n(flag, 0, __ATOMIC_SEQ_CST)) ring_peer(c);
+}
+
+ssize_t shm_write(shm_chan_t *c, const void *buff, size_t len) {
+    shm_ring_hdr_t *r = c->tx;
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    uint64_t used = tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (used > c->sz) return -1;
+    if (used == c->sz) {
+        __atomic_store_n(&r->wr_wait, 1, __ATOMIC_SEQ_CST);
+        used = tail - __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+        if (used >= c->sz) return (used == c->sz) ? 0 : -1;
+    }
+    size_t n = (len < c->sz - used) ? len : c->sz - used;
+    size_t off = tail & (c->sz - 1);
+    size_t first = (n < c->sz - off) ? n : c->sz - off;
+    memcpy(c->tx_data + off, buff, first);
+    memcpy(c->tx_data, (const uint8_t *) buff + first, n - first);
+    __atomic_store_n(&r->tail, tail + n, __ATOMIC_SEQ_CST);
+    wake_waiter(c, &r->rd_wait);
+    return n;
+}
+
+ssize_t shm_read(shm_chan_t *c, void *buff, size_t len) {
+    shm_ring_hdr_t *r = c->rx;
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    uint64_t avail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+    if (avail > c->sz) return -1;
+    if (avail == 0) {
+        __atomic_store_n(&r->rd_wait, 1, __ATOMIC_SEQ_CST);
+        avail = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) - head;
+        if (avail == 0) return 0;
+        if (avail > c->sz) return -1;
+    }
+    size_t n = (len < avail) ? len : avail;
+    size_t off = head & (c->sz - 1);
+    size_t first = (n < c->sz - off) ? n : c->sz - off;
+    memcpy(buff, c->rx_data + off, first);
+    memcpy((uint8_t *) buff + first, c->rx_data, n - first);
+    __atomic_store_n(&r->head, head + n, __ATOMIC_SEQ_CST);
+    wake_waiter(c, &r->wr_wait);
+    return n;
+}
+
+void shm_clear_bell(shm_chan_t *c) {
+    uint64_t n;
+    while (read(c->bell_fd, &n, sizeof(n)) < 0 && errno == EINTR);
+}
+
+size_t shm_tx_used(shm_chan_t *c) {
+    return __atomic_load_n(&c->tx->tail, __ATOMIC_RELAXED) - __atomic_load_n(&c->tx->head, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,89 @@
+#ifndef _SHM_RING_H
+#define _SHM_RING_H
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* byte stream between two processes on one host over shared memory, in place of a loopback TCP conn.
+   A channel is a pair of single-producer single-consumer rings (one each way) in a memfd and one eventfd
+   doorbell per side, so data is copied straight from one process's ring into the other's.
+
+   A side only rings the other's doorbell when that one said it is waiting: its reader found the ring
+   empty or its writer found it full. Either way, one wakeup of a side means "look at both rings". A new
+   channel starts with both readers waiting.
+
+   The connecting side creates the channel (its memfd sealed against shrinking and growing) and passes its
+   fds over a UNIX seqpacket socket along with a hello, the socket stays open for the life of the channel
+   (its peer end closing => the other side is gone). */
+
+#define SHM_VERSION 1
+#define SHM_MIN_RING_SZ (64 * 1024)
+#define SHM_MAX_RING_SZ (256 * 1024 * 1024)
+
+/* one direction, in shared memory. Positions only grow, producer and consumer have a cache line each */
+struct shm_ring_hdr_s {
+    uint64_t head; /* consumer, read upto */
+    uint8_t pad0[56];
+    uint64_t tail; /* producer, written upto */
+    uint8_t pad1[56];
+    uint32_t rd_wait; /* consumer found it empty, producer rings once it writes */
+    uint32_t wr_wait; /* producer found it full, consumer rings once it frees space */
+    uint8_t pad2[56];
+};
+
+typedef struct shm_ring_hdr_s shm_ring_hdr_t;
+
+struct shm_hello_s {
+    uint32_t version;
+    int32_t af;
+    uint8_t addr[16]; /* of the connecting side */
+    uint64_t ring_sz;
+};
+
+typedef struct shm_hello_s shm_hello_t;
+
+struct shm_chan_s {
+    uint8_t *map;
+    size_t map_sz;
+    shm_ring_hdr_t *tx, *rx;
+    uint8_t *tx_data, *rx_data;
+    size_t sz; /* of each ring, a power of 2 */
+    int bell_fd; /* rung by the other side, it is what to poll */
+    int peer_bell_fd;
+    uint64_t rung; /* times the other side was woken */
+};
+
+typedef struct shm_chan_s shm_chan_t;
+
+/* bound and listening, a stale socket file at path is replaced. Returns fd, -1 on failure */
+int shm_listen(const char *path);
+
+/* connects to path and offers a new channel with rings of (at least) ring_sz bytes. Returns the
+   connected socket, -1 on failure */
+int shm_connect(const char *path, size_t ring_sz, const shm_hello_t *hello, shm_chan_t *c);
+
+/* takes the channel offered on an accepted socket, the memfd must be sealed against resizing. Returns 0 on
+   success, 1 if nothing was offered yet (non-blocking sock), -1 on failure */
+int shm_accept(int sock, shm_hello_t *hello, shm_chan_t *c);
+
+/* unmaps and closes both doorbells */
+void shm_chan_destroy(shm_chan_t *c);
+
+/* bytes taken (upto len), 0 => ring is full (the other side rings once it frees space), -1 => ring is
+   corrupt */
+ssize_t shm_write(shm_chan_t *c, const void *buff, size_t len);
+
+/* bytes read (upto len), 0 => ring is empty (the other side rings once it writes), -1 => ring is corrupt */
+ssize_t shm_read(shm_chan_t *c, void *buff, size_t len);
+
+/* once woken, before looking at the rings */
+void shm_clear_bell(shm_chan_t *c);
+
+size_t shm_tx_used(shm_chan_t *c);
+
+#endif
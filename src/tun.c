@@ -29,7 +29,19 @@ static inline int run_routeup_script(const char *if_name, const char *ipset_name
     return system(tun_up_cmd);
 }
 
-int alloc_tun(const char *tun_up_cmd, const char *ipset_name) {
+static int set_mtu(const char *if_name, int mtu) {
+    struct ifreq ifr;
+    int ret, sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) return -1;
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, IFNAMSIZ, "%s", if_name);
+    ifr.ifr_mtu = mtu;
+    ret = ioctl(sock, SIOCSIFMTU, &ifr);
+    close(sock);
+    return ret;
+}
+
+int alloc_tun(const char *tun_up_cmd, const char *ipset_name, int mtu) {
     const char *dev = "tun%d";
     struct ifreq ifr;
     int fd, err;
@@ -47,6 +59,11 @@ int alloc_tun(const char *tun_up_cmd, const char *ipset_name) {
         close(fd);
         return err;
     }
+    if (mtu > 0 && set_mtu(ifr.ifr_name, mtu) != 0) {
+        log_crit("tun", "Couldn't set mtu %d on %s", mtu, ifr.ifr_name);
+        close(fd);
+        return -1;
+    }
     log_info("tun", "Opened device %s [fd: %d], will run the command [%s] now", ifr.ifr_name, fd, tun_up_cmd);
     int ret = run_routeup_script(ifr.ifr_name, ipset_name, tun_up_cmd);
     if (ret != 0) {
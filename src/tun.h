@@ -5,5 +5,6 @@
 #  include <config.h>
 #endif
 
-int alloc_tun(const char *tun_up_cmd, const char *ipset_name);
+/* mtu > 0 is set on the device before tun_up_cmd runs */
+int alloc_tun(const char *tun_up_cmd, const char *ipset_name, int mtu);
 #endif
@@ -3,11 +3,33 @@
 
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
 #include "debug.h"
 #include "constants.h"
 
 #define C_LOG "comp/zlib"
 
+#define ZLIB_FINISH_TRAILER_SZ 6
+#define ZLIB_MEM_LEVEL 8 /* deflateInit's */
+#define ZLIB_WINDOW_SZ (1 << MAX_WBITS)
+
+/* handed over streams carry on as raw deflate from a block boundary, the receiving side primes the
+   window (and the unused bits of the last input byte) like zran.c does for its access points */
+struct zlib_handoff_s {
+    char impl[8];
+    int32_t level;
+    uint8_t tx_raw, rx_raw, rx_bits, rx_last_in;
+    uint32_t tx_dict_len, rx_dict_len, rx_pending_len;
+};
+
+typedef struct zlib_handoff_s zlib_handoff_t;
+
+static int inflate_at_handoff_point(compress_t *comp) {
+    z_stream *zstrm = &comp->inflate;
+    if (zstrm->total_in == 0) return 1; /* where it started (zlib header, or the point it was picked up at) */
+    return (zstrm->data_type & 128) != 0; /* right after the end of a block */
+}
+
 ssize_t do_decompress(compress_t *comp, void *to, ssize_t capacity) {
     assert(comp != NULL);
     z_stream *zstrm = &comp->inflate;
@@ -22,11 +44,16 @@ ssize_t do_decompress(compress_t *comp, void *to, ssize_t capacity) {
 
     ssize_t available_at_start = zstrm->avail_in;
 
+    if (comp->handoff && inflate_at_handoff_point(comp)) return 0;
+
     int ret;
+    int flush = comp->handoff ? Z_BLOCK : Z_SYNC_FLUSH; /* Z_BLOCK returns at the end of a block */
     do {
-        ret = inflate(zstrm, Z_SYNC_FLUSH);
-        assertf(ret >= Z_OK, C_LOG, L("inflate return: %d"), ret);
-    } while ((zstrm->avail_out != 0) && (zstrm->avail_in != 0));
+        ret = inflate(zstrm, flush);
+        assertf(ret >= Z_OK || ret == Z_BUF_ERROR, C_LOG, L("inflate return: %d"), ret); /* buf-error: called without input only to drain held back output, and there was none */
+    } while ((zstrm->avail_out != 0) && (zstrm->avail_in != 0) && ! (comp->handoff && inflate_at_handoff_point(comp)));
+
+    if (zstrm->avail_in < available_at_start) comp->inflate_last_in = zstrm->next_in[-1];
 
     if (zstrm->avail_in == 0) {
         comp->inflatable_bytes = 0;
@@ -50,6 +77,25 @@ char dbgbuf[DBG_BUFF_SZ];
     }
 #endif
 
+/* only when nothing is held back, deflateParams then has nothing to emit with the old level */
+static void apply_level(compress_t *comp) {
+    z_stream *zstrm = &comp->deflate;
+    uint8_t nothing;
+    Bytef *next_out = zstrm->next_out;
+    uInt avail_out = zstrm->avail_out;
+    zstrm->next_out = &nothing;
+    zstrm->avail_out = 0;
+    int ret = deflateParams(zstrm, comp->compression_level, Z_DEFAULT_STRATEGY);
+    zstrm->next_out = next_out;
+    zstrm->avail_out = avail_out;
+    if (ret == Z_OK) {
+        comp->level_change_pending = 0;
+        log_info(C_LOG, L("compression level of %p changed to %d"), comp, comp->compression_level);
+    } else {
+        log_debug(C_LOG, L("compression level change of %p deferred (deflateParams: %d)"), comp, ret);
+    }
+}
+
 ssize_t do_compress(compress_t *comp, void *to, ssize_t capacity, ssize_t *consumed, int *complete) {
     assert(comp != NULL);
     z_stream *zstrm = &comp->deflate;
@@ -58,20 +104,23 @@ ssize_t do_compress(compress_t *comp, void *to, ssize_t capacity, ssize_t *consu
     zstrm->next_out = to;
     ssize_t available_at_start = zstrm->avail_in;
     ssize_t bytes_directly_written = 0;
-    if (available_at_start > 0 || ! comp->deflate_fully_flushed) {
+    int flush = comp->defer_flush ? Z_NO_FLUSH : Z_SYNC_FLUSH;
+    if (available_at_start > 0 || (flush == Z_SYNC_FLUSH && ! comp->deflate_fully_flushed)) {
         int ret;
         do {
-            ret = deflate(zstrm, Z_SYNC_FLUSH);
+            ret = deflate(zstrm, flush);
             assertf(ret >= Z_OK, C_LOG, L("deflate return: %d"), ret);
         } while ((zstrm->avail_out != 0) && (zstrm->avail_in != 0));
 
-        comp->deflate_fully_flushed = (zstrm->avail_out > 0);
+        comp->deflate_fully_flushed = (flush == Z_SYNC_FLUSH) && (zstrm->avail_out > 0);
 
         bytes_directly_written = capacity - zstrm->avail_out;
     }
 
     *complete = (zstrm->avail_in == 0);
     *consumed = available_at_start - zstrm->avail_in;
+    comp->unflushed_bytes = comp->deflate_fully_flushed ? 0 : (comp->unflushed_bytes + *consumed);
+    if (comp->level_change_pending && comp->deflate_fully_flushed) apply_level(comp);
 
     DBG(C_LOG, L("compress(%p) [complete: %d] overall %zd bytes => %zd bytes"), comp, *complete, *consumed, bytes_directly_written);
 
@@ -80,7 +129,7 @@ ssize_t do_compress(compress_t *comp, void *to, ssize_t capacity, ssize_t *consu
 
 ssize_t worst_case_compressed_out_sz(compress_t *comp, ssize_t len) {
     assert(comp != NULL);
-    return deflateBound(&comp->deflate, len);
+    return deflateBound(&comp->deflate, len + comp->unflushed_bytes);
 }
 
 void setup_compress_input(compress_t *comp, void *buff, ssize_t len) {
@@ -92,6 +141,53 @@ void setup_compress_input(compress_t *comp, void *buff, ssize_t len) {
     zstrm->next_in = buff;
 }
 
+void set_compression_level(compress_t *comp, int level) {
+    assert(comp != NULL);
+    comp->compression_level = level;
+    comp->level_change_pending = 1;
+    if (comp->deflate_fully_flushed || comp->deflate.total_in == 0) apply_level(comp);
+}
+
+void setup_decompress_input(compress_t *comp, const void *buff, ssize_t len) {
+    assert(comp != NULL);
+    z_stream *zstrm = &comp->inflate;
+    assert(0 == zstrm->avail_in && 0 == comp->inflatable_bytes);
+    zstrm->avail_in = len;
+    zstrm->next_in = (Bytef *) buff;
+    comp->inflatable_bytes = len;
+}
+
+void reset_compress_stream(compress_t *comp) {
+    assert(comp != NULL);
+    int ret = deflateReset(&comp->deflate);
+    assertf(ret == Z_OK, C_LOG, L("deflate-stream reset failed(err: %d)"), ret);
+    comp->deflate.avail_in = 0;
+    comp->deflate_fully_flushed = 0;
+    comp->unflushed_bytes = 0;
+}
+
+void reset_decompress_stream(compress_t *comp) {
+    assert(comp != NULL);
+    int ret = inflateReset(&comp->inflate);
+    assertf(ret == Z_OK, C_LOG, L("inflate-stream reset failed(err: %d)"), ret);
+    comp->inflate.avail_in = 0;
+    comp->inflatable_bytes = 0;
+}
+
+static void init_ctx_state(compress_t *comp, int compression_level) {
+    comp->deflate_fully_flushed = 0;
+    comp->defer_flush = 0;
+    comp->unflushed_bytes = 0;
+    comp->compression_level = compression_level;
+    comp->level_change_pending = 0;
+    comp->inflate_src_buff_sz = DECOMPRESSION_SRC_BUFF_CAPACITY;
+    comp->inflatable_bytes = 0;
+    comp->deflate_raw = comp->inflate_raw = 0;
+    comp->inflate_last_in = 0;
+    comp->inflate_resume_bits = 0;
+    comp->handoff = 0;
+}
+
 int init_compression_ctx(compress_t *comp, int compression_level) {
     assert(comp != NULL);
     int ret = deflateInit(&comp->deflate, compression_level);
@@ -99,8 +195,7 @@ int init_compression_ctx(compress_t *comp, int compression_level) {
         log_crit(C_LOG, L("deflate-stream initialization failed(err: %d): %s"), ret, comp->deflate.msg);
         return -1;
     }
-    comp->deflate_fully_flushed = 0;
-    comp->inflate_src_buff_sz = DECOMPRESSION_SRC_BUFF_CAPACITY;
+    init_ctx_state(comp, compression_level);
     ret = inflateInit(&comp->inflate);
     if (ret < Z_OK) {
         log_crit(C_LOG, L("inflate-stream initialization failed(err: %d): %s"), ret, comp->inflate.msg);
@@ -109,6 +204,118 @@ int init_compression_ctx(compress_t *comp, int compression_level) {
     return 0;
 }
 
+void set_compression_handoff(compress_t *comp, int on) {
+    assert(comp != NULL);
+    comp->handoff = on;
+}
+
+int compression_at_handoff_point(compress_t *comp) {
+    assert(comp != NULL);
+    int tx_ok = (comp->deflate_fully_flushed && comp->deflate.avail_in == 0) || (comp->deflate.total_out == 0 && ! comp->deflate_raw);
+    return tx_ok && inflate_at_handoff_point(comp);
+}
+
+/* received bytes inflate hasn't taken yet */
+static const uint8_t *pending_input(compress_t *comp, uint32_t *len) {
+    *len = comp->inflatable_bytes;
+    if (comp->inflatable_bytes == 0) return NULL;
+    if (comp->inflate.avail_in == 0) return comp->inflate_src_buff; /* received, not handed to inflate yet */
+    *len = comp->inflate.avail_in;
+    return comp->inflate.next_in;
+}
+
+ssize_t export_compression_state(compress_t *comp, uint8_t **state) {
+    assert(comp != NULL);
+    if (! compression_at_handoff_point(comp)) return -1;
+    zlib_handoff_t h;
+    memset(&h, 0, sizeof(h));
+    strcpy(h.impl, COMPRESSION_IMPL);
+    h.level = comp->compression_level;
+    h.tx_raw = comp->deflate_raw || comp->deflate.total_out > 0;
+    h.rx_raw = comp->inflate_raw || comp->inflate.total_in > 0;
+    h.rx_bits = (comp->inflate.total_in > 0) ? (comp->inflate.data_type & 7) : comp->inflate_resume_bits;
+    h.rx_last_in = comp->inflate_last_in;
+    const uint8_t *pending = pending_input(comp, &h.rx_pending_len);
+
+    uint8_t *b = malloc(sizeof(h) + 2 * ZLIB_WINDOW_SZ + h.rx_pending_len);
+    if (b == NULL) {
+        log_crit(C_LOG, L("couldn't allocate stream state of %p"), comp);
+        return -1;
+    }
+    uint8_t *dict = b + sizeof(h);
+    uInt dict_len = 0;
+    int ret = h.tx_raw ? deflateGetDictionary(&comp->deflate, dict, &dict_len) : Z_OK;
+    assertf(ret == Z_OK, C_LOG, L("deflate history export failed(err: %d)"), ret);
+    h.tx_dict_len = dict_len;
+    dict += dict_len;
+    dict_len = 0;
+    ret = h.rx_raw ? inflateGetDictionary(&comp->inflate, dict, &dict_len) : Z_OK;
+    assertf(ret == Z_OK, C_LOG, L("inflate history export failed(err: %d)"), ret);
+    h.rx_dict_len = dict_len;
+    if (h.rx_pending_len > 0) memcpy(dict + dict_len, pending, h.rx_pending_len);
+    memcpy(b, &h, sizeof(h));
+    *state = b;
+    return sizeof(h) + h.tx_dict_len + h.rx_dict_len + h.rx_pending_len;
+}
+
+int init_compression_ctx_from(compress_t *comp, const uint8_t *state, ssize_t len) {
+    assert(comp != NULL);
+    zlib_handoff_t h;
+    if (len < (ssize_t) sizeof(h)) {
+        log_crit(C_LOG, L("handed over stream state is too short (%zd bytes)"), len);
+        return -1;
+    }
+    memcpy(&h, state, sizeof(h));
+    if (strncmp(h.impl, COMPRESSION_IMPL, sizeof(h.impl)) != 0) {
+        log_crit(C_LOG, L("handed over stream isn't " COMPRESSION_IMPL " (%.8s)"), h.impl);
+        return -1;
+    }
+    if (h.tx_dict_len > ZLIB_WINDOW_SZ || h.rx_dict_len > ZLIB_WINDOW_SZ || h.rx_pending_len > DECOMPRESSION_SRC_BUFF_CAPACITY || h.rx_bits > 7 ||
+        len != (ssize_t) (sizeof(h) + h.tx_dict_len + h.rx_dict_len + h.rx_pending_len)) {
+        log_crit(C_LOG, L("handed over stream state is malformed"));
+        return -1;
+    }
+    const uint8_t *tx_dict = state + sizeof(h), *rx_dict = tx_dict + h.tx_dict_len, *pending = rx_dict + h.rx_dict_len;
+
+    int ret = h.tx_raw ? deflateInit2(&comp->deflate, h.level, Z_DEFLATED, -MAX_WBITS, ZLIB_MEM_LEVEL, Z_DEFAULT_STRATEGY) : deflateInit(&comp->deflate, h.level);
+    if (ret < Z_OK) {
+        log_crit(C_LOG, L("deflate-stream initialization failed(err: %d): %s"), ret, comp->deflate.msg);
+        return -1;
+    }
+    init_ctx_state(comp, h.level);
+    if (h.tx_raw) {
+        if (h.tx_dict_len > 0 && (ret = deflateSetDictionary(&comp->deflate, tx_dict, h.tx_dict_len)) != Z_OK) {
+            log_crit(C_LOG, L("deflate-stream history couldn't be restored(err: %d)"), ret);
+            deflateEnd(&comp->deflate);
+            return -1;
+        }
+        comp->deflate_raw = 1;
+        comp->deflate_fully_flushed = 1;
+    }
+
+    ret = h.rx_raw ? inflateInit2(&comp->inflate, -MAX_WBITS) : inflateInit(&comp->inflate);
+    if (ret < Z_OK) {
+        log_crit(C_LOG, L("inflate-stream initialization failed(err: %d): %s"), ret, comp->inflate.msg);
+        deflateEnd(&comp->deflate);
+        return -1;
+    }
+    if (h.rx_raw) {
+        if ((h.rx_bits > 0 && (ret = inflatePrime(&comp->inflate, h.rx_bits, h.rx_last_in >> (8 - h.rx_bits))) != Z_OK) ||
+            (h.rx_dict_len > 0 && (ret = inflateSetDictionary(&comp->inflate, rx_dict, h.rx_dict_len)) != Z_OK)) {
+            log_crit(C_LOG, L("inflate-stream history couldn't be restored(err: %d)"), ret);
+            deflateEnd(&comp->deflate);
+            inflateEnd(&comp->inflate);
+            return -1;
+        }
+        comp->inflate_raw = 1;
+        comp->inflate_last_in = h.rx_last_in;
+        comp->inflate_resume_bits = h.rx_bits;
+    }
+    memcpy(comp->inflate_src_buff, pending, h.rx_pending_len);
+    comp->inflatable_bytes = h.rx_pending_len;
+    return 0;
+}
+
 int destroy_compression_ctx(compress_t *comp) {
     int failure = 0;
     assert(comp != NULL);
@@ -118,7 +325,9 @@ int destroy_compression_ctx(compress_t *comp) {
     comp->deflate.avail_out = sizeof(buff);
     int ret = deflate(&comp->deflate, Z_FINISH);
     size_t diff_bytes = (sizeof(buff) - comp->deflate.avail_out);
-    if ((diff_bytes > 0) || (ret != Z_STREAM_END)) {
+    int only_trailer = (comp->deflate_fully_flushed && (diff_bytes <= ZLIB_FINISH_TRAILER_SZ)) /* empty final block + adler32 after a sync-flush */
+        || comp->deflate.total_in == 0; /* never used for compression (decompression only) */
+    if ((diff_bytes > 0 && ! only_trailer) || (ret != Z_STREAM_END)) {
         print_byte_array(buff, diff_bytes, remaining_bytes_message, sizeof(remaining_bytes_message));
         log_crit(C_LOG, L("deflate-stream destroy found %s %zd un-flushed bytes(err: %d): %s {bytes: %s}"), comp->deflate.avail_out == 0 ? "atleast" : "exactly", diff_bytes,  ret, comp->deflate.msg, remaining_bytes_message);
         failure = ret;
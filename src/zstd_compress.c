@@ -9,59 +9,92 @@
 
 #define C_LOG "comp/zstd"
 
+/* handed over streams start a new frame both ways, only the level and unused input go across. Peers flush
+   without ending frames, so the rx side is only ever there on a fresh stream (l3tc refuses -U, see
+   COMPRESSION_HANDOFF) */
+struct zstd_handoff_s {
+    char impl[8];
+    int32_t level;
+    uint32_t rx_pending_len;
+};
+
+typedef struct zstd_handoff_s zstd_handoff_t;
+
 ssize_t do_decompress(compress_t *comp, void *to, ssize_t capacity) {
     assert(comp != NULL);
     ZSTD_DStream *dstream = comp->dstream;
     assert(dstream != NULL);
     ZSTD_outBuffer out = { to, capacity, 0 };
-    uint32_t old_pos = comp->inflate_src_buff_offset;
-    ZSTD_inBuffer in = { comp->inflate_src_buff, comp->inflatable_bytes, old_pos };
+    ZSTD_inBuffer *in = &comp->dinput;
+    if (in->pos == in->size) {
+        DBG(C_LOG, L("decompress(%p) input reset"), comp);
+        in->src = comp->inflate_src_buff;
+        in->size = comp->inflatable_bytes;
+        in->pos = 0;
+    }
+    if (comp->handoff && comp->rx_at_handoff_point) return 0;
+    size_t old_pos = in->pos;
     size_t decompress_status = 0;
     do {
         DBG(C_LOG, L("BEFORE: buff states -> in: { src: %p, size: %zd, pos: %zd }, out: { dst: %p, size: %zd, pos: %zd }"),
-            in.src, in.size, in.pos, out.dst, out.size, out.pos);
-        decompress_status = ZSTD_decompressStream(dstream, &out, &in);
+            in->src, in->size, in->pos, out.dst, out.size, out.pos);
+        size_t pos = in->pos;
+        decompress_status = ZSTD_decompressStream(dstream, &out, in);
         DBG(C_LOG, L("AFTER: buff states -> in: { src: %p, size: %zd, pos: %zd }, out: { dst: %p, size: %zd, pos: %zd }"),
-            in.src, in.size, in.pos, out.dst, out.size, out.pos);
+            in->src, in->size, in->pos, out.dst, out.size, out.pos);
         assertf(! ZSTD_isError(decompress_status), C_LOG, L("decompress returned: %s"), ZSTD_getErrorName(decompress_status));
-    } while ((in.pos < in.size) &&
-             (out.pos < out.size));
-    if (comp->inflatable_bytes == in.pos) comp->inflatable_bytes = 0;
-    comp->inflate_src_buff_offset = comp->inflatable_bytes ? in.pos : 0;
+        if (decompress_status == 0) { /* frame done and flushed */
+            comp->rx_at_handoff_point = 1;
+        } else if (in->pos > pos) {
+            comp->rx_at_handoff_point = 0;
+        }
+    } while ((in->pos < in->size) &&
+             (out.pos < out.size) &&
+             ! (comp->handoff && comp->rx_at_handoff_point));
+    if (in->pos == in->size) comp->inflatable_bytes = 0;
     DBG(C_LOG, L("decompress(%p) %zd bytes (unhandled: %zd) => %zd bytes (remaining capacity: %zd) (dest buff: %p (orig capacity: %zd))"), \
-        comp, in.pos, in.size - in.pos, out.pos, out.size - out.pos, to, capacity);
+        comp, in->pos - old_pos, in->size - in->pos, out.pos, out.size - out.pos, to, capacity);
 
     return out.pos;
 }
 
+/* The stream is one endless frame fed a different pkt buffer per call and written to wherever the
+   ring has room, so zstd's stable in/out buffer modes (which pin both for the whole frame) don't
+   apply. Instead worst_case_compressed_out_sz is kept tight, when the ring region handed in can take
+   ZSTD_compressBound of what is buffered, zstd compresses straight into it rather than staging the
+   block in its own out-buffer. */
 ssize_t do_compress(compress_t *comp, void *to, ssize_t capacity, ssize_t *consumed, int *complete) {
     assert(comp != NULL);
-    ZSTD_CStream *cstream = comp->cstream;
+    ZSTD_CCtx *cstream = comp->cstream;
     assert(cstream != NULL);
     ZSTD_outBuffer out = { to, capacity, 0 };
-    uint32_t old_pos = comp->cinput.pos;
-    size_t in_sz_hint;
+    size_t old_pos = comp->cinput.pos;
+    ZSTD_EndDirective mode = comp->defer_flush ? ZSTD_e_continue : (comp->level_change_pending ? ZSTD_e_end : ZSTD_e_flush);
+    size_t remaining;
     do {
-        in_sz_hint = ZSTD_compressStream(cstream, &out , &comp->cinput);
-        assertf(! ZSTD_isError(in_sz_hint), C_LOG, L("compress returned: %s"), ZSTD_getErrorName(in_sz_hint));
+        remaining = ZSTD_compressStream2(cstream, &out, &comp->cinput, mode);
+        assertf(! ZSTD_isError(remaining), C_LOG, L("compress returned: %s"), ZSTD_getErrorName(remaining));
     } while ((comp->cinput.pos < comp->cinput.size) &&
              (out.pos < out.size));
-    if (out.pos < out.size)  {
-        size_t old_offset = out.pos;
-        size_t remaining = ZSTD_flushStream(cstream, &out);
-        assertf(! ZSTD_isError(remaining), C_LOG, L("compress flush returned: %s"), ZSTD_getErrorName(remaining));
-        log_debug(C_LOG, L("zstd flush had %zd bytes remaining and flushed %zd bytes"), remaining, out.pos - old_offset);
-    }
-    *consumed = comp->cinput.pos - old_pos; 
+    *consumed = comp->cinput.pos - old_pos;
     *complete = (comp->cinput.pos == comp->cinput.size);
-    
-    DBG(C_LOG, L("compress(%p) [complete: %d] overall %zd bytes => %zd bytes"), comp, *complete, *consumed, out.pos);
+    comp->deflate_fully_flushed = (mode != ZSTD_e_continue) && *complete && (remaining == 0);
+    comp->unflushed_bytes = comp->deflate_fully_flushed ? 0 : (comp->unflushed_bytes + *consumed);
+    if (mode == ZSTD_e_end && comp->deflate_fully_flushed) { /* next frame starts at the new level */
+        size_t ret = ZSTD_CCtx_setParameter(cstream, ZSTD_c_compressionLevel, comp->compression_level);
+        assertf(! ZSTD_isError(ret), C_LOG, L("compression level change failed: %s"), ZSTD_getErrorName(ret));
+        comp->level_change_pending = 0;
+        log_info(C_LOG, L("compression level of %p changed to %d"), comp, comp->compression_level);
+    }
+
+    DBG(C_LOG, L("compress(%p) [complete: %d, to flush: %zd] overall %zd bytes => %zd bytes"), comp, *complete, remaining, *consumed, out.pos);
 
     return out.pos;
 }
 
 ssize_t worst_case_compressed_out_sz(compress_t *comp, ssize_t len) {
-    return ZSTD_CStreamOutSize();
+    assert(comp != NULL);
+    return ZSTD_compressBound(len + comp->unflushed_bytes);
 }
 
 void setup_compress_input(compress_t *comp, void *buff, ssize_t len) {
@@ -72,19 +105,123 @@ void setup_compress_input(compress_t *comp, void *buff, ssize_t len) {
     comp->cinput.src = buff;
 }
 
+/* a level change mid-frame only takes with multi-threaded compression, so it waits for the frame to be
+   closed on the next flush (the decompressor moves on to the next frame by itself) */
+void set_compression_level(compress_t *comp, int level) {
+    assert(comp != NULL);
+    comp->compression_level = level;
+    comp->level_change_pending = 1;
+}
+
+void setup_decompress_input(compress_t *comp, const void *buff, ssize_t len) {
+    assert(comp != NULL);
+    assert(comp->dinput.pos == comp->dinput.size && 0 == comp->inflatable_bytes);
+    comp->dinput.src = buff;
+    comp->dinput.size = len;
+    comp->dinput.pos = 0;
+    comp->inflatable_bytes = len;
+}
+
+void reset_compress_stream(compress_t *comp) {
+    assert(comp != NULL);
+    size_t ret = ZSTD_CCtx_reset(comp->cstream, ZSTD_reset_session_only);
+    assertf(! ZSTD_isError(ret), C_LOG, L("compress-stream reset failed: %s"), ZSTD_getErrorName(ret));
+    memset(&comp->cinput, 0, sizeof(comp->cinput));
+    comp->deflate_fully_flushed = 0;
+    comp->unflushed_bytes = 0;
+}
+
+void reset_decompress_stream(compress_t *comp) {
+    assert(comp != NULL);
+    size_t ret = ZSTD_DCtx_reset(comp->dstream, ZSTD_reset_session_only);
+    assertf(! ZSTD_isError(ret), C_LOG, L("decompress-stream reset failed: %s"), ZSTD_getErrorName(ret));
+    comp->inflatable_bytes = 0;
+    memset(&comp->dinput, 0, sizeof(comp->dinput));
+    comp->rx_at_handoff_point = 1;
+}
+
 int init_compression_ctx(compress_t *comp, int compression_level) {
     assert(comp != NULL);
     assertf(comp->cstream = ZSTD_createCStream(), C_LOG, L("Couldn't allocate ZStd compressor stream"));
-    size_t init_res = ZSTD_initCStream(comp->cstream, compression_level);
-    assertf(! ZSTD_isError(init_res), C_LOG, L("ZSTD_initCStream() error : %s"), ZSTD_getErrorName(init_res));
+    size_t init_res = ZSTD_CCtx_setParameter(comp->cstream, ZSTD_c_compressionLevel, compression_level);
+    assertf(! ZSTD_isError(init_res), C_LOG, L("ZSTD_CCtx_setParameter() error : %s"), ZSTD_getErrorName(init_res));
     memset(&comp->cinput, 0, sizeof(comp->cinput));
+    comp->defer_flush = 0;
+    comp->deflate_fully_flushed = 0;
+    comp->unflushed_bytes = 0;
+    comp->compression_level = compression_level;
+    comp->level_change_pending = 0;
 
     assertf(comp->dstream = ZSTD_createDStream(), C_LOG, L("Couldn't allocate ZStd de-compressor stream"));
-    init_res = ZSTD_initDStream(comp->dstream);
-    comp->inflate_src_buff_sz = ZSTD_DStreamOutSize();
+    comp->inflate_src_buff_sz = ZSTD_DStreamInSize(); /* a whole block fits, zstd then decodes it from here without staging */
     comp->inflate_src_buff = malloc(comp->inflate_src_buff_sz);
-    assertf(! ZSTD_isError(init_res), C_LOG, L("ZSTD_initDStream() error : %s"), ZSTD_getErrorName(init_res));
-    comp->inflate_src_buff_offset = 0;
+    memset(&comp->dinput, 0, sizeof(comp->dinput));
+    comp->inflatable_bytes = 0;
+    comp->handoff = 0;
+    comp->rx_at_handoff_point = 1;
+    return 0;
+}
+
+/* the compressor closes its frame at the next flush, like for a level change */
+void set_compression_handoff(compress_t *comp, int on) {
+    assert(comp != NULL);
+    comp->handoff = on;
+    if (on) comp->level_change_pending = 1;
+}
+
+int compression_at_handoff_point(compress_t *comp) {
+    assert(comp != NULL);
+    return comp->deflate_fully_flushed && ! comp->level_change_pending && comp->rx_at_handoff_point;
+}
+
+ssize_t export_compression_state(compress_t *comp, uint8_t **state) {
+    assert(comp != NULL);
+    if (! compression_at_handoff_point(comp)) return -1;
+    zstd_handoff_t h;
+    memset(&h, 0, sizeof(h));
+    strcpy(h.impl, COMPRESSION_IMPL);
+    h.level = comp->compression_level;
+    const uint8_t *pending = NULL;
+    if (comp->inflatable_bytes > 0) {
+        ZSTD_inBuffer *in = &comp->dinput;
+        if (in->pos < in->size) {
+            pending = (const uint8_t *) in->src + in->pos;
+            h.rx_pending_len = in->size - in->pos;
+        } else { /* received, not handed to zstd yet */
+            pending = comp->inflate_src_buff;
+            h.rx_pending_len = comp->inflatable_bytes;
+        }
+    }
+    uint8_t *b = malloc(sizeof(h) + h.rx_pending_len);
+    if (b == NULL) {
+        log_crit(C_LOG, L("couldn't allocate stream state of %p"), comp);
+        return -1;
+    }
+    memcpy(b, &h, sizeof(h));
+    if (h.rx_pending_len > 0) memcpy(b + sizeof(h), pending, h.rx_pending_len);
+    *state = b;
+    return sizeof(h) + h.rx_pending_len;
+}
+
+int init_compression_ctx_from(compress_t *comp, const uint8_t *state, ssize_t len) {
+    assert(comp != NULL);
+    zstd_handoff_t h;
+    if (len < (ssize_t) sizeof(h)) {
+        log_crit(C_LOG, L("handed over stream state is too short (%zd bytes)"), len);
+        return -1;
+    }
+    memcpy(&h, state, sizeof(h));
+    if (strncmp(h.impl, COMPRESSION_IMPL, sizeof(h.impl)) != 0) {
+        log_crit(C_LOG, L("handed over stream isn't " COMPRESSION_IMPL " (%.8s)"), h.impl);
+        return -1;
+    }
+    if (len != (ssize_t) (sizeof(h) + h.rx_pending_len) || h.rx_pending_len > ZSTD_DStreamInSize()) {
+        log_crit(C_LOG, L("handed over stream state is malformed"));
+        return -1;
+    }
+    if (init_compression_ctx(comp, h.level) != 0) return -1;
+    memcpy(comp->inflate_src_buff, state + sizeof(h), h.rx_pending_len);
+    comp->inflatable_bytes = h.rx_pending_len;
     return 0;
 }
 
@@ -94,7 +231,8 @@ int destroy_compression_ctx(compress_t *comp) {
     unsigned char buff[64];
     char remaining_bytes_message[64];
     ZSTD_outBuffer out = { buff, sizeof(buff), 0 };
-    size_t const remaining = ZSTD_endStream(comp->cstream, &out);
+    ZSTD_inBuffer none = { NULL, 0, 0 };
+    size_t const remaining = ZSTD_compressStream2(comp->cstream, &out, &none, ZSTD_e_end);
     if (remaining > 0) {
         print_byte_array(buff, remaining, remaining_bytes_message, sizeof(remaining_bytes_message));
         log_warn(C_LOG, L("zstd compress-stream destroy had atleast %zd un-flushed bytes before close: {bytes: %s}"), remaining, remaining_bytes_message);
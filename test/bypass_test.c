@@ -0,0 +1,146 @@
+#include "../src/bypass.h"
+#include <assert.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+static size_t pkt(uint8_t *p, int v6, uint8_t proto, uint16_t port) {
+    size_t l3_len = v6 ? 40 : 20;
+    memset(p, 0, l3_len + 20);
+    if (v6) {
+        p[0] = 0x60;
+        p[6] = proto;
+        inet_pton(AF_INET6, "fd00::5", p + 24);
+    } else {
+        p[0] = 0x45;
+        p[9] = proto;
+        inet_pton(AF_INET, "10.0.0.5", p + 16);
+    }
+    p[l3_len] = 0x9c;
+    p[l3_len + 2] = port >> 8;
+    p[l3_len + 3] = port & 0xFF;
+    return l3_len + 20;
+}
+
+/* one window of traffic to key compressing to pct */
+static void window(bypass_tab_t *t, const uint8_t *key, int pct, time_t now) {
+    for (int i = 0; i < (BYPASS_WINDOW_BYTES + 999) / 1000; i++) bypass_account(t, key, 1000, 10 * pct, now);
+}
+
+static void test_key() {
+    uint8_t p[100], key[BYPASS_KEY_SZ];
+    char entry[80];
+    int af;
+    size_t len = pkt(p, 0, IPPROTO_TCP, 443);
+    assert(bypass_key(p, len, key) == 0);
+    assert(bypass_entry_str(key, entry, sizeof(entry), &af) == 0);
+    assert(af == AF_INET && strcmp(entry, "10.0.0.5,tcp:443") == 0);
+    len = pkt(p, 1, IPPROTO_UDP, 53);
+    assert(bypass_key(p, len, key) == 0);
+    assert(bypass_entry_str(key, entry, sizeof(entry), &af) == 0);
+    assert(af == AF_INET6 && strcmp(entry, "fd00::5,udp:53") == 0);
+    assert(bypass_entry_str(key, entry, 10, &af) != 0);
+
+    len = pkt(p, 0, IPPROTO_ICMP, 0);
+    assert(bypass_key(p, len, key) != 0);
+    len = pkt(p, 0, IPPROTO_TCP, 80);
+    p[7] = 10; /* non-first fragment */
+    assert(bypass_key(p, len, key) != 0);
+    len = pkt(p, 1, 0 /* hop-by-hop */, 80);
+    assert(bypass_key(p, len, key) != 0);
+    assert(bypass_key(p, 22, key) != 0);
+}
+
+static void test_hysteresis() {
+    bypass_tab_t t;
+    uint8_t p[100], key[BYPASS_KEY_SZ];
+    uint32_t hold;
+    assert(bypass_init(&t, 95) == 0);
+    assert(bypass_key(p, pkt(p, 0, IPPROTO_TCP, 443), key) == 0);
+    time_t now = 1000;
+
+    /* a window in between neither counts nor clears the streak, a good one clears it */
+    window(&t, key, 99, now);
+    window(&t, key, 90, now);
+    window(&t, key, 99, now);
+    window(&t, key, 80, now);
+    for (int i = 0; i < BYPASS_WINDOWS - 1; i++) window(&t, key, 99, now);
+    assert(bypass_next(&t, &hold) == NULL);
+    window(&t, key, 100, now);
+    bypass_dest_t *d = bypass_next(&t, &hold);
+    assert(d != NULL && hold == BYPASS_HOLD_MIN && memcmp(d->key, key, BYPASS_KEY_SZ) == 0);
+    assert(bypass_next(&t, &hold) == NULL);
+    assert(t.stats.windows == 8 && t.stats.poor_windows == 6 && t.stats.bypassed == 1);
+
+    /* stragglers while bypassed are ignored */
+    window(&t, key, 100, now + 1);
+    assert(t.stats.windows == 8);
+
+    /* back on probation, one poor window is enough and it stays away twice as long */
+    now += BYPASS_HOLD_MIN;
+    window(&t, key, 97, now);
+    assert(t.stats.reprobed == 1 && bypass_next(&t, &hold) != NULL && hold == 2 * BYPASS_HOLD_MIN);
+
+    /* till it compresses again */
+    now += 2 * BYPASS_HOLD_MIN;
+    window(&t, key, 50, now);
+    for (int i = 0; i < BYPASS_WINDOWS - 1; i++) window(&t, key, 99, now);
+    assert(bypass_next(&t, &hold) == NULL);
+    window(&t, key, 99, now);
+    assert(bypass_next(&t, &hold) != NULL && hold == BYPASS_HOLD_MIN);
+
+    /* hold is capped */
+    for (int i = 0; i < 10; i++) {
+        now += hold;
+        window(&t, key, 99, now);
+        assert(bypass_next(&t, &hold) != NULL);
+    }
+    assert(hold == BYPASS_HOLD_MAX);
+    bypass_destroy(&t);
+}
+
+static void test_undo_and_collisions() {
+    bypass_tab_t t;
+    uint8_t p[100], key[BYPASS_KEY_SZ], other[BYPASS_KEY_SZ];
+    uint32_t hold;
+    assert(bypass_init(&t, 90) == 0);
+    assert(bypass_key(p, pkt(p, 0, IPPROTO_UDP, 4500), key) == 0);
+    for (int i = 0; i < BYPASS_WINDOWS; i++) window(&t, key, 100, 0);
+    bypass_dest_t *d = bypass_next(&t, &hold);
+    assert(d != NULL);
+    bypass_undo(&t, d); /* ipset failed, judged from scratch */
+    assert(t.stats.failed == 1);
+    for (int i = 0; i < BYPASS_WINDOWS - 1; i++) window(&t, key, 100, 0);
+    assert(bypass_next(&t, &hold) == NULL);
+    window(&t, key, 100, 0);
+    assert(bypass_next(&t, &hold) != NULL && hold == BYPASS_HOLD_MIN);
+
+    /* a destination landing on the bypassed one's slot isn't tracked meanwhile */
+    uint16_t port = 1;
+    unsigned slot = d - t.slots;
+    for (;; port++) {
+        assert(bypass_key(p, pkt(p, 0, IPPROTO_UDP, port), other) == 0);
+        bypass_account(&t, other, 1, 1, 1);
+        if (t.stats.untracked_pkts > 0) break;
+    }
+    assert(memcmp(t.slots[slot].key, key, BYPASS_KEY_SZ) == 0);
+    bypass_account(&t, other, 1, 1, BYPASS_HOLD_MIN);
+    assert(memcmp(t.slots[slot].key, other, BYPASS_KEY_SZ) == 0); /* expired, taken over */
+
+    /* bypassing only what could be queued, the rest is judged next window */
+    bypass_destroy(&t);
+    assert(bypass_init(&t, 90) == 0);
+    for (port = 1; port <= 2 * BYPASS_PENDING_MAX; port++) {
+        assert(bypass_key(p, pkt(p, 0, IPPROTO_TCP, port), key) == 0);
+        for (int i = 0; i < BYPASS_WINDOWS; i++) window(&t, key, 100, 0);
+    }
+    assert(t.n_pending == BYPASS_PENDING_MAX && t.stats.bypassed == BYPASS_PENDING_MAX);
+    bypass_destroy(&t);
+}
+
+int main() {
+    test_key();
+    test_hysteresis();
+    test_undo_and_collisions();
+    return 0;
+}
@@ -0,0 +1,40 @@
+#include "../src/calibrate.h"
+#include "../src/compress.h"
+#include "../src/log.h"
+#include <assert.h>
+#include <stdio.h>
+
+#define BUDGET_MS 2
+#define MAX_RESULTS 32
+
+static void test_trivial_target_picks_best_level() {
+    calibration_t results[MAX_RESULTS];
+    int n = 0;
+    int level = calibrate_compression_level(0.001, BUDGET_MS, results, MAX_RESULTS, &n);
+    assert(level == MAX_COMPRESSION_LEVEL);
+    assert(n == MAX_COMPRESSION_LEVEL - MIN_COMPRESSION_LEVEL + 1);
+    for (int i = 0; i < n; i++) {
+        assert(results[i].level == MIN_COMPRESSION_LEVEL + i);
+        assert(results[i].mb_per_s > 0);
+        assert(results[i].ratio > 1); /* corpus is mostly text */
+    }
+}
+
+static void test_unreachable_target_falls_back_to_fastest_level() {
+    assert(calibrate_compression_level(1e12, BUDGET_MS, NULL, 0, NULL) == MIN_COMPRESSION_LEVEL);
+}
+
+static void test_results_are_capped() {
+    calibration_t results[2];
+    int n = -1;
+    calibrate_compression_level(0.001, BUDGET_MS, results, 2, &n);
+    assert(n == 2);
+}
+
+int main() {
+    log_init(0, "calibrate_test");
+    test_trivial_target_picks_best_level();
+    test_unreachable_target_falls_back_to_fastest_level();
+    test_results_are_capped();
+    return 0;
+}
@@ -166,10 +166,103 @@ void test_complete_and_consumed_behavior() {
     free(comp_src_xlarge);
 }
 
+struct pipe_s {
+    uint8_t *buff;
+    size_t len, off, recv_sz;
+};
+
+typedef struct pipe_s pipe_t;
+
+static void compress_into(compress_t *comp, pipe_t *p, uint8_t *src, size_t len) {
+    ssize_t consumed;
+    int complete;
+    setup_compress_input(comp, src, len);
+    do {
+        size_t room = 1024 * 1024;
+        p->buff = realloc(p->buff, p->len + room);
+        assert(p->buff != NULL);
+        p->len += do_compress(comp, p->buff + p->len, room, &consumed, &complete);
+    } while (! complete || ! comp->deflate_fully_flushed);
+}
+
+/* feeds the pipe to comp the way io does (a recv worth at a time), stops early at a handoff point */
+static void decompress_from(compress_t *comp, pipe_t *p, uint8_t *out, size_t *out_len, size_t cap) {
+    while (*out_len < cap) {
+        if (comp->inflatable_bytes == 0) {
+            if (p->off == p->len) return;
+            size_t n = p->len - p->off;
+            if (n > p->recv_sz) n = p->recv_sz; /* small recvs, so the handoff point isn't always at the end of the input */
+            if (n > comp->inflate_src_buff_sz) n = comp->inflate_src_buff_sz;
+            memcpy(comp->inflate_src_buff, p->buff + p->off, n);
+            comp->inflatable_bytes = n;
+            p->off += n;
+        }
+        *out_len += do_decompress(comp, out + *out_len, cap - *out_len);
+        if (comp->handoff && compression_at_handoff_point(comp)) return;
+    }
+}
+
+static void hand_over(compress_t *comp) {
+    uint8_t *state;
+    ssize_t len = export_compression_state(comp, &state);
+    assert(len > 0);
+    destroy_compression_ctx(comp);
+    memset(comp, 0, sizeof(*comp));
+    assert(init_compression_ctx_from(comp, state, len) == 0);
+    free(state);
+}
+
+/* both ends of a stream are picked up by a new ctx half way through, the output must not notice */
+void test_handoff(size_t recv_sz) {
+    FILE *f = fopen(ORIGINAL_PCAP_FILE, "r");
+    assert(f != NULL);
+    uint8_t *orig = malloc(LARGE_BUFF_SZ);
+    size_t orig_len = fread(orig, 1, LARGE_BUFF_SZ, f);
+    fclose(f);
+    uint8_t *out = malloc(orig_len);
+    size_t out_len = 0;
+    pipe_t p = {NULL, 0, 0, recv_sz};
+    compress_t tx, rx;
+    memset(&tx, 0, sizeof(tx));
+    memset(&rx, 0, sizeof(rx));
+    assert(init_compression_ctx(&tx, DEFAULT_COMPRESSION_LEVEL) == 0);
+    assert(init_compression_ctx(&rx, DEFAULT_COMPRESSION_LEVEL) == 0);
+
+    size_t half = orig_len / 2;
+    compress_into(&tx, &p, orig, half);
+    decompress_from(&rx, &p, out, &out_len, half / 4); /* rx is mid-block */
+    set_compression_handoff(&tx, 1);
+    set_compression_handoff(&rx, 1);
+    compress_into(&tx, &p, NULL, 0); /* zstd ends its frame */
+    assert(compression_at_handoff_point(&tx));
+    pipe_t unused = {NULL, 0, 0, 0};
+    compress_into(&rx, &unused, NULL, 0); /* the other direction, would go to the peer */
+    free(unused.buff);
+    decompress_from(&rx, &p, out, &out_len, orig_len);
+    assert(compression_at_handoff_point(&rx));
+    hand_over(&tx);
+    hand_over(&rx);
+
+    compress_into(&tx, &p, orig + half, orig_len - half);
+    decompress_from(&rx, &p, out, &out_len, orig_len);
+    assert(out_len == orig_len);
+    assert(memcmp(orig, out, orig_len) == 0);
+
+    destroy_compression_ctx(&tx);
+    destroy_compression_ctx(&rx);
+    free(p.buff);
+    free(orig);
+    free(out);
+}
+
 int main() {
     log_init(1, "test");
 
     test_complete_and_consumed_behavior();
+    test_handoff(1000);
+    test_handoff(333);
+    test_handoff(97);
+    test_handoff(SMALL_BUFF_SZ);
     
     do_test(EMBARASSINGLY_SMALL_BUFF_SZ, EMBARASSINGLY_SMALL_BUFF_SZ);
     do_test(VERY_SMALL_BUFF_SZ, EMBARASSINGLY_SMALL_BUFF_SZ);
@@ -0,0 +1,120 @@
+#include "../src/ctl.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+struct calls_s {
+    int echo, fail;
+};
+
+static int echo(void *ctx, int argc, char **argv, ctl_out_t *out) {
+    ((struct calls_s *) ctx)->echo++;
+    for (int i = 1; i < argc; i++) ctl_printf(out, "%s%s", argv[i], (i + 1 < argc) ? " " : "\n");
+    return 0;
+}
+
+static int fail(void *ctx, int argc, char **argv, ctl_out_t *out) {
+    ((struct calls_s *) ctx)->fail++;
+    return ctl_error(out, "no good: %s", argv[1]);
+}
+
+static const ctl_cmd_t cmds[] = {
+    {"echo", 1, 3, echo, "echo <a> [b [c]]"},
+    {"fail", 1, 1, fail, "fail <why>"},
+    {NULL, 0, 0, NULL, NULL}
+};
+
+static void expect(const char *req, const char *reply) {
+    struct calls_s calls = {0, 0};
+    ctl_out_t out = {NULL, 0, 0, 0};
+    char line[CTL_MAX_LINE];
+    strcpy(line, req);
+    ctl_run_line(line, cmds, &calls, &out);
+    assert(out.len == strlen(reply));
+    assert(out.len == 0 || memcmp(out.buff, reply, out.len) == 0);
+    free(out.buff);
+}
+
+static void test_run_line() {
+    expect("echo a b", "a b\nok\n");
+    expect("  echo \t x  ", "x\nok\n");
+    expect("echo", "error: usage: echo <a> [b [c]]\n");
+    expect("echo 1 2 3 4", "error: usage: echo <a> [b [c]]\n");
+    expect("fail disk", "error: no good: disk\n");
+    expect("nope", "error: unknown command 'nope' (try help)\n");
+    expect("help", "echo <a> [b [c]]\nfail <why>\nhelp\nok\n");
+    expect("", "");
+    expect("a b c d e f g h i j k l m n o p q", "error: more than 16 words in request\n");
+}
+
+static void test_reply_growth() {
+    ctl_out_t out = {NULL, 0, 0, 0};
+    for (int i = 0; i < 10000; i++) ctl_printf(&out, "line %d\n", i);
+    char *last = out.buff + out.len - strlen("line 9999\n");
+    assert(strncmp(last, "line 9999\n", 10) == 0);
+    free(out.buff);
+}
+
+static ssize_t read_all(int fd, char *buff, ssize_t cap) {
+    ssize_t len = 0, n;
+    while ((n = read(fd, buff + len, cap - len)) > 0) len += n;
+    return len;
+}
+
+/* pipelined requests split across reads, an overlong one, then a half-close */
+static void test_serve() {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert(fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0);
+    struct calls_s calls = {0, 0};
+    ctl_client_t c;
+    memset(&c, 0, sizeof(c));
+
+    assert(write(sv[1], "echo a\nec", 9) == 9);
+    assert(ctl_serve(sv[0], &c, cmds, &calls) == 0);
+    assert(write(sv[1], "ho b\nfail x\n", 12) == 12);
+    assert(ctl_serve(sv[0], &c, cmds, &calls) == 0);
+    assert(calls.echo == 2 && calls.fail == 1);
+
+    char big[CTL_MAX_LINE + 100];
+    memset(big, 'z', sizeof(big));
+    assert(write(sv[1], big, sizeof(big)) == sizeof(big));
+    assert(write(sv[1], "\necho c\n", 8) == 8);
+    assert(ctl_serve(sv[0], &c, cmds, &calls) == 0);
+    assert(calls.echo == 3);
+
+    shutdown(sv[1], SHUT_WR);
+    assert(ctl_serve(sv[0], &c, cmds, &calls) == -1); /* everything answered, client gone */
+    close(sv[0]);
+
+    char reply[4096];
+    ssize_t len = read_all(sv[1], reply, sizeof(reply) - 1);
+    reply[len] = '\0';
+    assert(strcmp(reply, "a\nok\nb\nok\nerror: no good: x\nerror: request longer than 1023 bytes\nc\nok\n") == 0);
+
+    ctl_client_destroy(&c);
+    close(sv[1]);
+}
+
+static void test_listen() {
+    char path[] = "/tmp/ctl_test.XXXXXX";
+    int tmp = mkstemp(path); /* stale file in the way */
+    assert(tmp >= 0);
+    close(tmp);
+    int fd = ctl_listen(path);
+    assert(fd >= 0);
+    close(fd);
+    unlink(path);
+}
+
+int main() {
+    test_run_line();
+    test_reply_growth();
+    test_serve();
+    test_listen();
+    return 0;
+}
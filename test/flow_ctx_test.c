@@ -0,0 +1,263 @@
+#include "../src/flow_ctx.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#define PKT_SZ 1000
+
+static void pkt(uint8_t *p, uint8_t src, uint16_t sport, int seq) {
+    memset(p, 0, PKT_SZ);
+    p[0] = 0x45;
+    p[2] = PKT_SZ >> 8;
+    p[3] = PKT_SZ & 0xFF;
+    p[9] = IPPROTO_TCP;
+    p[12] = 10; p[15] = src;
+    p[16] = 10; p[19] = 1;
+    p[20] = sport >> 8; p[21] = sport & 0xFF;
+    p[22] = 0; p[23] = 80;
+    snprintf((char *) p + 40, PKT_SZ - 40, "flow %d:%d seq %d GET /index.html HTTP/1.1 Host: example.com User-Agent: test", src, sport, seq);
+    for (int i = 120; i < PKT_SZ; i++) p[i] = (uint8_t) ((i * src + seq) % 17) + 'a';
+}
+
+static void init(flow_ctx_tab_t *fc, compress_t *shared, int max) {
+    memset(shared, 0, sizeof(*shared));
+    assert(init_compression_ctx(shared, 6) == 0);
+    assert(flow_ctx_init(fc, shared, max, 6) == 0);
+}
+
+static void fini(flow_ctx_tab_t *fc, compress_t *shared) {
+    flow_ctx_destroy(fc);
+    destroy_compression_ctx(shared);
+}
+
+static void test_promotion_and_lru() {
+    flow_ctx_tab_t *fc = malloc(sizeof(flow_ctx_tab_t));
+    compress_t shared;
+    init(fc, &shared, 1);
+    uint8_t a[PKT_SZ], b[PKT_SZ];
+    pkt(a, 2, 1000, 0);
+    pkt(b, 3, 2000, 0);
+
+    int light = FLOW_CTX_PROMOTE_BYTES / PKT_SZ;
+    for (int i = 0; i < light; i++) assert(flow_ctx_pick(fc, a, PKT_SZ) == 0);
+    assert(flow_ctx_pick(fc, a, PKT_SZ) == 1);
+    assert(fc->stats.promoted == 1 && fc->tx_live == 1 && fc->ctx[1].tx_reset_pending);
+    assert(flow_ctx_pick(fc, a, PKT_SZ) == 1);
+
+    for (int i = 0; i < light; i++) assert(flow_ctx_pick(fc, b, PKT_SZ) == 0);
+    assert(flow_ctx_pick(fc, b, PKT_SZ) == 1); /* a was least recently used */
+    assert(fc->stats.evicted == 1 && fc->tx_live == 1);
+    assert(flow_ctx_pick(fc, a, PKT_SZ) == 0); /* has to get heavy again */
+
+    fini(fc, &shared);
+    free(fc);
+
+    fc = malloc(sizeof(flow_ctx_tab_t));
+    init(fc, &shared, 0);
+    for (int i = 0; i < 2 * light; i++) assert(flow_ctx_pick(fc, a, PKT_SZ) == 0); /* off */
+    fini(fc, &shared);
+    free(fc);
+}
+
+/* frames are handed to the receiver in odd sized pieces and decoded into a small buffer */
+static void round_trip(int max, int defer) {
+    flow_ctx_tab_t *tx = malloc(sizeof(flow_ctx_tab_t)), *rx = malloc(sizeof(flow_ctx_tab_t));
+    compress_t tx_shared, rx_shared;
+    init(tx, &tx_shared, max);
+    init(rx, &rx_shared, max);
+
+    int n = 600;
+    uint8_t *sent = malloc(n * PKT_SZ), *got = malloc(n * PKT_SZ);
+    ssize_t wire_cap = 4 * 1024 * 1024, wire_len = 0, got_len = 0;
+    uint8_t *wire = malloc(wire_cap);
+    for (int i = 0; i < n; i++) {
+        uint8_t *p = sent + i * PKT_SZ;
+        int f = (i % 5 < 3) ? 0 : 1 + (i % 7); /* 2 heavy-ish flows sharing most pkts, a few light ones */
+        pkt(p, 2 + f, 1000 + f, i);
+        int id = flow_ctx_pick(tx, p, PKT_SZ);
+        ssize_t bound = flow_ctx_encode_bound(tx, id, PKT_SZ);
+        assert(bound > 0 && wire_len + bound <= wire_cap);
+        ssize_t w = flow_ctx_encode(tx, id, p, PKT_SZ, defer && (i % 16 != 15), wire + wire_len, wire_cap - wire_len);
+        assert(w >= 0);
+        wire_len += w;
+    }
+    wire_len += flow_ctx_encode(tx, 0, NULL, 0, 0, wire + wire_len, wire_cap - wire_len);
+    if (max > 0) assert(tx->stats.promoted > 0 && tx->stats.dedicated.in > 0);
+    assert(tx->stats.shared.in + tx->stats.dedicated.in == (uint64_t) n * PKT_SZ);
+    assert(tx->stats.shared.out + tx->stats.dedicated.out == (uint64_t) wire_len);
+
+    ssize_t off = 0;
+    int piece = 1;
+    while (off < wire_len || ! flow_ctx_rx_empty(rx) || rx->rx_owed) {
+        if (flow_ctx_rx_empty(rx) && off < wire_len) {
+            ssize_t len = (piece * 997) % rx->rx_buff_sz + 1;
+            if (len > wire_len - off) len = wire_len - off;
+            memcpy(rx->rx_buff, wire + off, len);
+            rx->rx_off = 0;
+            rx->rx_len = len;
+            off += len;
+            piece++;
+        }
+        ssize_t cap = 100 + (piece % 3) * 1000;
+        if (cap > n * PKT_SZ - got_len) cap = n * PKT_SZ - got_len;
+        if (cap == 0) break;
+        ssize_t w = flow_ctx_decode(rx, got + got_len, cap);
+        assert(w >= 0);
+        got_len += w;
+    }
+    assert(got_len == n * PKT_SZ);
+    assert(memcmp(sent, got, got_len) == 0);
+
+    fini(tx, &tx_shared);
+    fini(rx, &rx_shared);
+    free(tx); free(rx); free(sent); free(got); free(wire);
+}
+
+static void test_bad_ctx_id() {
+    flow_ctx_tab_t *rx = malloc(sizeof(flow_ctx_tab_t));
+    compress_t shared;
+    init(rx, &shared, 2);
+    uint8_t frame[] = {3, 0, 0, 1, 0};
+    memcpy(rx->rx_buff, frame, sizeof(frame));
+    rx->rx_len = sizeof(frame);
+    uint8_t out[16];
+    assert(flow_ctx_decode(rx, out, sizeof(out)) == -1);
+    fini(rx, &shared);
+    free(rx);
+}
+
+/* hub side of test_relay: frames are passed on as they'd be to the destination, header rewritten */
+struct hub_s {
+    uint8_t src[FLOW_CTX_RELAY_ADDR_SZ];
+    uint8_t *out;
+    ssize_t len, frame_in;
+    int units;
+};
+
+static int hub_forward(void *ctx, const uint8_t *hdr, const uint8_t *piece, ssize_t len) {
+    struct hub_s *h = (struct hub_s *) ctx;
+    if (h->frame_in == 0) {
+        assert(memcmp(hdr + FLOW_CTX_HDR_SZ, "dest-addr-123456", FLOW_CTX_RELAY_ADDR_SZ) == 0);
+        flow_ctx_relay_hdr(h->out + h->len, FLOW_CTX_RELAY_FROM | (hdr[1] & (FLOW_CTX_RESET | FLOW_CTX_MORE)), h->src, flow_ctx_relay_len(hdr));
+        h->len += FLOW_CTX_RELAY_HDR_SZ;
+    }
+    memcpy(h->out + h->len, piece, len);
+    h->len += len;
+    h->frame_in += len;
+    if (h->frame_in == flow_ctx_relay_len(hdr)) {
+        h->frame_in = 0;
+        if (! (hdr[1] & FLOW_CTX_MORE)) h->units++;
+    }
+    return 0;
+}
+
+static compress_t *dest_rx_comp(void *ctx, const uint8_t *src) {
+    assert(memcmp(src, "src-addr-1234567", FLOW_CTX_RELAY_ADDR_SZ) == 0);
+    return (compress_t *) ctx;
+}
+
+static int lost;
+
+static void dest_lost(void *ctx, const uint8_t *dest) {
+    lost++;
+}
+
+/* spoke -> hub (relay frames between shared ctx frames) -> spoke, hub doesn't decompress relay frames */
+static void test_relay() {
+    flow_ctx_tab_t *s = malloc(sizeof(flow_ctx_tab_t)), *hub = malloc(sizeof(flow_ctx_tab_t)), *d = malloc(sizeof(flow_ctx_tab_t));
+    compress_t s_shared, hub_shared, d_shared, s_relay, d_relay;
+    init(s, &s_shared, 0);
+    init(hub, &hub_shared, 0);
+    init(d, &d_shared, 0);
+    memset(&s_relay, 0, sizeof(s_relay));
+    memset(&d_relay, 0, sizeof(d_relay));
+    assert(init_compression_ctx(&s_relay, 6) == 0);
+    assert(init_compression_ctx(&d_relay, 6) == 0);
+    struct hub_s h = {.units = 0};
+    memcpy(h.src, "src-addr-1234567", FLOW_CTX_RELAY_ADDR_SZ);
+    flow_ctx_relay_t hub_relay = {&h, NULL, hub_forward, NULL}, d_relay_cb = {&d_relay, dest_rx_comp, NULL, dest_lost};
+    hub->relay = &hub_relay;
+    d->relay = &d_relay_cb;
+
+    int n = 200;
+    ssize_t cap = 4 * 1024 * 1024, wire_len = 0, got_len = 0, hub_got = 0;
+    uint8_t *wire = malloc(cap), *sent = malloc(n * PKT_SZ), *got = malloc(cap), *big = malloc(70000);
+    h.out = malloc(cap);
+    h.len = h.frame_in = 0;
+    for (int i = 0; i < n; i++) {
+        uint8_t *p = sent + i * PKT_SZ;
+        pkt(p, 2, 1000, i);
+        if (i % 3 == 0) { /* for the hub itself, left open so encode_relay has to flush it */
+            wire_len += flow_ctx_encode(s, 0, p, PKT_SZ, 1, wire + wire_len, cap - wire_len);
+        }
+        assert(flow_ctx_relay_bound(s, &s_relay, PKT_SZ) > 0);
+        wire_len += flow_ctx_encode_relay(s, &s_relay, (const uint8_t *) "dest-addr-123456", i == 0, p, PKT_SZ, wire + wire_len, cap - wire_len);
+    }
+    for (int i = 0; i < 70000; i++) big[i] = (i * 7919) >> 3; /* doesn't compress, spans frames */
+    wire_len += flow_ctx_encode_relay(s, &s_relay, (const uint8_t *) "dest-addr-123456", 0, big, 70000, wire + wire_len, cap - wire_len);
+
+    ssize_t off = 0;
+    while (off < wire_len || ! flow_ctx_rx_empty(hub) || hub->rx_owed) {
+        if (flow_ctx_rx_empty(hub) && off < wire_len) {
+            ssize_t len = (off * 31 + 7) % hub->rx_buff_sz + 1;
+            if (len > wire_len - off) len = wire_len - off;
+            memcpy(hub->rx_buff, wire + off, len);
+            hub->rx_off = 0;
+            hub->rx_len = len;
+            off += len;
+        }
+        ssize_t w = flow_ctx_decode(hub, got + hub_got, cap - hub_got);
+        assert(w >= 0);
+        hub_got += w;
+    }
+    assert(hub_got == ((n + 2) / 3) * PKT_SZ); /* only the hub's own pkts were decompressed */
+    assert(h.units == n + 1 && h.frame_in == 0);
+    assert(h.out[1] & FLOW_CTX_RESET);
+
+    flow_ctx_relay_hdr(h.out + h.len, FLOW_CTX_RELAY_FROM | FLOW_CTX_RELAY_LOST, (const uint8_t *) "src-addr-1234567", 0);
+    h.len += FLOW_CTX_RELAY_HDR_SZ;
+    off = 0;
+    while (off < h.len || ! flow_ctx_rx_empty(d) || d->rx_owed) {
+        if (flow_ctx_rx_empty(d) && off < h.len) {
+            ssize_t len = h.len - off;
+            if (len > d->rx_buff_sz) len = d->rx_buff_sz;
+            memcpy(d->rx_buff, h.out + off, len);
+            d->rx_off = 0;
+            d->rx_len = len;
+            off += len;
+        }
+        ssize_t w = flow_ctx_decode(d, got + got_len, 1500);
+        assert(w >= 0);
+        got_len += w;
+    }
+    assert(got_len == n * PKT_SZ + 70000);
+    assert(memcmp(got, sent, n * PKT_SZ) == 0 && memcmp(got + n * PKT_SZ, big, 70000) == 0);
+    assert(lost == 1);
+
+    uint8_t stray[FLOW_CTX_RELAY_HDR_SZ]; /* relay frames aren't taken without relaying set up */
+    flow_ctx_relay_hdr(stray, FLOW_CTX_RELAY_TO, (const uint8_t *) "dest-addr-123456", 0);
+    memcpy(s->rx_buff, stray, sizeof(stray));
+    s->rx_off = 0;
+    s->rx_len = sizeof(stray);
+    assert(flow_ctx_decode(s, got, 16) == -1);
+
+    destroy_compression_ctx(&s_relay);
+    destroy_compression_ctx(&d_relay);
+    fini(s, &s_shared);
+    fini(hub, &hub_shared);
+    fini(d, &d_shared);
+    free(s); free(hub); free(d); free(wire); free(sent); free(got); free(big); free(h.out);
+}
+
+int main() {
+    test_promotion_and_lru();
+    round_trip(0, 0);
+    round_trip(4, 0);
+    round_trip(4, 1);
+    round_trip(1, 1);
+    test_bad_ctx_id();
+    test_relay();
+    return 0;
+}
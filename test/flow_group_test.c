@@ -0,0 +1,91 @@
+#include "../src/flow_group.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+
+static size_t v4(uint8_t *p, uint8_t proto, uint8_t src, uint8_t dst, uint16_t sport, uint16_t dport, uint16_t frag_off) {
+    memset(p, 0, 60);
+    p[0] = 0x45;
+    p[6] = frag_off >> 8;
+    p[7] = frag_off & 0xFF;
+    p[9] = proto;
+    p[12] = 10; p[15] = src;
+    p[16] = 10; p[19] = dst;
+    p[20] = sport >> 8; p[21] = sport & 0xFF;
+    p[22] = dport >> 8; p[23] = dport & 0xFF;
+    p[30] = 0xAB; /* payload, must not matter */
+    return 60;
+}
+
+static size_t v6(uint8_t *p, uint8_t nh, uint8_t dst, uint16_t sport) {
+    memset(p, 0, 60);
+    p[0] = 0x60;
+    p[6] = nh;
+    p[23] = 1;
+    p[39] = dst;
+    p[40] = sport >> 8; p[41] = sport & 0xFF;
+    return 60;
+}
+
+static void test_key() {
+    uint8_t a[60], b[60];
+    size_t l = v4(a, IPPROTO_TCP, 1, 2, 1000, 80, 0);
+    v4(b, IPPROTO_TCP, 1, 2, 1000, 80, 0);
+    b[30] = 0xCD;
+    assert(flow_group_key(a, l) == flow_group_key(b, l));
+    v4(b, IPPROTO_TCP, 1, 2, 1001, 80, 0);
+    assert(flow_group_key(a, l) != flow_group_key(b, l));
+    v4(b, IPPROTO_TCP, 1, 3, 1000, 80, 0);
+    assert(flow_group_key(a, l) != flow_group_key(b, l));
+    v4(b, IPPROTO_UDP, 1, 2, 1000, 80, 0);
+    assert(flow_group_key(a, l) != flow_group_key(b, l));
+
+    /* ports aren't looked at for protocols without them and for non-first fragments */
+    l = v4(a, IPPROTO_GRE, 1, 2, 1000, 80, 0);
+    v4(b, IPPROTO_GRE, 1, 2, 2000, 90, 0);
+    assert(flow_group_key(a, l) == flow_group_key(b, l));
+    l = v4(a, IPPROTO_UDP, 1, 2, 1000, 80, 185);
+    v4(b, IPPROTO_UDP, 1, 2, 2000, 90, 185);
+    assert(flow_group_key(a, l) == flow_group_key(b, l));
+
+    l = v6(a, IPPROTO_TCP, 2, 1000);
+    v6(b, IPPROTO_TCP, 2, 1000);
+    assert(flow_group_key(a, l) == flow_group_key(b, l));
+    v6(b, IPPROTO_TCP, 3, 1000);
+    assert(flow_group_key(a, l) != flow_group_key(b, l));
+    v6(b, IPPROTO_TCP, 2, 1001);
+    assert(flow_group_key(a, l) != flow_group_key(b, l));
+    l = v6(a, 0 /* hop-by-hop */, 2, 1000);
+    v6(b, 0, 2, 1001);
+    assert(flow_group_key(a, l) == flow_group_key(b, l));
+
+    assert(flow_group_key(a, 10) == flow_group_key(a, 10)); /* too short / not IP, mustn't read past len */
+}
+
+static void test_order() {
+    uint64_t keys[] = {7, 3, 7, 9, 3, 7, 1};
+    uint8_t order[7];
+    uint8_t expected[] = {0, 2, 5, 1, 4, 3, 6};
+    flow_group_order(keys, 7, order);
+    assert(memcmp(order, expected, sizeof(expected)) == 0);
+
+    uint64_t same[FLOW_GROUP_MAX_PKTS], distinct[FLOW_GROUP_MAX_PKTS];
+    uint8_t o[FLOW_GROUP_MAX_PKTS];
+    for (int i = 0; i < FLOW_GROUP_MAX_PKTS; i++) {
+        same[i] = 42;
+        distinct[i] = i * 11;
+    }
+    flow_group_order(same, FLOW_GROUP_MAX_PKTS, o);
+    for (int i = 0; i < FLOW_GROUP_MAX_PKTS; i++) assert(o[i] == i);
+    flow_group_order(distinct, FLOW_GROUP_MAX_PKTS, o);
+    for (int i = 0; i < FLOW_GROUP_MAX_PKTS; i++) assert(o[i] == i);
+
+    flow_group_order(keys, 0, order);
+}
+
+int main() {
+    test_key();
+    test_order();
+    return 0;
+}
@@ -0,0 +1,178 @@
+#include "../src/gso.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#define MAX_SEGS 64
+
+static uint8_t pkt[70000];
+static uint8_t seg_buff[9000];
+
+struct segs_s {
+    int n;
+    size_t len[MAX_SEGS];
+    uint8_t *seg[MAX_SEGS];
+    int fail_at;
+};
+
+static int collect(void *seg, size_t len, void *_segs) {
+    struct segs_s *segs = _segs;
+    assert(segs->n < MAX_SEGS);
+    segs->seg[segs->n] = malloc(len);
+    memcpy(segs->seg[segs->n], seg, len);
+    segs->len[segs->n] = len;
+    return (segs->n++ == segs->fail_at) ? -1 : 0;
+}
+
+static void free_segs(struct segs_s *segs) {
+    for (int i = 0; i < segs->n; i++) free(segs->seg[i]);
+}
+
+static uint16_t rd16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t rd32(const uint8_t *p) {
+    return (((uint32_t) rd16(p)) << 16) | rd16(p + 2);
+}
+
+/* ones-complement sum of the region, folded, 0xFFFF => checksum in it is right */
+static uint16_t sum(uint32_t s, const uint8_t *p, size_t len) {
+    for (size_t i = 0; i < len; i += 2) s += (p[i] << 8) | ((i + 1 < len) ? p[i + 1] : 0);
+    while (s >> 16) s = (s & 0xFFFF) + (s >> 16);
+    return s;
+}
+
+static int l4_csum_ok(const uint8_t *p, size_t len) {
+    uint32_t s;
+    size_t hl;
+    if ((p[0] & 0xF0) == 0x40) {
+        hl = (p[0] & 0xF) * 4;
+        s = sum(0, p + 12, 8) + p[9] + (len - hl);
+    } else {
+        hl = 40;
+        s = sum(0, p + 8, 32) + p[6] + (len - hl);
+    }
+    return sum(s, p + hl, len - hl) == 0xFFFF;
+}
+
+static size_t mk_pkt(int v6, uint8_t proto, size_t payload_len, uint8_t tcp_flags) {
+    size_t hl = v6 ? 40 : 20, l4_hl = (proto == IPPROTO_TCP) ? 32 : 8; /* TCP with 12 bytes of options */
+    size_t len = hl + l4_hl + payload_len;
+    memset(pkt, 0, hl + l4_hl);
+    if (v6) {
+        pkt[0] = 0x60;
+        pkt[4] = (len - 40) >> 8; pkt[5] = (len - 40) & 0xFF;
+        pkt[6] = proto; pkt[7] = 64;
+        pkt[8] = 0xfd; pkt[23] = 1;
+        pkt[24] = 0xfd; pkt[39] = 2;
+    } else {
+        pkt[0] = 0x45;
+        pkt[2] = len >> 8; pkt[3] = len & 0xFF;
+        pkt[4] = 0xFF; pkt[5] = 0xFE; /* id, wraps after 2 segments */
+        pkt[6] = 0x40; /* DF */
+        pkt[8] = 64; pkt[9] = proto;
+        pkt[12] = 10; pkt[15] = 1;
+        pkt[16] = 10; pkt[19] = 2;
+    }
+    uint8_t *l4 = pkt + hl;
+    l4[0] = 0x30; l4[1] = 0x39; l4[2] = 0x00; l4[3] = 0x50;
+    if (proto == IPPROTO_TCP) {
+        l4[4] = 0xFF; l4[5] = 0xFF; l4[6] = 0xF0; l4[7] = 0x00; /* seq wraps mid-pkt */
+        l4[12] = (l4_hl / 4) << 4;
+        l4[13] = tcp_flags;
+        l4[14] = 0xFF; l4[15] = 0xFF;
+        l4[20] = 1; l4[21] = 1; l4[22] = 8; l4[23] = 10; /* NOP NOP timestamps */
+    } else {
+        l4[4] = (len - hl) >> 8; l4[5] = (len - hl) & 0xFF;
+    }
+    for (size_t i = 0; i < payload_len; i++) l4[l4_hl + i] = (i * 7) ^ (i >> 8);
+    return len;
+}
+
+static void test_csum() {
+    for (int v6 = 0; v6 < 2; v6++) {
+        size_t len = mk_pkt(v6, IPPROTO_UDP, 333, 0);
+        pkt[(v6 ? 40 : 20) + 6] = 0x12; /* partial (pseudo-header) sum, as handed over with offload */
+        assert(! l4_csum_ok(pkt, len));
+        assert(gso_fill_l4_csum(pkt, len) == 0);
+        assert(l4_csum_ok(pkt, len));
+        len = mk_pkt(v6, IPPROTO_TCP, 1001, 0x18);
+        assert(gso_fill_l4_csum(pkt, len) == 0);
+        assert(l4_csum_ok(pkt, len));
+        assert(gso_fill_l4_csum(pkt, len - 1) == -1); /* truncated */
+    }
+    size_t len = mk_pkt(0, IPPROTO_ICMP, 10, 0);
+    assert(gso_fill_l4_csum(pkt, len) == -1);
+}
+
+static void check_segments(int v6, size_t payload_len, size_t mtu) {
+    size_t len = mk_pkt(v6, IPPROTO_TCP, payload_len, 0x80 | 0x10 | 0x08 | 0x01); /* CWR ACK PSH FIN */
+    size_t hdr_len = (v6 ? 40 : 20) + 32, mss = mtu - hdr_len;
+    struct segs_s segs = {0};
+    segs.fail_at = -1;
+    assert(gso_segment_tcp(pkt, len, mtu, seg_buff, collect, &segs) == 0);
+    int expected = payload_len ? (payload_len + mss - 1) / mss : 1;
+    assert(segs.n == expected);
+    size_t off = 0;
+    for (int i = 0; i < segs.n; i++) {
+        uint8_t *s = segs.seg[i], *tcp = s + (v6 ? 40 : 20);
+        assert(segs.len[i] <= mtu);
+        assert(memcmp(s + hdr_len, pkt + hdr_len + off, segs.len[i] - hdr_len) == 0);
+        if (v6) {
+            assert(rd16(s + 4) == segs.len[i] - 40);
+        } else {
+            assert(rd16(s + 2) == segs.len[i]);
+            assert(rd16(s + 4) == (uint16_t) (0xFFFE + i));
+            assert(s[6] == 0x40);
+            assert(sum(0, s, 20) == 0xFFFF);
+        }
+        assert(rd32(tcp + 4) == (uint32_t) (0xFFFFF000 + off));
+        assert(memcmp(tcp + 20, pkt + (v6 ? 40 : 20) + 20, 12) == 0); /* options replicated */
+        int last = (i == segs.n - 1);
+        assert(tcp[13] == ((i == 0 ? 0x80 : 0) | 0x10 | (last ? 0x09 : 0)));
+        assert(l4_csum_ok(s, segs.len[i]));
+        off += segs.len[i] - hdr_len;
+    }
+    assert(off == payload_len);
+    free_segs(&segs);
+}
+
+static void test_segment() {
+    for (int v6 = 0; v6 < 2; v6++) {
+        check_segments(v6, 64000, 1500);
+        check_segments(v6, 65000 - (v6 ? 40 : 20), 9000);
+        check_segments(v6, 1400, 1500); /* fits, single segment */
+        check_segments(v6, 0, 1500);
+        check_segments(v6, 2 * (1500 - (v6 ? 72 : 52)), 1500); /* exact multiple of mss */
+    }
+}
+
+static void test_segment_failures() {
+    struct segs_s segs = {0};
+    size_t len = mk_pkt(0, IPPROTO_TCP, 10000, 0x10);
+    segs.fail_at = 2;
+    assert(gso_segment_tcp(pkt, len, 1500, seg_buff, collect, &segs) == 1);
+    assert(segs.n == 7);
+    free_segs(&segs);
+
+    memset(&segs, 0, sizeof(segs));
+    assert(gso_segment_tcp(pkt, len, 52, seg_buff, collect, &segs) == -1); /* no room for payload */
+    pkt[6] |= 0x20; /* MF */
+    assert(gso_segment_tcp(pkt, len, 1500, seg_buff, collect, &segs) == -1);
+    len = mk_pkt(0, IPPROTO_UDP, 10000, 0);
+    assert(gso_segment_tcp(pkt, len, 1500, seg_buff, collect, &segs) == -1);
+    len = mk_pkt(1, IPPROTO_TCP, 10000, 0x10);
+    pkt[6] = 0; /* hop-by-hop ext header */
+    assert(gso_segment_tcp(pkt, len, 1500, seg_buff, collect, &segs) == -1);
+    assert(segs.n == 0);
+}
+
+int main() {
+    test_csum();
+    test_segment();
+    test_segment_failures();
+    return 0;
+}
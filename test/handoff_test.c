@@ -0,0 +1,85 @@
+#include "../src/handoff.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define BLOB_SZ (3 * HANDOFF_CHUNK + 123)
+
+static void fill(uint8_t *b, size_t len) {
+    for (size_t i = 0; i < len; i++) b[i] = (uint8_t) (i * 7 + (i >> 11));
+}
+
+/* child passes a pipe and a blob that spans chunks, then an empty record, parent reads through the pipe */
+static void test_send_recv() {
+    int sv[2], p[2];
+    assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+    assert(pipe(p) == 0);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        close(sv[0]);
+        uint8_t *blob = malloc(BLOB_SZ);
+        fill(blob, BLOB_SZ);
+        if (handoff_send(sv[1], HANDOFF_TUN, p[1], blob, BLOB_SZ) != 0) _exit(1);
+        if (handoff_send(sv[1], HANDOFF_DONE, -1, NULL, 0) != 0) _exit(1);
+        _exit(0);
+    }
+    close(sv[1]);
+    close(p[1]);
+
+    int typ, fd;
+    void *data;
+    ssize_t len = handoff_recv(sv[0], &typ, &fd, &data);
+    assert(len == BLOB_SZ && typ == HANDOFF_TUN && fd >= 0);
+    uint8_t *expected = malloc(BLOB_SZ);
+    fill(expected, BLOB_SZ);
+    assert(memcmp(data, expected, BLOB_SZ) == 0);
+    free(expected);
+    free(data);
+
+    len = handoff_recv(sv[0], &typ, &fd, &data);
+    assert(len == 0 && typ == HANDOFF_DONE && data == NULL);
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(handoff_recv(sv[0], &typ, &fd, &data) == -1); /* peer gone */
+    close(sv[0]);
+    close(p[0]);
+}
+
+static void test_listen_connect() {
+    char path[] = "/tmp/handoff_test.XXXXXX";
+    int tmp = mkstemp(path); /* stale file in the way */
+    assert(tmp >= 0);
+    close(tmp);
+    int lstn = handoff_listen(path);
+    assert(lstn >= 0);
+    int c = handoff_connect(path);
+    assert(c >= 0);
+    int s = accept(lstn, NULL, NULL);
+    assert(s >= 0);
+
+    handoff_hello_t hello = {HANDOFF_VERSION, "zlib"};
+    assert(handoff_send(c, HANDOFF_HELLO, -1, &hello, sizeof(hello)) == 0);
+    int typ, fd;
+    void *data;
+    assert(handoff_recv(s, &typ, &fd, &data) == sizeof(hello));
+    assert(typ == HANDOFF_HELLO && fd == -1 && memcmp(data, &hello, sizeof(hello)) == 0);
+    free(data);
+
+    close(c);
+    close(s);
+    close(lstn);
+    unlink(path);
+    assert(handoff_connect(path) == -1);
+}
+
+int main() {
+    test_send_recv();
+    test_listen_connect();
+    return 0;
+}
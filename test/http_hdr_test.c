@@ -0,0 +1,262 @@
+#include "../src/http_hdr.h"
+#include "../src/compress.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#define ORIGINAL_PCAP_FILE "http.pcap.original"
+#define PKT_MAX (0xFFFF + 40)
+
+static const char *req =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Cookie: session=0123456789abcdef\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static size_t tcp_pkt(uint8_t *p, int v6, const char *payload, size_t payload_len) {
+    size_t l3_len = v6 ? 40 : 20, len = l3_len + 20 + payload_len;
+    memset(p, 0, l3_len + 20);
+    if (v6) {
+        p[0] = 0x60;
+        p[4] = (len - 40) >> 8;
+        p[5] = (len - 40) & 0xFF;
+        p[6] = IPPROTO_TCP;
+        p[23] = 1; p[39] = 2;
+    } else {
+        p[0] = 0x45;
+        p[2] = len >> 8;
+        p[3] = len & 0xFF;
+        p[9] = IPPROTO_TCP;
+        p[10] = 0xAB; p[11] = 0xCD; /* checksum, left alone */
+        p[12] = 10; p[15] = 1;
+        p[16] = 10; p[19] = 2;
+    }
+    p[l3_len + 12] = 5 << 4;
+    p[l3_len + 16] = 0x12; p[l3_len + 17] = 0x34;
+    memcpy(p + l3_len + 20, payload, payload_len);
+    return len;
+}
+
+static uint8_t enc[PKT_MAX]; /* what round_trip sent */
+
+/* encode, decode and commit both ends, returns the encoded length (0 => went as is) */
+static ssize_t round_trip(http_hdr_tab_t *tx, http_hdr_tab_t *rx, const uint8_t *pkt, size_t len) {
+    static uint8_t dec[PKT_MAX];
+    ssize_t e = http_hdr_encode(tx, pkt, len, enc, sizeof(enc));
+    if (e < 0) return 0;
+    assert(e < (ssize_t) len && http_hdr_is_encoded(enc, e));
+    assert(http_hdr_decode(rx, enc, e, dec, sizeof(dec)) == (ssize_t) len);
+    assert(memcmp(dec, pkt, len) == 0);
+    http_hdr_commit(tx, pkt);
+    http_hdr_commit(rx, dec);
+    return e;
+}
+
+static void test_round_trip() {
+    uint8_t p[2048];
+    http_hdr_tab_t tx, rx;
+    http_hdr_init(&tx);
+    http_hdr_init(&rx);
+    for (int v6 = 0; v6 < 2; v6++) {
+        size_t len = tcp_pkt(p, v6, req, strlen(req));
+        ssize_t first = round_trip(&tx, &rx, p, len);
+        assert(first > 0);
+        assert(tx.count == 4 && rx.count == 4); /* request line, Host, User-Agent and Cookie, the rest is static */
+        ssize_t again = round_trip(&tx, &rx, p, len);
+        assert(again > 0 && (v6 ? again == first : again < first)); /* v6 found everything in the table already */
+    }
+
+    /* body and an incomplete line after the headers go as they are */
+    char resp[512];
+    int n = snprintf(resp, sizeof(resp), "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nServer: x\r\n\r\nhello\r\nX-Part");
+    size_t len = tcp_pkt(p, 0, resp, n);
+    assert(round_trip(&tx, &rx, p, len) > 0);
+    n = snprintf(resp, sizeof(resp), "HTTP/1.1 200 OK\r\nDate: Mon, 01 Jan 2024 00:00:00 GMT\r\nX-Cut-Short: abc");
+    len = tcp_pkt(p, 1, resp, n);
+    assert(round_trip(&tx, &rx, p, len) > 0);
+
+    /* not HTTP, or nothing to gain */
+    len = tcp_pkt(p, 0, "SSH-2.0-OpenSSH_9.0\r\n", 21);
+    assert(round_trip(&tx, &rx, p, len) == 0);
+    len = tcp_pkt(p, 0, "GET / HTTP/1.1", 14);
+    assert(round_trip(&tx, &rx, p, len) == 0);
+    http_hdr_destroy(&tx);
+    http_hdr_destroy(&rx);
+}
+
+static void test_uncommitted() {
+    uint8_t p[2048], dec[2048];
+    http_hdr_tab_t tx, rx;
+    http_hdr_init(&tx);
+    http_hdr_init(&rx);
+    size_t len = tcp_pkt(p, 0, req, strlen(req));
+    ssize_t e = http_hdr_encode(&tx, p, len, enc, sizeof(enc));
+    assert(e > 0 && tx.count == 0); /* dropped, never committed */
+    e = http_hdr_encode(&tx, p, len, enc, sizeof(enc));
+    assert(http_hdr_decode(&rx, enc, e, dec, sizeof(dec)) == (ssize_t) len);
+    http_hdr_commit(&tx, p);
+    http_hdr_commit(&rx, dec);
+    assert(tx.count == rx.count && tx.count == 4);
+
+    /* a decoder behind the encoder is caught on references it doesn't have */
+    e = http_hdr_encode(&tx, p, len, enc, sizeof(enc));
+    http_hdr_reset(&rx);
+    assert(http_hdr_decode(&rx, enc, e, dec, sizeof(dec)) < 0);
+    http_hdr_destroy(&tx);
+    http_hdr_destroy(&rx);
+}
+
+static void test_malformed() {
+    uint8_t p[2048], dec[2048];
+    http_hdr_tab_t tx, rx;
+    http_hdr_init(&tx);
+    http_hdr_init(&rx);
+    size_t len = tcp_pkt(p, 0, req, strlen(req));
+    p[6] = 0x20; /* fragment */
+    assert(http_hdr_encode(&tx, p, len, enc, sizeof(enc)) < 0);
+    p[6] = 0;
+    assert(http_hdr_encode(&tx, p, len - 1, enc, sizeof(enc)) < 0); /* length field disagrees */
+    p[9] = IPPROTO_UDP;
+    assert(http_hdr_encode(&tx, p, len, enc, sizeof(enc)) < 0);
+    p[9] = IPPROTO_TCP;
+    assert(http_hdr_encode(&tx, p, len, enc, 60) < 0); /* no room */
+
+    ssize_t e = http_hdr_encode(&tx, p, len, enc, sizeof(enc));
+    assert(e > 0);
+    assert(http_hdr_decode(&rx, enc, e, dec, len - 1) < 0);
+    for (ssize_t cut = e - 1; cut > 40; cut--) { /* truncated tokens (length fixed up to match) */
+        enc[2] = cut >> 8;
+        enc[3] = cut & 0xFF;
+        ssize_t d = http_hdr_decode(&rx, enc, cut, dec, sizeof(dec));
+        assert(d < 0 || d < (ssize_t) len);
+    }
+    enc[2] = e >> 8;
+    enc[3] = e & 0xFF;
+    enc[40] = 0x7F; /* unknown op */
+    assert(http_hdr_decode(&rx, enc, e, dec, sizeof(dec)) < 0);
+    enc[40] = 0xFF; /* line-ref past the table */
+    assert(http_hdr_decode(&rx, enc, e, dec, sizeof(dec)) < 0);
+    const uint8_t huge_line[] = {0x03, 0xFF, 0xFF, 0xFF, 0xFF, 0x0F, 0x00}, huge_name[] = {0x02, 0xFF, 0xFF, 0xFF, 0xFF, 0x0F, 0x00, 0x00};
+    memcpy(enc + 40, huge_line, sizeof(huge_line)); /* line-ref varints at and past 2^31 */
+    enc[2] = 0;
+    enc[3] = 40 + sizeof(huge_line);
+    assert(http_hdr_decode(&rx, enc, 40 + sizeof(huge_line), dec, sizeof(dec)) < 0);
+    enc[44] = 0x07;
+    assert(http_hdr_decode(&rx, enc, 40 + sizeof(huge_line), dec, sizeof(dec)) < 0);
+    memcpy(enc + 40, huge_name, sizeof(huge_name));
+    enc[3] = 40 + sizeof(huge_name);
+    assert(http_hdr_decode(&rx, enc, 40 + sizeof(huge_name), dec, sizeof(dec)) < 0);
+    assert(! http_hdr_is_encoded(p, len));
+    http_hdr_destroy(&tx);
+    http_hdr_destroy(&rx);
+}
+
+static void test_export() {
+    uint8_t p[2048], dec[2048];
+    http_hdr_tab_t tx, rx, taken;
+    http_hdr_init(&tx);
+    http_hdr_init(&rx);
+    http_hdr_init(&taken);
+    size_t len = tcp_pkt(p, 0, req, strlen(req));
+    round_trip(&tx, &rx, p, len);
+    size_t sz = http_hdr_export_sz(&rx);
+    uint8_t *blob = malloc(sz);
+    http_hdr_export(&rx, blob);
+    assert(http_hdr_import(&taken, blob, sz - 1) != 0);
+    assert(http_hdr_import(&taken, blob, sz) == 0 && taken.count == rx.count);
+    ssize_t e = http_hdr_encode(&tx, p, len, enc, sizeof(enc));
+    assert(http_hdr_decode(&taken, enc, e, dec, sizeof(dec)) == (ssize_t) len && memcmp(dec, p, len) == 0);
+    free(blob);
+
+    http_hdr_destroy(&rx);
+    http_hdr_init(&rx); /* empty table round-trips too */
+    uint8_t empty[1];
+    assert(http_hdr_export_sz(&rx) == 1);
+    http_hdr_export(&rx, empty);
+    assert(http_hdr_import(&taken, empty, 1) == 0 && taken.count == 0);
+    http_hdr_destroy(&tx);
+    http_hdr_destroy(&taken);
+}
+
+static size_t compressed_sz(compress_t *comp, uint8_t *pkt, size_t len) {
+    static uint8_t out[2 * PKT_MAX];
+    size_t total = 0;
+    int complete = 0;
+    setup_compress_input(comp, pkt, len);
+    while (! complete) {
+        ssize_t consumed;
+        ssize_t n = do_compress(comp, out, sizeof(out), &consumed, &complete);
+        assert(n >= 0);
+        total += n;
+    }
+    return total;
+}
+
+/* every pkt of the capture round-trips, and the ratio (flushed per pkt, as conns do) with and without coding */
+static void test_pcap() {
+    FILE *f = fopen(ORIGINAL_PCAP_FILE, "r");
+    assert(f != NULL);
+    uint8_t gh[24], rh[16];
+    static uint8_t frame[PKT_MAX + 14];
+    assert(fread(gh, 1, sizeof(gh), f) == sizeof(gh));
+    assert(gh[0] == 0xd4 && gh[1] == 0xc3 && gh[20] == 1); /* little-endian, ethernet */
+
+    http_hdr_tab_t tx, rx;
+    http_hdr_init(&tx);
+    http_hdr_init(&rx);
+    compress_t plain, coded;
+    memset(&plain, 0, sizeof(plain));
+    memset(&coded, 0, sizeof(coded));
+    assert(init_compression_ctx(&plain, DEFAULT_COMPRESSION_LEVEL) == 0);
+    assert(init_compression_ctx(&coded, DEFAULT_COMPRESSION_LEVEL) == 0);
+
+    int pkts = 0, http_pkts = 0;
+    size_t in = 0, coded_in = 0, plain_out = 0, coded_out = 0;
+    while (fread(rh, 1, sizeof(rh), f) == sizeof(rh)) {
+        uint32_t caplen = rh[8] | (rh[9] << 8) | (rh[10] << 16) | ((uint32_t) rh[11] << 24);
+        assert(caplen <= sizeof(frame) && fread(frame, 1, caplen, f) == caplen);
+        uint8_t *p = frame + 14;
+        if (caplen < 14 + 40 || (p[0] & 0xF0) != 0x40) continue;
+        size_t len = (p[2] << 8) | p[3];
+        if (len > caplen - 14) continue; /* snapped */
+        pkts++;
+        in += len;
+        plain_out += compressed_sz(&plain, p, len);
+        ssize_t e = round_trip(&tx, &rx, p, len);
+        if (e > 0) {
+            http_pkts++;
+            coded_in += e;
+            coded_out += compressed_sz(&coded, enc, e);
+        } else {
+            coded_in += len;
+            coded_out += compressed_sz(&coded, p, len);
+        }
+    }
+    fclose(f);
+
+    printf("%d pkts (%d with HTTP headers), %zu bytes: compressed to %zu (%.3f), coded %zu then compressed to %zu (%.3f)\n",
+           pkts, http_pkts, in, plain_out, (double) plain_out / in, coded_in, coded_out, (double) coded_out / in);
+    assert(http_pkts > 0 && coded_in < in);
+#ifdef USE_ZLIB
+    assert(coded_out < plain_out); /* zstd's window holds on to earlier headers already, it gains next to nothing */
+#endif
+    destroy_compression_ctx(&plain);
+    destroy_compression_ctx(&coded);
+    http_hdr_destroy(&tx);
+    http_hdr_destroy(&rx);
+}
+
+int main() {
+    test_round_trip();
+    test_uncommitted();
+    test_malformed();
+    test_export();
+    test_pcap();
+    return 0;
+}
@@ -0,0 +1,167 @@
+#include "../src/lpm.h"
+#include "../src/log.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define RANDOM_ROUTES 2000
+#define RANDOM_LOOKUPS 200000
+
+static lpm_prefix_t prefix(const char *s) {
+    lpm_prefix_t p;
+    assert(lpm_parse_prefix(s, &p) == 0);
+    return p;
+}
+
+static uint16_t lookup(lpm_t *lpm, const char *addr) {
+    lpm_prefix_t p = prefix(addr);
+    return (p.af == AF_INET) ? lpm_lookup_v4(lpm, p.addr) : lpm_lookup_v6(lpm, p.addr);
+}
+
+static void test_parse() {
+    lpm_prefix_t p;
+    char buff[64];
+    assert(lpm_parse_prefix("10.1.2.3/16", &p) == 0);
+    assert(p.af == AF_INET && p.len == 16);
+    assert(strcmp(lpm_prefix_str(&p, buff, sizeof(buff)), "10.1.0.0/16") == 0);
+    assert(lpm_parse_prefix("10.1.2.3", &p) == 0 && p.len == 32);
+    assert(lpm_parse_prefix("2001:db8::1/33", &p) == 0);
+    assert(p.af == AF_INET6 && p.len == 33);
+    assert(strcmp(lpm_prefix_str(&p, buff, sizeof(buff)), "2001:db8::/33") == 0);
+    assert(lpm_parse_prefix("10.1.2.3/33", &p) != 0);
+    assert(lpm_parse_prefix("10.1.2.3/", &p) != 0);
+    assert(lpm_parse_prefix("10.1.2.3/8x", &p) != 0);
+    assert(lpm_parse_prefix("not-an-address/8", &p) != 0);
+    assert(lpm_parse_prefix("::/129", &p) != 0);
+}
+
+static void test_nested_v4() {
+    lpm_t lpm;
+    lpm_init(&lpm);
+    lpm_prefix_t p;
+    p = prefix("10.0.0.0/8"); assert(lpm_add(&lpm, &p, 1) == 0);
+    p = prefix("10.1.2.128/25"); assert(lpm_add(&lpm, &p, 3) == 0); /* added before its parent on purpose */
+    p = prefix("10.1.0.0/16"); assert(lpm_add(&lpm, &p, 2) == 0);
+    p = prefix("10.1.2.200"); assert(lpm_add(&lpm, &p, 4) == 0);
+    assert(lpm_build(&lpm) == 0);
+    assert(lookup(&lpm, "10.200.0.1") == 1);
+    assert(lookup(&lpm, "10.1.3.1") == 2);
+    assert(lookup(&lpm, "10.1.2.1") == 2); /* same /24 as the /25, but outside it */
+    assert(lookup(&lpm, "10.1.2.129") == 3);
+    assert(lookup(&lpm, "10.1.2.200") == 4);
+    assert(lookup(&lpm, "11.0.0.1") == 0);
+    lpm_destroy(&lpm);
+}
+
+static void test_default_routes() {
+    lpm_t lpm;
+    lpm_init(&lpm);
+    lpm_prefix_t p;
+    p = prefix("0.0.0.0/0"); assert(lpm_add(&lpm, &p, 7) == 0);
+    p = prefix("::/0"); assert(lpm_add(&lpm, &p, 8) == 0);
+    assert(lpm_build(&lpm) == 0);
+    assert(lpm.tbl24 == NULL); /* default alone doesn't need the table */
+    assert(lookup(&lpm, "192.168.1.1") == 7);
+    assert(lookup(&lpm, "2001:db8::1") == 8);
+    lpm_destroy(&lpm);
+}
+
+static void test_nested_v6() {
+    lpm_t lpm;
+    lpm_init(&lpm);
+    lpm_prefix_t p;
+    p = prefix("2001:db8:1::/48"); assert(lpm_add(&lpm, &p, 2) == 0);
+    p = prefix("2001:db8::/32"); assert(lpm_add(&lpm, &p, 1) == 0);
+    p = prefix("2001:db8:1:2::/64"); assert(lpm_add(&lpm, &p, 3) == 0);
+    p = prefix("2001:db8:2::/48"); assert(lpm_add(&lpm, &p, 4) == 0);
+    p = prefix("2001:db8:1:2::5"); assert(lpm_add(&lpm, &p, 5) == 0);
+    assert(lpm_build(&lpm) == 0);
+    assert(lookup(&lpm, "2001:db8:ffff::1") == 1);
+    assert(lookup(&lpm, "2001:db8:1:ffff::1") == 2);
+    assert(lookup(&lpm, "2001:db8:1:2::1") == 3);
+    assert(lookup(&lpm, "2001:db8:1:2::5") == 5);
+    assert(lookup(&lpm, "2001:db8:2::9") == 4);
+    assert(lookup(&lpm, "2001:db9::1") == 0);
+    lpm_destroy(&lpm);
+}
+
+static uint16_t naive_lookup(lpm_prefix_t *routes, uint16_t *nhs, uint8_t *shadowed, int n, int af, uint8_t *addr) {
+    int best_len = -1;
+    uint16_t best = 0;
+    for (int i = 0; i < n; i++) {
+        if (shadowed[i] || routes[i].af != af || routes[i].len <= best_len) continue;
+        int match = 1;
+        for (int b = 0; b < routes[i].len && match; b++) {
+            match = ((addr[b / 8] ^ routes[i].addr[b / 8]) & (0x80 >> (b % 8))) == 0;
+        }
+        if (match) {
+            best_len = routes[i].len;
+            best = nhs[i];
+        }
+    }
+    return best;
+}
+
+static void random_addr(int af, uint8_t *addr, lpm_prefix_t *near) {
+    int bytes = (af == AF_INET) ? 4 : 16;
+    for (int i = 0; i < bytes; i++) addr[i] = rand() & 0xFF;
+    if (near != NULL) { /* mostly keep the leading bits of an existing route to exercise deep matches */
+        int keep = rand() % (near->len + 1);
+        for (int b = 0; b < keep; b++) {
+            uint8_t mask = 0x80 >> (b % 8);
+            addr[b / 8] = (addr[b / 8] & ~mask) | (near->addr[b / 8] & mask);
+        }
+    }
+}
+
+static void test_against_naive(int af) {
+    lpm_t lpm;
+    lpm_init(&lpm);
+    lpm_prefix_t *routes = calloc(RANDOM_ROUTES, sizeof(lpm_prefix_t));
+    uint16_t *nhs = calloc(RANDOM_ROUTES, sizeof(uint16_t));
+    uint8_t *shadowed = calloc(RANDOM_ROUTES, sizeof(uint8_t));
+    int max_len = (af == AF_INET) ? 32 : 128;
+    srand(af);
+    for (int i = 0; i < RANDOM_ROUTES; i++) {
+        routes[i].af = af;
+        random_addr(af, routes[i].addr, (i > 0 && rand() % 2) ? &routes[rand() % i] : NULL);
+        routes[i].len = (af == AF_INET) ? 8 + rand() % 25 : 16 + rand() % 113;
+        if (routes[i].len > max_len) routes[i].len = max_len;
+        char buff[64];
+        lpm_prefix_str(&routes[i], buff, sizeof(buff));
+        assert(lpm_parse_prefix(buff, &routes[i]) == 0); /* clears host bits */
+        nhs[i] = 1 + i % LPM_MAX_NH;
+        assert(lpm_add(&lpm, &routes[i], nhs[i]) == 0);
+    }
+    assert(lpm_build(&lpm) == 0);
+    /* duplicates: later lpm_add for the same prefix wins in the table, mirror that in the naive view */
+    for (int i = 0; i < RANDOM_ROUTES; i++) {
+        for (int j = i + 1; j < RANDOM_ROUTES; j++) {
+            if (routes[i].len == routes[j].len && memcmp(routes[i].addr, routes[j].addr, 16) == 0) shadowed[i] = 1;
+        }
+    }
+    for (int i = 0; i < RANDOM_LOOKUPS; i++) {
+        uint8_t addr[16] = {0};
+        random_addr(af, addr, (rand() % 4) ? &routes[rand() % RANDOM_ROUTES] : NULL);
+        uint16_t expected = naive_lookup(routes, nhs, shadowed, RANDOM_ROUTES, af, addr);
+        uint16_t actual = (af == AF_INET) ? lpm_lookup_v4(&lpm, addr) : lpm_lookup_v6(&lpm, addr);
+        assert(expected == actual);
+    }
+    free(routes);
+    free(nhs);
+    free(shadowed);
+    lpm_destroy(&lpm);
+}
+
+int main() {
+    log_init(0, "lpm_test");
+    test_parse();
+    test_nested_v4();
+    test_default_routes();
+    test_nested_v6();
+    test_against_naive(AF_INET);
+    test_against_naive(AF_INET6);
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include "../src/maglev.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define KEY_SZ 16
+
+static void keys_of(uint8_t *keys, int n) {
+    memset(keys, 0, n * KEY_SZ);
+    for (int i = 0; i < n; i++) {
+        keys[i * KEY_SZ] = 10;
+        keys[i * KEY_SZ + 3] = i + 1; /* 10.0.0.<i+1> */
+    }
+}
+
+static void shares(maglev_t *m, int *count) {
+    memset(count, 0, MAGLEV_MAX_MEMBERS * sizeof(int));
+    for (int c = 0; c < MAGLEV_TABLE_SZ; c++) {
+        assert(m->entry[c] != MAGLEV_NONE);
+        count[m->entry[c]]++;
+    }
+}
+
+static void test_even() {
+    maglev_t m;
+    uint8_t keys[MAGLEV_MAX_MEMBERS * KEY_SZ], up[MAGLEV_MAX_MEMBERS];
+    int count[MAGLEV_MAX_MEMBERS];
+    assert(maglev_init(&m) == 0);
+    for (int n = 1; n <= MAGLEV_MAX_MEMBERS; n++) {
+        keys_of(keys, n);
+        memset(up, 1, n);
+        assert(maglev_build(&m, keys, KEY_SZ, n, up) == n);
+        shares(&m, count);
+        for (int i = 0; i < n; i++) assert(count[i] == MAGLEV_TABLE_SZ / n || count[i] == MAGLEV_TABLE_SZ / n + 1);
+    }
+    maglev_destroy(&m);
+}
+
+/* slots that changed hands though neither member went down or came back */
+static int moved(const uint8_t *before, const uint8_t *after, int changed) {
+    int n = 0;
+    for (int c = 0; c < MAGLEV_TABLE_SZ; c++) {
+        if (before[c] != after[c] && before[c] != changed && after[c] != changed) n++;
+    }
+    return n;
+}
+
+static void test_disruption() {
+    maglev_t m;
+    uint8_t keys[8 * KEY_SZ], up[8], before[MAGLEV_TABLE_SZ];
+    assert(maglev_init(&m) == 0);
+    keys_of(keys, 8);
+    memset(up, 1, 8);
+    maglev_build(&m, keys, KEY_SZ, 8, up);
+    memcpy(before, m.entry, MAGLEV_TABLE_SZ);
+
+    up[3] = 0;
+    assert(maglev_build(&m, keys, KEY_SZ, 8, up) == 7);
+    int n = moved(before, m.entry, 3);
+    printf("member down: %d of %d slots of the others moved\n", n, MAGLEV_TABLE_SZ);
+    assert(n < MAGLEV_TABLE_SZ / 50);
+    for (int c = 0; c < MAGLEV_TABLE_SZ; c++) assert(m.entry[c] != 3);
+
+    up[3] = 1;
+    maglev_build(&m, keys, KEY_SZ, 8, up);
+    assert(memcmp(before, m.entry, MAGLEV_TABLE_SZ) == 0); /* back where it was */
+
+    /* nobody up, then just one */
+    memset(up, 0, 8);
+    assert(maglev_build(&m, keys, KEY_SZ, 8, up) == 0);
+    assert(maglev_lookup(&m, 12345) == -1);
+    up[5] = 1;
+    assert(maglev_build(&m, keys, KEY_SZ, 8, up) == 1);
+    for (uint64_t h = 0; h < 10000; h += 7) assert(maglev_lookup(&m, h) == 5);
+    maglev_destroy(&m);
+}
+
+int main() {
+    test_even();
+    test_disruption();
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include "../src/mss.h"
+#include <assert.h>
+#include <string.h>
+#include <netinet/in.h>
+
+static uint32_t sum16(uint32_t sum, const uint8_t *p, size_t len) {
+    for (size_t i = 0; i + 1 < len; i += 2) sum += (p[i] << 8) | p[i + 1];
+    if (len & 1) sum += p[len - 1] << 8;
+    return sum;
+}
+
+/* TCP checksum over the pseudo-header, 0 => pkt's checksum checks out */
+static uint16_t tcp_csum(const uint8_t *p, size_t l3_len, size_t len) {
+    uint32_t sum;
+    if (l3_len == 20) {
+        sum = sum16(0, p + 12, 8);
+    } else {
+        sum = sum16(0, p + 8, 32);
+    }
+    sum += IPPROTO_TCP + (len - l3_len);
+    sum = sum16(sum, p + l3_len, len - l3_len);
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum & 0xFFFF;
+}
+
+static void fill_csum(uint8_t *p, size_t l3_len, size_t len) {
+    p[l3_len + 16] = p[l3_len + 17] = 0;
+    uint16_t c = tcp_csum(p, l3_len, len);
+    p[l3_len + 16] = c >> 8;
+    p[l3_len + 17] = c & 0xFF;
+}
+
+/* SYN with NOP, window-scale and MSS options (and some payload, as with TFO) */
+static size_t syn(uint8_t *p, int v6, uint16_t mss, uint8_t flags) {
+    size_t l3_len = v6 ? 40 : 20, len = l3_len + 32 + 5;
+    memset(p, 0, len);
+    if (v6) {
+        p[0] = 0x60;
+        p[5] = len - 40;
+        p[6] = IPPROTO_TCP;
+        p[23] = 1; p[39] = 2;
+    } else {
+        p[0] = 0x45;
+        p[3] = len;
+        p[9] = IPPROTO_TCP;
+        p[12] = 10; p[15] = 1;
+        p[16] = 10; p[19] = 2;
+    }
+    uint8_t *t = p + l3_len;
+    t[0] = 0x9c; t[1] = 0x40; t[3] = 80;
+    t[12] = 8 << 4;
+    t[13] = flags;
+    uint8_t opts[12] = {1, 3, 3, 7, 2, 4, mss >> 8, mss & 0xFF, 1, 1, 0, 0};
+    memcpy(t + 20, opts, sizeof(opts));
+    memcpy(t + 32, "hello", 5);
+    fill_csum(p, l3_len, len);
+    return len;
+}
+
+static uint16_t mss_of(const uint8_t *p, size_t l3_len) {
+    return (p[l3_len + 26] << 8) | p[l3_len + 27];
+}
+
+static void test_v4() {
+    uint8_t p[100];
+    size_t len = syn(p, 0, 65495, 0x02);
+    assert(mss_clamp(p, len, 1500) == 1);
+    assert(mss_of(p, 20) == 1460 && tcp_csum(p, 20, len) == 0);
+    assert(mss_clamp(p, len, 1500) == 0); /* fits already */
+    assert(mss_clamp(p, len, 9000) == 0); /* never raised */
+
+    len = syn(p, 0, 65495, 0x12); /* SYN-ACK */
+    assert(mss_clamp(p, len, 9000) == 1);
+    assert(mss_of(p, 20) == 8960 && tcp_csum(p, 20, len) == 0);
+
+    len = syn(p, 0, 65495, 0x10); /* not a SYN */
+    assert(mss_clamp(p, len, 1500) == 0 && mss_of(p, 20) == 65495);
+
+    len = syn(p, 0, 65495, 0x02);
+    p[7] = 10; /* non-first fragment */
+    assert(mss_clamp(p, len, 1500) == 0);
+}
+
+static void test_v6() {
+    uint8_t p[100];
+    size_t len = syn(p, 1, 65475, 0x02);
+    assert(mss_clamp(p, len, 1500) == 1);
+    assert(mss_of(p, 40) == 1440 && tcp_csum(p, 40, len) == 0);
+    len = syn(p, 1, 65475, 0x02);
+    assert(mss_clamp(p, len, 0xFFFF) == 0); /* 65475 fits a 64k MTU */
+    p[6] = 0; /* hop-by-hop, not walked */
+    assert(mss_clamp(p, len, 1500) == 0);
+}
+
+static void test_malformed() {
+    uint8_t p[100];
+    size_t len = syn(p, 0, 65495, 0x02);
+    assert(mss_clamp(p, 20 + 28, 1500) == 0); /* options cut short */
+    p[20 + 25] = 0; /* MSS option of length 0 */
+    assert(mss_clamp(p, len, 1500) == 0);
+    len = syn(p, 0, 65495, 0x02);
+    p[20 + 20] = 0; /* end of options before MSS */
+    assert(mss_clamp(p, len, 1500) == 0);
+    len = syn(p, 0, 65495, 0x02);
+    assert(mss_clamp(p, len, 40) == 0); /* no room for any payload */
+}
+
+int main() {
+    test_v4();
+    test_v6();
+    test_malformed();
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include "../src/pep.h"
+#include <assert.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+static void v4_tuple(uint8_t *tuple) {
+    struct in_addr c, s;
+    inet_pton(AF_INET, "10.0.0.1", &c);
+    inet_pton(AF_INET, "10.50.0.5", &s);
+    pep_tuple(tuple, AF_INET, &c, 40000, &s, 80);
+}
+
+static uint16_t csum(const uint8_t *p, size_t len) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < len; i += 2) sum += (p[i] << 8) | p[i + 1];
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return sum;
+}
+
+static void test_tuple() {
+    uint8_t tuple[PEP_TUPLE_SZ];
+    uint16_t port;
+    v4_tuple(tuple);
+    assert(pep_tuple_af(tuple) == AF_INET);
+    const uint8_t *a = pep_tuple_addr(tuple, 0, &port);
+    assert(port == 40000 && a[0] == 10 && a[3] == 1);
+    a = pep_tuple_addr(tuple, 1, &port);
+    assert(port == 80 && a[1] == 50 && a[3] == 5);
+    assert(pep_hdr_len(tuple) == 20 + PEP_HDR_SZ);
+}
+
+static void test_v4_round_trip() {
+    uint8_t out[PEP_MSG_MAX];
+    pep_msg_t m = {PEP_DATA, 0, 0, {0}, NULL, 5}, d;
+    v4_tuple(m.tuple);
+    memcpy(out + pep_hdr_len(m.tuple), "hello", 5);
+    size_t len = pep_encode(&m, out);
+    assert(len == 20 + PEP_HDR_SZ + 5);
+    assert(pep_is_msg(out, len));
+    assert(csum(out, 20) == 0xFFFF);
+    assert(out[12] == 10 && out[15] == 1 && out[17] == 50); /* client => server */
+    assert(pep_decode(out, len, &d) == 0);
+    assert(d.op == PEP_DATA && d.len == 5 && memcmp(d.data, "hello", 5) == 0);
+    assert(memcmp(d.tuple, m.tuple, PEP_TUPLE_SZ) == 0);
+
+    /* server's messages go the other way, same tuple */
+    pep_msg_t ack = {PEP_ACK, PEP_FROM_SERVER, 0xDEADBEEF, {0}, NULL, 0};
+    v4_tuple(ack.tuple);
+    len = pep_encode(&ack, out);
+    assert(out[12] == 10 && out[13] == 50 && out[19] == 1);
+    assert(out[20 + 2] == 0 && out[20 + 3] == 80);
+    assert(pep_decode(out, len, &d) == 0);
+    assert(d.op == PEP_ACK && d.flags == PEP_FROM_SERVER && d.arg == 0xDEADBEEF && d.len == 0);
+    assert(memcmp(d.tuple, ack.tuple, PEP_TUPLE_SZ) == 0);
+}
+
+static void test_v6_round_trip() {
+    uint8_t out[PEP_MSG_MAX], tuple[PEP_TUPLE_SZ];
+    struct in6_addr c, s;
+    inet_pton(AF_INET6, "fd00::1", &c);
+    inet_pton(AF_INET6, "fd50::5", &s);
+    pep_tuple(tuple, AF_INET6, &c, 1234, &s, 443);
+    assert(pep_tuple_af(tuple) == AF_INET6);
+    pep_msg_t m = {PEP_FIN, PEP_FROM_SERVER, 0, {0}, NULL, 0}, d;
+    memcpy(m.tuple, tuple, PEP_TUPLE_SZ);
+    size_t len = pep_encode(&m, out);
+    assert(len == 40 + PEP_HDR_SZ && pep_is_msg(out, len));
+    assert(out[8] == 0xfd && out[9] == 0x50 && out[24] == 0xfd && out[25] == 0x00);
+    assert(pep_decode(out, len, &d) == 0);
+    assert(d.op == PEP_FIN && memcmp(d.tuple, tuple, PEP_TUPLE_SZ) == 0);
+}
+
+static void test_malformed() {
+    uint8_t out[PEP_MSG_MAX];
+    pep_msg_t m = {PEP_OPEN, 0, 0, {0}, NULL, 0}, d;
+    v4_tuple(m.tuple);
+    size_t len = pep_encode(&m, out);
+    assert(pep_decode(out, len - 1, &d) != 0); /* truncated */
+    out[20] = 9;
+    assert(pep_decode(out, len, &d) != 0); /* unknown op */
+    out[9] = IPPROTO_TCP;
+    assert(! pep_is_msg(out, len));
+
+    /* data only on DATA */
+    m.op = PEP_ACK;
+    m.len = 3;
+    len = pep_encode(&m, out);
+    assert(pep_decode(out, len, &d) != 0);
+}
+
+static void test_window() {
+    uint8_t tuple[PEP_TUPLE_SZ];
+    pep_stream_t s, r;
+    v4_tuple(tuple);
+    pep_stream_init(&s, tuple, 0, 0);
+    pep_stream_init(&r, tuple, 1, 0);
+
+    /* sender runs out of credit a window in */
+    size_t sent = 0;
+    while (pep_credit(&s) > 0) {
+        size_t n = pep_credit(&s);
+        assert(n <= PEP_CHUNK);
+        pep_sent(&s, n);
+        assert(pep_rcvd(&r, n) == 0);
+        sent += n;
+    }
+    assert(sent == PEP_WINDOW && s.up == PEP_WINDOW && r.up == PEP_WINDOW);
+    assert(pep_rcvd(&r, 1) != 0);
+    assert(pep_buffered(&r) == PEP_WINDOW && ! pep_ack_due(&r));
+
+    /* ack only once a quarter of the window went out */
+    pep_passed(&r, PEP_WINDOW / 4 - 1);
+    assert(! pep_ack_due(&r));
+    pep_passed(&r, 1);
+    assert(pep_ack_due(&r));
+    uint32_t acked = pep_ack(&r);
+    assert(acked == PEP_WINDOW / 4 && ! pep_ack_due(&r));
+    assert(pep_acked(&s, acked) == 0);
+    assert(pep_credit(&s) == PEP_CHUNK);
+    assert(pep_acked(&s, PEP_WINDOW + 1) != 0); /* more than was sent */
+    assert(pep_acked(&s, PEP_WINDOW) == 0 && pep_credit(&s) == PEP_CHUNK);
+
+    assert(pep_mbps(1000000, 1000000000) == 8.0);
+    assert(pep_mbps(1, 0) == 0);
+}
+
+int main() {
+    test_tuple();
+    test_v4_round_trip();
+    test_v6_round_trip();
+    test_malformed();
+    test_window();
+    return 0;
+}
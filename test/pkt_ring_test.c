@@ -0,0 +1,216 @@
+#include "../src/pkt_ring.h"
+#include "../src/log.h"
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#define BLK_SZ 4096
+#define FRAME_DATA_OFF TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+#define MAC_OFF (FRAME_DATA_OFF + TPACKET_ALIGN(sizeof(struct sockaddr_ll)))
+
+static const uint8_t src_mac[6] = {2, 0, 0, 0, 0, 1}, dst_mac[6] = {2, 0, 0, 0, 0, 2};
+
+static size_t v4_udp(uint8_t *p, size_t len, int seq) {
+    memset(p, 0, len);
+    p[0] = 0x45; p[2] = len >> 8; p[3] = len & 0xFF; p[8] = 64; p[9] = 17;
+    p[12] = 127; p[15] = 1; p[16] = 127; p[19] = 1;
+    p[22] = 0; p[23] = 9; /* discard */
+    p[24] = (len - 20) >> 8; p[25] = (len - 20) & 0xFF;
+    for (size_t i = 28; i < len; i++) p[i] = i * seq;
+    return len;
+}
+
+static size_t v6_udp(uint8_t *p, size_t len, int seq) {
+    memset(p, 0, len);
+    p[0] = 0x60; p[4] = (len - 40) >> 8; p[5] = (len - 40) & 0xFF; p[6] = 17; p[7] = 64;
+    p[23] = 1; p[39] = 2;
+    for (size_t i = 48; i < len; i++) p[i] = i * seq;
+    return len;
+}
+
+struct got_s {
+    int n;
+    size_t len[8];
+    uint8_t pkt[8][2048];
+};
+
+static int collect(void *pkt, size_t len, void *_got) {
+    struct got_s *got = _got;
+    assert(got->n < 8 && len <= sizeof(got->pkt[0]));
+    memcpy(got->pkt[got->n], pkt, len);
+    got->len[got->n++] = len;
+    return 0;
+}
+
+struct spot_s {
+    const uint8_t *pkt;
+    size_t len;
+    int found;
+};
+
+static int spot(void *pkt, size_t len, void *_s) {
+    struct spot_s *s = _s;
+    s->found |= (len == s->len && memcmp(pkt, s->pkt, len) == 0);
+    return 0;
+}
+
+/* one frame the way the kernel lays it out in a TPACKET_V3 block, returns where the next one goes */
+static uint8_t *put_frame(uint8_t *at, uint16_t proto, uint8_t pkttype, const uint8_t *pkt, size_t len, size_t padding) {
+    struct tpacket3_hdr *h = (struct tpacket3_hdr *) at;
+    memset(h, 0, MAC_OFF);
+    struct sockaddr_ll *sll = (struct sockaddr_ll *) (at + FRAME_DATA_OFF);
+    sll->sll_family = AF_PACKET;
+    sll->sll_protocol = htons(proto);
+    sll->sll_pkttype = pkttype;
+    h->tp_mac = MAC_OFF;
+    h->tp_net = MAC_OFF + 14;
+    h->tp_snaplen = h->tp_len = 14 + len + padding;
+    memset(at + MAC_OFF, 0, 14);
+    memcpy(at + h->tp_net, pkt, len);
+    memset(at + h->tp_net + len, 0xEE, padding);
+    h->tp_next_offset = TPACKET_ALIGN(h->tp_net + len + padding);
+    return at + h->tp_next_offset;
+}
+
+static struct tpacket_block_desc *block(pkt_ring_t *r, int i) {
+    return (struct tpacket_block_desc *) (r->rx_map + i * BLK_SZ);
+}
+
+static uint8_t *open_block(pkt_ring_t *r, int i) {
+    struct tpacket_block_desc *bd = block(r, i);
+    memset(bd, 0, BLK_SZ);
+    bd->version = TPACKET_V3;
+    bd->hdr.bh1.offset_to_first_pkt = TPACKET_ALIGN(sizeof(*bd));
+    return ((uint8_t *) bd) + bd->hdr.bh1.offset_to_first_pkt;
+}
+
+/* only retired (user-owned) blocks are walked, in ring order, and go back to the kernel after. Outgoing,
+   non-IP frames are skipped, link padding is trimmed */
+static void test_rx_walk() {
+    pkt_ring_t r;
+    memset(&r, 0, sizeof(r));
+    r.rx_blk_sz = BLK_SZ;
+    r.rx_blk_nr = 2;
+    r.mtu = 1500;
+    r.rx_map = aligned_alloc(BLK_SZ, 2 * BLK_SZ);
+    r.seg_buff = malloc(r.mtu);
+    uint8_t pkt[3][600], arp[28] = {0};
+    size_t len0 = v4_udp(pkt[0], 46 - 14 - 6, 1), len1 = v6_udp(pkt[1], 500, 2), len2 = v4_udp(pkt[2], 300, 3);
+
+    uint8_t *at = open_block(&r, 0);
+    at = put_frame(at, ETH_P_IP, PACKET_HOST, pkt[0], len0, 6); /* padded to the 60 byte ethernet minimum */
+    at = put_frame(at, ETH_P_IP, PACKET_OUTGOING, pkt[2], len2, 0);
+    at = put_frame(at, ETH_P_ARP, PACKET_BROADCAST, arp, sizeof(arp), 0);
+    at = put_frame(at, ETH_P_IPV6, PACKET_HOST, pkt[1], len1, 0);
+    block(&r, 0)->hdr.bh1.num_pkts = 4;
+    open_block(&r, 1);
+    block(&r, 0)->hdr.bh1.block_status = TP_STATUS_USER;
+    block(&r, 1)->hdr.bh1.block_status = TP_STATUS_KERNEL;
+
+    struct got_s got = {0};
+    assert(pkt_ring_read(&r, 8, collect, &got) == 1);
+    assert(got.n == 2);
+    assert(got.len[0] == len0 && memcmp(got.pkt[0], pkt[0], len0) == 0);
+    assert(got.len[1] == len1 && memcmp(got.pkt[1], pkt[1], len1) == 0);
+    assert(block(&r, 0)->hdr.bh1.block_status == TP_STATUS_KERNEL && r.rx_blk == 1);
+    assert(pkt_ring_read(&r, 8, collect, &got) == 0); /* nothing retired */
+
+    at = open_block(&r, 1);
+    put_frame(at, ETH_P_IP, PACKET_HOST, pkt[2], len2, 0);
+    block(&r, 1)->hdr.bh1.num_pkts = 1;
+    block(&r, 1)->hdr.bh1.block_status = TP_STATUS_USER;
+    got.n = 0;
+    assert(pkt_ring_read(&r, 8, collect, &got) == 1);
+    assert(got.n == 1 && got.len[0] == len2 && memcmp(got.pkt[0], pkt[2], len2) == 0);
+    assert(r.rx_blk == 0); /* wrapped */
+
+    free(r.rx_map);
+    free(r.seg_buff);
+}
+
+/* frames carry an ethernet header for the configured macs and the pkt (put together from both buffers),
+   a frame still owned by the kernel pushes back */
+static void test_tx_layout() {
+    pkt_ring_t r;
+    int sv[2];
+    memset(&r, 0, sizeof(r));
+    assert(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == 0); /* stands in for the packet socket kicks go to */
+    r.tx_fd = sv[0];
+    r.mtu = 1500;
+    r.tx_frame_sz = 2048;
+    r.tx_frame_nr = 2;
+    r.tx_map = calloc(r.tx_frame_nr, r.tx_frame_sz);
+    memcpy(r.src_mac, src_mac, 6);
+    memcpy(r.dst_mac, dst_mac, 6);
+    uint8_t pkt[2][1600];
+    size_t len0 = v4_udp(pkt[0], 1000, 1), len1 = v6_udp(pkt[1], 200, 2);
+
+    assert(pkt_ring_send(&r, pkt[0], 100, pkt[0] + 100, len0 - 100) == (ssize_t) len0);
+    assert(pkt_ring_send(&r, pkt[1], len1, NULL, 0) == (ssize_t) len1);
+    for (int i = 0; i < 2; i++) {
+        struct tpacket3_hdr *h = (struct tpacket3_hdr *) (r.tx_map + i * r.tx_frame_sz);
+        uint8_t *d = ((uint8_t *) h) + FRAME_DATA_OFF;
+        size_t len = i ? len1 : len0;
+        uint16_t proto = i ? ETH_P_IPV6 : ETH_P_IP;
+        assert(h->tp_status == TP_STATUS_SEND_REQUEST && h->tp_len == 14 + len);
+        assert(memcmp(d, dst_mac, 6) == 0 && memcmp(d + 6, src_mac, 6) == 0);
+        assert(d[12] == (proto >> 8) && d[13] == (proto & 0xFF));
+        assert(memcmp(d + 14, pkt[i], len) == 0);
+    }
+    assert(r.tx_frame == 0 && r.tx_pending == 2);
+
+    errno = 0;
+    assert(pkt_ring_send(&r, pkt[1], len1, NULL, 0) == -1 && errno == EAGAIN); /* kernel hasn't sent frame 0 yet */
+    assert(r.tx_pending == 0); /* and was kicked */
+    ((struct tpacket3_hdr *) r.tx_map)->tp_status = TP_STATUS_AVAILABLE;
+    assert(pkt_ring_send(&r, pkt[1], len1, NULL, 0) == (ssize_t) len1);
+
+    errno = 0;
+    assert(pkt_ring_send(&r, pkt[0], 1000, pkt[0], 501) == -1 && errno == EMSGSIZE);
+
+    free(r.tx_map);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/* a pkt sent through the tx ring on lo comes back through the rx ring, needs CAP_NET_RAW */
+static void test_lo() {
+    int fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (fd < 0) {
+        printf("can't open packet sockets (%s), skipping the test on lo\n", strerror(errno));
+        return;
+    }
+    close(fd);
+    pkt_ring_t r;
+    uint8_t lo_mac[6] = {0};
+    assert(pkt_ring_open(&r, "lo", lo_mac) == 0);
+    uint8_t pkt[1000];
+    size_t len = v4_udp(pkt, sizeof(pkt), 7);
+    assert(pkt_ring_send(&r, pkt, len, NULL, 0) == (ssize_t) len);
+    pkt_ring_kick(&r);
+
+    struct spot_s s = {.pkt = pkt, .len = len, .found = 0}; /* whatever else is on lo shows up too */
+    for (int i = 0; i < 200 && ! s.found; i++) {
+        struct pollfd pfd = {.fd = r.rx_fd, .events = POLLIN};
+        poll(&pfd, 1, 10);
+        pkt_ring_read(&r, 64, spot, &s);
+    }
+    assert(s.found);
+    pkt_ring_close(&r);
+}
+
+int main() {
+    log_init(0, "pkt_ring_test");
+    test_rx_walk();
+    test_tx_layout();
+    test_lo();
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include "../src/profile.h"
+#include "../src/compress.h"
+#include "../src/io.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+static void define(profile_set_t *s, const char *line, int expected) {
+    char buff[256];
+    strcpy(buff, line);
+    assert(profile_define(s, buff) == expected);
+}
+
+static const char *str(const link_profile_t *p) {
+    static char buff[256];
+    return profile_str(p, buff, sizeof(buff));
+}
+
+static void test_define_and_reference() {
+    profile_set_t s;
+    profile_set_init(&s);
+    define(&s, "wan level=9 ring=4M max-ring=32M flush=batch", 0);
+    define(&s, "lan codec=none ring=64k", 0);
+    define(&s, "trading @wan lowlat=2 flush=pkt prio=6 weight=4", 0);
+    assert(s.n == 3);
+
+    const link_profile_t *wan = profile_find(&s, "wan");
+    assert(wan != NULL && wan->level == 9 && wan->ring_sz == 4 << 20 && wan->max_ring_sz == 32 << 20);
+    assert(wan->flush_policy == IO_FLUSH_BATCH);
+    assert(profile_find(&s, "lan")->level == NO_COMPRESSION_LEVEL);
+
+    const link_profile_t *t = profile_find(&s, "trading");
+    assert(t->level == 9 && t->flush_policy == IO_FLUSH_PKT && t->low_lat_mode == 2 && t->prio == 6 && t->weight == 4);
+    assert(strcmp(str(t), "level=9 ring=4194304 max-ring=33554432 flush=pkt lowlat=2 weight=4 prio=6") == 0);
+
+    define(&s, "wan level=3", 0); /* redefinition replaces, earlier references keep what they copied */
+    assert(s.n == 3 && profile_find(&s, "wan")->level == 3 && (profile_find(&s, "wan")->set & PROFILE_RING) == 0);
+    assert(t->level == 9);
+    assert(profile_find(&s, "nope") == NULL);
+    profile_set_destroy(&s);
+}
+
+static void test_bad_definitions() {
+    profile_set_t s;
+    profile_set_init(&s);
+    define(&s, "", -1);
+    define(&s, "a=b level=1", -1);
+    define(&s, "x @undefined", -1);
+    define(&s, "x 10.0.0.0/8", -1);
+    define(&s, "x level=99", -1);
+    define(&s, "x ring=12q", -1);
+    define(&s, "x ring=0", -1);
+    define(&s, "x flush=sometimes", -1);
+    define(&s, "x lowlat=3", -1);
+    define(&s, "x weight=0", -1);
+    define(&s, "x prio=7", -1);
+    define(&s, "x codec=lz4", -1);
+    define(&s, "x via=hub.example.com", -1);
+    define(&s, "x shm=run/l3tc.sock", -1);
+    define(&s, "x colour=blue", -1);
+    assert(s.n == 0);
+    profile_set_destroy(&s);
+}
+
+static void test_peer_words() {
+    profile_set_t s;
+    profile_set_init(&s);
+    define(&s, "wan level=9 rate=20000", 0);
+    link_profile_t p;
+    memset(&p, 0, sizeof(p));
+    assert(strcmp(str(&p), "-") == 0);
+    assert(profile_apply_word(&s, "10.1.0.0/16", &p) == 0);
+    assert(p.set == 0);
+    assert(profile_apply_word(&s, "@wan", &p) == 1);
+    assert(profile_apply_word(&s, "level=2", &p) == 1); /* later words win */
+    assert(profile_apply_word(&s, "level=x", &p) == -1);
+    assert(profile_apply_word(&s, "@lan", &p) == -1);
+    assert(p.level == 2 && p.rate_kbit == 20000);
+    assert(strcmp(str(&p), "level=2 rate=20000") == 0);
+    assert(profile_apply_word(&s, "via=fd00::1", &p) == 1);
+    assert(p.via_af == AF_INET6 && p.via[0] == 0xfd && p.via[15] == 1);
+    assert(profile_apply_word(&s, "via=10.0.0.1", &p) == 1);
+    assert(p.via_af == AF_INET && p.via[0] == 10 && p.via[3] == 1 && p.via[4] == 0);
+    assert(strcmp(str(&p), "level=2 rate=20000 via=10.0.0.1") == 0);
+    p.set &= ~PROFILE_VIA;
+    assert(profile_apply_word(&s, "shm=/run/l3tc/b.sock", &p) == 1);
+    assert(strcmp(str(&p), "level=2 rate=20000 shm=/run/l3tc/b.sock") == 0);
+    p.set &= ~PROFILE_SHM;
+
+    link_profile_t base;
+    memset(&base, 0, sizeof(base));
+    assert(profile_apply_word(&s, "ring=1G", &base) == 1);
+    profile_merge(&base, &p);
+    assert(base.ring_sz == 1 << 30 && base.level == 2 && base.set == (PROFILE_RING | PROFILE_LEVEL | PROFILE_RATE));
+    profile_set_destroy(&s);
+}
+
+int main() {
+    test_define_and_reference();
+    test_bad_definitions();
+    test_peer_words();
+    return 0;
+}
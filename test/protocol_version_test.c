@@ -1,6 +1,7 @@
 #include "../src/common.h"
 #include <assert.h>
 #include <stddef.h>
+#include <string.h>
 
 int T0_buff1_5_bytes() {
     uint8_t part_1[] = {0x0A, 0x0B, 0x0C, 0x0D, 0x0E};
@@ -76,6 +77,73 @@ int T12_buff1_0_bytes_buff2_3_bytes() {
     assert(parse_ipv4_pkt_sz(NULL, 0, part_2, 3) == 0x0);
 }
 
+int T13_ipv6_payload_len() {
+    uint8_t hdr[8] = {0x60, 0, 0, 0, 0x05, 0xDC, 0x06, 0x40};
+    assert(parse_ipv6_pkt_sz(hdr, 8, NULL, 0) == 40 + 0x05DC);
+    assert(parse_l3_pkt_sz(hdr, 8, NULL, 0) == 40 + 0x05DC);
+}
+
+int T14_ipv6_payload_len_split() {
+    uint8_t part_1[] = {0x60, 0, 0, 0, 0x01};
+    uint8_t part_2[] = {0x00, 0x3B};
+    assert(parse_ipv6_pkt_sz(part_1, 5, part_2, 2) == 40 + 0x0100);
+    assert(parse_ipv6_pkt_sz(part_1, 5, NULL, 0) == 0);
+    assert(parse_l3_pkt_sz(NULL, 0, part_1, 5) == 0);
+}
+
+int T15_ipv6_no_payload() {
+    uint8_t hdr[] = {0x60, 0, 0, 0, 0, 0, 0x3B /* no-next-header */, 0x40};
+    assert(parse_ipv6_pkt_sz(hdr, 8, NULL, 0) == 40);
+}
+
+static void jumbo_pkt(uint8_t *pkt, uint32_t jumbo_len) {
+    memset(pkt, 0, 48);
+    pkt[0] = 0x60;
+    pkt[6] = 0; /* hop-by-hop */
+    pkt[40] = 0x06; /* tcp */
+    pkt[41] = 0; /* 8 bytes */
+    pkt[42] = 0xC2; /* jumbo payload */
+    pkt[43] = 4;
+    pkt[44] = jumbo_len >> 24; pkt[45] = jumbo_len >> 16; pkt[46] = jumbo_len >> 8; pkt[47] = jumbo_len;
+}
+
+int T16_ipv6_jumbogram() {
+    uint8_t pkt[48];
+    jumbo_pkt(pkt, 0x00001000);
+    assert(parse_ipv6_pkt_sz(pkt, 48, NULL, 0) == 40 + 0x00001000);
+    assert(parse_ipv6_pkt_sz(pkt, 47, NULL, 0) == 0);
+    for (int split = 0; split <= 48; split++) {
+        assert(parse_ipv6_pkt_sz(pkt, split, pkt + split, 48 - split) == 40 + 0x00001000);
+    }
+    jumbo_pkt(pkt, MAX_L3_PKT_SZ - 40);
+    assert(parse_ipv6_pkt_sz(pkt, 48, NULL, 0) == MAX_L3_PKT_SZ);
+    /* bigger than anything can hold */
+    jumbo_pkt(pkt, MAX_L3_PKT_SZ - 40 + 1);
+    assert(parse_ipv6_pkt_sz(pkt, 48, NULL, 0) == L3_PKT_MALFORMED);
+    jumbo_pkt(pkt, 0x000186A0);
+    for (int split = 0; split <= 48; split++) {
+        assert(parse_ipv6_pkt_sz(pkt, split, pkt + split, 48 - split) == L3_PKT_MALFORMED);
+    }
+    jumbo_pkt(pkt, 0xFFFFFFFF);
+    assert(parse_l3_pkt_sz(pkt, 48, NULL, 0) == L3_PKT_MALFORMED);
+}
+
+int T17_ipv6_hop_by_hop_without_jumbo() {
+    uint8_t pkt[48];
+    jumbo_pkt(pkt, 0);
+    pkt[42] = 0x00; /* pad1 */
+    pkt[43] = 0x01; /* padN (3 bytes) */
+    pkt[44] = 3;
+    assert(parse_ipv6_pkt_sz(pkt, 48, NULL, 0) == 40);
+}
+
+int T18_l3_unknown_version() {
+    uint8_t hdr[] = {0x50, 0, 0, 0x20, 0, 0, 0, 0};
+    assert(parse_l3_pkt_sz(hdr, 8, NULL, 0) == 0);
+    hdr[0] = 0x45;
+    assert(parse_l3_pkt_sz(hdr, 8, NULL, 0) == 0x20);
+}
+
 int main() {
     T0_buff1_5_bytes();
     T1_buff1_4_bytes();
@@ -90,4 +158,10 @@ int main() {
     T10_buff1_0_bytes_buff2_5_bytes();
     T11_buff1_0_bytes_buff2_4_bytes();
     T12_buff1_0_bytes_buff2_3_bytes();
+    T13_ipv6_payload_len();
+    T14_ipv6_payload_len_split();
+    T15_ipv6_no_payload();
+    T16_ipv6_jumbogram();
+    T17_ipv6_hop_by_hop_without_jumbo();
+    T18_l3_unknown_version();
 }
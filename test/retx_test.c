@@ -0,0 +1,119 @@
+#include "../src/retx.h"
+#include <assert.h>
+#include <string.h>
+#include <netinet/in.h>
+
+static size_t v4_tcp(uint8_t *p, uint16_t sport, uint32_t seq, int payload, uint8_t flags) {
+    size_t len = 40 + payload;
+    memset(p, 0, len);
+    p[0] = 0x45;
+    p[2] = len >> 8; p[3] = len & 0xFF;
+    p[9] = IPPROTO_TCP;
+    p[12] = 10; p[15] = 1;
+    p[16] = 10; p[19] = 2;
+    p[20] = sport >> 8; p[21] = sport & 0xFF;
+    p[23] = 80;
+    p[24] = seq >> 24; p[25] = seq >> 16; p[26] = seq >> 8; p[27] = seq;
+    p[32] = 5 << 4;
+    p[33] = flags;
+    return len;
+}
+
+/* check + take, as the conn does for a pkt it accepts. Returns 1 if it was suppressed */
+static int xmit(retx_tab_t *t, uint8_t *p, size_t len, uint64_t gen, uint64_t sent, uint64_t mark) {
+    retx_seg_t seg;
+    if (retx_check(t, p, len, gen, sent, &seg)) return 1;
+    retx_taken(t, &seg, gen, mark);
+    return 0;
+}
+
+static void test_queued_and_sent() {
+    retx_tab_t t;
+    uint8_t p[1500];
+    assert(retx_init(&t) == 0);
+    size_t l = v4_tcp(p, 1000, 100, 500, 0x10);
+    assert(! xmit(&t, p, l, 1, 0, 600));
+    l = v4_tcp(p, 1000, 600, 500, 0x10);
+    assert(! xmit(&t, p, l, 1, 0, 1200));
+
+    /* originals still queued, every copy goes */
+    l = v4_tcp(p, 1000, 100, 500, 0x18);
+    assert(xmit(&t, p, l, 1, 700, 1300));
+    assert(xmit(&t, p, l, 1, 1100, 1300));
+    assert(t.stats.queued_pkts == 2 && t.stats.queued_bytes == 2 * l);
+
+    /* out on the conn, first copy of a range goes, the next one is let through */
+    assert(xmit(&t, p, l, 1, 1200, 1300));
+    assert(! xmit(&t, p, l, 1, 1200, 1300));
+    l = v4_tcp(p, 1000, 600, 500, 0x10);
+    assert(xmit(&t, p, l, 1, 1200, 1300));
+    assert(t.stats.sent_pkts == 2 && t.stats.passed_pkts == 1);
+
+    /* partly new data is taken, and moves the flow on */
+    l = v4_tcp(p, 1000, 900, 500, 0x10);
+    assert(! xmit(&t, p, l, 1, 1200, 2000));
+    l = v4_tcp(p, 1000, 1100, 200, 0x10);
+    assert(xmit(&t, p, l, 1, 1500, 2000));
+    retx_destroy(&t);
+}
+
+static void test_not_tracked() {
+    retx_tab_t t;
+    uint8_t p[1500];
+    assert(retx_init(&t) == 0);
+    size_t l = v4_tcp(p, 2000, 100, 500, 0x10);
+    assert(! xmit(&t, p, l, 1, 0, 600));
+
+    /* stream started over, the original may be gone */
+    assert(! xmit(&t, p, l, 2, 0, 600));
+    assert(xmit(&t, p, l, 2, 0, 600));
+
+    /* pure acks, syn and rst aren't looked at */
+    l = v4_tcp(p, 2000, 100, 0, 0x10);
+    assert(! xmit(&t, p, l, 2, 0, 600) && ! xmit(&t, p, l, 2, 0, 600));
+    l = v4_tcp(p, 2000, 100, 10, 0x02);
+    assert(! xmit(&t, p, l, 2, 0, 600) && ! xmit(&t, p, l, 2, 0, 600));
+
+    /* another flow (port) isn't confused with it */
+    l = v4_tcp(p, 2001, 100, 500, 0x10);
+    assert(! xmit(&t, p, l, 2, 0, 600));
+
+    /* fragments aren't looked into */
+    l = v4_tcp(p, 3000, 100, 500, 0x10);
+    p[6] = 0x20;
+    assert(! xmit(&t, p, l, 2, 0, 600) && ! xmit(&t, p, l, 2, 0, 600));
+
+    /* seq wraps */
+    l = v4_tcp(p, 4000, 0xFFFFFF00, 512, 0x10);
+    assert(! xmit(&t, p, l, 2, 0, 600));
+    assert(xmit(&t, p, l, 2, 0, 600));
+    l = v4_tcp(p, 4000, 0x100, 100, 0x10);
+    assert(! xmit(&t, p, l, 2, 0, 700));
+    retx_destroy(&t);
+}
+
+static void test_v6() {
+    retx_tab_t t;
+    uint8_t p[1500];
+    assert(retx_init(&t) == 0);
+    memset(p, 0, 100);
+    p[0] = 0x60;
+    p[5] = 60; /* payload-len: tcp header + 40 bytes */
+    p[6] = IPPROTO_TCP;
+    p[23] = 1; p[39] = 2;
+    p[41] = 80;
+    p[47] = 10; /* seq */
+    p[52] = 5 << 4;
+    assert(! xmit(&t, p, 100, 1, 0, 50));
+    assert(xmit(&t, p, 100, 1, 10, 50));
+    p[6] = 0; /* hop-by-hop, not walked */
+    assert(! xmit(&t, p, 100, 1, 10, 50));
+    retx_destroy(&t);
+}
+
+int main() {
+    test_queued_and_sent();
+    test_not_tracked();
+    test_v6();
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include "../src/ring.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+struct src_s {
+    const char *data;
+    ssize_t len;
+};
+
+/* copies as much of src as fits */
+static int fill_from(int fd, void *buff, ssize_t len, ssize_t *end, void *ctx, ssize_t additional_len) {
+    struct src_s *s = (struct src_s *) ctx;
+    ssize_t n = (s->len < len) ? s->len : len;
+    memcpy(buff, s->data, n);
+    s->data += n;
+    s->len -= n;
+    *end += n;
+    return (s->len == 0) ? CONN_IO_OK_EXHAUSTED : CONN_IO_OK;
+}
+
+static ssize_t push_nothing(void *b1, ssize_t len1, void *b2, ssize_t len2, void *ctx) {
+    return 0;
+}
+
+static void fill(ring_buff_t *r, const char *data, data_push_fn_t *pusher) {
+    struct src_s s = {data, strlen(data)};
+    fill_ring(-1, r, fill_from, pusher, &s);
+}
+
+static void test_peek_consume() {
+    ring_buff_t r;
+    void *b1, *b2;
+    ssize_t len1, len2;
+    assert(init_backlog_ring(&r, 8, 0, 8) == 0);
+    fill(&r, "abcdef", NULL);
+    assert(ring_used(&r) == 6);
+    ring_consume(&r, 4);
+    fill(&r, "ghij", NULL); /* wraps */
+    assert(r.wraped && ring_used(&r) == 6);
+    ring_peek(&r, &b1, &len1, &b2, &len2);
+    assert(len1 == 4 && memcmp(b1, "efgh", 4) == 0);
+    assert(len2 == 2 && memcmp(b2, "ij", 2) == 0);
+    ring_consume(&r, 5);
+    assert(! r.wraped && ring_used(&r) == 1);
+    ring_peek(&r, &b1, &len1, &b2, &len2);
+    assert(len1 == 1 && *(char *) b1 == 'j' && len2 == 0 && b2 == NULL);
+    ring_consume(&r, 1);
+    assert(ring_empty(&r) && r.start == 0 && r.end == 0);
+    destroy_ring_buff(&r);
+}
+
+static void test_full_ring_gives_up() {
+    ring_buff_t r;
+    assert(init_backlog_ring(&r, 8, 0, 8) == 0);
+    fill(&r, "abcdefgh", push_nothing);
+    assert(ring_used(&r) == 8);
+    struct src_s s = {"xyz", 3};
+    assert(fill_ring(-1, &r, fill_from, push_nothing, &s) == CONN_IO_OK_NOT_ENOUGH_SPACE); /* used to spin */
+    assert(s.len == 3 && ring_used(&r) == 8);
+    s.len = 3;
+    assert(fill_ring(-1, &r, fill_from, NULL, &s) == CONN_IO_OK_NOT_ENOUGH_SPACE);
+    destroy_ring_buff(&r);
+}
+
+static void test_load() {
+    ring_buff_t r;
+    void *b1, *b2;
+    ssize_t len1, len2;
+    assert(init_backlog_ring(&r, 8, 0, 8) == 0);
+    fill(&r, "abcdef", NULL);
+    assert(ring_load(&r, "xyz", 3) == 0);
+    ring_peek(&r, &b1, &len1, &b2, &len2);
+    assert(len1 == 3 && memcmp(b1, "xyz", 3) == 0 && len2 == 0);
+    assert(ring_load(&r, "0123456789", 10) == 0); /* grows */
+    assert(r.sz == 10 && r.max == 10 && ring_used(&r) == 10);
+    ring_peek(&r, &b1, &len1, &b2, &len2);
+    assert(len1 == 10 && memcmp(b1, "0123456789", 10) == 0);
+    ring_consume(&r, 10);
+    assert(ring_empty(&r));
+    destroy_ring_buff(&r);
+}
+
+int main() {
+    test_peek_consume();
+    test_full_ring_gives_up();
+    test_load();
+    return 0;
+}
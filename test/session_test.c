@@ -0,0 +1,100 @@
+#include "../src/session.h"
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#define RETX_SZ 16
+
+static void send_seq(session_t *s, uint8_t from, int len) {
+    uint8_t b[64];
+    for (int i = 0; i < len; i++) b[i] = from + i;
+    session_sent(s, b, len);
+}
+
+static void test_retx_wraps() {
+    session_t s;
+    uint8_t out[RETX_SZ];
+    assert(session_init(&s, RETX_SZ) == 0);
+    send_seq(&s, 0, 10);
+    assert(s.tx_seq == 10 && s.tx_lo == 0);
+    send_seq(&s, 10, 10); /* wraps, bytes 0..3 are gone */
+    assert(s.tx_seq == 20 && s.tx_lo == 4);
+    assert(! session_can_replay(&s, 3) && session_can_replay(&s, 4) && session_can_replay(&s, 20) && ! session_can_replay(&s, 21));
+    assert(session_replay(&s, 6, out) == 14);
+    for (int i = 0; i < 14; i++) assert(out[i] == 6 + i);
+    assert(s.tx_seq == 6 && s.tx_lo == 4);
+    send_seq(&s, 6, 14); /* replayed bytes go out again, nothing older is lost */
+    assert(s.tx_seq == 20 && s.tx_lo == 4);
+    send_seq(&s, 20, 40); /* more than fits */
+    assert(s.tx_seq == 60 && s.tx_lo == 44);
+    assert(session_replay(&s, 44, out) == RETX_SZ);
+    for (int i = 0; i < RETX_SZ; i++) assert(out[i] == 44 + i);
+    session_destroy(&s);
+}
+
+static void test_resume_check() {
+    session_t s;
+    assert(session_init(&s, RETX_SZ) == 0);
+    send_seq(&s, 0, 20);
+    s.rx_seq = 100;
+    session_hello_t h = {0, s.id, 8, 120, 90};
+    assert(session_can_resume(&s, &h));
+    h.rx_seq = 3; /* we no longer have what it's missing */
+    assert(! session_can_resume(&s, &h));
+    h.rx_seq = 8;
+    h.tx_lo = 101; /* it no longer has what we're missing */
+    assert(! session_can_resume(&s, &h));
+    h.tx_lo = 90;
+    h.tx_seq = 99; /* we got more than it sent, not the same stream */
+    assert(! session_can_resume(&s, &h));
+    h.tx_seq = 120;
+    h.id++;
+    assert(! session_can_resume(&s, &h));
+    session_destroy(&s);
+}
+
+static void test_hello() {
+    session_t s;
+    session_hello_t h;
+    uint8_t b[SESSION_HELLO_SZ];
+    assert(session_init(&s, RETX_SZ) == 0);
+    send_seq(&s, 0, 20);
+    s.rx_seq = 0x0102030405060708ULL;
+    session_hello_encode(&s, SESSION_RESUMED, b);
+    assert(memcmp(b, "L3TS", 4) == 0);
+    assert(session_hello_decode(b, &h) == 0);
+    assert(h.flags == SESSION_RESUMED && h.id == s.id && h.rx_seq == s.rx_seq && h.tx_seq == 20 && h.tx_lo == 4);
+    b[4]++;
+    assert(session_hello_decode(b, &h) != 0);
+    b[4]--;
+    b[0] = 'x';
+    assert(session_hello_decode(b, &h) != 0);
+    session_destroy(&s);
+}
+
+static void test_restore() {
+    session_t a, b;
+    uint8_t retained[RETX_SZ], out[RETX_SZ];
+    assert(session_init(&a, RETX_SZ) == 0);
+    assert(session_init(&b, RETX_SZ) == 0);
+    send_seq(&a, 0, 30);
+    a.rx_seq = 77;
+    size_t len = a.tx_seq - a.tx_lo;
+    assert(session_replay(&a, a.tx_lo, retained) == len);
+    send_seq(&a, 30 - len, len);
+    assert(session_restore(&b, a.id, a.rx_seq, a.tx_seq, retained, len) == 0);
+    assert(b.id == a.id && b.rx_seq == 77 && b.tx_seq == 30 && b.tx_lo == a.tx_lo);
+    assert(session_replay(&b, 20, out) == 10);
+    for (int i = 0; i < 10; i++) assert(out[i] == 20 + i);
+    assert(session_restore(&b, a.id, 0, 5, retained, len) != 0);
+    session_destroy(&a);
+    session_destroy(&b);
+}
+
+int main() {
+    test_retx_wraps();
+    test_resume_check();
+    test_hello();
+    test_restore();
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include "../src/shm_ring.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define STREAM_SZ (32 * 1024 * 1024)
+
+static uint8_t at(uint64_t pos, int dir) {
+    return (uint8_t) (pos * 13 + (pos >> 9) + dir);
+}
+
+/* both ways at once, in odd sized pieces, through the smallest rings. Only ever sleeps on the doorbell,
+   a lost wakeup shows up as a poll timing out */
+static void pump(shm_chan_t *c, int dir) {
+    static uint8_t buff[70001];
+    uint64_t sent = 0, rcvd = 0;
+    size_t piece = 1;
+    while (sent < STREAM_SZ || rcvd < STREAM_SZ) {
+        int progress = 0;
+        if (sent < STREAM_SZ) {
+            size_t len = (piece < STREAM_SZ - sent) ? piece : STREAM_SZ - sent;
+            for (size_t i = 0; i < len; i++) buff[i] = at(sent + i, dir);
+            ssize_t n = shm_write(c, buff, len);
+            assert(n >= 0);
+            sent += n;
+            progress |= (n > 0);
+        }
+        if (rcvd < STREAM_SZ) {
+            ssize_t n = shm_read(c, buff, piece);
+            assert(n >= 0);
+            for (ssize_t i = 0; i < n; i++) assert(buff[i] == at(rcvd + i, ! dir));
+            rcvd += n;
+            progress |= (n > 0);
+        }
+        piece = (piece * 7 + 3) % sizeof(buff) + 1;
+        if (! progress) {
+            struct pollfd pfd = {.fd = c->bell_fd, .events = POLLIN};
+            assert(poll(&pfd, 1, 5000) == 1);
+            shm_clear_bell(c);
+        }
+    }
+}
+
+static void test_stream() {
+    char path[] = "/tmp/shm_ring_test.XXXXXX";
+    assert(mkdtemp(path) != NULL);
+    char sock_path[64];
+    snprintf(sock_path, sizeof(sock_path), "%s/s", path);
+    int lstn = shm_listen(sock_path);
+    assert(lstn >= 0);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        shm_chan_t c;
+        shm_hello_t h = {.af = 2, .addr = {127, 0, 0, 2}};
+        int sock = shm_connect(sock_path, 1, &h, &c);
+        if (sock < 0 || c.sz != SHM_MIN_RING_SZ) _exit(1);
+        pump(&c, 0);
+        shm_chan_destroy(&c);
+        _exit(0);
+    }
+    int sock = accept(lstn, NULL, NULL);
+    assert(sock >= 0);
+    shm_chan_t c;
+    shm_hello_t h;
+    assert(shm_accept(sock, &h, &c) == 0);
+    assert(h.version == SHM_VERSION && h.af == 2 && h.addr[3] == 2 && c.sz == SHM_MIN_RING_SZ);
+    struct pollfd bell = {.fd = c.bell_fd, .events = POLLIN}; /* the first write wakes us, though we never read */
+    assert(poll(&bell, 1, 5000) == 1);
+    pump(&c, 1);
+    printf("%d MB each way, woke the other side %llu times\n", STREAM_SZ >> 20, (unsigned long long) c.rung);
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    struct pollfd pfd = {.fd = sock, .events = POLLRDHUP}; /* the other side is gone */
+    assert(poll(&pfd, 1, 1000) == 1 && (pfd.revents & (POLLRDHUP | POLLHUP)));
+    assert(shm_read(&c, &h, 1) == 0);
+    shm_chan_destroy(&c);
+    close(sock);
+    close(lstn);
+    unlink(sock_path);
+    rmdir(path);
+}
+
+/* hello with a memfd of rings of h's size (sealed or not) and two doorbells */
+static void offer(int sock, const shm_hello_t *h, int sealed) {
+    int fds[3] = {memfd_create("shm_ring_test", sealed ? MFD_ALLOW_SEALING : 0), eventfd(0, 0), eventfd(0, 0)};
+    assert(fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0);
+    assert(ftruncate(fds[0], 4096 + 2 * h->ring_sz) == 0);
+    if (sealed) assert(fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) == 0);
+    union {
+        struct cmsghdr align;
+        char buff[CMSG_SPACE(sizeof(fds))];
+    } ctl;
+    struct iovec iov = {.iov_base = (void *) h, .iov_len = sizeof(*h)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buff, .msg_controllen = sizeof(ctl.buff)};
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    assert(sendmsg(sock, &msg, 0) == sizeof(*h));
+    for (int i = 0; i < 3; i++) close(fds[i]);
+}
+
+/* an offer that isn't a channel, or whose memory the other side could still resize, is turned away. Nothing
+   offered yet on a non-blocking socket is no failure */
+static void test_bad_offer() {
+    int sv[2];
+    shm_chan_t c;
+    shm_hello_t h = {.version = SHM_VERSION, .ring_sz = SHM_MIN_RING_SZ};
+    assert(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, sv) == 0);
+    assert(shm_accept(sv[0], &h, &c) == 1);
+    assert(send(sv[1], &h, sizeof(h), 0) == sizeof(h)); /* no fds */
+    assert(shm_accept(sv[0], &h, &c) == -1);
+    assert(c.map == NULL && c.bell_fd == -1);
+    offer(sv[1], &h, 0);
+    assert(shm_accept(sv[0], &h, &c) == -1);
+    assert(c.map == NULL && c.bell_fd == -1);
+    offer(sv[1], &h, 1);
+    assert(shm_accept(sv[0], &h, &c) == 0);
+    shm_chan_destroy(&c);
+    close(sv[1]);
+    assert(shm_accept(sv[0], &h, &c) == -1); /* hung up */
+    close(sv[0]);
+}
+
+int main() {
+    test_stream();
+    test_bad_offer();
+    return 0;
+}